@@ -0,0 +1,351 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "accesslog.h"
+#include "conn.h"
+#include "trace.h"
+#include "topology.h"
+
+// How long the logger sleeps when every ring is empty. Records wait at
+// most this long, and are written in batches of whatever piled up.
+#define LOG_FLUSH_INTERVAL_MS 10
+
+// Longest formatted line
+#define LOG_LINE_MAX (LOG_URI_MAX + 256)
+
+// Records formatted per worker per batch
+#define LOG_BATCH 256
+
+static struct worker *log_workers;
+static int log_nworkers;
+static int log_fd = -1;
+static pthread_t log_thread;
+static _Atomic int log_stopping;
+static double log_us_per_tick;      // for the trace_clock() ticks of records
+
+static struct log_record *ring_reserve(struct log_ring *r) {
+    uint32_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    if (tail - r->head_cache == LOG_RING_SIZE) {
+        r->head_cache = atomic_load_explicit(&r->head, memory_order_acquire);
+        if (tail - r->head_cache == LOG_RING_SIZE) {
+            atomic_fetch_add_explicit(&r->dropped, 1, memory_order_relaxed);
+            return NULL;
+        }
+    }
+    return &r->records[tail & (LOG_RING_SIZE - 1)];
+}
+
+static void ring_commit(struct log_ring *r) {
+    uint32_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    atomic_store_explicit(&r->tail, tail + 1, memory_order_release);
+}
+
+static uint64_t realtime_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int accesslog_sampled(struct worker *w) {
+    struct log_ring *r = w->log;
+    if (r == NULL) {
+        return 0;
+    }
+    if (config.log_sample > 1 && ++r->sample < config.log_sample) {
+        return 0;
+    }
+    r->sample = 0;
+    return 1;
+}
+
+static void fill_request(struct log_record *rec, const union sock_addr *addr,
+                         const struct http_request *req, int status,
+                         size_t bytes) {
+    rec->type = LOG_REQUEST;
+    rec->timed = 0;
+    rec->addr = *addr;
+    rec->time_ms = realtime_ms();
+    rec->status = status;
+    rec->bytes = bytes;
+    // Streams go to the handlers as HTTP/1.0 requests, but are logged as
+    // what they came as
+    rec->major_version =
+        req->version.len == 8 && req->version.ptr[5] == '2' ? 2 : 1;
+    rec->minor_version = req->minor_version;
+    rec->method_len = req->method.len < sizeof(rec->method)
+                          ? req->method.len
+                          : sizeof(rec->method);
+    memcpy(rec->method, req->method.ptr, rec->method_len);
+    rec->uri_len = req->uri.len < LOG_URI_MAX ? req->uri.len : LOG_URI_MAX;
+    memcpy(rec->uri, req->uri.ptr, rec->uri_len);
+}
+
+void accesslog_request(struct worker *w, const union sock_addr *addr,
+                       const struct http_request *req, int status,
+                       size_t bytes) {
+    struct log_ring *r = w->log;
+    struct log_record *rec = ring_reserve(r);
+    if (rec == NULL) {
+        return;
+    }
+    fill_request(rec, addr, req, status, bytes);
+    ring_commit(r);
+}
+
+void accesslog_request_timed(struct conn *c, const struct http_request *req,
+                             int status, size_t bytes, uint64_t parsed,
+                             uint64_t handled) {
+    // A pipelined request came in behind one still being written: log that
+    // one now, without its write, to keep the lines in order
+    accesslog_written(c, 0);
+    // Only sampled requests get here, so they may well cost a malloc()
+    struct log_record *rec = malloc(sizeof(*rec));
+    if (rec == NULL) {
+        accesslog_request(c->w, conn_peer(c), req, status, bytes);
+        return;
+    }
+    fill_request(rec, conn_peer(c), req, status, bytes);
+    rec->timed = 1;
+    rec->timing[TIMING_CONNECT] =
+        c->requests == 0 ? c->read_tsc - c->accept_tsc : 0;
+    rec->timing[TIMING_READ] = c->head_tsc - c->read_tsc;
+    rec->timing[TIMING_PARSE] = parsed - c->head_tsc;
+    rec->timing[TIMING_HANDLER] = handled - parsed;
+    // Counted from handled until the write is done
+    rec->timing[TIMING_WRITE] = handled;
+    c->timed = rec;
+}
+
+void accesslog_written(struct conn *c, int written) {
+    struct log_record *timed = c->timed;
+    if (timed == NULL) {
+        return;
+    }
+    c->timed = NULL;
+    timed->timing[TIMING_WRITE] =
+        written ? trace_clock() - timed->timing[TIMING_WRITE] : 0;
+    struct log_ring *r = c->w->log;
+    struct log_record *rec = ring_reserve(r);
+    if (rec != NULL) {
+        *rec = *timed;
+        ring_commit(r);
+    }
+    free(timed);
+}
+
+void accesslog_accept(struct worker *w, const union sock_addr *addr) {
+    struct log_ring *r = w->log;
+    if (r == NULL || config.log_level < LOG_DEBUG) {
+        return;
+    }
+    struct log_record *rec = ring_reserve(r);
+    if (rec == NULL) {
+        return;
+    }
+    rec->type = LOG_ACCEPT;
+    rec->addr = *addr;
+    rec->time_ms = realtime_ms();
+    ring_commit(r);
+}
+
+// Format one record as
+//   2026-01-02T03:04:05.678Z 10.0.0.1:43210 "GET / HTTP/1.1" 200 27
+static int format_record(const struct log_record *rec, char *out) {
+    time_t secs = rec->time_ms / 1000;
+    struct tm tm;
+    gmtime_r(&secs, &tm);
+    char stamp[32];
+    strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", &tm);
+    char addr[ADDR_STRLEN];
+    addr_format(&rec->addr, addr);
+
+    if (rec->type == LOG_ACCEPT) {
+        return snprintf(out, LOG_LINE_MAX, "%s.%03uZ %s accepted\n", stamp,
+                        (unsigned)(rec->time_ms % 1000), addr);
+    }
+    int n = snprintf(out, LOG_LINE_MAX,
+                     "%s.%03uZ %s \"%.*s %.*s HTTP/%u.%u\" %u %llu",
+                     stamp, (unsigned)(rec->time_ms % 1000), addr,
+                     rec->method_len, rec->method, rec->uri_len, rec->uri,
+                     rec->major_version, rec->minor_version, rec->status,
+                     (unsigned long long)rec->bytes);
+    if (n >= LOG_LINE_MAX - 1) {
+        n = LOG_LINE_MAX - 2;
+    }
+    if (rec->timed) {
+        // e.g. " read=3.2us parse=0.4us handler=1.1us write=12.0us"
+        static const char *const names[TIMING_STAGES] = {
+            [TIMING_CONNECT] = "connect",
+            [TIMING_READ] = "read",
+            [TIMING_PARSE] = "parse",
+            [TIMING_HANDLER] = "handler",
+            [TIMING_WRITE] = "write",
+        };
+        for (int i = 0; i < TIMING_STAGES; i++) {
+            // Later requests on a connection had no connect, and a
+            // response cut short no write
+            if (rec->timing[i] == 0 &&
+                (i == TIMING_CONNECT || i == TIMING_WRITE)) {
+                continue;
+            }
+            int m = snprintf(out + n, LOG_LINE_MAX - 1 - n, " %s=%.1fus",
+                             names[i], rec->timing[i] * log_us_per_tick);
+            n = m < LOG_LINE_MAX - 1 - n ? n + m : LOG_LINE_MAX - 2;
+        }
+    }
+    out[n++] = '\n';
+    return n;
+}
+
+static void write_all(struct iovec *iov, int iovcnt) {
+    while (iovcnt > 0) {
+        ssize_t n = writev(log_fd, iov, iovcnt);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("webserver (access log)");
+            return;
+        }
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+}
+
+static void *logger_main(void *arg) {
+    (void)arg;
+    char *batch = malloc((size_t)log_nworkers * LOG_BATCH * LOG_LINE_MAX);
+    struct iovec *iov = malloc(sizeof(*iov) * log_nworkers);
+    uint64_t *reported = calloc(log_nworkers, sizeof(*reported));
+    if (batch == NULL || iov == NULL || reported == NULL) {
+        perror("webserver (malloc)");
+        return NULL;
+    }
+
+    for (;;) {
+        // Format up to LOG_BATCH records of every ring into that ring's
+        // region and write all regions with one writev()
+        int iovcnt = 0;
+        for (int i = 0; i < log_nworkers; i++) {
+            struct log_ring *r = log_workers[i].log;
+            uint32_t head =
+                atomic_load_explicit(&r->head, memory_order_relaxed);
+            uint32_t tail =
+                atomic_load_explicit(&r->tail, memory_order_acquire);
+            if (tail - head > LOG_BATCH) {
+                tail = head + LOG_BATCH;
+            }
+
+            char *region = batch + (size_t)i * LOG_BATCH * LOG_LINE_MAX;
+            size_t len = 0;
+            for (; head != tail; head++) {
+                len += format_record(&r->records[head & (LOG_RING_SIZE - 1)],
+                                     region + len);
+            }
+            atomic_store_explicit(&r->head, head, memory_order_release);
+            if (len > 0) {
+                iov[iovcnt].iov_base = region;
+                iov[iovcnt].iov_len = len;
+                iovcnt++;
+            }
+
+            uint64_t dropped =
+                atomic_load_explicit(&r->dropped, memory_order_relaxed);
+            if (dropped != reported[i]) {
+                fprintf(stderr, "webserver: worker %d dropped %llu access "
+                        "log records\n", i,
+                        (unsigned long long)(dropped - reported[i]));
+                reported[i] = dropped;
+            }
+        }
+
+        if (iovcnt > 0) {
+            write_all(iov, iovcnt);
+        } else if (atomic_load(&log_stopping)) {
+            break;
+        } else {
+            struct timespec ts = {0, LOG_FLUSH_INTERVAL_MS * 1000000L};
+            nanosleep(&ts, NULL);
+        }
+    }
+    free(reported);
+    free(iov);
+    free(batch);
+    return NULL;
+}
+
+// Measure how long a trace_clock() tick is against CLOCK_MONOTONIC
+static void calibrate(void) {
+    uint64_t t0 = trace_clock();
+    uint64_t n0 = metric_clock();
+    struct timespec ts = {0, 10 * 1000000L};
+    nanosleep(&ts, NULL);
+    uint64_t t1 = trace_clock();
+    uint64_t n1 = metric_clock();
+    log_us_per_tick = t1 > t0 ? (double)(n1 - n0) / 1000 / (t1 - t0) : 0;
+}
+
+int accesslog_start(struct worker *workers, int nworkers, const char *path) {
+    if (config.log_level < LOG_INFO) {
+        return 0;
+    }
+
+    if (strcmp(path, "-") == 0) {
+        // Anything printed so far must come out before the first record
+        fflush(stdout);
+        log_fd = STDOUT_FILENO;
+    } else {
+        log_fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+        if (log_fd < 0) {
+            perror("webserver (open access log)");
+            return -1;
+        }
+    }
+
+    if (config.log_timing) {
+        calibrate();
+    }
+
+    for (int i = 0; i < nworkers; i++) {
+        workers[i].log = aligned_alloc(64, sizeof(struct log_ring));
+        if (workers[i].log == NULL) {
+            perror("webserver (aligned_alloc)");
+            return -1;
+        }
+        memset(workers[i].log, 0, sizeof(struct log_ring));
+        // Only the logger thread reads it from elsewhere
+        topology_place(workers[i].log, sizeof(struct log_ring),
+                       workers[i].node);
+    }
+    log_workers = workers;
+    log_nworkers = nworkers;
+
+    int err = pthread_create(&log_thread, NULL, logger_main, NULL);
+    if (err != 0) {
+        fprintf(stderr, "webserver (pthread_create): %s\n", strerror(err));
+        return -1;
+    }
+    return 0;
+}
+
+void accesslog_stop(void) {
+    if (log_workers == NULL) {
+        return;
+    }
+    atomic_store(&log_stopping, 1);
+    pthread_join(log_thread, NULL);
+}
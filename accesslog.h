@@ -0,0 +1,95 @@
+#ifndef WEBSERVER_ACCESSLOG_H
+#define WEBSERVER_ACCESSLOG_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "addr.h"
+#include "http_parser.h"
+#include "server.h"
+
+struct conn;
+
+// Records each worker can have waiting for the logger thread; when the ring
+// is full, records are dropped and counted rather than blocking the worker
+#define LOG_RING_SIZE 4096
+
+// Bytes of the URI a record keeps; longer URIs are cut off
+#define LOG_URI_MAX 200
+
+enum log_record_type {
+    LOG_REQUEST,
+    LOG_ACCEPT,
+};
+
+// Where a request's time went, with --log-timing
+enum log_timing {
+    TIMING_CONNECT,     // from accept until its first byte, first requests
+    TIMING_READ,        // from its first byte until its head was complete
+    TIMING_PARSE,       // until the head was parsed
+    TIMING_HANDLER,     // until the response was queued
+    TIMING_WRITE,       // until the write queue was empty
+    TIMING_STAGES,
+};
+
+// Raw fields only; formatting happens on the logger thread
+struct log_record {
+    uint8_t type;
+    uint8_t major_version;
+    uint8_t minor_version;
+    uint8_t method_len;
+    uint8_t uri_len;
+    uint8_t timed;              // timing[] is filled in
+    uint16_t status;
+    union sock_addr addr;       // the client
+    uint64_t time_ms;           // CLOCK_REALTIME
+    uint64_t bytes;             // response size
+    uint64_t timing[TIMING_STAGES];     // trace_clock() ticks, 0 for none
+    char method[16];
+    char uri[LOG_URI_MAX];
+};
+
+// Single-producer, single-consumer: the worker appends at tail, the logger
+// thread consumes at head. Each index lives on its own cache line.
+struct log_ring {
+    _Alignas(64) _Atomic uint32_t head;
+    _Alignas(64) _Atomic uint32_t tail;
+    uint32_t head_cache;        // producer's last view of head
+    uint32_t sample;            // producer's sampling counter
+    _Atomic uint64_t dropped;
+    _Alignas(64) struct log_record records[LOG_RING_SIZE];
+};
+
+// Give every worker a ring and start the logger thread writing to path
+// ("-" for stdout). Does nothing below LOG_INFO.
+int accesslog_start(struct worker *workers, int nworkers, const char *path);
+
+// Write out whatever the rings still hold and stop the logger thread
+void accesslog_stop(void);
+
+// Whether the next answered request is to be logged, subject to
+// --log-sample; counts it towards the sample either way
+int accesslog_sampled(struct worker *w);
+
+// Queue a record of an answered request that accesslog_sampled() picked
+void accesslog_request(struct worker *w, const union sock_addr *addr,
+                       const struct http_request *req, int status,
+                       size_t bytes);
+
+// Like accesslog_request(), for a request on c with --log-timing. parsed
+// and handled are the trace_clock() ticks of the stages. The record is
+// held by c until accesslog_written() completes it, unless c already
+// holds one; then it is queued untimed.
+void accesslog_request_timed(struct conn *c, const struct http_request *req,
+                             int status, size_t bytes, uint64_t parsed,
+                             uint64_t handled);
+
+// Queue the record c holds, if any, now that its write queue is empty, or
+// without a write time if written is 0 because c goes away
+void accesslog_written(struct conn *c, int written);
+
+// Queue a record of an accepted connection; only logged at LOG_DEBUG
+void accesslog_accept(struct worker *w, const union sock_addr *addr);
+
+#endif
@@ -0,0 +1,117 @@
+#include <arpa/inet.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "addr.h"
+
+static int parse_port(const char *s, in_port_t *port) {
+    char *end;
+    long n = strtol(s, &end, 10);
+    if (*s < '0' || *s > '9' || *end != '\0' || n < 1 || n > 65535) {
+        return -1;
+    }
+    *port = htons((uint16_t)n);
+    return 0;
+}
+
+int addr_parse(const char *s, union sock_addr *a, int *dual_stack) {
+    memset(a, 0, sizeof(*a));
+    *dual_stack = 0;
+    const char *colon = strrchr(s, ':');
+    const char *port = colon != NULL ? colon + 1 : s;
+    size_t hostlen = colon != NULL ? (size_t)(colon - s) : 0;
+    char host[INET6_ADDRSTRLEN + 2];
+    if (hostlen >= sizeof(host)) {
+        return -1;
+    }
+    memcpy(host, s, hostlen);
+    host[hostlen] = '\0';
+
+    if (colon == NULL || strcmp(host, "*") == 0) {
+        a->in6.sin6_family = AF_INET6;
+        a->in6.sin6_addr = in6addr_any;
+        *dual_stack = 1;
+        return parse_port(port, &a->in6.sin6_port);
+    }
+    if (host[0] == '[' && hostlen > 2 && host[hostlen - 1] == ']') {
+        host[hostlen - 1] = '\0';
+        a->in6.sin6_family = AF_INET6;
+        if (inet_pton(AF_INET6, host + 1, &a->in6.sin6_addr) != 1) {
+            return -1;
+        }
+        return parse_port(port, &a->in6.sin6_port);
+    }
+    a->in.sin_family = AF_INET;
+    if (inet_pton(AF_INET, host, &a->in.sin_addr) != 1) {
+        return -1;
+    }
+    return parse_port(port, &a->in.sin_port);
+}
+
+socklen_t addr_len(const union sock_addr *a) {
+    return a->sa.sa_family == AF_INET6 ? sizeof(a->in6) : sizeof(a->in);
+}
+
+// Decimal digits of n, without leading zeros
+static char *put_uint(char *p, unsigned n) {
+    char digits[5];
+    int k = 0;
+    do {
+        digits[k++] = '0' + n % 10;
+        n /= 10;
+    } while (n != 0);
+    while (k > 0) {
+        *p++ = digits[--k];
+    }
+    return p;
+}
+
+static char *put_ipv4(char *p, const uint8_t *b) {
+    for (int i = 0; i < 4; i++) {
+        if (i > 0) {
+            *p++ = '.';
+        }
+        p = put_uint(p, b[i]);
+    }
+    return p;
+}
+
+size_t addr_format_host(const union sock_addr *a, char *out) {
+    char *p = out;
+    if (a->sa.sa_family == AF_INET) {
+        p = put_ipv4(p, (const uint8_t *)&a->in.sin_addr);
+    } else if (a->sa.sa_family == AF_INET6) {
+        const struct in6_addr *ip = &a->in6.sin6_addr;
+        if (IN6_IS_ADDR_V4MAPPED(ip)) {
+            p = put_ipv4(p, ip->s6_addr + 12);
+        } else {
+            // Rare enough not to hand-roll the zero compression
+            inet_ntop(AF_INET6, ip, p, INET6_ADDRSTRLEN);
+            p += strlen(p);
+        }
+    } else {
+        *p++ = '-';
+    }
+    *p = '\0';
+    return (size_t)(p - out);
+}
+
+size_t addr_format(const union sock_addr *a, char *out) {
+    int bracket = a->sa.sa_family == AF_INET6 &&
+                  !IN6_IS_ADDR_V4MAPPED(&a->in6.sin6_addr);
+    char *p = out + bracket;
+    p += addr_format_host(a, p);
+    if (a->sa.sa_family != AF_INET && a->sa.sa_family != AF_INET6) {
+        return (size_t)(p - out);
+    }
+    if (bracket) {
+        out[0] = '[';
+        *p++ = ']';
+    }
+    *p++ = ':';
+    p = put_uint(p, ntohs(a->sa.sa_family == AF_INET ? a->in.sin_port
+                                                      : a->in6.sin6_port));
+    *p = '\0';
+    return (size_t)(p - out);
+}
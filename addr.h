@@ -0,0 +1,36 @@
+#ifndef WEBSERVER_ADDR_H
+#define WEBSERVER_ADDR_H
+
+#include <netinet/in.h>
+#include <stddef.h>
+#include <sys/socket.h>
+
+// A socket address of either family, as accept4() fills it in
+union sock_addr {
+    struct sockaddr sa;
+    struct sockaddr_in in;
+    struct sockaddr_in6 in6;
+};
+
+// Longest formatted address: "[ffff:...:255.255.255.255]:65535" and a NUL
+#define ADDR_STRLEN (INET6_ADDRSTRLEN + 8)
+
+// Parse a listen address: "PORT" or "*:PORT" for every address of both
+// families, "A.B.C.D:PORT" or "[IPV6]:PORT" for just that one. Sets
+// *dual_stack for the wildcard forms, which are bound to [::] with
+// IPV6_V6ONLY off. Numeric addresses only, nothing is looked up.
+int addr_parse(const char *s, union sock_addr *a, int *dual_stack);
+
+// The length bind() and friends expect for a
+socklen_t addr_len(const union sock_addr *a);
+
+// Write a as "A.B.C.D:PORT" or "[IPV6]:PORT" and a NUL to out, which holds
+// ADDR_STRLEN bytes, and return the length. IPv4 clients of a dual-stack
+// listener show up as plain IPv4. Reentrant, unlike inet_ntoa().
+size_t addr_format(const union sock_addr *a, char *out);
+
+// Like addr_format(), without the port and the brackets: "A.B.C.D" or
+// "IPV6", as X-Forwarded-For wants it
+size_t addr_format_host(const union sock_addr *a, char *out);
+
+#endif
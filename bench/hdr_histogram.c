@@ -0,0 +1,74 @@
+#include <string.h>
+
+#include "hdr_histogram.h"
+
+void hdr_init(struct hdr_histogram *h) {
+    memset(h, 0, sizeof(*h));
+    h->min = UINT64_MAX;
+}
+
+// Values below 2 * HDR_SUB_BUCKET_HALF are recorded exactly. Every bucket
+// after that covers the next power of two with HDR_SUB_BUCKET_HALF
+// sub-buckets, each twice as wide as the previous bucket's.
+static unsigned counts_index(uint64_t value) {
+    uint64_t v = value | (2 * HDR_SUB_BUCKET_HALF - 1);
+    unsigned bucket = 64 - __builtin_clzll(v) - HDR_SUB_BUCKET_BITS;
+    unsigned sub = value >> bucket;
+    return (bucket << (HDR_SUB_BUCKET_BITS - 1)) + sub;
+}
+
+// The largest value that lands in the same slot as counts_index() i
+static uint64_t highest_equivalent(unsigned i) {
+    if (i < 2 * HDR_SUB_BUCKET_HALF) {
+        return i;
+    }
+    unsigned bucket = (i >> (HDR_SUB_BUCKET_BITS - 1)) - 1;
+    uint64_t sub = i - (bucket << (HDR_SUB_BUCKET_BITS - 1));
+    return ((sub + 1) << bucket) - 1;
+}
+
+void hdr_record(struct hdr_histogram *h, uint64_t value) {
+    if (value > HDR_MAX_VALUE) {
+        value = HDR_MAX_VALUE;
+    }
+    h->counts[counts_index(value)]++;
+    h->total++;
+    if (value < h->min) {
+        h->min = value;
+    }
+    if (value > h->max) {
+        h->max = value;
+    }
+}
+
+void hdr_add(struct hdr_histogram *h, const struct hdr_histogram *from) {
+    for (unsigned i = 0; i < HDR_COUNTS; i++) {
+        h->counts[i] += from->counts[i];
+    }
+    h->total += from->total;
+    if (from->min < h->min) {
+        h->min = from->min;
+    }
+    if (from->max > h->max) {
+        h->max = from->max;
+    }
+}
+
+uint64_t hdr_percentile(const struct hdr_histogram *h, double percent) {
+    if (h->total == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)(percent / 100.0 * h->total + 0.5);
+    if (rank < 1) {
+        rank = 1;
+    }
+    uint64_t seen = 0;
+    for (unsigned i = 0; i < HDR_COUNTS; i++) {
+        seen += h->counts[i];
+        if (seen >= rank) {
+            uint64_t v = highest_equivalent(i);
+            return v < h->max ? v : h->max;
+        }
+    }
+    return h->max;
+}
@@ -0,0 +1,36 @@
+#ifndef BENCH_HDR_HISTOGRAM_H
+#define BENCH_HDR_HISTOGRAM_H
+
+#include <stdint.h>
+
+// A fixed-size HdrHistogram: values from 1 up to HDR_MAX_VALUE are recorded
+// with three significant decimal digits of precision, so a percentile is
+// never off by more than 0.1% no matter how large the value is
+#define HDR_SUB_BUCKET_BITS 11          // 2048 sub-buckets per bucket
+#define HDR_MAX_VALUE_BITS 40           // about 18 minutes in nanoseconds
+#define HDR_MAX_VALUE ((1ULL << HDR_MAX_VALUE_BITS) - 1)
+
+#define HDR_SUB_BUCKET_HALF (1 << (HDR_SUB_BUCKET_BITS - 1))
+#define HDR_BUCKETS (HDR_MAX_VALUE_BITS - HDR_SUB_BUCKET_BITS + 1)
+#define HDR_COUNTS ((HDR_BUCKETS + 1) * HDR_SUB_BUCKET_HALF)
+
+struct hdr_histogram {
+    uint64_t total;
+    uint64_t min;
+    uint64_t max;
+    uint64_t counts[HDR_COUNTS];
+};
+
+void hdr_init(struct hdr_histogram *h);
+
+// Record a value; values above HDR_MAX_VALUE are clamped to it
+void hdr_record(struct hdr_histogram *h, uint64_t value);
+
+// Add every value recorded in from to h
+void hdr_add(struct hdr_histogram *h, const struct hdr_histogram *from);
+
+// The smallest value that percentile percent of the recorded values are at
+// or below, e.g. hdr_percentile(h, 99.9)
+uint64_t hdr_percentile(const struct hdr_histogram *h, double percent);
+
+#endif
@@ -0,0 +1,778 @@
+// A small HTTP/1.1 load generator for the webserver.
+//
+// Every thread drives its share of the connections from one epoll loop.
+// In closed-loop mode (the default) each connection sends its next request
+// as soon as the previous response is complete, which measures capacity.
+// With --rate=N requests are instead sent on a fixed schedule, and latency
+// is measured from when a request was due rather than when it could be
+// sent, so a stalled server shows up in the tail instead of hiding behind
+// the generator slowing down (coordinated omission).
+//
+// Slow clients (--slow=N) are extra connections that trickle each request
+// out one byte at a time; they are not measured, they only add pressure.
+
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hdr_histogram.h"
+
+#ifndef TCP_FASTOPEN_CONNECT
+#define TCP_FASTOPEN_CONNECT 30
+#endif
+
+#define RESPONSE_HEAD_MAX 4096
+#define RECONNECT_DELAY_NS (10 * 1000000ULL)
+
+struct options {
+    const char *addr;
+    int port;
+    const char *path;
+    int connections;
+    int threads;
+    double duration;            // seconds measured
+    double warmup;              // seconds run before measuring
+    double rate;                // requests per second, 0 for closed loop
+    int close;                  // one request per connection
+    int fastopen;               // send the request with the SYN
+    int slow;                   // slow clients
+    int slow_interval;          // milliseconds between their bytes
+    int summary;                // print one line for scripts
+};
+
+static struct options opt = {
+    .addr = "127.0.0.1",
+    .port = 8080,
+    .path = "/",
+    .connections = 64,
+    .threads = 1,
+    .duration = 10,
+    .warmup = 1,
+    .slow_interval = 100,
+};
+
+static struct sockaddr_in server;
+static char request[2048];
+static size_t request_len;
+
+enum client_state {
+    CLIENT_CONNECTING,
+    CLIENT_IDLE,                // connected, waiting for a request to send
+    CLIENT_SENDING,
+    CLIENT_WAITING,             // request sent, reading the response
+    CLIENT_BACKOFF,             // connect failed, retrying soon
+};
+
+enum chunk_state {
+    CHUNK_SIZE,
+    CHUNK_DATA,
+    CHUNK_DATA_END,             // the CRLF after the data
+    CHUNK_TRAILER,
+};
+
+struct client {
+    int fd;
+    enum client_state state;
+    int slow;
+    int pending;                // closed loop: send once connected
+    uint64_t start;             // when the current request was due
+    uint64_t timer;             // slow byte or reconnect time
+    size_t sent;
+
+    // Response being read
+    char head[RESPONSE_HEAD_MAX];
+    size_t have;
+    int in_body;
+    int server_close;           // Connection: close, or no Content-Length
+    long long body_left;        // -1 when the body ends at EOF
+    int chunked;                // Transfer-Encoding: chunked
+    enum chunk_state chunk_state;
+    long long chunk_left;       // bytes of the chunk size or data still due
+};
+
+struct thread {
+    pthread_t thread;
+    int id;
+    int epfd;
+    struct client *clients;     // slow clients first
+    int nclients;
+    int nslow;
+    struct client **idle;       // open loop: connections ready to send
+    int nidle;
+    int nbackoff;
+    uint64_t interval;          // open loop: nanoseconds between requests
+    uint64_t due;               // open loop: the oldest unsent request
+    uint64_t measure_from;
+    uint64_t deadline;
+
+    struct hdr_histogram hist;
+    uint64_t bytes;
+    uint64_t slow_requests;
+    uint64_t connect_errors;
+    uint64_t io_errors;
+    uint64_t status_errors;
+    uint64_t unsent;
+};
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void client_connect(struct thread *t, struct client *c);
+static void client_send(struct thread *t, struct client *c, uint64_t start);
+
+static void client_drop(struct thread *t, struct client *c) {
+    if (c->fd >= 0) {
+        close(c->fd);
+        c->fd = -1;
+    }
+}
+
+static void client_backoff(struct thread *t, struct client *c) {
+    client_drop(t, c);
+    c->state = CLIENT_BACKOFF;
+    c->timer = now_ns() + RECONNECT_DELAY_NS;
+    t->nbackoff++;
+}
+
+// A connection is ready for its next request
+static void client_ready(struct thread *t, struct client *c) {
+    if (opt.rate == 0 || c->slow) {
+        client_send(t, c, now_ns());
+    } else {
+        c->state = CLIENT_IDLE;
+        t->idle[t->nidle++] = c;
+    }
+}
+
+// Drop the connection and open a new one; the request in flight, if any,
+// is sent again on the new connection
+static void client_reconnect(struct thread *t, struct client *c) {
+    client_drop(t, c);
+    client_connect(t, c);
+}
+
+static void client_connect(struct thread *t, struct client *c) {
+    c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (c->fd < 0) {
+        perror("loadgen (socket)");
+        t->connect_errors++;
+        client_backoff(t, c);
+        return;
+    }
+    int one = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (opt.fastopen) {
+        // connect() returns right away and the first send goes out with
+        // the SYN once the server gave us a cookie
+        setsockopt(c->fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &one,
+                   sizeof(one));
+    }
+
+    struct epoll_event ev = {
+        .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+        .data.ptr = c,
+    };
+    if (epoll_ctl(t->epfd, EPOLL_CTL_ADD, c->fd, &ev) != 0) {
+        perror("loadgen (epoll_ctl)");
+        t->connect_errors++;
+        client_backoff(t, c);
+        return;
+    }
+    c->state = CLIENT_CONNECTING;
+    if (connect(c->fd, (struct sockaddr *)&server, sizeof(server)) != 0 &&
+        errno != EINPROGRESS) {
+        t->connect_errors++;
+        client_backoff(t, c);
+    }
+}
+
+static void client_write(struct thread *t, struct client *c) {
+    while (c->sent < request_len) {
+        size_t n = c->slow ? 1 : request_len - c->sent;
+        ssize_t w = send(c->fd, request + c->sent, n, MSG_NOSIGNAL);
+        if (w < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return;
+            }
+            t->io_errors++;
+            client_reconnect(t, c);
+            return;
+        }
+        c->sent += w;
+        if (c->slow && c->sent < request_len) {
+            c->timer = now_ns() + opt.slow_interval * 1000000ULL;
+            return;
+        }
+    }
+    c->state = CLIENT_WAITING;
+    c->have = 0;
+    c->in_body = 0;
+}
+
+static void client_send(struct thread *t, struct client *c, uint64_t start) {
+    c->state = CLIENT_SENDING;
+    c->start = start;
+    c->sent = 0;
+    client_write(t, c);
+}
+
+// Find the end of the response head and pick out what decides where the
+// body ends. Returns the head length, 0 if incomplete, or -1 if malformed.
+static int parse_head(struct thread *t, struct client *c) {
+    char *end = memmem(c->head, c->have, "\r\n\r\n", 4);
+    if (end == NULL) {
+        return c->have < sizeof(c->head) ? 0 : -1;
+    }
+    if (c->have < 12 || memcmp(c->head, "HTTP/1.", 7) != 0) {
+        return -1;
+    }
+    int status = atoi(c->head + 9);
+    if ((status < 200 || status >= 400) && c->start >= t->measure_from) {
+        t->status_errors++;
+    }
+
+    c->body_left = -1;
+    c->chunked = 0;
+    c->chunk_state = CHUNK_SIZE;
+    c->chunk_left = 0;
+    c->server_close = c->head[7] == '0';
+    for (char *line = memmem(c->head, end - c->head, "\r\n", 2);
+         line != NULL && line < end;
+         line = memmem(line + 2, end + 2 - (line + 2), "\r\n", 2)) {
+        char *h = line + 2;
+        if (strncasecmp(h, "Content-Length:", 15) == 0) {
+            c->body_left = strtoll(h + 15, NULL, 10);
+        } else if (strncasecmp(h, "Transfer-Encoding:", 18) == 0) {
+            c->chunked = 1;
+        } else if (strncasecmp(h, "Connection:", 11) == 0) {
+            char *v = h + 11;
+            while (*v == ' ') {
+                v++;
+            }
+            if (strncasecmp(v, "close", 5) == 0) {
+                c->server_close = 1;
+            } else if (strncasecmp(v, "keep-alive", 10) == 0) {
+                c->server_close = 0;
+            }
+        }
+    }
+    if (c->body_left < 0 && !c->chunked) {
+        c->server_close = 1;
+    }
+    return end + 4 - c->head;
+}
+
+// Follow a chunked body through n more bytes of it. Returns 1 once the
+// body is complete, 0 if more is to come, or -1 if it is malformed.
+static int chunked_feed(struct client *c, const char *p, size_t n) {
+    const char *end = p + n;
+    while (p < end) {
+        switch (c->chunk_state) {
+        case CHUNK_SIZE:
+            if (*p == '\n') {
+                c->chunk_state = c->chunk_left > 0 ? CHUNK_DATA : CHUNK_TRAILER;
+            } else if (*p >= '0' && *p <= '9') {
+                c->chunk_left = c->chunk_left * 16 + (*p - '0');
+            } else if ((*p | 0x20) >= 'a' && (*p | 0x20) <= 'f') {
+                c->chunk_left = c->chunk_left * 16 + ((*p | 0x20) - 'a' + 10);
+            } else if (*p != '\r') {
+                return -1;
+            }
+            p++;
+            break;
+        case CHUNK_DATA: {
+            long long take = end - p;
+            if (take > c->chunk_left) {
+                take = c->chunk_left;
+            }
+            p += take;
+            c->chunk_left -= take;
+            if (c->chunk_left == 0) {
+                c->chunk_state = CHUNK_DATA_END;
+            }
+            break;
+        }
+        case CHUNK_DATA_END:
+            if (*p++ == '\n') {
+                c->chunk_state = CHUNK_SIZE;
+            }
+            break;
+        case CHUNK_TRAILER:
+            // chunk_left counts the bytes of the current trailer line
+            if (*p == '\n') {
+                if (c->chunk_left == 0) {
+                    return 1;
+                }
+                c->chunk_left = 0;
+            } else if (*p != '\r') {
+                c->chunk_left++;
+            }
+            p++;
+            break;
+        }
+    }
+    return 0;
+}
+
+static void client_done(struct thread *t, struct client *c) {
+    uint64_t now = now_ns();
+    if (c->slow) {
+        t->slow_requests++;
+    } else if (c->start >= t->measure_from && now < t->deadline) {
+        hdr_record(&t->hist, now - c->start);
+    }
+    if (c->server_close || opt.close) {
+        c->pending = 0;
+        client_reconnect(t, c);
+    } else {
+        client_ready(t, c);
+    }
+}
+
+static void client_read(struct thread *t, struct client *c) {
+    char discard[65536];
+    for (;;) {
+        char *buf = c->in_body ? discard : c->head + c->have;
+        size_t cap = c->in_body ? sizeof(discard) : sizeof(c->head) - c->have;
+        ssize_t n = recv(c->fd, buf, cap, 0);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return;
+            }
+            t->io_errors++;
+            c->pending = 1;
+            client_reconnect(t, c);
+            return;
+        }
+        if (n == 0) {
+            if (c->in_body && c->body_left < 0) {
+                client_done(t, c);
+            } else {
+                // The server went away before answering; try the request
+                // again on a fresh connection
+                t->io_errors++;
+                c->pending = 1;
+                client_reconnect(t, c);
+            }
+            return;
+        }
+        if (c->start >= t->measure_from) {
+            t->bytes += n;
+        }
+
+        long long body = n;
+        if (!c->in_body) {
+            c->have += n;
+            int head = parse_head(t, c);
+            if (head == 0) {
+                continue;
+            }
+            if (head < 0) {
+                t->io_errors++;
+                c->pending = 1;
+                client_reconnect(t, c);
+                return;
+            }
+            c->in_body = 1;
+            body = c->have - head;
+        }
+        if (c->chunked) {
+            // The body is whatever of the bytes just read follows the head
+            int done = chunked_feed(c, buf + n - body, body);
+            if (done < 0) {
+                t->io_errors++;
+                c->pending = 1;
+                client_reconnect(t, c);
+                return;
+            }
+            if (done > 0) {
+                client_done(t, c);
+                return;
+            }
+        } else if (c->body_left >= 0) {
+            c->body_left -= body;
+            if (c->body_left <= 0) {
+                client_done(t, c);
+                return;
+            }
+        }
+    }
+}
+
+static void client_event(struct thread *t, struct client *c, uint32_t events) {
+    if (c->state == CLIENT_CONNECTING) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err != 0) {
+            t->connect_errors++;
+            client_backoff(t, c);
+            return;
+        }
+        if (!(events & EPOLLOUT)) {
+            return;
+        }
+        if (c->pending) {
+            // Retry the request the last connection lost, still timed from
+            // when it was first due
+            c->pending = 0;
+            client_send(t, c, c->start);
+        } else {
+            client_ready(t, c);
+        }
+        return;
+    }
+    if (c->state == CLIENT_SENDING && (events & EPOLLOUT) && !c->slow) {
+        client_write(t, c);
+    }
+    if (c->state == CLIENT_WAITING && (events & (EPOLLIN | EPOLLRDHUP))) {
+        client_read(t, c);
+    } else if (c->state == CLIENT_IDLE && (events & (EPOLLIN | EPOLLRDHUP))) {
+        // An idle keep-alive connection was closed by the server
+        char byte;
+        if (recv(c->fd, &byte, 1, 0) == 0) {
+            for (int i = 0; i < t->nidle; i++) {
+                if (t->idle[i] == c) {
+                    t->idle[i] = t->idle[--t->nidle];
+                    break;
+                }
+            }
+            client_reconnect(t, c);
+        }
+    }
+}
+
+// Fire the timers of slow clients and reconnecting clients, and return
+// the earliest one still pending
+static uint64_t run_timers(struct thread *t, uint64_t now, uint64_t wake) {
+    int end = t->nbackoff > 0 ? t->nclients : t->nslow;
+    for (int i = 0; i < end; i++) {
+        struct client *c = &t->clients[i];
+        if (c->state == CLIENT_BACKOFF) {
+            if (c->timer <= now) {
+                t->nbackoff--;
+                client_connect(t, c);
+            } else if (c->timer < wake) {
+                wake = c->timer;
+            }
+        } else if (c->slow && c->state == CLIENT_SENDING) {
+            if (c->timer <= now) {
+                client_write(t, c);
+            }
+            if (c->state == CLIENT_SENDING && c->timer < wake) {
+                wake = c->timer;
+            }
+        }
+    }
+    return wake;
+}
+
+static void *thread_main(void *arg) {
+    struct thread *t = arg;
+    t->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (t->epfd < 0) {
+        perror("loadgen (epoll_create1)");
+        return NULL;
+    }
+    uint64_t start = now_ns();
+    t->measure_from = start + (uint64_t)(opt.warmup * 1e9);
+    t->deadline = t->measure_from + (uint64_t)(opt.duration * 1e9);
+    t->due = start + t->interval * t->id / opt.threads;
+
+    for (int i = 0; i < t->nclients; i++) {
+        client_connect(t, &t->clients[i]);
+    }
+
+    struct epoll_event events[256];
+    for (;;) {
+        uint64_t now = now_ns();
+
+        // Hand the requests that are due to idle connections; the rest
+        // wait, and their latency keeps counting from when they were due
+        while (opt.rate > 0 && t->due <= now && t->nidle > 0) {
+            client_send(t, t->idle[--t->nidle], t->due);
+            t->due += t->interval;
+        }
+        if (now >= t->deadline) {
+            break;
+        }
+
+        uint64_t wake = t->deadline;
+        if (opt.rate > 0 && t->nidle > 0 && t->due < wake) {
+            wake = t->due;
+        }
+        if (t->nbackoff > 0 || t->nslow > 0) {
+            wake = run_timers(t, now, wake);
+        }
+
+        uint64_t wait = wake > now ? wake - now : 0;
+        struct timespec timeout = {
+            .tv_sec = wait / 1000000000,
+            .tv_nsec = wait % 1000000000,
+        };
+        int n = epoll_pwait2(t->epfd, events, 256, &timeout, NULL);
+        if (n < 0 && errno != EINTR) {
+            perror("loadgen (epoll_pwait2)");
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            client_event(t, events[i].data.ptr, events[i].events);
+        }
+    }
+
+    if (opt.rate > 0 && t->due < t->deadline) {
+        t->unsent = (t->deadline - t->due) / t->interval;
+    }
+    for (int i = 0; i < t->nclients; i++) {
+        client_drop(t, &t->clients[i]);
+    }
+    close(t->epfd);
+    return NULL;
+}
+
+static void format_ns(char *out, size_t len, uint64_t ns) {
+    if (ns < 1000) {
+        snprintf(out, len, "%lluns", (unsigned long long)ns);
+    } else if (ns < 1000000) {
+        snprintf(out, len, "%.1fus", ns / 1e3);
+    } else if (ns < 1000000000) {
+        snprintf(out, len, "%.2fms", ns / 1e6);
+    } else {
+        snprintf(out, len, "%.2fs", ns / 1e9);
+    }
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [--addr=IP] [--port=N] [--path=/URI]\n"
+            "          [--connections=N] [--threads=N] [--duration=SECONDS]\n"
+            "          [--warmup=SECONDS] [--rate=REQUESTS_PER_SECOND]\n"
+            "          [--close] [--slow=N] [--slow-interval=MS] [--summary]\n"
+            "          [--fastopen]\n",
+            prog);
+}
+
+static int parse_number(const char *arg, const char *value, double min,
+                        double max, double *out) {
+    char *end;
+    double n = strtod(value, &end);
+    if (*value == '\0' || *end != '\0' || n < min || n > max) {
+        fprintf(stderr, "loadgen: invalid value in '%s'\n", arg);
+        return -1;
+    }
+    *out = n;
+    return 0;
+}
+
+static int parse_args(int argc, char *argv[]) {
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        const char *value = strchr(arg, '=');
+        value = value != NULL ? value + 1 : "";
+        double n;
+        if (strncmp(arg, "--addr=", 7) == 0) {
+            opt.addr = value;
+        } else if (strncmp(arg, "--path=", 7) == 0 && value[0] == '/') {
+            opt.path = value;
+        } else if (strcmp(arg, "--close") == 0) {
+            opt.close = 1;
+        } else if (strcmp(arg, "--fastopen") == 0) {
+            opt.fastopen = 1;
+        } else if (strcmp(arg, "--summary") == 0) {
+            opt.summary = 1;
+        } else if (strncmp(arg, "--port=", 7) == 0) {
+            if (parse_number(arg, value, 1, 65535, &n) != 0) {
+                return -1;
+            }
+            opt.port = (int)n;
+        } else if (strncmp(arg, "--connections=", 14) == 0) {
+            if (parse_number(arg, value, 1, 1000000, &n) != 0) {
+                return -1;
+            }
+            opt.connections = (int)n;
+        } else if (strncmp(arg, "--threads=", 10) == 0) {
+            if (parse_number(arg, value, 1, 1024, &n) != 0) {
+                return -1;
+            }
+            opt.threads = (int)n;
+        } else if (strncmp(arg, "--duration=", 11) == 0) {
+            if (parse_number(arg, value, 0.1, 86400, &opt.duration) != 0) {
+                return -1;
+            }
+        } else if (strncmp(arg, "--warmup=", 9) == 0) {
+            if (parse_number(arg, value, 0, 3600, &opt.warmup) != 0) {
+                return -1;
+            }
+        } else if (strncmp(arg, "--rate=", 7) == 0) {
+            if (parse_number(arg, value, 1, 1e9, &opt.rate) != 0) {
+                return -1;
+            }
+        } else if (strncmp(arg, "--slow=", 7) == 0) {
+            if (parse_number(arg, value, 0, 1000000, &n) != 0) {
+                return -1;
+            }
+            opt.slow = (int)n;
+        } else if (strncmp(arg, "--slow-interval=", 16) == 0) {
+            if (parse_number(arg, value, 1, 60000, &n) != 0) {
+                return -1;
+            }
+            opt.slow_interval = (int)n;
+        } else {
+            usage(argv[0]);
+            return -1;
+        }
+    }
+    if (opt.threads > opt.connections) {
+        opt.threads = opt.connections;
+    }
+    return 0;
+}
+
+static void report(struct thread *threads) {
+    struct hdr_histogram *h = malloc(sizeof(*h));
+    if (h == NULL) {
+        perror("loadgen (malloc)");
+        return;
+    }
+    hdr_init(h);
+    uint64_t bytes = 0, slow = 0, connect_errors = 0, io_errors = 0;
+    uint64_t status_errors = 0, unsent = 0;
+    for (int i = 0; i < opt.threads; i++) {
+        struct thread *t = &threads[i];
+        hdr_add(h, &t->hist);
+        bytes += t->bytes;
+        slow += t->slow_requests;
+        connect_errors += t->connect_errors;
+        io_errors += t->io_errors;
+        status_errors += t->status_errors;
+        unsent += t->unsent;
+    }
+
+    double rps = h->total / opt.duration;
+    static const double percentiles[] = {50, 90, 99, 99.9};
+    char p[4][16], max[16];
+    for (int i = 0; i < 4; i++) {
+        format_ns(p[i], sizeof(p[i]), hdr_percentile(h, percentiles[i]));
+    }
+    format_ns(max, sizeof(max), h->total > 0 ? h->max : 0);
+
+    if (opt.summary) {
+        printf("%10.0f %10s %10s %10s %10s %8llu\n", rps, p[0], p[2], p[3],
+               max, (unsigned long long)(connect_errors + io_errors +
+                                         status_errors + unsent));
+        free(h);
+        return;
+    }
+
+    if (opt.rate > 0) {
+        printf("open loop at %.0f requests/s", opt.rate);
+    } else {
+        printf("closed loop");
+    }
+    printf(", %d connections%s on %d threads, %.1f s against %s:%d%s\n",
+           opt.connections, opt.close ? " (one request each)" : "",
+           opt.threads, opt.duration, opt.addr, opt.port, opt.path);
+    if (opt.slow > 0) {
+        printf("  slow clients  %d, %llu requests answered\n", opt.slow,
+               (unsigned long long)slow);
+    }
+    printf("  requests      %llu (%.1f/s)\n", (unsigned long long)h->total,
+           rps);
+    printf("  transfer      %.1f MB (%.1f MB/s)\n", bytes / 1e6,
+           bytes / 1e6 / opt.duration);
+    printf("  errors        %llu connect, %llu read/write, %llu status\n",
+           (unsigned long long)connect_errors, (unsigned long long)io_errors,
+           (unsigned long long)status_errors);
+    if (unsent > 0) {
+        printf("  unsent        %llu requests were never sent; the server "
+               "could not keep up\n", (unsigned long long)unsent);
+    }
+    printf("  latency       p50 %s  p90 %s  p99 %s  p99.9 %s  max %s\n",
+           p[0], p[1], p[2], p[3], max);
+    free(h);
+}
+
+int main(int argc, char *argv[]) {
+    if (parse_args(argc, argv) != 0) {
+        return 1;
+    }
+
+    server.sin_family = AF_INET;
+    server.sin_port = htons(opt.port);
+    if (inet_pton(AF_INET, opt.addr, &server.sin_addr) != 1) {
+        fprintf(stderr, "loadgen: invalid address '%s'\n", opt.addr);
+        return 1;
+    }
+    int n = snprintf(request, sizeof(request),
+                     "GET %s HTTP/1.1\r\nHost: %s:%d\r\n%s\r\n", opt.path,
+                     opt.addr, opt.port,
+                     opt.close ? "Connection: close\r\n" : "");
+    if (n < 0 || (size_t)n >= sizeof(request)) {
+        fprintf(stderr, "loadgen: path too long\n");
+        return 1;
+    }
+    request_len = n;
+
+    struct thread *threads = calloc(opt.threads, sizeof(*threads));
+    int total = opt.connections + opt.slow;
+    struct client *clients = calloc(total, sizeof(*clients));
+    struct client **idle = calloc(total, sizeof(*idle));
+    if (threads == NULL || clients == NULL || idle == NULL) {
+        perror("loadgen (calloc)");
+        return 1;
+    }
+
+    // Deal the connections out to the threads, slow clients first so each
+    // thread's timers are at the front of its array
+    int next = 0;
+    for (int i = 0; i < opt.threads; i++) {
+        struct thread *t = &threads[i];
+        int slow = opt.slow / opt.threads + (i < opt.slow % opt.threads);
+        int fast = opt.connections / opt.threads +
+                   (i < opt.connections % opt.threads);
+        t->id = i;
+        t->clients = &clients[next];
+        t->idle = &idle[next];
+        t->nclients = slow + fast;
+        t->nslow = slow;
+        for (int j = 0; j < t->nclients; j++) {
+            t->clients[j].fd = -1;
+            t->clients[j].slow = j < slow;
+        }
+        next += t->nclients;
+        if (opt.rate > 0) {
+            t->interval = (uint64_t)(1e9 * opt.threads / opt.rate);
+        }
+        hdr_init(&t->hist);
+    }
+
+    for (int i = 0; i < opt.threads; i++) {
+        int err = pthread_create(&threads[i].thread, NULL, thread_main,
+                                 &threads[i]);
+        if (err != 0) {
+            fprintf(stderr, "loadgen (pthread_create): %s\n", strerror(err));
+            return 1;
+        }
+    }
+    for (int i = 0; i < opt.threads; i++) {
+        pthread_join(threads[i].thread, NULL);
+    }
+
+    report(threads);
+    return 0;
+}
@@ -0,0 +1,92 @@
+#!/bin/bash
+# Profile the server under load: record call stacks with perf while
+# loadgen drives one scenario, and render them as a flame graph.
+#
+#   $ make clean && make bench CFLAGS="-O2 -g -fno-omit-frame-pointer"
+#   $ FLAMEGRAPH_DIR=~/FlameGraph bench/profile.sh
+#
+# The frame pointers give perf whole stacks for little cost. Without
+# FLAMEGRAPH_DIR (a checkout of github.com/brendangregg/FlameGraph) the
+# stacks perf recorded are left in profile.perf. With TOOL=bpftrace,
+# bench/stages.bt runs instead and prints where a request's time goes, for
+# which the server must have been built with USDT probes (see trace.h).
+#
+# DURATION, CONNECTIONS, THREADS and FREQ tune the run, SCENARIO picks the
+# request (hello, static-small or stream), OUT the output prefix, and
+# SERVER_ARGS and LOADGEN_ARGS are passed on. perf and bpftrace usually
+# need root or kernel.perf_event_paranoid <= 1.
+
+set -u
+cd "$(dirname "$0")/.."
+
+DURATION=${DURATION:-10}
+CONNECTIONS=${CONNECTIONS:-64}
+THREADS=${THREADS:-$(( $(nproc) > 4 ? 4 : $(nproc) ))}
+FREQ=${FREQ:-999}
+SCENARIO=${SCENARIO:-hello}
+TOOL=${TOOL:-perf}
+OUT=${OUT:-profile}
+FLAMEGRAPH_DIR=${FLAMEGRAPH_DIR:-}
+SERVER_ARGS=${SERVER_ARGS:-}
+LOADGEN_ARGS=${LOADGEN_ARGS:-}
+
+declare -A scenario_args=(
+    [hello]="--path=/"
+    [static-small]="--path=/small.html"
+    [stream]="--path=/stream/1048576"
+)
+if [ -z "${scenario_args[$SCENARIO]+x}" ]; then
+    echo "profile: unknown scenario $SCENARIO" >&2
+    exit 1
+fi
+
+docroot=$(mktemp -d)
+server=
+cleanup() {
+    [ -n "$server" ] && kill "$server" 2> /dev/null
+    rm -rf "$docroot"
+}
+trap cleanup EXIT
+
+head -c 4096 /dev/zero | tr '\0' 'x' > "$docroot/small.html"
+
+# shellcheck disable=SC2086
+./webserver --log-level=off --root="$docroot" $SERVER_ARGS > /dev/null 2>&1 &
+server=$!
+for _ in $(seq 1 50); do
+    (exec 3<> /dev/tcp/127.0.0.1/8080) 2> /dev/null && break
+    sleep 0.1
+done
+
+# Profile the middle of the run, not the ramp up
+# shellcheck disable=SC2086
+./bench/loadgen --summary --duration="$DURATION" --warmup=1 \
+    --connections="$CONNECTIONS" --threads="$THREADS" \
+    ${scenario_args[$SCENARIO]} $LOADGEN_ARGS &
+loadgen=$!
+sleep 1
+
+case $TOOL in
+perf)
+    perf record -F "$FREQ" -g -p "$server" -o "$OUT.data" \
+        -- sleep $((DURATION - 1)) 2> /dev/null
+    wait "$loadgen"
+    perf script -i "$OUT.data" > "$OUT.perf" 2> /dev/null
+    if [ -n "$FLAMEGRAPH_DIR" ]; then
+        "$FLAMEGRAPH_DIR/stackcollapse-perf.pl" "$OUT.perf" > "$OUT.folded"
+        "$FLAMEGRAPH_DIR/flamegraph.pl" "$OUT.folded" > "$OUT.svg"
+        echo "profile: wrote $OUT.svg" >&2
+    else
+        echo "profile: wrote $OUT.perf; set FLAMEGRAPH_DIR for a flame" \
+            "graph" >&2
+    fi
+    ;;
+bpftrace)
+    timeout -s INT $((DURATION - 1)) bpftrace -p "$server" bench/stages.bt
+    wait "$loadgen"
+    ;;
+*)
+    echo "profile: unknown tool $TOOL" >&2
+    exit 1
+    ;;
+esac
@@ -0,0 +1,207 @@
+// Compare the router with matching the routes one by one with strcmp().
+//
+// For each table size the same mix of exact, parameter and prefix routes
+// is registered with both, and the same request paths are looked up;
+// every lookup must find the same route either way.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../router.h"
+
+#define PATHS 4096
+#define LOOKUPS (4 * 1000 * 1000)
+#define PATH_MAX_LEN 64
+
+struct linear_route {
+    unsigned method;
+    char pattern[PATH_MAX_LEN];
+};
+
+static struct linear_route *table;
+static unsigned ntable;
+
+// Keeps the timed loops from being optimized away
+static volatile uintptr_t sink;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static unsigned method_bit(const char *method) {
+    if (strcmp(method, "GET") == 0) {
+        return ROUTE_GET;
+    }
+    return strcmp(method, "POST") == 0 ? ROUTE_POST : 0;
+}
+
+// Match one pattern the obvious way, segment by segment
+static int linear_match_one(const char *pattern, const char *path) {
+    if (strchr(pattern, ':') == NULL && strchr(pattern, '*') == NULL) {
+        return strcmp(pattern, path) == 0;
+    }
+    while (*pattern != '\0') {
+        if (*pattern == '*') {
+            return 1;
+        }
+        if (*pattern == ':') {
+            if (*path == '/' || *path == '\0') {
+                return 0;
+            }
+            while (*pattern != '/' && *pattern != '\0') {
+                pattern++;
+            }
+            while (*path != '/' && *path != '\0') {
+                path++;
+            }
+            continue;
+        }
+        if (*pattern++ != *path++) {
+            return 0;
+        }
+    }
+    return *path == '\0';
+}
+
+static int linear_match(const char *method, const char *path) {
+    unsigned bit = method_bit(method);
+    for (unsigned i = 0; i < ntable; i++) {
+        if ((table[i].method & bit) &&
+            linear_match_one(table[i].pattern, path)) {
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+// Route i of a table: mostly exact API paths, some with parameters and a
+// few static prefixes, as a typical service has them
+static void make_route(unsigned i, char *pattern, unsigned *method) {
+    *method = i % 3 == 0 ? ROUTE_POST : ROUTE_GET | ROUTE_POST;
+    switch (i % 8) {
+    case 0:
+    case 1:
+    case 2:
+    case 3:
+    case 4:
+        snprintf(pattern, PATH_MAX_LEN, "/api/v1/resource%u", i);
+        break;
+    case 5:
+    case 6:
+        snprintf(pattern, PATH_MAX_LEN, "/api/v1/users%u/:id/posts/:post", i);
+        break;
+    default:
+        snprintf(pattern, PATH_MAX_LEN, "/assets%u/*", i);
+        break;
+    }
+}
+
+// A request path that route i answers
+static void make_path(unsigned i, char *path) {
+    switch (i % 8) {
+    case 0:
+    case 1:
+    case 2:
+    case 3:
+    case 4:
+        snprintf(path, PATH_MAX_LEN, "/api/v1/resource%u", i);
+        break;
+    case 5:
+    case 6:
+        snprintf(path, PATH_MAX_LEN, "/api/v1/users%u/%u/posts/%u", i,
+                 i * 7, i * 13);
+        break;
+    default:
+        snprintf(path, PATH_MAX_LEN, "/assets%u/css/site.css", i);
+        break;
+    }
+}
+
+static int run(unsigned nroutes) {
+    struct router *r = router_new();
+    table = calloc(nroutes, sizeof(*table));
+    if (r == NULL || table == NULL) {
+        return -1;
+    }
+    ntable = nroutes;
+    for (unsigned i = 0; i < nroutes; i++) {
+        make_route(i, table[i].pattern, &table[i].method);
+        if (router_add(r, table[i].method, table[i].pattern, &table[i]) != 0) {
+            return -1;
+        }
+    }
+    if (router_build(r) != 0) {
+        return -1;
+    }
+
+    // One in eight lookups misses, which costs the linear scan the most
+    static char paths[PATHS][PATH_MAX_LEN];
+    static size_t lens[PATHS];
+    static const char *methods[PATHS];
+    srand(nroutes);
+    for (unsigned i = 0; i < PATHS; i++) {
+        unsigned route = (unsigned)rand() % nroutes;
+        if (i % 8 == 7) {
+            snprintf(paths[i], PATH_MAX_LEN, "/missing/%u", route);
+        } else {
+            make_path(route, paths[i]);
+        }
+        lens[i] = strlen(paths[i]);
+        methods[i] = route % 3 == 0 ? "POST" : "GET";
+    }
+
+    // Both must agree before there is anything to compare
+    for (unsigned i = 0; i < PATHS; i++) {
+        struct http_str method = {methods[i], strlen(methods[i])};
+        struct route_match m;
+        int expect = linear_match(methods[i], paths[i]);
+        enum route_result res = router_match(r, &method, paths[i], lens[i], &m);
+        const struct linear_route *got = res == ROUTE_FOUND ? m.data : NULL;
+        if ((expect < 0 && got != NULL) ||
+            (expect >= 0 && got != &table[expect])) {
+            fprintf(stderr, "router_bench: %s %s: router and linear scan "
+                    "disagree\n", methods[i], paths[i]);
+            return -1;
+        }
+    }
+
+    uint64_t start = now_ns();
+    for (unsigned i = 0; i < LOOKUPS; i++) {
+        unsigned k = i & (PATHS - 1);
+        sink += (uintptr_t)linear_match(methods[k], paths[k]);
+    }
+    double linear = (double)(now_ns() - start) / LOOKUPS;
+
+    start = now_ns();
+    for (unsigned i = 0; i < LOOKUPS; i++) {
+        unsigned k = i & (PATHS - 1);
+        struct http_str method = {methods[k], methods[k][0] == 'G' ? 3 : 4};
+        struct route_match m;
+        if (router_match(r, &method, paths[k], lens[k], &m) == ROUTE_FOUND) {
+            sink += (uintptr_t)m.data;
+        }
+    }
+    double routed = (double)(now_ns() - start) / LOOKUPS;
+
+    printf("%8u %12.1f %12.1f %9.1fx\n", nroutes, linear, routed,
+           linear / routed);
+    free(table);
+    return 0;
+}
+
+int main(void) {
+    static const unsigned sizes[] = {10, 50, 100, 250, 500, 1000};
+    printf("%8s %12s %12s %10s\n", "routes", "linear ns", "router ns",
+           "speedup");
+    for (unsigned i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        if (run(sizes[i]) != 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,106 @@
+#!/bin/bash
+# Run every benchmark scenario against every server mode and print one
+# line per run, so two builds can be compared side by side:
+#
+#   $ make bench
+#   $ bench/run.sh > before.txt
+#
+# DURATION, CONNECTIONS, THREADS, RATE and SLOW tune the runs, and MODES
+# and SCENARIOS pick a subset, e.g. MODES="epoll uring" SCENARIOS=hello.
+# SERVER_ARGS and LOADGEN_ARGS are passed on to every server and loadgen.
+
+set -u
+cd "$(dirname "$0")/.."
+
+DURATION=${DURATION:-5}
+CONNECTIONS=${CONNECTIONS:-64}
+THREADS=${THREADS:-$(( $(nproc) > 4 ? 4 : $(nproc) ))}
+RATE=${RATE:-20000}
+SLOW=${SLOW:-200}
+MODES=${MODES:-"blocking epoll-1 epoll uring-1 uring"}
+SCENARIOS=${SCENARIOS:-"hello hello-close open-loop slow-clients static-small static-large stream"}
+SERVER_ARGS=${SERVER_ARGS:-}
+LOADGEN_ARGS=${LOADGEN_ARGS:-}
+
+declare -A mode_args=(
+    [blocking]="--mode=blocking"
+    [epoll-1]="--workers=1"
+    [epoll]=""
+    [uring-1]="--io=uring --workers=1"
+    [uring]="--io=uring"
+)
+
+declare -A scenario_args=(
+    [hello]="--path=/"
+    [hello-close]="--path=/ --close"
+    [open-loop]="--path=/ --rate=$RATE"
+    [slow-clients]="--path=/ --slow=$SLOW"
+    [static-small]="--path=/small.html"
+    [static-large]="--path=/large.bin"
+    [stream]="--path=/stream/1048576"
+)
+
+docroot=$(mktemp -d)
+server=
+cleanup() {
+    [ -n "$server" ] && kill "$server" 2> /dev/null
+    rm -rf "$docroot"
+}
+trap cleanup EXIT
+
+head -c 4096 /dev/zero | tr '\0' 'x' > "$docroot/small.html"
+head -c $((1024 * 1024)) /dev/urandom > "$docroot/large.bin"
+
+# Start the server and wait until it accepts connections. A previous run
+# can hold the port in TIME_WAIT for a while, so give binding some time.
+start_server() {
+    for _ in $(seq 1 120); do
+        ./webserver --log-level=off "$@" > /dev/null 2>&1 &
+        server=$!
+        for _ in $(seq 1 20); do
+            if (exec 3<> /dev/tcp/127.0.0.1/8080) 2> /dev/null; then
+                return 0
+            fi
+            kill -0 "$server" 2> /dev/null || break
+            sleep 0.1
+        done
+        kill "$server" 2> /dev/null
+        wait "$server" 2> /dev/null
+        sleep 1
+    done
+    echo "bench: the server did not start with: $*" >&2
+    return 1
+}
+
+stop_server() {
+    kill "$server" 2> /dev/null
+    wait "$server" 2> /dev/null
+    server=
+}
+
+printf "%-10s %-14s %10s %10s %10s %10s %10s %8s\n" mode scenario req/s \
+    p50 p99 p99.9 max errors
+for mode in $MODES; do
+    for scenario in $SCENARIOS; do
+        root=
+        case $scenario in
+        static-*)
+            # The blocking baseline only has its hard-coded page
+            [ "$mode" = blocking ] && continue
+            root="--root=$docroot"
+            ;;
+        stream)
+            [ "$mode" = blocking ] && continue
+            ;;
+        esac
+
+        # shellcheck disable=SC2086
+        start_server ${mode_args[$mode]} $root $SERVER_ARGS || exit 1
+        printf "%-10s %-14s " "$mode" "$scenario"
+        # shellcheck disable=SC2086
+        ./bench/loadgen --summary --duration="$DURATION" \
+            --connections="$CONNECTIONS" --threads="$THREADS" \
+            ${scenario_args[$scenario]} $LOADGEN_ARGS
+        stop_server
+    done
+done
@@ -0,0 +1,43 @@
+#!/bin/bash
+# Show what each option of the socket options profile does: run the
+# scenarios it should affect once with the defaults and once per option.
+#
+#   $ make bench
+#   $ bench/sockopts.sh
+#
+# The server side of TCP Fast Open needs net.ipv4.tcp_fastopen=3; the
+# fastopen profile is meaningless without it. DURATION, CONNECTIONS and
+# THREADS are passed on to bench/run.sh.
+
+set -u
+cd "$(dirname "$0")/.."
+
+PROFILES=${PROFILES:-"default nodelay-off defer-accept fastopen busy-poll small-backlog small-buffers"}
+
+declare -A server_args=(
+    [default]=""
+    [nodelay-off]="--nodelay=off"
+    [defer-accept]="--defer-accept=1"
+    [fastopen]="--fastopen=256"
+    [busy-poll]="--busy-poll=50"
+    [small-backlog]="--backlog=16"
+    [small-buffers]="--sndbuf=16384 --rcvbuf=16384"
+)
+
+declare -A loadgen_args=(
+    [fastopen]="--fastopen"
+)
+
+if [ "$(cat /proc/sys/net/ipv4/tcp_fastopen)" != 3 ]; then
+    echo "note: net.ipv4.tcp_fastopen is not 3, fastopen falls back to" \
+        "plain connects" >&2
+fi
+
+for profile in $PROFILES; do
+    echo "== $profile: ${server_args[$profile]}"
+    MODES=${MODES:-epoll} \
+        SCENARIOS=${SCENARIOS:-"hello hello-close static-large"} \
+        SERVER_ARGS="${server_args[$profile]}" \
+        LOADGEN_ARGS="${loadgen_args[$profile]:-}" \
+        bench/run.sh
+done
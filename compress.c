@@ -0,0 +1,294 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <zlib.h>
+
+#ifdef HAVE_BROTLI
+#include <brotli/encode.h>
+#endif
+
+#include "compress.h"
+
+// Compression settings per level: gzip level, brotli quality and window
+static const struct {
+    int gzip;
+    int brotli;
+    int brotli_window;
+} levels[] = {
+    [COMPRESS_FAST] = {5, 4, 18},
+    [COMPRESS_BEST] = {9, 11, 22},
+};
+
+// Fast brotli encoders allocate from an arena of this size, which is
+// rewound after every body. It holds what the encoder needs for bodies
+// up to BROTLI_ARENA_INPUT; larger ones use malloc().
+#define BROTLI_ARENA_SIZE (8 * 1024 * 1024)
+#define BROTLI_ARENA_INPUT (1024 * 1024)
+
+struct compressor {
+    enum compress_level level;
+    z_stream gzip;
+    int gzip_ready;
+    unsigned char *out;
+    size_t cap;
+#ifdef HAVE_BROTLI
+    char *arena;
+    size_t arena_used;
+#endif
+};
+
+const char *encoding_name(enum encoding e) {
+    switch (e) {
+    case ENCODING_GZIP:
+        return "gzip";
+    case ENCODING_BR:
+        return "br";
+    default:
+        return NULL;
+    }
+}
+
+unsigned encoding_supported(void) {
+    unsigned e = ENCODING_BIT(ENCODING_IDENTITY) | ENCODING_BIT(ENCODING_GZIP);
+#ifdef HAVE_BROTLI
+    e |= ENCODING_BIT(ENCODING_BR);
+#endif
+    return e;
+}
+
+static int is_space(char ch) {
+    return ch == ' ' || ch == '\t';
+}
+
+// Is the qvalue of a list element zero? Anything that is not a valid
+// "q=0..." counts as non-zero.
+static int zero_quality(const char *p, const char *end) {
+    while (p < end && (p = memchr(p, ';', end - p)) != NULL) {
+        p++;
+        while (p < end && is_space(*p)) {
+            p++;
+        }
+        if (end - p >= 2 && (p[0] == 'q' || p[0] == 'Q') && p[1] == '=') {
+            p += 2;
+            if (p == end || *p != '0') {
+                return 0;
+            }
+            for (p++; p < end && !is_space(*p) && *p != ';'; p++) {
+                if (*p != '.' && *p != '0') {
+                    return 0;
+                }
+            }
+            return 1;
+        }
+    }
+    return 0;
+}
+
+unsigned encoding_accepted(const struct http_request *req) {
+    const unsigned identity = ENCODING_BIT(ENCODING_IDENTITY);
+    const struct http_str *value = http_header_get(req, "Accept-Encoding");
+    if (value == NULL) {
+        return identity;
+    }
+
+    unsigned yes = 0, no = 0;
+    int any = 0;
+    const char *p = value->ptr;
+    const char *end = value->ptr + value->len;
+    while (p < end) {
+        const char *comma = memchr(p, ',', end - p);
+        const char *next = comma != NULL ? comma : end;
+        while (p < next && is_space(*p)) {
+            p++;
+        }
+        const char *tok = p;
+        while (p < next && *p != ';' && !is_space(*p)) {
+            p++;
+        }
+        size_t len = p - tok;
+        int zero = zero_quality(p, next);
+
+        unsigned bit = 0;
+        if ((len == 4 && strncasecmp(tok, "gzip", 4) == 0) ||
+            (len == 6 && strncasecmp(tok, "x-gzip", 6) == 0)) {
+            bit = ENCODING_BIT(ENCODING_GZIP);
+        } else if (len == 2 && strncasecmp(tok, "br", 2) == 0) {
+            bit = ENCODING_BIT(ENCODING_BR);
+        } else if (len == 1 && tok[0] == '*') {
+            any = zero ? -1 : 1;
+        }
+        if (zero) {
+            no |= bit;
+        } else {
+            yes |= bit;
+        }
+        p = next + 1;
+    }
+
+    // Explicit codings win over the wildcard
+    unsigned all = (1u << ENCODINGS) - 1;
+    return identity | yes | (any > 0 ? all & ~no : 0);
+}
+
+enum encoding encoding_pick(unsigned accepted, unsigned available) {
+    unsigned both = accepted & available;
+    if (both & ENCODING_BIT(ENCODING_BR)) {
+        return ENCODING_BR;
+    }
+    if (both & ENCODING_BIT(ENCODING_GZIP)) {
+        return ENCODING_GZIP;
+    }
+    return ENCODING_IDENTITY;
+}
+
+int encoding_compressible(const char *type) {
+    return strncmp(type, "text/", 5) == 0 || strstr(type, "json") != NULL ||
+           strstr(type, "javascript") != NULL || strstr(type, "xml") != NULL ||
+           strcmp(type, "application/wasm") == 0;
+}
+
+struct compressor *compressor_new(enum compress_level level) {
+    struct compressor *z = calloc(1, sizeof(*z));
+    if (z == NULL) {
+        perror("webserver (calloc)");
+        return NULL;
+    }
+    z->level = level;
+    if (deflateInit2(&z->gzip, levels[level].gzip, Z_DEFLATED, 15 + 16, 8,
+                     Z_DEFAULT_STRATEGY) == Z_OK) {
+        z->gzip_ready = 1;
+    } else {
+        fprintf(stderr, "webserver: cannot set up gzip\n");
+    }
+#ifdef HAVE_BROTLI
+    if (level == COMPRESS_FAST &&
+        (z->arena = malloc(BROTLI_ARENA_SIZE)) == NULL) {
+        perror("webserver (malloc)");
+    }
+#endif
+    return z;
+}
+
+void compressor_free(struct compressor *z) {
+    if (z == NULL) {
+        return;
+    }
+    if (z->gzip_ready) {
+        deflateEnd(&z->gzip);
+    }
+#ifdef HAVE_BROTLI
+    free(z->arena);
+#endif
+    free(z->out);
+    free(z);
+}
+
+static int reserve(struct compressor *z, size_t size) {
+    if (z->cap >= size) {
+        return 0;
+    }
+    unsigned char *out = realloc(z->out, size);
+    if (out == NULL) {
+        perror("webserver (realloc)");
+        return -1;
+    }
+    z->out = out;
+    z->cap = size;
+    return 0;
+}
+
+static size_t compress_gzip(struct compressor *z, const void *in,
+                            size_t len) {
+    if (!z->gzip_ready || deflateReset(&z->gzip) != Z_OK ||
+        reserve(z, deflateBound(&z->gzip, len)) != 0) {
+        return 0;
+    }
+    z->gzip.next_in = (unsigned char *)in;
+    z->gzip.avail_in = len;
+    z->gzip.next_out = z->out;
+    z->gzip.avail_out = z->cap;
+    if (deflate(&z->gzip, Z_FINISH) != Z_STREAM_END) {
+        return 0;
+    }
+    return z->gzip.total_out;
+}
+
+#ifdef HAVE_BROTLI
+static void *arena_alloc(void *opaque, size_t size) {
+    struct compressor *z = opaque;
+    size = (size + 63) & ~(size_t)63;
+    if (size > BROTLI_ARENA_SIZE - z->arena_used) {
+        return NULL;
+    }
+    void *p = z->arena + z->arena_used;
+    z->arena_used += size;
+    return p;
+}
+
+static void arena_free(void *opaque, void *p) {
+    (void)opaque;
+    (void)p;
+}
+
+static size_t compress_brotli(struct compressor *z, const void *in,
+                              size_t len) {
+    size_t bound = BrotliEncoderMaxCompressedSize(len);
+    if (bound == 0 || reserve(z, bound) != 0) {
+        return 0;
+    }
+    size_t out_len = z->cap;
+    int quality = levels[z->level].brotli;
+    int window = levels[z->level].brotli_window;
+    if (z->arena == NULL) {
+        // Cached responses are compressed once, so they may allocate
+        // whatever the best quality needs
+        if (!BrotliEncoderCompress(quality, window, BROTLI_MODE_TEXT, len, in,
+                                   &out_len, z->out)) {
+            return 0;
+        }
+        return out_len;
+    }
+
+    z->arena_used = 0;
+    BrotliEncoderState *s =
+        len <= BROTLI_ARENA_INPUT
+            ? BrotliEncoderCreateInstance(arena_alloc, arena_free, z)
+            : BrotliEncoderCreateInstance(NULL, NULL, NULL);
+    if (s == NULL) {
+        return 0;
+    }
+    BrotliEncoderSetParameter(s, BROTLI_PARAM_QUALITY, quality);
+    BrotliEncoderSetParameter(s, BROTLI_PARAM_LGWIN, window);
+    BrotliEncoderSetParameter(s, BROTLI_PARAM_MODE, BROTLI_MODE_TEXT);
+    BrotliEncoderSetParameter(s, BROTLI_PARAM_SIZE_HINT,
+                              len < (1u << 30) ? (uint32_t)len : 0);
+    const uint8_t *next_in = in;
+    size_t avail_in = len;
+    uint8_t *next_out = z->out;
+    size_t avail_out = z->cap;
+    int ok = BrotliEncoderCompressStream(s, BROTLI_OPERATION_FINISH,
+                                         &avail_in, &next_in, &avail_out,
+                                         &next_out, NULL) &&
+             BrotliEncoderIsFinished(s);
+    BrotliEncoderDestroyInstance(s);
+    return ok ? z->cap - avail_out : 0;
+}
+#endif
+
+const void *compress_body(struct compressor *z, enum encoding e,
+                          const void *in, size_t len, size_t *out_len) {
+    size_t n = 0;
+    if (e == ENCODING_GZIP) {
+        n = compress_gzip(z, in, len);
+#ifdef HAVE_BROTLI
+    } else if (e == ENCODING_BR) {
+        n = compress_brotli(z, in, len);
+#endif
+    }
+    if (n == 0 || n >= len) {
+        return NULL;
+    }
+    *out_len = n;
+    return z->out;
+}
@@ -0,0 +1,54 @@
+#ifndef WEBSERVER_COMPRESS_H
+#define WEBSERVER_COMPRESS_H
+
+#include <stddef.h>
+
+#include "http_parser.h"
+
+// Content codings, in the order we prefer them
+enum encoding {
+    ENCODING_IDENTITY,
+    ENCODING_GZIP,
+    ENCODING_BR,
+    ENCODINGS,
+};
+
+#define ENCODING_BIT(e) (1u << (e))
+#define ENCODING_ALL ((1u << ENCODINGS) - 1)
+
+// Bodies smaller than this go out as they are; they would barely shrink
+#define ENCODING_MIN_SIZE 256
+
+// The Content-Encoding token for e, NULL for identity
+const char *encoding_name(enum encoding e);
+
+// The codings the request's Accept-Encoding allows, one ENCODING_BIT each.
+// Identity is always allowed.
+unsigned encoding_accepted(const struct http_request *req);
+
+// The coding to answer with out of those both sides can do
+enum encoding encoding_pick(unsigned accepted, unsigned available);
+
+// Is a body of this type worth compressing?
+int encoding_compressible(const char *content_type);
+
+// Codings this build can produce itself
+unsigned encoding_supported(void);
+
+enum compress_level {
+    COMPRESS_FAST,              // per request, for responses built on the fly
+    COMPRESS_BEST,              // once, for responses that are cached
+};
+
+// A reusable compression context with its output buffer. Not thread-safe;
+// every worker has its own.
+struct compressor *compressor_new(enum compress_level level);
+void compressor_free(struct compressor *z);
+
+// Compress len bytes at in. Returns the compressed bytes, which stay valid
+// until the next call on z, and stores their length in *out_len. Returns
+// NULL if the coding is not available or the body would not shrink.
+const void *compress_body(struct compressor *z, enum encoding e,
+                          const void *in, size_t len, size_t *out_len);
+
+#endif
@@ -0,0 +1,601 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "config.h"
+#include "conn.h"
+#include "router.h"
+
+// Longest line of a config file
+#define CONFIG_LINE_MAX 4096
+
+// One option read from a config file, as it would be given on the command
+// line
+struct config_text {
+    struct config_text *next;
+    char arg[];
+};
+
+static const struct server_config defaults = {
+    .mode = MODE_EPOLL,
+    .keepalive_timeout = 5,
+    .read_timeout = 10,
+    .write_timeout = 30,
+    .max_header_size = 8 * 1024,
+    .max_body_size = 1024 * 1024,
+    .max_requests = 1000,
+    .log_level = LOG_INFO,
+    .access_log = "-",
+    .log_sample = 1,
+    .drain_timeout = 30,
+    .offload_threads = 2,
+    .cpu_steering = 1,
+    .metrics = 1,
+    .compression = 1,
+    .accept_batch = 64,
+    .proxy_path = "/*",
+    .health_check = "/",
+    .health_interval = 5,
+    .upstream_timeout = 30,
+    .ws_path = "/ws/:topic",
+    .ws_queue = 16,
+    .ws_timeout = 300,
+    .backlog = SOMAXCONN,
+    .nodelay = 1,
+};
+
+struct server_config config;
+
+// What config_parse() was last given, for config_reread()
+static int saved_argc;
+static char **saved_argv;
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [--config=FILE]\n"
+            "          [--mode=epoll|blocking] [--io=epoll|uring]\n"
+            "          [--workers=N] [--listen=[ADDR:]PORT]...\n"
+            "          [--keepalive-timeout=SECONDS]\n"
+            "          [--read-timeout=SECONDS] [--write-timeout=SECONDS]\n"
+            "          [--max-header-size=BYTES] [--max-body-size=BYTES]\n"
+            "          [--max-requests=N] [--root=DIR] [--pack=FILE]\n"
+            "          [--make-pack=FILE --root=DIR]\n"
+            "          [--log-level=off|error|info|debug] [--access-log=PATH]\n"
+            "          [--log-sample=N] [--log-timing]\n"
+            "          [--tls-cert=PEM --tls-key=PEM]\n"
+            "          [--drain-timeout=SECONDS] [--offload-threads=N]\n"
+            "          [--steering=cpu|hash] [--metrics=on|off]\n"
+            "          [--compression=on|off]\n"
+            "          [--route='[METHOD,...] ROUTE ACTION [ARG]']...\n"
+            "          [--max-conns=N] [--max-conns-per-ip=N]\n"
+            "          [--max-rate=N] [--max-rate-per-ip=N]\n"
+            "          [--accept-batch=N] [--shed-lag=MS] [--shed-conns=N]\n"
+            "          [--shed=pause|reject]\n"
+            "          [--backlog=N] [--nodelay=on|off]\n"
+            "          [--defer-accept=SECONDS]\n"
+            "          [--fastopen=N] [--busy-poll=USEC] [--sndbuf=BYTES]\n"
+            "          [--rcvbuf=BYTES] [--upstream=ADDR:PORT]...\n"
+            "          [--balance=round-robin|least-conn]\n"
+            "          [--proxy-path=ROUTE] [--health-check=PATH]\n"
+            "          [--health-interval=SECONDS]\n"
+            "          [--upstream-timeout=SECONDS] [--cache-size=BYTES]\n"
+            "          [--ws-path=ROUTE] [--ws-queue=N]\n"
+            "          [--ws-slow=drop|close] [--ws-timeout=SECONDS]\n",
+            prog);
+}
+
+// Parse the numeric value of a --name=value option into [min, max]
+static int parse_number(const char *arg, const char *value, long min,
+                        long max, long *out) {
+    char *end;
+    long n = strtol(value, &end, 10);
+    if (*value == '\0' || *end != '\0' || n < min || n > max) {
+        fprintf(stderr, "webserver: invalid value in '%s'\n", arg);
+        return -1;
+    }
+    *out = n;
+    return 0;
+}
+
+static int parse_log_level(struct server_config *cfg, const char *arg,
+                           const char *value) {
+    static const char *const names[] = {
+        [LOG_OFF] = "off",
+        [LOG_ERROR] = "error",
+        [LOG_INFO] = "info",
+        [LOG_DEBUG] = "debug",
+    };
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if (strcmp(value, names[i]) == 0) {
+            cfg->log_level = (enum log_level)i;
+            return 0;
+        }
+    }
+    fprintf(stderr, "webserver: invalid value in '%s'\n", arg);
+    return -1;
+}
+
+
+static const char *const method_names[] = {
+    "GET", "HEAD", "POST", "PUT", "DELETE", "OPTIONS", "PATCH",
+};
+
+static const char *const action_names[] = {
+    [ACTION_TEXT] = "text",
+    [ACTION_METRICS] = "metrics",
+    [ACTION_STREAM] = "stream",
+    [ACTION_PROXY] = "proxy",
+};
+
+// The length of the word at s, up to a blank
+static size_t word_len(const char *s) {
+    return strcspn(s, " \t");
+}
+
+static const char *skip_blanks(const char *s) {
+    return s + strspn(s, " \t");
+}
+
+// Parse the value of --route=[METHOD,...] ROUTE ACTION [ARG]: the methods
+// default to all of them, and ARG is the rest of the option
+static int parse_route(struct server_config *cfg, const char *arg,
+                       const char *value) {
+    if (cfg->nroutes == ROUTES_MAX) {
+        fprintf(stderr, "webserver: at most %d --route options\n",
+                ROUTES_MAX);
+        return -1;
+    }
+    struct route_spec *r = &cfg->routes[cfg->nroutes];
+    const char *s = skip_blanks(value);
+    r->methods = ROUTE_ANY;
+    if (*s != '/') {
+        r->methods = 0;
+        size_t len = word_len(s);
+        const char *end = s + len;
+        while (s < end) {
+            size_t n = strcspn(s, ",");
+            if (s + n > end) {
+                n = (size_t)(end - s);
+            }
+            size_t i = 0;
+            while (i < sizeof(method_names) / sizeof(method_names[0]) &&
+                   (strlen(method_names[i]) != n ||
+                    strncmp(s, method_names[i], n) != 0)) {
+                i++;
+            }
+            if (i == sizeof(method_names) / sizeof(method_names[0])) {
+                fprintf(stderr, "webserver: unknown method in '%s'\n", arg);
+                return -1;
+            }
+            r->methods |= 1u << i;
+            s += n + (s + n < end);
+        }
+        s = skip_blanks(end);
+    }
+    r->pattern = s;
+    r->pattern_len = word_len(s);
+    s = skip_blanks(s + r->pattern_len);
+    size_t len = word_len(s);
+    size_t i = 0;
+    while (i < sizeof(action_names) / sizeof(action_names[0]) &&
+           (strlen(action_names[i]) != len ||
+            strncmp(s, action_names[i], len) != 0)) {
+        i++;
+    }
+    if (r->pattern_len == 0 || *r->pattern != '/' ||
+        i == sizeof(action_names) / sizeof(action_names[0])) {
+        fprintf(stderr, "webserver: invalid route in '%s'\n", arg);
+        return -1;
+    }
+    r->action = (enum route_action)i;
+    r->arg = skip_blanks(s + len);
+    if (r->action == ACTION_TEXT && *r->arg == '\0') {
+        fprintf(stderr, "webserver: a text route needs its text in '%s'\n",
+                arg);
+        return -1;
+    }
+    // The size of the body is the route's first parameter
+    if (r->action == ACTION_STREAM &&
+        memmem(r->pattern, r->pattern_len, "/:", 2) == NULL) {
+        fprintf(stderr, "webserver: a stream route needs a :bytes "
+                "parameter in '%s'\n", arg);
+        return -1;
+    }
+    cfg->nroutes++;
+    return 0;
+}
+
+// Apply one option to cfg. Returns 1 if there is no such option.
+static int parse_option(struct server_config *cfg, const char *arg) {
+    long n;
+    if (strcmp(arg, "--mode=blocking") == 0) {
+        cfg->mode = MODE_BLOCKING;
+    } else if (strcmp(arg, "--mode=epoll") == 0) {
+        cfg->mode = MODE_EPOLL;
+    } else if (strcmp(arg, "--io=epoll") == 0) {
+        cfg->io = IO_EPOLL;
+    } else if (strcmp(arg, "--io=uring") == 0) {
+        cfg->io = IO_URING;
+    } else if (strncmp(arg, "--workers=", 10) == 0) {
+        if (parse_number(arg, arg + 10, 1, 4096, &n) != 0) {
+            return -1;
+        }
+        cfg->workers = (int)n;
+    } else if (strncmp(arg, "--listen=", 9) == 0) {
+        if (cfg->nlisten == LISTEN_MAX) {
+            fprintf(stderr, "webserver: at most %d --listen addresses\n",
+                    LISTEN_MAX);
+            return -1;
+        }
+        struct listen_addr *a = &cfg->listen[cfg->nlisten++];
+        if (addr_parse(arg + 9, &a->addr, &a->dual_stack) != 0) {
+            fprintf(stderr, "webserver: invalid address in '%s'\n", arg);
+            return -1;
+        }
+    } else if (strncmp(arg, "--keepalive-timeout=", 20) == 0) {
+        if (parse_number(arg, arg + 20, 1, 3600, &n) != 0) {
+            return -1;
+        }
+        cfg->keepalive_timeout = (int)n;
+    } else if (strncmp(arg, "--read-timeout=", 15) == 0) {
+        if (parse_number(arg, arg + 15, 1, 3600, &n) != 0) {
+            return -1;
+        }
+        cfg->read_timeout = (int)n;
+    } else if (strncmp(arg, "--write-timeout=", 16) == 0) {
+        if (parse_number(arg, arg + 16, 1, 3600, &n) != 0) {
+            return -1;
+        }
+        cfg->write_timeout = (int)n;
+    } else if (strncmp(arg, "--max-header-size=", 18) == 0) {
+        if (parse_number(arg, arg + 18, 1024, BUFFER_MAX_SIZE, &n) != 0) {
+            return -1;
+        }
+        cfg->max_header_size = (size_t)n;
+    } else if (strncmp(arg, "--max-body-size=", 16) == 0) {
+        if (parse_number(arg, arg + 16, 0, LONG_MAX, &n) != 0) {
+            return -1;
+        }
+        cfg->max_body_size = (uint64_t)n;
+    } else if (strncmp(arg, "--max-requests=", 15) == 0) {
+        if (parse_number(arg, arg + 15, 1, 1000000000, &n) != 0) {
+            return -1;
+        }
+        cfg->max_requests = (unsigned)n;
+    } else if (strncmp(arg, "--root=", 7) == 0 && arg[7] != '\0') {
+        cfg->root = arg + 7;
+    } else if (strncmp(arg, "--pack=", 7) == 0 && arg[7] != '\0') {
+        cfg->pack = arg + 7;
+    } else if (strncmp(arg, "--make-pack=", 12) == 0 &&
+               arg[12] != '\0') {
+        cfg->make_pack = arg + 12;
+    } else if (strncmp(arg, "--log-level=", 12) == 0) {
+        if (parse_log_level(cfg, arg, arg + 12) != 0) {
+            return -1;
+        }
+    } else if (strncmp(arg, "--access-log=", 13) == 0 &&
+               arg[13] != '\0') {
+        cfg->access_log = arg + 13;
+    } else if (strncmp(arg, "--log-sample=", 13) == 0) {
+        if (parse_number(arg, arg + 13, 1, 1000000, &n) != 0) {
+            return -1;
+        }
+        cfg->log_sample = (unsigned)n;
+    } else if (strcmp(arg, "--log-timing") == 0) {
+        cfg->log_timing = 1;
+    } else if (strncmp(arg, "--drain-timeout=", 16) == 0) {
+        if (parse_number(arg, arg + 16, 1, 3600, &n) != 0) {
+            return -1;
+        }
+        cfg->drain_timeout = (int)n;
+    } else if (strncmp(arg, "--offload-threads=", 18) == 0) {
+        if (parse_number(arg, arg + 18, 0, 256, &n) != 0) {
+            return -1;
+        }
+        cfg->offload_threads = (int)n;
+    } else if (strcmp(arg, "--metrics=on") == 0) {
+        cfg->metrics = 1;
+    } else if (strcmp(arg, "--metrics=off") == 0) {
+        cfg->metrics = 0;
+    } else if (strcmp(arg, "--compression=on") == 0) {
+        cfg->compression = 1;
+    } else if (strcmp(arg, "--compression=off") == 0) {
+        cfg->compression = 0;
+    } else if (strncmp(arg, "--route=", 8) == 0) {
+        if (parse_route(cfg, arg, arg + 8) != 0) {
+            return -1;
+        }
+    } else if (strcmp(arg, "--steering=cpu") == 0) {
+        cfg->cpu_steering = 1;
+    } else if (strcmp(arg, "--steering=hash") == 0) {
+        cfg->cpu_steering = 0;
+    } else if (strncmp(arg, "--max-conns=", 12) == 0) {
+        if (parse_number(arg, arg + 12, 0, 10000000, &n) != 0) {
+            return -1;
+        }
+        cfg->max_conns = (int)n;
+    } else if (strncmp(arg, "--max-conns-per-ip=", 19) == 0) {
+        if (parse_number(arg, arg + 19, 0, 10000000, &n) != 0) {
+            return -1;
+        }
+        cfg->max_conns_per_ip = (int)n;
+    } else if (strncmp(arg, "--max-rate=", 11) == 0) {
+        if (parse_number(arg, arg + 11, 0, 1000000000, &n) != 0) {
+            return -1;
+        }
+        cfg->max_rate = (int)n;
+    } else if (strncmp(arg, "--max-rate-per-ip=", 18) == 0) {
+        if (parse_number(arg, arg + 18, 0, 1000000000, &n) != 0) {
+            return -1;
+        }
+        cfg->max_rate_per_ip = (int)n;
+    } else if (strncmp(arg, "--accept-batch=", 15) == 0) {
+        if (parse_number(arg, arg + 15, 1, 65536, &n) != 0) {
+            return -1;
+        }
+        cfg->accept_batch = (int)n;
+    } else if (strncmp(arg, "--shed-lag=", 11) == 0) {
+        if (parse_number(arg, arg + 11, 0, 60000, &n) != 0) {
+            return -1;
+        }
+        cfg->shed_lag = (int)n;
+    } else if (strncmp(arg, "--shed-conns=", 13) == 0) {
+        if (parse_number(arg, arg + 13, 0, 10000000, &n) != 0) {
+            return -1;
+        }
+        cfg->shed_conns = (int)n;
+    } else if (strcmp(arg, "--shed=pause") == 0) {
+        cfg->shed = SHED_PAUSE;
+    } else if (strcmp(arg, "--shed=reject") == 0) {
+        cfg->shed = SHED_REJECT;
+    } else if (strncmp(arg, "--backlog=", 10) == 0) {
+        if (parse_number(arg, arg + 10, 1, 1 << 20, &n) != 0) {
+            return -1;
+        }
+        cfg->backlog = (int)n;
+    } else if (strcmp(arg, "--nodelay=on") == 0) {
+        cfg->nodelay = 1;
+    } else if (strcmp(arg, "--nodelay=off") == 0) {
+        cfg->nodelay = 0;
+    } else if (strncmp(arg, "--defer-accept=", 15) == 0) {
+        if (parse_number(arg, arg + 15, 0, 3600, &n) != 0) {
+            return -1;
+        }
+        cfg->defer_accept = (int)n;
+    } else if (strncmp(arg, "--fastopen=", 11) == 0) {
+        if (parse_number(arg, arg + 11, 0, 65535, &n) != 0) {
+            return -1;
+        }
+        cfg->fastopen = (int)n;
+    } else if (strncmp(arg, "--busy-poll=", 12) == 0) {
+        if (parse_number(arg, arg + 12, 0, 1000000, &n) != 0) {
+            return -1;
+        }
+        cfg->busy_poll = (int)n;
+    } else if (strncmp(arg, "--sndbuf=", 9) == 0) {
+        if (parse_number(arg, arg + 9, 0, INT_MAX / 2, &n) != 0) {
+            return -1;
+        }
+        cfg->sndbuf = (int)n;
+    } else if (strncmp(arg, "--rcvbuf=", 9) == 0) {
+        if (parse_number(arg, arg + 9, 0, INT_MAX / 2, &n) != 0) {
+            return -1;
+        }
+        cfg->rcvbuf = (int)n;
+    } else if (strncmp(arg, "--upstream=", 11) == 0) {
+        if (cfg->nupstream == UPSTREAM_MAX) {
+            fprintf(stderr, "webserver: at most %d --upstream addresses\n",
+                    UPSTREAM_MAX);
+            return -1;
+        }
+        int wildcard;
+        union sock_addr *a = &cfg->upstream[cfg->nupstream++];
+        if (addr_parse(arg + 11, a, &wildcard) != 0 || wildcard) {
+            fprintf(stderr, "webserver: invalid address in '%s'\n", arg);
+            return -1;
+        }
+    } else if (strcmp(arg, "--balance=round-robin") == 0) {
+        cfg->balance = BALANCE_ROUND_ROBIN;
+    } else if (strcmp(arg, "--balance=least-conn") == 0) {
+        cfg->balance = BALANCE_LEAST_CONN;
+    } else if (strncmp(arg, "--proxy-path=", 13) == 0 && arg[13] == '/') {
+        cfg->proxy_path = arg + 13;
+    } else if (strncmp(arg, "--health-check=", 15) == 0 &&
+               arg[15] == '/') {
+        cfg->health_check = arg + 15;
+    } else if (strncmp(arg, "--health-interval=", 18) == 0) {
+        if (parse_number(arg, arg + 18, 1, 3600, &n) != 0) {
+            return -1;
+        }
+        cfg->health_interval = (int)n;
+    } else if (strncmp(arg, "--upstream-timeout=", 19) == 0) {
+        if (parse_number(arg, arg + 19, 1, 3600, &n) != 0) {
+            return -1;
+        }
+        cfg->upstream_timeout = (int)n;
+    } else if (strncmp(arg, "--cache-size=", 13) == 0) {
+        if (parse_number(arg, arg + 13, 0, LONG_MAX, &n) != 0) {
+            return -1;
+        }
+        cfg->cache_size = (size_t)n;
+    } else if (strncmp(arg, "--ws-path=", 10) == 0 && arg[10] == '/') {
+        cfg->ws_path = arg + 10;
+    } else if (strncmp(arg, "--ws-queue=", 11) == 0) {
+        if (parse_number(arg, arg + 11, 1, CONN_MAX_IOV - 2, &n) != 0) {
+            return -1;
+        }
+        cfg->ws_queue = (int)n;
+    } else if (strcmp(arg, "--ws-slow=drop") == 0) {
+        cfg->ws_slow = WS_SLOW_DROP;
+    } else if (strcmp(arg, "--ws-slow=close") == 0) {
+        cfg->ws_slow = WS_SLOW_CLOSE;
+    } else if (strncmp(arg, "--ws-timeout=", 13) == 0) {
+        if (parse_number(arg, arg + 13, 1, 86400, &n) != 0) {
+            return -1;
+        }
+        cfg->ws_timeout = (int)n;
+    } else if (strncmp(arg, "--tls-cert=", 11) == 0 && arg[11] != '\0') {
+        cfg->tls_cert = arg + 11;
+    } else if (strncmp(arg, "--tls-key=", 10) == 0 && arg[10] != '\0') {
+        cfg->tls_key = arg + 10;
+    } else {
+        return 1;
+    }
+    return 0;
+}
+
+// Check the options against each other once they are all in
+static int check(struct server_config *cfg) {
+    if (cfg->nlisten == 0) {
+        addr_parse(DEFAULT_LISTEN, &cfg->listen[0].addr,
+                   &cfg->listen[0].dual_stack);
+        cfg->nlisten = 1;
+    }
+    if (cfg->nlisten > 1 && cfg->mode == MODE_BLOCKING) {
+        fprintf(stderr, "webserver: the blocking mode listens on one "
+                "address\n");
+        return -1;
+    }
+    if ((cfg->tls_cert == NULL) != (cfg->tls_key == NULL)) {
+        fprintf(stderr, "webserver: --tls-cert and --tls-key go together\n");
+        return -1;
+    }
+    if (cfg->tls_cert != NULL && cfg->mode == MODE_BLOCKING) {
+        fprintf(stderr, "webserver: the blocking mode has no TLS\n");
+        return -1;
+    }
+    if (cfg->nupstream > 0 &&
+        (cfg->mode == MODE_BLOCKING || cfg->io != IO_EPOLL)) {
+        fprintf(stderr, "webserver: the proxy needs --io=epoll\n");
+        return -1;
+    }
+    if (cfg->cache_size > 0 && cfg->nupstream == 0) {
+        fprintf(stderr, "webserver: --cache-size caches --upstream "
+                "responses\n");
+        return -1;
+    }
+    for (int i = 0; i < cfg->nroutes; i++) {
+        if (cfg->routes[i].action == ACTION_PROXY && cfg->nupstream == 0) {
+            fprintf(stderr, "webserver: a proxy route needs --upstream\n");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Read the options in path, one per line, into cfg
+static int load_file(struct server_config *cfg, const char *path) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        fprintf(stderr, "webserver (%s): %s\n", path, strerror(errno));
+        return -1;
+    }
+    char line[CONFIG_LINE_MAX];
+    int lineno = 0;
+    int ret = 0;
+    while (ret == 0 && fgets(line, sizeof(line), f) != NULL) {
+        lineno++;
+        if (strchr(line, '\n') == NULL && !feof(f)) {
+            fprintf(stderr, "webserver: %s:%d: line too long\n", path,
+                    lineno);
+            ret = -1;
+            break;
+        }
+        line[strcspn(line, "\r\n")] = '\0';
+        const char *name = skip_blanks(line);
+        if (*name == '\0' || *name == '#') {
+            continue;
+        }
+        size_t name_len = word_len(name);
+        const char *value = skip_blanks(name + name_len);
+        size_t value_len = strlen(value);
+        while (value_len > 0 &&
+               (value[value_len - 1] == ' ' || value[value_len - 1] == '\t')) {
+            value_len--;
+        }
+
+        // Kept for as long as cfg, which points into it
+        struct config_text *t =
+            malloc(sizeof(*t) + name_len + value_len + 4);
+        if (t == NULL) {
+            perror("webserver (malloc)");
+            ret = -1;
+            break;
+        }
+        t->next = cfg->text;
+        cfg->text = t;
+        if (value_len > 0) {
+            sprintf(t->arg, "--%.*s=%.*s", (int)name_len, name,
+                    (int)value_len, value);
+        } else {
+            sprintf(t->arg, "--%.*s", (int)name_len, name);
+        }
+        ret = parse_option(cfg, t->arg);
+        if (ret > 0) {
+            fprintf(stderr, "webserver: %s:%d: unknown option '%.*s'\n",
+                    path, lineno, (int)name_len, name);
+            ret = -1;
+        } else if (ret < 0) {
+            fprintf(stderr, "webserver: in %s:%d\n", path, lineno);
+        }
+    }
+    if (ret == 0 && ferror(f)) {
+        fprintf(stderr, "webserver (%s): %s\n", path, strerror(errno));
+        ret = -1;
+    }
+    fclose(f);
+    return ret;
+}
+
+int config_parse(struct server_config *cfg, int argc, char *argv[]) {
+    saved_argc = argc;
+    saved_argv = argv;
+    *cfg = defaults;
+    cfg->workers = default_workers();
+
+    // The file first, so that the command line overrides it
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--config=", 9) != 0 || argv[i][9] == '\0') {
+            continue;
+        }
+        if (cfg->config_file != NULL) {
+            fprintf(stderr, "webserver: only one --config\n");
+            return -1;
+        }
+        cfg->config_file = argv[i] + 9;
+    }
+    if (cfg->config_file != NULL && load_file(cfg, cfg->config_file) != 0) {
+        return -1;
+    }
+
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        if (strncmp(arg, "--config=", 9) == 0 && arg[9] != '\0') {
+            continue;
+        }
+        int ret = parse_option(cfg, arg);
+        if (ret > 0) {
+            usage(argv[0]);
+        }
+        if (ret != 0) {
+            return -1;
+        }
+    }
+    return check(cfg);
+}
+
+int config_reread(struct server_config *cfg) {
+    return config_parse(cfg, saved_argc, saved_argv);
+}
+
+void config_free(struct server_config *cfg) {
+    while (cfg->text != NULL) {
+        struct config_text *t = cfg->text;
+        cfg->text = t->next;
+        free(t);
+    }
+}
@@ -0,0 +1,31 @@
+#ifndef WEBSERVER_CONFIG_H
+#define WEBSERVER_CONFIG_H
+
+#include "server.h"
+
+// The server's options, from the command line and a config file.
+//
+// --config=FILE reads options from FILE first, one per line, each an
+// option without its leading "--" and with blanks instead of its '=':
+//
+//   listen 8080
+//   root /srv/www
+//   route GET,HEAD /health text ok
+//
+// Blank lines and lines starting with '#' are skipped. The command line
+// comes after the file, so its options replace single values from the file
+// and add to lists such as listen and route.
+
+// Fill cfg from the defaults, the config file --config names, if any, and
+// argv. Prints what is wrong and returns -1 if anything is.
+int config_parse(struct server_config *cfg, int argc, char *argv[]);
+
+// Fill cfg again from the arguments config_parse() was last given, reading
+// the config file anew; for a reload
+int config_reread(struct server_config *cfg);
+
+// Free what was read from the config file into cfg. The strings in cfg
+// point into it.
+void config_free(struct server_config *cfg);
+
+#endif
@@ -0,0 +1,162 @@
+#include <string.h>
+
+#include "accesslog.h"
+#include "conn.h"
+#include "h2.h"
+#include "limit.h"
+#include "stream.h"
+#include "tls.h"
+#include "upstream.h"
+#include "ws.h"
+
+int conn_buffer_get(struct conn *c) {
+    if (c->buffer != NULL) {
+        return 0;
+    }
+    c->buffer = buf_alloc(&c->w->bufs, 0);
+    if (c->buffer == NULL) {
+        return -1;
+    }
+    c->buftier = 0;
+    c->cap = buf_tier_size[0];
+    return 0;
+}
+
+int conn_buffer_grow(struct conn *c) {
+    if (c->buftier + 1 == BUF_TIERS) {
+        return -1;
+    }
+    char *buf = buf_alloc(&c->w->bufs, c->buftier + 1);
+    if (buf == NULL) {
+        return -1;
+    }
+    // The parser keeps offsets, so the partial request can simply move
+    memcpy(buf, c->buffer, c->len);
+    buf_free(&c->w->bufs, c->buftier, c->buffer);
+    c->buffer = buf;
+    c->buftier++;
+    c->cap = buf_tier_size[c->buftier];
+    return 0;
+}
+
+void conn_buffer_release(struct conn *c) {
+    if (c->buffer != NULL && c->len == 0) {
+        buf_free(&c->w->bufs, c->buftier, c->buffer);
+        c->buffer = NULL;
+        c->cap = 0;
+    }
+}
+
+int conn_input_pending(const struct conn *c) {
+    char byte;
+    return recv(c->fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT) > 0;
+}
+
+const union sock_addr *conn_peer(struct conn *c) {
+    if (!c->addr_known) {
+        socklen_t len = sizeof(c->addr);
+        if (getpeername(c->fd, &c->addr.sa, &len) != 0) {
+            // Formats as "-"; the client is gone anyway
+            c->addr.sa.sa_family = AF_UNSPEC;
+        }
+        c->addr_known = 1;
+    }
+    return &c->addr;
+}
+
+void conn_schedule(struct timer_wheel *tw, struct conn *c, int reading) {
+    uint64_t deadline;
+    if (c->offload != NULL) {
+        // The pool has it, queue and all; looked at again in a second
+        deadline = c->w->now + 1000;
+    } else if (c->lingering) {
+        deadline = c->last_active + config.keepalive_timeout * 1000ULL;
+    } else if (c->iovpos < c->iovcnt) {
+        deadline = c->last_active + config.write_timeout * 1000ULL;
+    } else if (reading || c->body_left > 0) {
+        // Trickling bytes does not buy a client more time
+        if (c->request_start == 0) {
+            c->request_start = c->w->now;
+        }
+        deadline = c->request_start + config.read_timeout * 1000ULL;
+    } else if (c->proxy != NULL || h2_proxying(c)) {
+        // Waiting for the backend, or for the client to take a body
+        // spliced to its socket
+        deadline = c->last_active + config.upstream_timeout * 1000ULL;
+    } else if (c->ws != NULL && !c->w->draining) {
+        // A subscriber may listen without a word for a long time
+        c->request_start = 0;
+        deadline = c->last_active + config.ws_timeout * 1000ULL;
+    } else {
+        c->request_start = 0;
+        deadline = c->w->draining && c->stream == NULL &&
+                           h2_open_streams(c) == 0
+                       ? c->w->now
+                       : c->last_active + config.keepalive_timeout * 1000ULL;
+    }
+    timer_set(tw, &c->timer, deadline);
+}
+
+void conn_pin(struct conn *c) {
+    for (int i = c->iovpinned; i < c->iovcnt; i++) {
+        if (c->owner[i] != NULL) {
+            rcbuf_get(c->owner[i]);
+        }
+    }
+    c->iovpinned = c->iovcnt;
+}
+
+// Forget segments [c->iovpos, upto), releasing the pinned ones
+static void release_until(struct conn *c, int upto) {
+    for (int i = c->iovpos; i < upto; i++) {
+        if (i < c->iovpinned && c->owner[i] != NULL) {
+            rcbuf_put(c->owner[i]);
+        }
+    }
+    c->iovpos = upto;
+}
+
+int conn_written(struct conn *c, size_t n) {
+    // The bytes of a stream are counted where they go out, framed
+    if (c->parent == NULL) {
+        metric_add(&c->w->metrics.bytes_out, n);
+    }
+
+    // Skip the segments that were written completely and advance into the
+    // first partially written one
+    int i = c->iovpos;
+    while (i < c->iovcnt && n >= c->iov[i].iov_len) {
+        n -= c->iov[i].iov_len;
+        i++;
+    }
+    release_until(c, i);
+
+    if (c->iovpos < c->iovcnt) {
+        if (c->iov[i].iov_base == NULL) {
+            c->file[i].off += n;
+        } else {
+            c->iov[i].iov_base = (char *)c->iov[i].iov_base + n;
+        }
+        c->iov[i].iov_len -= n;
+        return 0;
+    }
+    c->iovpos = c->iovpinned = c->iovcnt = 0;
+    if (c->parent == NULL) {
+        c->w->written(c);
+    }
+    return 1;
+}
+
+void conn_discard(struct conn *c) {
+    release_until(c, c->iovcnt);
+    accesslog_written(c, 0);
+    h2_free(c);
+    ws_free(c);
+    stream_free(c);
+    upstream_abort(c);
+    tls_free(c);
+    limit_release(c);
+    c->iovpos = c->iovpinned = c->iovcnt = 0;
+    c->len = 0;
+    conn_buffer_release(c);
+}
@@ -0,0 +1,211 @@
+#ifndef WEBSERVER_CONN_H
+#define WEBSERVER_CONN_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "addr.h"
+#include "http_parser.h"
+#include "rcbuf.h"
+#include "server.h"
+#include "timer.h"
+#include "trace.h"
+
+// Most responses we can queue before the connection has to be flushed; this
+// bounds how far ahead of the client a pipelined connection can get
+#define CONN_MAX_IOV 32
+
+// Where a file segment of the write queue reads from
+struct conn_file {
+    int fd;
+    off_t off;
+};
+
+struct log_record;
+struct ssl_st;
+struct h2_session;
+struct offload_job;
+struct ws_session;
+
+// Per-connection state, shared between the event loop and the handler
+struct conn {
+    int fd;
+    struct worker *w;           // the worker owning this connection
+    union sock_addr addr;       // the client, see conn_peer()
+
+    unsigned requests;          // requests answered on this connection
+    unsigned addr_known : 1;    // addr is filled in
+    unsigned readable : 1;      // socket may have unread data
+    unsigned eof : 1;           // peer closed its side
+    unsigned close_after_write : 1;
+    unsigned lingering : 1;     // response sent, draining input before close
+    unsigned limit_counted : 1; // counts against --max-conns, see limit.h
+    uint32_t limit_slot;        // its client's entry in the limits, + 1
+
+    // TLS state, see tls.h. tls is NULL for plain HTTP.
+    struct ssl_st *tls;
+    unsigned tls_handshake : 1;     // handshake not finished yet
+    unsigned tls_want_write : 1;    // handshake waits for the socket to drain
+    unsigned tls_kernel_tx : 1;     // the kernel encrypts what we send
+    unsigned tls_kernel_rx : 1;     // and decrypts what we receive
+    unsigned tls_poll_armed : 1;    // io_uring: waiting to read via OpenSSL
+    uint16_t tls_retry;             // length of a blocked write to repeat
+
+    uint64_t last_active;       // CLOCK_MONOTONIC milliseconds
+    uint64_t request_start;     // when the buffered partial request began
+    uint64_t body_left;         // request body bytes still to be skipped
+    struct timer timer;         // the deadline of the current state
+
+    // With --log-timing, in trace_clock() ticks, see accesslog.h
+    uint64_t accept_tsc;        // when the connection was accepted
+    uint64_t read_tsc;          // when the request at the buffer start began
+    uint64_t head_tsc;          // when the last bytes arrived
+    struct log_record *timed;   // waits for its response to be written
+
+    // Queued response segments, written in order. Runs of memory segments
+    // go out with a single sendmsg(); file segments have a NULL iov_base
+    // and are sent from file[] with sendfile(). A segment may point into a
+    // reference counted buffer or file; those are only pinned once a write
+    // has to wait for the socket (see conn_pin()).
+    int iovpos;                 // first segment not yet fully written
+    int iovpinned;              // segments before this one are pinned
+    int iovcnt;
+    struct iovec iov[CONN_MAX_IOV];
+    struct conn_file file[CONN_MAX_IOV];
+    struct rcbuf *owner[CONN_MAX_IOV];
+    uint64_t write_start;       // when the queue last became non-empty, ns
+    struct stream *stream;      // response body still being produced
+    struct upstream_conn *proxy; // backend the response comes from
+
+    // HTTP/2, see h2.h. A session's streams each have a struct conn of
+    // their own, without a socket, which points at the real one as parent.
+    struct h2_session *h2;
+    struct conn *parent;
+    // A WebSocket after an upgrade, see ws.h
+    struct ws_session *ws;
+    // A request being answered on the offload pool. Until it is back the
+    // event loop leaves the connection alone, buffer and queue included.
+    struct offload_job *offload;
+
+    // io_uring backend state. Received data that did not fit into buffer
+    // yet waits in provided buffers chained from stash_head.
+    struct msghdr msg;          // describes the send in flight
+    unsigned inflight;          // submitted operations not yet completed
+    unsigned recv_armed : 1;
+    unsigned send_armed : 1;
+    unsigned poll_armed : 1;
+    unsigned close_armed : 1;   // a close is linked behind the send
+    unsigned shutdown_armed : 1; // a shutdown is linked behind the send
+    unsigned closing : 1;
+    unsigned recv_paused : 1;   // stash is backed up, recv cancelled
+    int stash_head, stash_tail;
+    uint32_t stash_off;         // bytes of the head buffer already used
+
+    struct http_parser parser;  // state of the request at the buffer start
+    // Receive buffer from the worker's pool. Only held while input is
+    // buffered, so an idle connection costs no more than this struct.
+    char *buffer;
+    size_t len;                 // bytes received into buffer
+    size_t cap;                 // size of buffer, 0 while none is held
+    int buftier;
+};
+
+// Queue len bytes at data for writing. The data is not copied. If owner is
+// NULL the data must stay valid until written; otherwise it must stay valid
+// until the worker goes offline, and conn_pin() takes a reference if the
+// write outlives that. Returns -1 when the queue is full.
+static inline int conn_queue(struct conn *c, const void *data, size_t len,
+                             struct rcbuf *owner) {
+    if (c->iovcnt == CONN_MAX_IOV) {
+        return -1;
+    }
+    c->iov[c->iovcnt].iov_base = (void *)data;
+    c->iov[c->iovcnt].iov_len = len;
+    c->owner[c->iovcnt] = owner;
+    c->iovcnt++;
+    return 0;
+}
+
+// Queue len bytes of the file fd starting at off. The same lifetime rules
+// as for conn_queue() apply to the descriptor.
+static inline int conn_queue_file(struct conn *c, int fd, off_t off,
+                                  size_t len, struct rcbuf *owner) {
+    if (c->iovcnt == CONN_MAX_IOV) {
+        return -1;
+    }
+    c->iov[c->iovcnt].iov_base = NULL;
+    c->iov[c->iovcnt].iov_len = len;
+    c->file[c->iovcnt].fd = fd;
+    c->file[c->iovcnt].off = off;
+    c->owner[c->iovcnt] = owner;
+    c->iovcnt++;
+    return 0;
+}
+
+// Note that bytes arrived on c, into a buffer that held nothing if
+// was_empty; for --log-timing only
+static inline void conn_read_stamp(struct conn *c, int was_empty) {
+    uint64_t now = trace_clock();
+    if (was_empty) {
+        c->read_tsc = now;
+    }
+    c->head_tsc = now;
+}
+
+static inline int conn_queue_space(const struct conn *c) {
+    return CONN_MAX_IOV - c->iovcnt;
+}
+
+// Is c between requests, with nothing buffered, queued or in progress?
+// The io_uring backend also has to check its own state.
+static inline int conn_idle(const struct conn *c) {
+    return c->len == 0 && c->body_left == 0 && c->iovpos == c->iovcnt &&
+           c->stream == NULL && c->proxy == NULL && c->offload == NULL &&
+           !c->lingering && !c->tls_handshake;
+}
+
+// Is there input on c's socket we have not read yet? A request that raced
+// the drain of an idle connection is answered rather than cut off.
+int conn_input_pending(const struct conn *c);
+
+// The client's address. accept4() hands it over for free; a multishot
+// accept on io_uring cannot, so it is asked for the first time anyone wants
+// it, which costs nothing unless requests are logged.
+const union sock_addr *conn_peer(struct conn *c);
+
+// Arm c's timer for the state it is in: a response that makes no progress
+// for --write-timeout, a request (head and body) that takes longer than
+// --read-timeout to arrive, a backend that takes longer than
+// --upstream-timeout to answer, or an idle connection after
+// --keepalive-timeout (--ws-timeout for a WebSocket), or right away for an
+// idle one while the worker drains. reading says whether a partial request
+// is buffered anywhere, which only the event loop knows.
+void conn_schedule(struct timer_wheel *tw, struct conn *c, int reading);
+
+// Make sure c holds a receive buffer. Returns -1 if none could be had.
+int conn_buffer_get(struct conn *c);
+
+// Move the buffered input to a buffer of the next tier because the request
+// head does not fit. Returns -1 when the largest tier is full already.
+int conn_buffer_grow(struct conn *c);
+
+// Give the receive buffer back to the pool once it is empty
+void conn_buffer_release(struct conn *c);
+
+// Take references on everything still queued, before the worker goes
+// offline with writes outstanding
+void conn_pin(struct conn *c);
+
+// Account for n bytes of the queue having been written. Returns 1 once the
+// whole queue is written, after calling the worker's written() hook.
+int conn_written(struct conn *c, size_t n);
+
+// Drop whatever is still queued, any stream producing more, the TLS
+// session and what it holds against the limits, before the connection is
+// freed
+void conn_discard(struct conn *c);
+
+#endif
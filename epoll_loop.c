@@ -0,0 +1,719 @@
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "accesslog.h"
+#include "conn.h"
+#include "h2.h"
+#include "http.h"
+#include "limit.h"
+#include "offload.h"
+#include "overload.h"
+#include "qsbr.h"
+#include "server.h"
+#include "static_files.h"
+#include "stream.h"
+#include "tls.h"
+#include "upstream.h"
+#include "ws.h"
+
+#define MAX_EVENTS 256
+// How often a worker that stopped accepting looks at its lag again
+#define SHED_RECHECK_MS 1
+
+struct epoll_loop {
+    struct worker *w;
+    int epfd;
+    struct timer_wheel timers;
+    unsigned accept_pending;    // listener slots that may have a backlog
+    unsigned queued[LISTEN_MAX];    // their backlogs when last seen
+    int paused;                 // not accepting while overloaded
+};
+
+static int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) {
+        return -1;
+    }
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static void conn_close(struct epoll_loop *loop, struct conn *c) {
+    TRACE1(close, c->fd);
+    timer_cancel(&loop->timers, &c->timer);
+    conn_discard(c);
+    // Closing the fd also removes it from the epoll set
+    close(c->fd);
+    slab_free(&loop->w->conns, c);
+}
+
+// Note the backlog of listener slot as last seen, for the gauge
+static void accept_queued(struct epoll_loop *loop, int slot, unsigned n) {
+    struct worker_metrics *m = &loop->w->metrics;
+    uint64_t total = atomic_load_explicit(&m->accept_queue,
+                                          memory_order_relaxed);
+    atomic_store_explicit(&m->accept_queue, total - loop->queued[slot] + n,
+                          memory_order_relaxed);
+    loop->queued[slot] = n;
+}
+
+// Accept up to --accept-batch pending connections on listener slot. With
+// EPOLLET we only hear about the backlog once, so the slot stays pending
+// until accept() reports EAGAIN; the batch bounds how long the
+// connections we already have wait for new ones. Returns the number
+// accepted.
+static int accept_batch(struct epoll_loop *loop, int slot) {
+    int fd = loop->w->listen_fd[slot];
+    int accepted = 0;
+    for (;;) {
+        if (accepted == config.accept_batch) {
+            metric_add(&loop->w->metrics.accept_deferred, 1);
+            accept_queued(loop, slot, overload_queue(fd));
+            return accepted;
+        }
+        if (config.shed == SHED_PAUSE && overload_shedding(loop->w)) {
+            // Overloaded halfway through; accept_run() pauses from here
+            accept_queued(loop, slot, overload_queue(fd));
+            return accepted;
+        }
+        union sock_addr addr;
+        socklen_t addrlen = sizeof(addr);
+        // Close-on-exec, or a new process started for a reload would keep
+        // our connections open
+        int newsockfd = accept4(fd, &addr.sa, &addrlen,
+                                SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (newsockfd < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                metric_add(&loop->w->metrics.errors[SYSCALL_ACCEPT], 1);
+                perror("webserver (accept)");
+            }
+            loop->accept_pending &= ~(1u << slot);
+            if (loop->queued[slot] != 0) {
+                accept_queued(loop, slot, 0);
+            }
+            return accepted;
+        }
+        accepted++;
+        TRACE2(accept, newsockfd, loop->w->id);
+        if (config.shed == SHED_REJECT && overload_shedding(loop->w)) {
+            overload_reject(loop->w, newsockfd);
+            continue;
+        }
+
+        struct conn *c = slab_alloc(&loop->w->conns);
+        if (c == NULL) {
+            close(newsockfd);
+            continue;
+        }
+        memset(c, 0, sizeof(*c));
+        c->fd = newsockfd;
+        c->w = loop->w;
+        c->addr = addr;
+        c->addr_known = 1;
+        c->readable = 1;
+        c->last_active = loop->w->now;
+        if (config.log_timing) {
+            c->accept_tsc = trace_clock();
+        }
+        metric_add(&loop->w->metrics.accepts, 1);
+        // Over a limit, the client does not get as far as a read
+        if (limit_accept(c) != 0) {
+            metric_add(&loop->w->metrics.limit_refused, 1);
+            close(newsockfd);
+            slab_free(&loop->w->conns, c);
+            continue;
+        }
+        accesslog_accept(loop->w, &addr);
+        if (config.tls_cert != NULL && tls_accept(c) != 0) {
+            limit_release(c);
+            close(newsockfd);
+            slab_free(&loop->w->conns, c);
+            continue;
+        }
+        // The handshake has the same deadline as a request
+        conn_schedule(&loop->timers, c, c->tls_handshake);
+
+        // Register for both directions up front so we never need EPOLL_CTL_MOD
+        struct epoll_event ev = {
+            .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+            .data.ptr = c,
+        };
+        if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, newsockfd, &ev) != 0) {
+            perror("webserver (epoll_ctl)");
+            conn_close(loop, c);
+        }
+    }
+}
+
+// Accept on the listeners that may have a backlog, unless the worker is
+// overloaded and leaves new connections there
+static void accept_run(struct epoll_loop *loop) {
+    struct worker *w = loop->w;
+    int pause = config.shed == SHED_PAUSE && overload_shedding(w);
+    if (pause != loop->paused) {
+        loop->paused = pause;
+        if (pause) {
+            metric_add(&w->metrics.overload_paused, 1);
+        }
+    }
+    for (int i = 0; i < w->nlisten; i++) {
+        if (!(loop->accept_pending & 1u << i)) {
+            continue;
+        }
+        if (pause) {
+            accept_queued(loop, i, overload_queue(w->listen_fd[i]));
+        } else {
+            accept_batch(loop, i);
+        }
+    }
+}
+
+// Drain the socket into the connection buffer until it is full. Returns -1
+// when the connection should be dropped.
+static int conn_read(struct conn *c) {
+    while (c->readable) {
+        if (c->cap == 0 && conn_buffer_get(c) != 0) {
+            return -1;
+        }
+        if (c->len == c->cap) {
+            break;
+        }
+        size_t room = c->cap - c->len;
+        ssize_t n = tls_user_rx(c) ? tls_read(c, c->buffer + c->len, room)
+                                   : read(c->fd, c->buffer + c->len, room);
+        if (n > 0) {
+            TRACE2(read, c->fd, n);
+            if (config.log_timing) {
+                conn_read_stamp(c, c->len == 0);
+            }
+            c->len += n;
+            metric_add(&c->w->metrics.bytes_in, n);
+            continue;
+        }
+        if (n == 0) {
+            c->eof = 1;
+            c->readable = 0;
+            break;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            c->readable = 0;
+            break;
+        }
+        if (c->tls != NULL && (errno == EIO || errno == EPROTO)) {
+            // A TLS alert, or garbage where a record should be
+            c->eof = 1;
+            c->readable = 0;
+            break;
+        }
+        metric_add(&c->w->metrics.errors[SYSCALL_READ], 1);
+        perror("webserver (read)");
+        return -1;
+    }
+    return 0;
+}
+
+// Write the queued responses with as few system calls as the socket
+// allows. Returns 1 once the queue is empty, 0 if we have to wait for
+// EPOLLOUT and -1 on error.
+static int conn_flush(struct conn *c) {
+    while (c->iovpos < c->iovcnt) {
+        int i = c->iovpos;
+        ssize_t n;
+        if (tls_user_tx(c)) {
+            n = tls_write(c);
+        } else if (c->iov[i].iov_base == NULL) {
+            // File data goes from the page cache straight to the socket
+            off_t off = c->file[i].off;
+            n = sendfile(c->fd, c->file[i].fd, &off, c->iov[i].iov_len);
+            if (n == 0) {
+                // The file shrank underneath us
+                return -1;
+            }
+        } else {
+            int end = i;
+            while (end < c->iovcnt && c->iov[end].iov_base != NULL) {
+                end++;
+            }
+            // Hold back a partial packet when file data follows
+            struct msghdr msg = {.msg_iov = c->iov + i, .msg_iovlen = end - i};
+            int flags = MSG_NOSIGNAL | (end < c->iovcnt ? MSG_MORE : 0);
+            n = sendmsg(c->fd, &msg, flags);
+        }
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                // The rest is written after we slept in epoll_wait()
+                conn_pin(c);
+                return 0;
+            }
+            if (c->iov[i].iov_base == NULL && !tls_user_tx(c)) {
+                metric_add(&c->w->metrics.errors[SYSCALL_SENDFILE], 1);
+                perror("webserver (sendfile)");
+            } else {
+                metric_add(&c->w->metrics.errors[SYSCALL_WRITE], 1);
+                perror("webserver (write)");
+            }
+            return -1;
+        }
+        TRACE2(write, c->fd, n);
+        conn_written(c, n);
+    }
+    return 1;
+}
+
+// Closing a socket with unread input makes the kernel send a RST, which
+// can destroy responses the client has not read yet. Shut down our side
+// instead and discard input until the peer closes or the idle timeout hits.
+// Returns -1 once the connection is closed.
+static int conn_linger(struct epoll_loop *loop, struct conn *c) {
+    if (!c->lingering) {
+        c->lingering = 1;
+        tls_close_notify(c);
+        if (shutdown(c->fd, SHUT_WR) != 0) {
+            conn_close(loop, c);
+            return -1;
+        }
+    }
+    char discard[4096];
+    for (;;) {
+        ssize_t n = read(c->fd, discard, sizeof(discard));
+        if (n > 0) {
+            continue;
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
+        }
+        conn_close(loop, c);
+        return -1;
+    }
+}
+
+// Read, answer and write until the connection would block in every
+// direction we care about. Returns -1 once the connection is closed.
+static int conn_run(struct epoll_loop *loop, struct conn *c) {
+    if (c->lingering) {
+        return conn_linger(loop, c);
+    }
+    if (c->tls_handshake) {
+        int done = tls_handshake(c);
+        if (done < 0) {
+            conn_close(loop, c);
+            return -1;
+        }
+        if (done == 0) {
+            // We are registered for both directions, so whichever the
+            // handshake waits for brings us back
+            return 0;
+        }
+    }
+    for (;;) {
+        if (conn_read(c) != 0) {
+            conn_close(loop, c);
+            return -1;
+        }
+
+        int progress = http_process(c);
+        if (c->offload != NULL) {
+            // The pool has it now; offload_run() brings it back
+            return 0;
+        }
+
+        int done = conn_flush(c);
+        if (done < 0) {
+            conn_close(loop, c);
+            return -1;
+        }
+        if (done == 0) {
+            // EPOLLOUT brings us back here
+            return 0;
+        }
+        if (c->stream != NULL) {
+            // The socket took everything; let the stream produce more
+            int more = stream_pump(c);
+            if (more < 0) {
+                conn_close(loop, c);
+                return -1;
+            }
+            if (more > 0) {
+                continue;
+            }
+        }
+        if (c->proxy != NULL) {
+            // Relay what the backend has sent; its events bring us back
+            // for more, the client's for spliced data it has not taken
+            int more = upstream_pump(c);
+            if (more < 0) {
+                conn_close(loop, c);
+                return -1;
+            }
+            if (more > 0 || progress > 0) {
+                continue;
+            }
+            if (c->eof && c->body_left > 0) {
+                // The rest of the body is never coming
+                conn_close(loop, c);
+                return -1;
+            }
+            conn_buffer_release(c);
+            return 0;
+        }
+        if (c->h2 != NULL && h2_pump(c) > 0) {
+            // The next batch of frames, from whichever streams have some
+            continue;
+        }
+        if (c->close_after_write) {
+            if (c->eof) {
+                conn_close(loop, c);
+                return -1;
+            }
+            return conn_linger(loop, c);
+        }
+        if (progress > 0) {
+            // Answering made room in the buffer and the write queue; there
+            // may be more pipelined requests behind them
+            continue;
+        }
+        if (c->eof) {
+            conn_close(loop, c);
+            return -1;
+        }
+        if (c->len == c->cap && c->cap > 0) {
+            // The request head does not fit into the buffer
+            if (conn_buffer_grow(c) != 0) {
+                conn_close(loop, c);
+                return -1;
+            }
+            continue;
+        }
+        conn_buffer_release(c);
+        return 0;
+    }
+}
+
+static void conn_event(struct epoll_loop *loop, struct conn *c,
+                       uint32_t events) {
+    if (c->offload != NULL) {
+        // Whatever happened is seen once the pool is done with it
+        c->readable = 1;
+        return;
+    }
+    if (events & EPOLLERR) {
+        conn_close(loop, c);
+        return;
+    }
+    // OpenSSL may also have been waiting to write before it can read on
+    if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP) ||
+        (tls_user_rx(c) && c->tls_want_write)) {
+        c->readable = 1;
+    }
+    c->last_active = loop->w->now;
+    if (conn_run(loop, c) == 0) {
+        conn_schedule(&loop->timers, c, c->len > 0 || c->tls_handshake);
+    }
+}
+
+// Close the connections whose deadline passed and return how long
+// epoll_wait() may sleep. While draining, idle connections are shut down
+// gracefully as soon as their timer comes up.
+static int expire_timers(struct epoll_loop *loop) {
+    struct timer *t;
+    while ((t = timer_expired(&loop->timers, loop->w->now)) != NULL) {
+        struct conn *c =
+            (struct conn *)((char *)t - offsetof(struct conn, timer));
+        int expired = t->expires <= loop->w->now;
+        if (c->offload != NULL) {
+            // Not closed under the pool's feet; its deadline starts over
+            // once it is back
+            conn_schedule(&loop->timers, c, 0);
+        } else if (c->h2 != NULL && (loop->w->draining || expired)) {
+            // A session has streams of its own to time out, and a GOAWAY
+            // to send before it goes
+            if (h2_timeout(c, expired) != 0) {
+                conn_close(loop, c);
+            } else if (conn_run(loop, c) == 0) {
+                conn_schedule(&loop->timers, c, c->len > 0);
+            }
+        } else if (c->proxy != NULL && expired) {
+            // The backend is too slow, or the client too slow to take
+            // what came from it
+            if (upstream_timeout(c) != 0) {
+                conn_close(loop, c);
+            } else if (conn_run(loop, c) == 0) {
+                conn_schedule(&loop->timers, c, c->len > 0);
+            }
+        } else if (c->ws != NULL && loop->w->draining && conn_idle(c)) {
+            // A WebSocket is told why it goes
+            ws_going_away(c);
+            if (conn_run(loop, c) == 0) {
+                conn_schedule(&loop->timers, c, c->len > 0);
+            }
+        } else if (loop->w->draining && conn_idle(c)) {
+            if (conn_input_pending(c)) {
+                c->readable = 1;
+                if (conn_run(loop, c) == 0) {
+                    conn_schedule(&loop->timers, c, c->len > 0);
+                }
+            } else if (conn_linger(loop, c) == 0) {
+                conn_schedule(&loop->timers, c, 0);
+            }
+        } else if (t->expires > loop->w->now) {
+            // Woken early by drain_start(); it still has time
+            timer_set(&loop->timers, t, t->expires);
+        } else {
+            conn_close(loop, c);
+        }
+    }
+    return timer_timeout(&loop->timers);
+}
+
+// Drive the clients that events of their backend connections left work
+// for, once the events of the clients themselves are handled
+static void upstream_run(struct epoll_loop *loop) {
+    struct upstream_pool *p = loop->w->upstream;
+    if (p == NULL) {
+        return;
+    }
+    struct conn *c;
+    while ((c = upstream_ready(p)) != NULL) {
+        if (c->parent != NULL) {
+            // A stream is driven by its session
+            c = c->parent;
+        }
+        c->last_active = loop->w->now;
+        if (conn_run(loop, c) == 0) {
+            conn_schedule(&loop->timers, c, c->len > 0 || c->tls_handshake);
+        }
+    }
+    upstream_reap(p);
+}
+
+// Carry on with the connections whose requests the offload pool answered
+static void offload_run(struct epoll_loop *loop) {
+    struct offload_job *next;
+    for (struct offload_job *j = offload_finished(loop->w); j != NULL;
+         j = next) {
+        next = j->next;
+        struct conn *c = j->done(j);
+        if (c == NULL) {
+            continue;
+        }
+        c->last_active = loop->w->now;
+        if (conn_run(loop, c) == 0) {
+            conn_schedule(&loop->timers, c, c->len > 0 || c->tls_handshake);
+        }
+    }
+}
+
+// Queue the messages published to this worker's WebSocket subscribers
+// since the last round and write them out, everything a connection got in
+// one go
+static void ws_run(struct epoll_loop *loop) {
+    struct worker *w = loop->w;
+    if (w->ws == NULL) {
+        return;
+    }
+    ws_deliver(w);
+    struct conn *c;
+    int slow;
+    while ((c = ws_ready(w, &slow)) != NULL) {
+        if (slow) {
+            conn_close(loop, c);
+            continue;
+        }
+        c->last_active = w->now;
+        if (conn_run(loop, c) == 0) {
+            conn_schedule(&loop->timers, c, c->len > 0);
+        }
+    }
+    ws_reap(w);
+}
+
+// Stop accepting and let the open connections finish: every response from
+// now on closes its connection, and idle connections are shut down right
+// away. The listeners live on in the process we handed them to, if any.
+static void drain_start(struct epoll_loop *loop) {
+    uint64_t value;
+    if (read(loop->w->wakefd, &value, sizeof(value)) < 0 ||
+        loop->w->draining) {
+        return;
+    }
+    loop->w->draining = 1;
+    for (int i = 0; i < loop->w->nlisten; i++) {
+        epoll_ctl(loop->epfd, EPOLL_CTL_DEL, loop->w->listen_fd[i], NULL);
+        close(loop->w->listen_fd[i]);
+    }
+    loop->w->nlisten = 0;
+    loop->accept_pending = 0;
+    timer_expire_all(&loop->timers);
+}
+
+int run_epoll(struct worker *w) {
+    struct epoll_loop loop = {.w = w};
+    timer_wheel_init(&loop.timers, monotonic_ms());
+
+    if (config.root != NULL) {
+        w->files = static_cache_new();
+        if (w->files == NULL) {
+            return 1;
+        }
+    }
+
+    for (int i = 0; i < w->nlisten; i++) {
+        if (set_nonblocking(w->listen_fd[i]) != 0) {
+            perror("webserver (fcntl)");
+            return 1;
+        }
+    }
+
+    loop.epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop.epfd < 0) {
+        perror("webserver (epoll_create1)");
+        return 1;
+    }
+    if (config.nupstream > 0) {
+        w->upstream = upstream_pool_new(w, loop.epfd);
+        if (w->upstream == NULL) {
+            close(loop.epfd);
+            return 1;
+        }
+    }
+
+    // A listener is tagged with its slot in listen_fd[], the wakeup eventfd
+    // with the worker, connections with their state, backend connections
+    // with their state plus one, the cache mailbox with the backend pool,
+    // the offload eventfd with the worker's deque and the WebSocket inbox
+    // eventfd with the worker's subscribers. A listener handed to
+    // us may be shared by several workers; only one of them needs waking.
+    struct epoll_event wake = {.events = EPOLLIN, .data.ptr = w};
+    if (epoll_ctl(loop.epfd, EPOLL_CTL_ADD, w->wakefd, &wake) != 0) {
+        perror("webserver (epoll_ctl)");
+        close(loop.epfd);
+        return 1;
+    }
+    if (w->offload != NULL) {
+        struct epoll_event ev = {.events = EPOLLIN, .data.ptr = w->offload};
+        if (epoll_ctl(loop.epfd, EPOLL_CTL_ADD, offload_fd(w), &ev) != 0) {
+            perror("webserver (epoll_ctl)");
+            close(loop.epfd);
+            return 1;
+        }
+    }
+    if (w->ws != NULL) {
+        struct epoll_event ev = {.events = EPOLLIN, .data.ptr = w->ws};
+        if (epoll_ctl(loop.epfd, EPOLL_CTL_ADD, ws_fd(w), &ev) != 0) {
+            perror("webserver (epoll_ctl)");
+            close(loop.epfd);
+            return 1;
+        }
+    }
+    for (int i = 0; i < w->nlisten; i++) {
+        struct epoll_event ev = {
+            .events = EPOLLIN | EPOLLET | EPOLLEXCLUSIVE,
+            .data.ptr = &w->listen_fd[i],
+        };
+        if (epoll_ctl(loop.epfd, EPOLL_CTL_ADD, w->listen_fd[i], &ev) != 0) {
+            perror("webserver (epoll_ctl)");
+            close(loop.epfd);
+            return 1;
+        }
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+    for (;;) {
+        w->now = monotonic_ms();
+        int timeout = expire_timers(&loop);
+        // A timeout may have sent a request to another backend
+        upstream_run(&loop);
+        if (loop.accept_pending != 0) {
+            // Come back for the rest of a backlog right away, or once the
+            // lag may have gone down; closing connections wakes us anyway
+            int wait = !loop.paused ? 0
+                       : w->lag_shedding ? SHED_RECHECK_MS : timeout;
+            if (timeout < 0 || (wait >= 0 && wait < timeout)) {
+                timeout = wait;
+            }
+        }
+        if (ws_pending(w)) {
+            // Published on this worker after its round's delivery
+            timeout = 0;
+        }
+        if (w->draining && w->conns.in_use == 0) {
+            qsbr_offline(w->id);
+            upstream_pool_free(w->upstream);
+            close(loop.epfd);
+            return 0;
+        }
+
+        // Sleeping counts as a quiescent state: we hold no pointers into
+        // shared responses other than the ones conn_pin() took references on
+        qsbr_offline(w->id);
+        int n = epoll_wait(loop.epfd, events, MAX_EVENTS, timeout);
+        qsbr_online(w->id);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("webserver (epoll_wait)");
+            close(loop.epfd);
+            return 1;
+        }
+
+        w->now = monotonic_ms();
+        uint64_t start = metric_clock();
+        for (int i = 0; i < n; i++) {
+            int *listener = events[i].data.ptr;
+            if (listener >= w->listen_fd &&
+                listener < w->listen_fd + LISTEN_MAX) {
+                // Accepted once the connections we have are served
+                if (!w->draining) {
+                    loop.accept_pending |= 1u << (listener - w->listen_fd);
+                }
+            } else if (events[i].data.ptr == w) {
+                drain_start(&loop);
+            } else if (w->offload != NULL &&
+                       events[i].data.ptr == (void *)w->offload) {
+                offload_run(&loop);
+            } else if (w->ws != NULL && events[i].data.ptr == (void *)w->ws) {
+                ws_notify(w);
+            } else if (w->upstream != NULL &&
+                       events[i].data.ptr == (void *)w->upstream) {
+                upstream_notify(w->upstream);
+            } else if ((uintptr_t)events[i].data.ptr & 1) {
+                upstream_event(
+                    (struct upstream_conn *)((char *)events[i].data.ptr - 1),
+                    events[i].events);
+            } else {
+                conn_event(&loop, events[i].data.ptr, events[i].events);
+            }
+        }
+        accept_run(&loop);
+        upstream_run(&loop);
+        ws_run(&loop);
+
+        uint64_t lag = metric_clock() - start;
+        if (n > 0) {
+            metric_observe(&w->metrics.latency[LATENCY_LOOP], lag);
+        }
+        overload_lag(w, lag);
+    }
+}
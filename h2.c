@@ -0,0 +1,1342 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "h2.h"
+#include "hpack.h"
+#include "http.h"
+#include "metrics.h"
+#include "stream.h"
+#include "tls.h"
+#include "upstream.h"
+
+#define PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define PREFACE_LEN 24
+#define FRAME_HEADER 9
+#define FRAME_MAX 16384             // the largest frame we take, the default
+#define FRAME_SEND_MAX 65536        // the largest we send, if allowed
+#define STREAMS_MAX 100             // SETTINGS_MAX_CONCURRENT_STREAMS
+#define WINDOW_DEFAULT 65535        // every flow control window starts here
+#define WINDOW_MAX 0x7fffffff
+#define BLOCK_MAX BUFFER_MAX_SIZE   // a header block split into CONTINUATIONs
+#define FIELDS_MAX (HTTP_MAX_HEADERS + 8)   // room for the pseudo-headers
+#define CTRL_SIZE 4096
+#define ARENA_SIZE (16 * 1024)
+#define COPY_MAX 1024               // DATA payloads copied, not pointed at
+
+enum frame_type {
+    FRAME_DATA,
+    FRAME_HEADERS,
+    FRAME_PRIORITY,
+    FRAME_RST_STREAM,
+    FRAME_SETTINGS,
+    FRAME_PUSH_PROMISE,
+    FRAME_PING,
+    FRAME_GOAWAY,
+    FRAME_WINDOW_UPDATE,
+    FRAME_CONTINUATION,
+};
+
+#define FLAG_END_STREAM 0x1
+#define FLAG_ACK 0x1
+#define FLAG_END_HEADERS 0x4
+#define FLAG_PADDED 0x8
+#define FLAG_PRIORITY 0x20
+
+enum h2_error {
+    H2_NO_ERROR,
+    H2_PROTOCOL_ERROR,
+    H2_INTERNAL_ERROR,
+    H2_FLOW_CONTROL_ERROR,
+    H2_SETTINGS_TIMEOUT,
+    H2_STREAM_CLOSED,
+    H2_FRAME_SIZE_ERROR,
+    H2_REFUSED_STREAM,
+    H2_CANCEL,
+    H2_COMPRESSION_ERROR,
+    H2_CONNECT_ERROR,
+    H2_ENHANCE_YOUR_CALM,
+};
+
+enum h2_setting {
+    SETTINGS_HEADER_TABLE_SIZE = 1,
+    SETTINGS_ENABLE_PUSH,
+    SETTINGS_MAX_CONCURRENT_STREAMS,
+    SETTINGS_INITIAL_WINDOW_SIZE,
+    SETTINGS_MAX_FRAME_SIZE,
+    SETTINGS_MAX_HEADER_LIST_SIZE,
+};
+
+struct h2_stream {
+    struct conn c;              // where the handler queues the response
+    struct h2_stream *next;     // in the session, oldest first
+    struct h2_stream *dep;      // the open stream this one depends on
+    uint32_t id;
+    uint16_t weight;            // 1 to 256
+    int32_t send_window;        // negative after the client shrank it
+    int32_t recv_window;
+    uint64_t vtime;             // virtual time of its next frame, see pick()
+    int seg;                    // the first byte of c's queue not framed
+    size_t seg_off;
+    size_t carved;              // bytes of c's queue framed, not yet sent
+    unsigned head_sent : 1;
+    unsigned end_sent : 1;      // END_STREAM went out
+    unsigned remote_closed : 1; // and came in
+    unsigned head_only : 1;     // a HEAD request: the body is dropped
+    unsigned reset : 1;         // freed as soon as nothing points into it
+    unsigned ready : 1;         // has a frame to send, see pick()
+};
+
+struct h2_session {
+    struct conn *c;
+    struct h2_stream *streams;
+    unsigned nstreams;
+    uint32_t last_id;           // the highest stream the client opened
+    int32_t send_window;        // of the connection
+    int32_t recv_window;
+    int32_t initial_window;     // the client's SETTINGS_INITIAL_WINDOW_SIZE
+    uint32_t frame_max;         // the largest DATA payload we send
+    uint64_t vclock;            // virtual time of the last frame framed
+    unsigned preface : 1;       // the client's preface arrived
+    unsigned failed : 1;        // a connection error; GOAWAY is queued
+    unsigned goaway_wanted : 1;
+    unsigned goaway_sent : 1;
+    unsigned peer_goaway : 1;
+
+    // A header block waiting for its CONTINUATION frames, with what its
+    // HEADERS frame said
+    unsigned in_block : 1;
+    unsigned block_priority : 1;
+    unsigned block_exclusive : 1;
+    uint8_t block_flags;
+    uint16_t block_weight;
+    uint32_t block_id;
+    uint32_t block_dep;
+    uint8_t *block;             // BLOCK_MAX bytes once needed
+    size_t block_len;
+
+    char *fields;               // decoded requests, --max-header-size bytes
+    struct hpack_decoder dec;
+    struct hpack_encoder enc;
+
+    // Control frames go out at the front of the next batch. The batch
+    // itself is built from the arena: frame headers, header blocks and
+    // small payloads, all in one segment where they are adjacent.
+    size_t ctrl_len;
+    uint8_t ctrl[CTRL_SIZE];
+    size_t arena_len;
+    uint8_t arena[ARENA_SIZE];
+};
+
+static uint32_t get32(const uint8_t *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 |
+           p[3];
+}
+
+static void put32(uint8_t *p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static void frame_header(uint8_t *p, size_t len, uint8_t type,
+                         uint8_t flags, uint32_t id) {
+    p[0] = len >> 16;
+    p[1] = len >> 8;
+    p[2] = len;
+    p[3] = type;
+    p[4] = flags;
+    put32(p + 5, id);
+}
+
+// Room for a control frame with a payload of len bytes. Input stops being
+// read once half the buffer is in use, which leaves room for the frames
+// any one input frame or a round of the streams causes.
+static uint8_t *ctrl_frame(struct h2_session *s, size_t len, uint8_t type,
+                           uint8_t flags, uint32_t id) {
+    if (s->ctrl_len + FRAME_HEADER + len > CTRL_SIZE) {
+        return NULL;
+    }
+    uint8_t *p = s->ctrl + s->ctrl_len;
+    frame_header(p, len, type, flags, id);
+    s->ctrl_len += FRAME_HEADER + len;
+    return p + FRAME_HEADER;
+}
+
+static void send_rst(struct h2_session *s, uint32_t id, uint32_t code) {
+    uint8_t *p = ctrl_frame(s, 4, FRAME_RST_STREAM, 0, id);
+    if (p != NULL) {
+        put32(p, code);
+    }
+}
+
+static void send_window_update(struct h2_session *s, uint32_t id,
+                               uint32_t increment) {
+    uint8_t *p = ctrl_frame(s, 4, FRAME_WINDOW_UPDATE, 0, id);
+    if (p != NULL) {
+        put32(p, increment);
+    }
+}
+
+static void send_goaway(struct h2_session *s, uint32_t code) {
+    uint8_t *p = ctrl_frame(s, 8, FRAME_GOAWAY, 0, 0);
+    if (p != NULL) {
+        put32(p, s->last_id);
+        put32(p + 4, code);
+    }
+    s->goaway_sent = 1;
+}
+
+// A connection error: say GOAWAY and stop looking at input. Returns -1.
+static int conn_error(struct h2_session *s, uint32_t code) {
+    if (!s->failed) {
+        send_goaway(s, code);
+        s->failed = 1;
+    }
+    return -1;
+}
+
+static struct h2_stream *find(const struct h2_session *s, uint32_t id) {
+    for (struct h2_stream *st = s->streams; st != NULL; st = st->next) {
+        if (st->id == id) {
+            return st;
+        }
+    }
+    return NULL;
+}
+
+// A stream error: the stream is dropped once its frames are sent
+static void reset_stream(struct h2_session *s, struct h2_stream *st,
+                         uint32_t code) {
+    if (!st->reset) {
+        send_rst(s, st->id, code);
+        st->reset = 1;
+    }
+}
+
+static struct h2_stream *open_stream(struct h2_session *s, uint32_t id) {
+    struct h2_stream *st = calloc(1, sizeof(*st));
+    if (st == NULL) {
+        perror("webserver (calloc)");
+        return NULL;
+    }
+    struct conn *c = s->c;
+    struct conn *sc = &st->c;
+    sc->fd = -1;
+    sc->w = c->w;
+    sc->addr = *conn_peer(c);
+    sc->addr_known = 1;
+    sc->parent = c;
+    sc->last_active = c->w->now;
+    st->id = id;
+    st->weight = 16;
+    st->send_window = s->initial_window;
+    st->recv_window = WINDOW_DEFAULT;
+    // Starts even with whoever was served last
+    st->vtime = s->vclock;
+
+    struct h2_stream **tail = &s->streams;
+    while (*tail != NULL) {
+        tail = &(*tail)->next;
+    }
+    *tail = st;
+    s->nstreams++;
+    metric_add(&c->w->metrics.h2_streams, 1);
+    return st;
+}
+
+static void free_stream(struct h2_session *s, struct h2_stream *st) {
+    struct h2_stream **link = &s->streams;
+    for (struct h2_stream *x = s->streams; x != NULL; x = x->next) {
+        // Its dependents move up to its own parent
+        if (x->dep == st) {
+            x->dep = st->dep;
+        }
+        if (x->next == st) {
+            link = &x->next;
+        }
+    }
+    *link = st->next;
+    s->nstreams--;
+    conn_discard(&st->c);
+    free(st);
+}
+
+// Make st depend on the stream dep_id with weight, following RFC 7540
+// section 5.3 as far as open streams go: a stream that is closed or was
+// never opened is the root
+static void set_priority(struct h2_session *s, struct h2_stream *st,
+                         uint32_t dep_id, int exclusive, unsigned weight) {
+    struct h2_stream *dep = dep_id != 0 ? find(s, dep_id) : NULL;
+    if (dep == st) {
+        return;
+    }
+    // Depending on one's own dependent moves that one up first
+    int depth = 0;
+    for (struct h2_stream *d = dep; d != NULL && depth < STREAMS_MAX;
+         d = d->dep, depth++) {
+        if (d == st) {
+            dep->dep = st->dep;
+            break;
+        }
+    }
+    if (exclusive) {
+        for (struct h2_stream *x = s->streams; x != NULL; x = x->next) {
+            if (x != st && x->dep == dep) {
+                x->dep = st;
+            }
+        }
+    }
+    st->dep = dep;
+    st->weight = weight;
+}
+
+// Headers that only concern one HTTP/1 connection. A request with one of
+// them is malformed; responses lose them.
+static int connection_specific(const char *name, size_t len) {
+    static const char *const names[] = {
+        "Connection", "Keep-Alive", "Proxy-Connection", "Transfer-Encoding",
+        "Upgrade",
+    };
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if (strlen(names[i]) == len && strncasecmp(names[i], name, len) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int is_field(const struct http_str *name, const char *want) {
+    return name->len == strlen(want) &&
+           memcmp(name->ptr, want, name->len) == 0;
+}
+
+// Turn the n decoded fields into req, with :authority as the Host header.
+// Returns -1 for a malformed request and 1 if there are more headers than
+// a request may have.
+static int make_request(const struct http_header *f, int n,
+                        struct http_request *req) {
+    struct http_str scheme = {NULL, 0}, authority = {NULL, 0};
+    int regular = 0, host = 0, too_many = 0;
+    memset(req, 0, sizeof(*req));
+    for (int i = 0; i < n; i++) {
+        const struct http_str *name = &f[i].name;
+        for (size_t j = 0; j < name->len; j++) {
+            if (name->ptr[j] >= 'A' && name->ptr[j] <= 'Z') {
+                return -1;
+            }
+        }
+        if (name->len > 0 && name->ptr[0] == ':') {
+            struct http_str *slot;
+            if (regular) {
+                return -1;
+            } else if (is_field(name, ":method")) {
+                slot = &req->method;
+            } else if (is_field(name, ":path")) {
+                slot = &req->uri;
+            } else if (is_field(name, ":scheme")) {
+                slot = &scheme;
+            } else if (is_field(name, ":authority")) {
+                slot = &authority;
+            } else {
+                return -1;
+            }
+            if (slot->ptr != NULL) {
+                return -1;
+            }
+            *slot = f[i].value;
+            continue;
+        }
+        regular = 1;
+        if (connection_specific(name->ptr, name->len) ||
+            (is_field(name, "te") &&
+             !(f[i].value.len == 8 &&
+               memcmp(f[i].value.ptr, "trailers", 8) == 0))) {
+            return -1;
+        }
+        host |= is_field(name, "host");
+        if (req->nheaders == HTTP_MAX_HEADERS) {
+            too_many = 1;
+            continue;
+        }
+        req->headers[req->nheaders++] = f[i];
+    }
+    if (req->method.ptr == NULL || scheme.ptr == NULL ||
+        req->uri.ptr == NULL || req->uri.len == 0) {
+        return -1;
+    }
+    if (!host && authority.ptr != NULL) {
+        if (req->nheaders == HTTP_MAX_HEADERS) {
+            too_many = 1;
+        } else {
+            req->headers[req->nheaders].name = (struct http_str){"Host", 4};
+            req->headers[req->nheaders].value = authority;
+            req->nheaders++;
+        }
+    }
+    req->version = (struct http_str){"HTTP/2.0", 8};
+    // Nothing that answers a stream may frame the body itself
+    req->minor_version = 0;
+    return too_many;
+}
+
+static void dispatch(struct h2_session *s, struct h2_stream *st,
+                     const struct http_request *req, int too_large) {
+    st->head_only =
+        req->method.len == 4 && memcmp(req->method.ptr, "HEAD", 4) == 0;
+    http_process_stream(&st->c, req, too_large, !st->remote_closed);
+    // What it queued may outlive the worker's next quiescent state
+    conn_pin(&st->c);
+    if (++s->c->requests >= config.max_requests) {
+        s->goaway_wanted = 1;
+    }
+}
+
+// The request body ended
+static void body_end(struct h2_session *s, struct h2_stream *st) {
+    st->remote_closed = 1;
+    if (st->c.body_left > 0) {
+        // Shorter than its Content-Length
+        reset_stream(s, st, H2_PROTOCOL_ERROR);
+    }
+}
+
+// A header block is complete: start its stream
+static int on_request(struct h2_session *s, const uint8_t *block,
+                      size_t len) {
+    struct http_header fields[FIELDS_MAX];
+    int truncated;
+    int n = hpack_decode(&s->dec, block, len, fields, FIELDS_MAX, s->fields,
+                         config.max_header_size, &truncated);
+    if (n < 0) {
+        return conn_error(s, H2_COMPRESSION_ERROR);
+    }
+    uint32_t id = s->block_id;
+    int end_stream = s->block_flags & FLAG_END_STREAM;
+    if (id <= s->last_id) {
+        struct h2_stream *st = find(s, id);
+        if (st == NULL) {
+            send_rst(s, id, H2_STREAM_CLOSED);
+        } else if (!st->remote_closed && end_stream) {
+            // Trailers, which nothing looks at
+            body_end(s, st);
+        } else {
+            reset_stream(s, st, H2_PROTOCOL_ERROR);
+        }
+        return 0;
+    }
+    s->last_id = id;
+    if (s->goaway_sent) {
+        // Beyond the last stream we said we would answer
+        return 0;
+    }
+    if (s->nstreams >= STREAMS_MAX) {
+        send_rst(s, id, H2_REFUSED_STREAM);
+        return 0;
+    }
+
+    struct http_request req;
+    int r = make_request(fields, n, &req);
+    if (r < 0) {
+        send_rst(s, id, H2_PROTOCOL_ERROR);
+        return 0;
+    }
+    struct h2_stream *st = open_stream(s, id);
+    if (st == NULL) {
+        send_rst(s, id, H2_REFUSED_STREAM);
+        return 0;
+    }
+    if (s->block_priority) {
+        set_priority(s, st, s->block_dep, s->block_exclusive,
+                     s->block_weight);
+    }
+    st->remote_closed = end_stream != 0;
+    dispatch(s, st, &req, r > 0 || truncated);
+    return 0;
+}
+
+// Strip the padding of a PADDED frame
+static int unpad(uint8_t flags, const uint8_t **p, const uint8_t **end) {
+    if (!(flags & FLAG_PADDED)) {
+        return 0;
+    }
+    if (*p == *end) {
+        return -1;
+    }
+    size_t pad = *(*p)++;
+    if (pad > (size_t)(*end - *p)) {
+        return -1;
+    }
+    *end -= pad;
+    return 0;
+}
+
+static int on_headers(struct h2_session *s, uint8_t flags, uint32_t id,
+                      const uint8_t *p, size_t len) {
+    const uint8_t *end = p + len;
+    if (id == 0 || !(id & 1) || unpad(flags, &p, &end) != 0) {
+        return conn_error(s, H2_PROTOCOL_ERROR);
+    }
+    s->block_priority = 0;
+    if (flags & FLAG_PRIORITY) {
+        if (end - p < 5) {
+            return conn_error(s, H2_PROTOCOL_ERROR);
+        }
+        uint32_t dep = get32(p);
+        s->block_priority = (dep & 0x7fffffff) != id;
+        s->block_exclusive = dep >> 31;
+        s->block_dep = dep & 0x7fffffff;
+        s->block_weight = p[4] + 1;
+        p += 5;
+    }
+    s->block_id = id;
+    s->block_flags = flags;
+    if (flags & FLAG_END_HEADERS) {
+        return on_request(s, p, end - p);
+    }
+    if (s->block == NULL && (s->block = malloc(BLOCK_MAX)) == NULL) {
+        perror("webserver (malloc)");
+        return conn_error(s, H2_INTERNAL_ERROR);
+    }
+    memcpy(s->block, p, end - p);
+    s->block_len = end - p;
+    s->in_block = 1;
+    return 0;
+}
+
+static int on_continuation(struct h2_session *s, uint8_t flags, uint32_t id,
+                           const uint8_t *p, size_t len) {
+    if (!s->in_block || id != s->block_id) {
+        return conn_error(s, H2_PROTOCOL_ERROR);
+    }
+    if (s->block_len + len > BLOCK_MAX) {
+        return conn_error(s, H2_ENHANCE_YOUR_CALM);
+    }
+    memcpy(s->block + s->block_len, p, len);
+    s->block_len += len;
+    if (!(flags & FLAG_END_HEADERS)) {
+        return 0;
+    }
+    s->in_block = 0;
+    return on_request(s, s->block, s->block_len);
+}
+
+static int on_data(struct h2_session *s, uint8_t flags, uint32_t id,
+                   const uint8_t *p, size_t len) {
+    const uint8_t *end = p + len;
+    if (id == 0 || unpad(flags, &p, &end) != 0) {
+        return conn_error(s, H2_PROTOCOL_ERROR);
+    }
+    // The padding counts against the windows as well
+    if ((int32_t)len > s->recv_window) {
+        return conn_error(s, H2_FLOW_CONTROL_ERROR);
+    }
+    s->recv_window -= len;
+    if (s->recv_window < WINDOW_DEFAULT / 2) {
+        send_window_update(s, 0, WINDOW_DEFAULT - s->recv_window);
+        s->recv_window = WINDOW_DEFAULT;
+    }
+
+    struct h2_stream *st = find(s, id);
+    if (st == NULL || st->reset) {
+        // Still on its way when we dropped the stream
+        return id > s->last_id ? conn_error(s, H2_PROTOCOL_ERROR) : 0;
+    }
+    if (st->remote_closed) {
+        reset_stream(s, st, H2_STREAM_CLOSED);
+        return 0;
+    }
+    if ((int32_t)len > st->recv_window) {
+        reset_stream(s, st, H2_FLOW_CONTROL_ERROR);
+        return 0;
+    }
+    st->recv_window -= len;
+
+    // Only what Content-Length announced goes to a backend
+    struct conn *sc = &st->c;
+    size_t n = end - p;
+    if (n > sc->body_left) {
+        n = (size_t)sc->body_left;
+    }
+    if (sc->proxy != NULL && n > 0) {
+        upstream_body(sc, (const char *)p, n);
+    }
+    sc->body_left -= n;
+
+    if (flags & FLAG_END_STREAM) {
+        body_end(s, st);
+    } else if (st->recv_window < WINDOW_DEFAULT / 2) {
+        send_window_update(s, id, WINDOW_DEFAULT - st->recv_window);
+        st->recv_window = WINDOW_DEFAULT;
+    }
+    return 0;
+}
+
+static int on_priority(struct h2_session *s, uint32_t id, const uint8_t *p,
+                       size_t len) {
+    if (id == 0) {
+        return conn_error(s, H2_PROTOCOL_ERROR);
+    }
+    if (len != 5) {
+        send_rst(s, id, H2_FRAME_SIZE_ERROR);
+        return 0;
+    }
+    // Priorities of streams not open yet are not remembered
+    struct h2_stream *st = find(s, id);
+    uint32_t dep = get32(p);
+    if (st != NULL) {
+        set_priority(s, st, dep & 0x7fffffff, dep >> 31, p[4] + 1);
+    }
+    return 0;
+}
+
+static int on_rst_stream(struct h2_session *s, uint32_t id, size_t len) {
+    if (id == 0) {
+        return conn_error(s, H2_PROTOCOL_ERROR);
+    }
+    if (len != 4) {
+        return conn_error(s, H2_FRAME_SIZE_ERROR);
+    }
+    struct h2_stream *st = find(s, id);
+    if (st != NULL) {
+        st->reset = 1;
+    } else if (id > s->last_id) {
+        return conn_error(s, H2_PROTOCOL_ERROR);
+    }
+    return 0;
+}
+
+static int apply_settings(struct h2_session *s, const uint8_t *p,
+                          size_t len) {
+    for (size_t i = 0; i + 6 <= len; i += 6) {
+        unsigned key = p[i] << 8 | p[i + 1];
+        uint32_t value = get32(p + i + 2);
+        switch (key) {
+        case SETTINGS_HEADER_TABLE_SIZE:
+            hpack_encoder_resize(&s->enc, value < HPACK_TABLE_SIZE
+                                              ? value
+                                              : HPACK_TABLE_SIZE);
+            break;
+        case SETTINGS_ENABLE_PUSH:
+            // We never push anyway
+            if (value > 1) {
+                return conn_error(s, H2_PROTOCOL_ERROR);
+            }
+            break;
+        case SETTINGS_INITIAL_WINDOW_SIZE: {
+            if (value > WINDOW_MAX) {
+                return conn_error(s, H2_FLOW_CONTROL_ERROR);
+            }
+            // Every open stream's window moves by the difference
+            int64_t delta = (int64_t)value - s->initial_window;
+            for (struct h2_stream *st = s->streams; st != NULL;
+                 st = st->next) {
+                if (st->send_window + delta > WINDOW_MAX) {
+                    return conn_error(s, H2_FLOW_CONTROL_ERROR);
+                }
+                st->send_window += delta;
+            }
+            s->initial_window = value;
+            break;
+        }
+        case SETTINGS_MAX_FRAME_SIZE:
+            if (value < FRAME_MAX || value > 0xffffff) {
+                return conn_error(s, H2_PROTOCOL_ERROR);
+            }
+            s->frame_max = value < FRAME_SEND_MAX ? value : FRAME_SEND_MAX;
+            break;
+        default:
+            // SETTINGS_MAX_CONCURRENT_STREAMS is for pushed streams, and
+            // the list size is advisory, as are settings we do not know
+            break;
+        }
+    }
+    return 0;
+}
+
+static int on_settings(struct h2_session *s, uint8_t flags, uint32_t id,
+                       const uint8_t *p, size_t len) {
+    if (id != 0) {
+        return conn_error(s, H2_PROTOCOL_ERROR);
+    }
+    if (flags & FLAG_ACK) {
+        return len == 0 ? 0 : conn_error(s, H2_FRAME_SIZE_ERROR);
+    }
+    if (len % 6 != 0) {
+        return conn_error(s, H2_FRAME_SIZE_ERROR);
+    }
+    if (apply_settings(s, p, len) != 0) {
+        return -1;
+    }
+    ctrl_frame(s, 0, FRAME_SETTINGS, FLAG_ACK, 0);
+    return 0;
+}
+
+static int on_ping(struct h2_session *s, uint8_t flags, uint32_t id,
+                   const uint8_t *p, size_t len) {
+    if (id != 0) {
+        return conn_error(s, H2_PROTOCOL_ERROR);
+    }
+    if (len != 8) {
+        return conn_error(s, H2_FRAME_SIZE_ERROR);
+    }
+    if (!(flags & FLAG_ACK)) {
+        uint8_t *q = ctrl_frame(s, 8, FRAME_PING, FLAG_ACK, 0);
+        if (q != NULL) {
+            memcpy(q, p, 8);
+        }
+    }
+    return 0;
+}
+
+static int on_window_update(struct h2_session *s, uint32_t id,
+                            const uint8_t *p, size_t len) {
+    if (len != 4) {
+        return conn_error(s, H2_FRAME_SIZE_ERROR);
+    }
+    uint32_t increment = get32(p) & 0x7fffffff;
+    if (id == 0) {
+        if (increment == 0) {
+            return conn_error(s, H2_PROTOCOL_ERROR);
+        }
+        if ((int64_t)s->send_window + increment > WINDOW_MAX) {
+            return conn_error(s, H2_FLOW_CONTROL_ERROR);
+        }
+        s->send_window += increment;
+        return 0;
+    }
+    struct h2_stream *st = find(s, id);
+    if (st == NULL) {
+        return id > s->last_id ? conn_error(s, H2_PROTOCOL_ERROR) : 0;
+    }
+    if (increment == 0) {
+        reset_stream(s, st, H2_PROTOCOL_ERROR);
+    } else if ((int64_t)st->send_window + increment > WINDOW_MAX) {
+        reset_stream(s, st, H2_FLOW_CONTROL_ERROR);
+    } else {
+        st->send_window += increment;
+    }
+    return 0;
+}
+
+static int on_frame(struct h2_session *s, uint8_t type, uint8_t flags,
+                    uint32_t id, const uint8_t *p, size_t len) {
+    if (s->in_block && type != FRAME_CONTINUATION) {
+        return conn_error(s, H2_PROTOCOL_ERROR);
+    }
+    switch (type) {
+    case FRAME_DATA:
+        return on_data(s, flags, id, p, len);
+    case FRAME_HEADERS:
+        return on_headers(s, flags, id, p, len);
+    case FRAME_PRIORITY:
+        return on_priority(s, id, p, len);
+    case FRAME_RST_STREAM:
+        return on_rst_stream(s, id, len);
+    case FRAME_SETTINGS:
+        return on_settings(s, flags, id, p, len);
+    case FRAME_PUSH_PROMISE:
+        // Only servers push
+        return conn_error(s, H2_PROTOCOL_ERROR);
+    case FRAME_PING:
+        return on_ping(s, flags, id, p, len);
+    case FRAME_GOAWAY:
+        if (id != 0) {
+            return conn_error(s, H2_PROTOCOL_ERROR);
+        }
+        // The streams it started are still answered
+        s->peer_goaway = 1;
+        return 0;
+    case FRAME_WINDOW_UPDATE:
+        return on_window_update(s, id, p, len);
+    case FRAME_CONTINUATION:
+        return on_continuation(s, flags, id, p, len);
+    default:
+        // Unknown frame types are ignored
+        return 0;
+    }
+}
+
+int h2_process(struct conn *c) {
+    struct h2_session *s = c->h2;
+    size_t off = 0;
+    int progress = 0;
+    if (c->len == 0) {
+        return 0;
+    }
+    if (!s->preface && !s->failed) {
+        size_t n = c->len < PREFACE_LEN ? c->len : PREFACE_LEN;
+        if (memcmp(c->buffer, PREFACE, n) != 0) {
+            conn_error(s, H2_PROTOCOL_ERROR);
+        } else if (n < PREFACE_LEN) {
+            return 0;
+        } else {
+            s->preface = 1;
+            off = PREFACE_LEN;
+            progress++;
+        }
+    }
+    while (!s->failed && s->ctrl_len <= CTRL_SIZE / 2 &&
+           c->len - off >= FRAME_HEADER) {
+        const uint8_t *p = (const uint8_t *)c->buffer + off;
+        size_t len = (size_t)p[0] << 16 | p[1] << 8 | p[2];
+        if (len > FRAME_MAX) {
+            conn_error(s, H2_FRAME_SIZE_ERROR);
+            break;
+        }
+        if (c->len - off < FRAME_HEADER + len) {
+            break;
+        }
+        on_frame(s, p[3], p[4], get32(p + 5) & 0x7fffffff, p + FRAME_HEADER,
+                 len);
+        off += FRAME_HEADER + len;
+        progress++;
+    }
+    if (s->failed) {
+        // Nothing more is looked at
+        off = c->len;
+    }
+    if (off > 0) {
+        memmove(c->buffer, c->buffer + off, c->len - off);
+        c->len -= off;
+    }
+    return progress;
+}
+
+// Bytes of the arena for the batch, or NULL once it is full
+static uint8_t *arena_take(struct h2_session *s, size_t len) {
+    if (s->arena_len + len > ARENA_SIZE) {
+        return NULL;
+    }
+    uint8_t *p = s->arena + s->arena_len;
+    s->arena_len += len;
+    return p;
+}
+
+// Queue len bytes of the arena at p, as part of the segment before if it
+// ends there. The caller makes sure of a free slot.
+static void arena_queue(struct h2_session *s, uint8_t *p, size_t len) {
+    struct conn *c = s->c;
+    if (c->iovcnt > 0) {
+        struct iovec *last = &c->iov[c->iovcnt - 1];
+        if (last->iov_base != NULL && c->owner[c->iovcnt - 1] == NULL &&
+            (uint8_t *)last->iov_base + last->iov_len == p) {
+            last->iov_len += len;
+            return;
+        }
+    }
+    conn_queue(c, p, len, NULL);
+}
+
+static void flush_ctrl(struct h2_session *s) {
+    if (s->ctrl_len == 0 || conn_queue_space(s->c) == 0) {
+        return;
+    }
+    uint8_t *p = arena_take(s, s->ctrl_len);
+    if (p == NULL) {
+        return;
+    }
+    memcpy(p, s->ctrl, s->ctrl_len);
+    arena_queue(s, p, s->ctrl_len);
+    s->ctrl_len = 0;
+}
+
+// Is part of st's queue not framed yet?
+static int pending(const struct h2_stream *st) {
+    return st->seg < st->c.iovcnt;
+}
+
+// Is all of st's response queued and framed?
+static int complete(const struct h2_stream *st) {
+    return !pending(st) && st->c.stream == NULL && st->c.proxy == NULL;
+}
+
+// Move past n bytes of st's queue, and past empty segments
+static void advance(struct h2_stream *st, size_t n) {
+    st->seg_off += n;
+    st->carved += n;
+    while (pending(st) && st->seg_off == st->c.iov[st->seg].iov_len) {
+        st->seg++;
+        st->seg_off = 0;
+    }
+}
+
+// Skip the rest of the body of a HEAD request
+static void drop_body(struct h2_stream *st) {
+    while (pending(st)) {
+        advance(st, st->c.iov[st->seg].iov_len - st->seg_off);
+    }
+}
+
+// st has sent bytes worth of frames; the more weight, the sooner it is
+// its turn again
+static void account(struct h2_session *s, struct h2_stream *st,
+                    size_t bytes) {
+    s->vclock = st->vtime;
+    st->vtime += (uint64_t)bytes * 256 / st->weight;
+}
+
+// Frame the HTTP/1 head the handler queued as HEADERS, and CONTINUATION
+// frames if the client takes smaller frames than the block. Returns -1
+// if it has to wait for a batch with more room.
+static int frame_head(struct h2_session *s, struct h2_stream *st) {
+    struct conn *sc = &st->c;
+    advance(st, 0);
+    const char *head = NULL, *end = NULL;
+    if (pending(st) && sc->iov[st->seg].iov_base != NULL) {
+        head = (const char *)sc->iov[st->seg].iov_base + st->seg_off;
+        end = memmem(head, sc->iov[st->seg].iov_len - st->seg_off,
+                     "\r\n\r\n", 4);
+    }
+    if (end == NULL || end - head < 12 || memcmp(head, "HTTP/1.", 7) != 0) {
+        reset_stream(s, st, H2_INTERNAL_ERROR);
+        return 0;
+    }
+    int status = 0;
+    for (int i = 9; i < 12; i++) {
+        status = status * 10 + (head[i] - '0');
+    }
+    size_t head_len = end + 4 - head;
+
+    // Encoded, every line grows by at most eight bytes
+    size_t lines = 0;
+    for (const char *q = head; (q = memchr(q, '\n', end + 4 - q)) != NULL;
+         q++) {
+        lines++;
+    }
+    size_t bound = head_len + 8 * lines + 16;
+    size_t need = bound + (bound / s->frame_max + 1) * FRAME_HEADER;
+    if (need > ARENA_SIZE - CTRL_SIZE) {
+        reset_stream(s, st, H2_INTERNAL_ERROR);
+        return 0;
+    }
+    if (s->arena_len + need > ARENA_SIZE) {
+        return -1;
+    }
+
+    uint8_t *start = s->arena + s->arena_len;
+    uint8_t *p = hpack_encode_status(&s->enc, start + FRAME_HEADER, status);
+    const char *line = (const char *)memchr(head, '\n', head_len) + 1;
+    while (line < end + 2) {
+        const char *eol = memchr(line, '\n', end + 4 - line);
+        const char *colon = memchr(line, ':', eol - line);
+        if (colon != NULL && !connection_specific(line, colon - line)) {
+            const char *value = colon + 1;
+            const char *value_end = eol;
+            while (value < value_end && (*value == ' ' || *value == '\t')) {
+                value++;
+            }
+            while (value_end > value &&
+                   (value_end[-1] == '\r' || value_end[-1] == ' ')) {
+                value_end--;
+            }
+            p = hpack_encode_field(&s->enc, p, line, colon - line, value,
+                                   value_end - value);
+        }
+        line = eol + 1;
+    }
+    size_t block_len = p - (start + FRAME_HEADER);
+
+    advance(st, head_len);
+    st->head_sent = 1;
+    if (st->head_only) {
+        drop_body(st);
+    }
+    uint8_t flags = 0;
+    if (complete(st)) {
+        flags = FLAG_END_STREAM;
+        st->end_sent = 1;
+    }
+
+    // Split from the back, so every part moves over bytes already moved
+    size_t max = s->frame_max;
+    size_t nframes = (block_len + max - 1) / max;
+    for (size_t k = nframes - 1; k > 0; k--) {
+        uint8_t *src = start + FRAME_HEADER + k * max;
+        uint8_t *dst = src + k * FRAME_HEADER;
+        size_t part = block_len - k * max < max ? block_len - k * max : max;
+        memmove(dst, src, part);
+        frame_header(dst - FRAME_HEADER, part, FRAME_CONTINUATION,
+                     k == nframes - 1 ? FLAG_END_HEADERS : 0, st->id);
+    }
+    frame_header(start, nframes == 1 ? block_len : max, FRAME_HEADERS,
+                 flags | (nframes == 1 ? FLAG_END_HEADERS : 0), st->id);
+    size_t total = block_len + nframes * FRAME_HEADER;
+    s->arena_len += total;
+    arena_queue(s, start, total);
+    account(s, st, total);
+    return 0;
+}
+
+// Frame as much of the next segment of st's queue as one DATA frame and
+// the windows take. Small payloads are copied next to the frame header,
+// larger ones queued where they are, with their owner.
+static int frame_data(struct h2_session *s, struct h2_stream *st) {
+    struct conn *sc = &st->c;
+    int i = st->seg;
+    size_t n = sc->iov[i].iov_len - st->seg_off;
+    if (n > s->frame_max) {
+        n = s->frame_max;
+    }
+    if (n > (size_t)st->send_window) {
+        n = st->send_window;
+    }
+    if (n > (size_t)s->send_window) {
+        n = s->send_window;
+    }
+    int copy = sc->iov[i].iov_base != NULL && n <= COPY_MAX;
+    uint8_t *p = arena_take(s, FRAME_HEADER + (copy ? n : 0));
+    if (p == NULL) {
+        return -1;
+    }
+    if (copy) {
+        memcpy(p + FRAME_HEADER, (char *)sc->iov[i].iov_base + st->seg_off,
+               n);
+        arena_queue(s, p, FRAME_HEADER + n);
+    } else {
+        arena_queue(s, p, FRAME_HEADER);
+        if (sc->iov[i].iov_base == NULL) {
+            conn_queue_file(s->c, sc->file[i].fd,
+                            sc->file[i].off + st->seg_off, n, sc->owner[i]);
+        } else {
+            conn_queue(s->c, (char *)sc->iov[i].iov_base + st->seg_off, n,
+                       sc->owner[i]);
+        }
+    }
+    st->send_window -= n;
+    s->send_window -= n;
+    advance(st, n);
+    uint8_t flags = 0;
+    if (complete(st)) {
+        flags = FLAG_END_STREAM;
+        st->end_sent = 1;
+    }
+    frame_header(p, n, FRAME_DATA, flags, st->id);
+    account(s, st, FRAME_HEADER + n);
+    return 0;
+}
+
+// The body ended after its last DATA frame went out
+static int frame_end(struct h2_session *s, struct h2_stream *st) {
+    uint8_t *p = arena_take(s, FRAME_HEADER);
+    if (p == NULL) {
+        return -1;
+    }
+    frame_header(p, 0, FRAME_DATA, FLAG_END_STREAM, st->id);
+    arena_queue(s, p, FRAME_HEADER);
+    st->end_sent = 1;
+    account(s, st, FRAME_HEADER);
+    return 0;
+}
+
+static int has_frame(const struct h2_session *s, const struct h2_stream *st) {
+    if (st->reset || st->end_sent) {
+        return 0;
+    }
+    if (!st->head_sent) {
+        return pending(st) || complete(st);
+    }
+    if (pending(st)) {
+        return st->head_only || (st->send_window > 0 && s->send_window > 0);
+    }
+    return complete(st);
+}
+
+// The stream whose frame goes next: of those with one to send and no
+// ancestor with one, the one with the lowest virtual time. Each frame
+// moves a stream's clock on by its size over its weight, which shares the
+// connection among siblings by weight, as RFC 7540 section 5.3 describes
+// for a tree of streams; parents go first.
+static struct h2_stream *pick(struct h2_session *s) {
+    for (struct h2_stream *st = s->streams; st != NULL; st = st->next) {
+        st->ready = has_frame(s, st);
+    }
+    struct h2_stream *best = NULL;
+    for (struct h2_stream *st = s->streams; st != NULL; st = st->next) {
+        if (!st->ready || (best != NULL && st->vtime >= best->vtime)) {
+            continue;
+        }
+        int blocked = 0, depth = 0;
+        for (struct h2_stream *d = st->dep; d != NULL && depth < STREAMS_MAX;
+             d = d->dep, depth++) {
+            if (d->ready) {
+                blocked = 1;
+                break;
+            }
+        }
+        if (!blocked) {
+            best = st;
+        }
+    }
+    return best;
+}
+
+static int frame_stream(struct h2_session *s, struct h2_stream *st) {
+    if (!st->head_sent) {
+        return frame_head(s, st);
+    }
+    if (st->head_only) {
+        drop_body(st);
+        if (!complete(st)) {
+            return 0;
+        }
+    }
+    if (pending(st)) {
+        return frame_data(s, st);
+    }
+    return frame_end(s, st);
+}
+
+// Everything queued on c has been sent: so are the parts of the streams'
+// queues the frames pointed at. Streams that are done are freed, and the
+// others' producers run once their queue is empty, like on a connection
+// of their own.
+static void retire(struct h2_session *s) {
+    struct h2_stream *next;
+    for (struct h2_stream *st = s->streams; st != NULL; st = next) {
+        struct conn *sc = &st->c;
+        next = st->next;
+        if (st->carved > 0) {
+            conn_written(sc, st->carved);
+            st->carved = 0;
+            st->seg = sc->iovpos;
+            st->seg_off = 0;
+        }
+        if (st->end_sent && !st->remote_closed) {
+            // Answered; the rest of the request body is not wanted
+            reset_stream(s, st, H2_NO_ERROR);
+        }
+        if (st->reset || st->end_sent) {
+            free_stream(s, st);
+            continue;
+        }
+        if (sc->iovpos == sc->iovcnt) {
+            int more = 0;
+            if (sc->stream != NULL) {
+                more = stream_pump(sc);
+            } else if (sc->proxy != NULL) {
+                more = upstream_pump(sc);
+            }
+            if (more < 0) {
+                reset_stream(s, st, H2_INTERNAL_ERROR);
+                continue;
+            }
+        }
+        conn_pin(sc);
+    }
+}
+
+int h2_pump(struct conn *c) {
+    struct h2_session *s = c->h2;
+    if (c->iovcnt > 0) {
+        return 0;
+    }
+    retire(s);
+    s->arena_len = 0;
+    if (!s->failed) {
+        if ((s->goaway_wanted || c->w->draining) && !s->goaway_sent) {
+            send_goaway(s, H2_NO_ERROR);
+        }
+        flush_ctrl(s);
+        struct h2_stream *st;
+        while (conn_queue_space(c) >= 3 && (st = pick(s)) != NULL) {
+            if (frame_stream(s, st) != 0) {
+                break;
+            }
+        }
+    }
+    // Including what the streams had to say meanwhile
+    flush_ctrl(s);
+    if (s->failed ||
+        ((s->goaway_sent || s->peer_goaway) && s->nstreams == 0)) {
+        c->close_after_write = 1;
+    }
+    if (c->iovcnt == 0) {
+        return 0;
+    }
+    c->write_start = metric_clock();
+    return 1;
+}
+
+int h2_detect(const struct conn *c) {
+    if (config.io != IO_EPOLL) {
+        return 0;
+    }
+    if (c->tls != NULL) {
+        return tls_alpn_h2(c);
+    }
+    size_t n = c->len < PREFACE_LEN ? c->len : PREFACE_LEN;
+    if (n == 0 || memcmp(c->buffer, PREFACE, n) != 0) {
+        return 0;
+    }
+    return n == PREFACE_LEN ? 1 : -1;
+}
+
+int h2_start(struct conn *c) {
+    struct h2_session *s = calloc(1, sizeof(*s));
+    if (s == NULL || (s->fields = malloc(config.max_header_size)) == NULL) {
+        perror("webserver (malloc)");
+        free(s);
+        return -1;
+    }
+    s->c = c;
+    s->send_window = s->recv_window = s->initial_window = WINDOW_DEFAULT;
+    s->frame_max = FRAME_MAX;
+    hpack_decoder_init(&s->dec);
+    hpack_encoder_init(&s->enc);
+
+    // The server's preface; the defaults do for everything else
+    uint8_t *p = ctrl_frame(s, 12, FRAME_SETTINGS, 0, 0);
+    p[0] = 0;
+    p[1] = SETTINGS_MAX_CONCURRENT_STREAMS;
+    put32(p + 2, STREAMS_MAX);
+    p[6] = 0;
+    p[7] = SETTINGS_MAX_HEADER_LIST_SIZE;
+    put32(p + 8, config.max_header_size);
+
+    c->h2 = s;
+    metric_add(&c->w->metrics.h2_sessions, 1);
+    return 0;
+}
+
+static int base64url_decode(const char *in, size_t len, uint8_t *out,
+                            size_t cap) {
+    uint32_t bits = 0;
+    int nbits = 0;
+    size_t n = 0;
+    for (size_t i = 0; i < len && in[i] != '='; i++) {
+        char ch = in[i];
+        int v;
+        if (ch >= 'A' && ch <= 'Z') {
+            v = ch - 'A';
+        } else if (ch >= 'a' && ch <= 'z') {
+            v = ch - 'a' + 26;
+        } else if (ch >= '0' && ch <= '9') {
+            v = ch - '0' + 52;
+        } else if (ch == '-') {
+            v = 62;
+        } else if (ch == '_') {
+            v = 63;
+        } else {
+            return -1;
+        }
+        bits = bits << 6 | v;
+        nbits += 6;
+        if (nbits >= 8) {
+            nbits -= 8;
+            if (n == cap) {
+                return -1;
+            }
+            out[n++] = bits >> nbits;
+        }
+    }
+    return (int)n;
+}
+
+int h2_upgrade(struct conn *c, const struct http_request *req) {
+    static const char switching[] = "HTTP/1.1 101 Switching Protocols\r\n"
+                                    "Connection: Upgrade\r\n"
+                                    "Upgrade: h2c\r\n\r\n";
+    if (config.io != IO_EPOLL || c->tls != NULL || req->minor_version != 1) {
+        return 0;
+    }
+    const struct http_str *upgrade = http_header_get(req, "Upgrade");
+    const struct http_str *settings = http_header_get(req, "HTTP2-Settings");
+    if (upgrade == NULL || settings == NULL ||
+        !http_has_token(upgrade, "h2c")) {
+        return 0;
+    }
+    uint8_t raw[256];
+    int n = base64url_decode(settings->ptr, settings->len, raw, sizeof(raw));
+    if (n < 0 || n % 6 != 0 || h2_start(c) != 0) {
+        return 0;
+    }
+    struct h2_session *s = c->h2;
+    if (apply_settings(s, raw, n) != 0) {
+        // Answered over HTTP/1.1 instead
+        h2_free(c);
+        return 0;
+    }
+    if (c->iovcnt == 0) {
+        c->write_start = metric_clock();
+    }
+    conn_queue(c, switching, sizeof(switching) - 1, NULL);
+
+    // The request itself becomes stream 1, with nothing more to come
+    s->last_id = 1;
+    struct h2_stream *st = open_stream(s, 1);
+    if (st == NULL) {
+        send_rst(s, 1, H2_REFUSED_STREAM);
+        return 1;
+    }
+    struct http_request r = *req;
+    r.nheaders = 0;
+    for (unsigned i = 0; i < req->nheaders; i++) {
+        const struct http_str *name = &req->headers[i].name;
+        if (!connection_specific(name->ptr, name->len) &&
+            !(name->len == 14 &&
+              strncasecmp(name->ptr, "HTTP2-Settings", 14) == 0)) {
+            r.headers[r.nheaders++] = req->headers[i];
+        }
+    }
+    r.version = (struct http_str){"HTTP/2.0", 8};
+    r.minor_version = 0;
+    st->remote_closed = 1;
+    dispatch(s, st, &r, 0);
+    return 1;
+}
+
+int h2_timeout(struct conn *c, int expired) {
+    struct h2_session *s = c->h2;
+    if (c->w->draining) {
+        s->goaway_wanted = 1;
+    }
+    if (!expired) {
+        return 0;
+    }
+    // A client too slow to take its frames, or a session idle for too long
+    if (c->iovpos < c->iovcnt || !h2_proxying(c)) {
+        return -1;
+    }
+    for (struct h2_stream *st = s->streams; st != NULL; st = st->next) {
+        if (st->c.proxy != NULL && !st->reset &&
+            upstream_timeout(&st->c) != 0) {
+            // Cut short after its head
+            reset_stream(s, st, H2_CANCEL);
+        }
+    }
+    return 0;
+}
+
+int h2_proxying(const struct conn *c) {
+    if (c->h2 == NULL) {
+        return 0;
+    }
+    for (struct h2_stream *st = c->h2->streams; st != NULL; st = st->next) {
+        if (st->c.proxy != NULL) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+unsigned h2_open_streams(const struct conn *c) {
+    return c->h2 != NULL ? c->h2->nstreams : 0;
+}
+
+void h2_free(struct conn *c) {
+    struct h2_session *s = c->h2;
+    if (s == NULL) {
+        return;
+    }
+    while (s->streams != NULL) {
+        free_stream(s, s->streams);
+    }
+    free(s->block);
+    free(s->fields);
+    free(s);
+    c->h2 = NULL;
+}
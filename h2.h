@@ -0,0 +1,62 @@
+#ifndef WEBSERVER_H2_H
+#define WEBSERVER_H2_H
+
+#include "conn.h"
+#include "http_parser.h"
+
+// HTTP/2 (RFC 7540) on the epoll backend: negotiated with ALPN over TLS,
+// or in the clear with the connection preface (prior knowledge) or an
+// Upgrade: h2c request.
+//
+// Every stream is answered by the handlers HTTP/1 requests go to. A
+// stream has a connection of its own that never touches a socket: the
+// handler queues its response there as usual, and the session frames what
+// is queued into the write queue of the real connection, the response
+// head as a HEADERS frame encoded with HPACK and the body as DATA frames
+// that point at the segments the handler queued, files included. Streams
+// take turns by their priority; whatever they have queued once the socket
+// has taken the previous batch goes out together, behind the control
+// frames that piled up meanwhile.
+
+struct h2_session;
+
+// Does c start with HTTP/2? Looks at the ALPN protocol of a TLS
+// connection and at the first bytes of a clear one. Returns 1 if so, 0 if
+// not and -1 if too few bytes arrived to tell.
+int h2_detect(const struct conn *c);
+
+// Make c an HTTP/2 connection, with our SETTINGS queued as the server's
+// preface. Returns -1 if no session could be had.
+int h2_start(struct conn *c);
+
+// Switch c to HTTP/2 if req asks for it with Upgrade: h2c: queue the 101,
+// start the session and answer req, which has no body, as stream 1.
+// Returns 1 if it did.
+int h2_upgrade(struct conn *c, const struct http_request *req);
+
+// Handle every complete frame buffered on c, starting the streams whose
+// requests are complete. Returns non-zero if anything was consumed.
+int h2_process(struct conn *c);
+
+// Called by the event loop once the write queue of c is empty: finish
+// what it held, let the streams produce more and queue the next batch of
+// frames. Returns 1 if c has been given more to write, 0 if not. Sets
+// close_after_write once the session is over.
+int h2_pump(struct conn *c);
+
+// c's timer came up because its deadline passed (expired) or the worker
+// drains. Streams waiting for a backend time out like their HTTP/1
+// counterparts, and a draining session says GOAWAY. Returns -1 if c has
+// to be closed instead.
+int h2_timeout(struct conn *c, int expired);
+
+// Has c a stream waiting for its backend? 0 for HTTP/1 connections.
+int h2_proxying(const struct conn *c);
+
+// Streams open on c, 0 for HTTP/1 connections
+unsigned h2_open_streams(const struct conn *c);
+
+// Drop the session of c, if any, with all of its streams
+void h2_free(struct conn *c);
+
+#endif
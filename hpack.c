@@ -0,0 +1,572 @@
+#include <string.h>
+#include <strings.h>
+#include <sys/types.h>
+
+#include "hpack.h"
+
+#define STATIC_ENTRIES 61
+#define HUFFMAN_EOS 256
+#define HUFFMAN_LEN_MAX 30
+
+// Code length of every symbol of the Huffman code of RFC 7541 appendix B,
+// EOS last. The code is canonical, so the codes follow from the lengths.
+static const uint8_t huffman_len[257] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+    30,
+};
+
+static uint32_t huffman_code[257];
+
+// Canonical decoding: the codes of one length are consecutive, starting
+// at first_code[], and their symbols are listed in order from first_sym[]
+static uint32_t first_code[HUFFMAN_LEN_MAX + 1];
+static uint16_t first_sym[HUFFMAN_LEN_MAX + 1];
+static uint16_t len_count[HUFFMAN_LEN_MAX + 1];
+static uint16_t sorted_syms[257];
+
+static const struct {
+    const char *name;
+    const char *value;
+} static_table[STATIC_ENTRIES + 1] = {
+    {NULL, NULL},
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""},
+};
+
+// The fields our own responses are made of, by the static index of their
+// name
+static const struct {
+    uint8_t name_index;
+    const char *value;
+} fixed_fields[] = {
+    {54, "webserver-c"},
+    {31, "text/html"},
+    {31, "text/plain"},
+    {31, "text/css"},
+    {31, "text/javascript"},
+    {31, "application/json"},
+    {31, "application/xml"},
+    {31, "application/octet-stream"},
+    {31, "application/wasm"},
+    {31, "application/pdf"},
+    {31, "image/svg+xml"},
+    {31, "image/png"},
+    {31, "image/jpeg"},
+    {31, "image/gif"},
+    {31, "image/webp"},
+    {31, "image/x-icon"},
+    {31, "font/woff2"},
+    {31, "video/mp4"},
+    {59, "Accept-Encoding"},
+    {26, "gzip"},
+    {26, "br"},
+};
+
+#define NFIXED (sizeof(fixed_fields) / sizeof(fixed_fields[0]))
+_Static_assert(NFIXED <= HPACK_FIXED_MAX, "HPACK_FIXED_MAX too small");
+
+// Each fixed field as a literal with incremental indexing, Huffman coded
+static uint8_t fixed_insert[NFIXED][48];
+static uint8_t fixed_insert_len[NFIXED];
+static uint16_t fixed_size[NFIXED];         // as a table entry
+
+static uint8_t *put_int(uint8_t *p, uint8_t flags, int prefix, uint32_t n) {
+    uint32_t max = (1u << prefix) - 1;
+    if (n < max) {
+        *p++ = flags | n;
+        return p;
+    }
+    *p++ = flags | max;
+    n -= max;
+    while (n >= 128) {
+        *p++ = 0x80 | (n & 0x7f);
+        n >>= 7;
+    }
+    *p++ = n;
+    return p;
+}
+
+static int get_int(const uint8_t **pp, const uint8_t *end, int prefix,
+                   uint32_t *n) {
+    const uint8_t *p = *pp;
+    if (p == end) {
+        return -1;
+    }
+    uint32_t max = (1u << prefix) - 1;
+    uint32_t v = *p++ & max;
+    if (v == max) {
+        for (int shift = 0;; shift += 7) {
+            // Nothing we accept needs more than 28 bits
+            if (p == end || shift > 21) {
+                return -1;
+            }
+            uint8_t b = *p++;
+            v += (uint32_t)(b & 0x7f) << shift;
+            if (!(b & 0x80)) {
+                break;
+            }
+        }
+    }
+    *pp = p;
+    *n = v;
+    return 0;
+}
+
+static size_t huffman_encode(const char *s, size_t len, uint8_t *out) {
+    uint64_t bits = 0;
+    int n = 0;
+    size_t o = 0;
+    for (size_t i = 0; i < len; i++) {
+        unsigned sym = (uint8_t)s[i];
+        bits = bits << huffman_len[sym] | huffman_code[sym];
+        n += huffman_len[sym];
+        while (n >= 8) {
+            n -= 8;
+            out[o++] = (uint8_t)(bits >> n);
+        }
+    }
+    if (n > 0) {
+        // Padded with the most significant bits of EOS, all ones
+        out[o++] = (uint8_t)(bits << (8 - n)) | (0xff >> n);
+    }
+    return o;
+}
+
+// Decode len bytes at in, storing at most room bytes at out. Returns the
+// decoded length, which may exceed room, or -1 for an invalid string.
+static ssize_t huffman_decode(const uint8_t *in, size_t len, char *out,
+                              size_t room) {
+    uint32_t code = 0;
+    int bits = 0;
+    size_t n = 0;
+    for (size_t i = 0; i < len; i++) {
+        for (int b = 7; b >= 0; b--) {
+            code = code << 1 | ((in[i] >> b) & 1);
+            bits++;
+            if (bits > HUFFMAN_LEN_MAX) {
+                return -1;
+            }
+            // Prefixes of longer codes lie above the codes of this length
+            uint32_t rank = code - first_code[bits];
+            if (rank < len_count[bits]) {
+                unsigned sym = sorted_syms[first_sym[bits] + rank];
+                if (sym == HUFFMAN_EOS) {
+                    return -1;
+                }
+                if (n < room) {
+                    out[n] = (char)sym;
+                }
+                n++;
+                code = 0;
+                bits = 0;
+            }
+        }
+    }
+    // Only up to seven bits of EOS may pad the end
+    if (bits > 7 || code != (1u << bits) - 1) {
+        return -1;
+    }
+    return (ssize_t)n;
+}
+
+void hpack_init(void) {
+    unsigned next = 0;
+    uint32_t code = 0;
+    for (int len = 1; len <= HUFFMAN_LEN_MAX; len++) {
+        first_code[len] = code;
+        first_sym[len] = next;
+        for (unsigned sym = 0; sym <= HUFFMAN_EOS; sym++) {
+            if (huffman_len[sym] == len) {
+                huffman_code[sym] = code + len_count[len];
+                sorted_syms[next++] = sym;
+                len_count[len]++;
+            }
+        }
+        code = (code + len_count[len]) << 1;
+    }
+
+    for (size_t k = 0; k < NFIXED; k++) {
+        const char *value = fixed_fields[k].value;
+        size_t len = strlen(value);
+        uint8_t coded[40];
+        size_t coded_len = huffman_encode(value, len, coded);
+        uint8_t *p = put_int(fixed_insert[k], 0x40, 6,
+                             fixed_fields[k].name_index);
+        p = put_int(p, 0x80, 7, coded_len);
+        memcpy(p, coded, coded_len);
+        fixed_insert_len[k] = p + coded_len - fixed_insert[k];
+        fixed_size[k] =
+            strlen(static_table[fixed_fields[k].name_index].name) + len + 32;
+    }
+}
+
+// The static index of a header name, in any case, or 0
+static unsigned static_name_index(const char *name, size_t len) {
+    // Pseudo-headers are never looked up this way
+    for (unsigned i = 15; i <= STATIC_ENTRIES; i++) {
+        const char *s = static_table[i].name;
+        if (strlen(s) == len && strncasecmp(s, name, len) == 0) {
+            return i;
+        }
+    }
+    return 0;
+}
+
+void hpack_decoder_init(struct hpack_decoder *d) {
+    d->max_size = HPACK_TABLE_SIZE;
+    d->size = 0;
+    d->first = 0;
+    d->count = 0;
+    d->end = 0;
+}
+
+static void evict_oldest(struct hpack_decoder *d) {
+    unsigned i = d->first;
+    d->size -= d->entry[i].name_len + d->entry[i].value_len + 32;
+    d->first = (d->first + 1) % HPACK_ENTRIES_MAX;
+    if (--d->count == 0) {
+        d->end = 0;
+    }
+}
+
+static void table_insert(struct hpack_decoder *d, const char *name,
+                         uint32_t name_len, const char *value,
+                         uint32_t value_len) {
+    uint32_t size = name_len + value_len + 32;
+    while (d->count > 0 && d->size + size > d->max_size) {
+        evict_oldest(d);
+    }
+    if (size > d->max_size) {
+        // Inserting it empties the table and leaves it empty
+        return;
+    }
+    if (d->end + name_len + value_len > sizeof(d->data)) {
+        // Move the live entries to the front; they fit with room to spare
+        uint32_t start = d->entry[d->first].off;
+        memmove(d->data, d->data + start, d->end - start);
+        d->end -= start;
+        for (unsigned k = 0; k < d->count; k++) {
+            d->entry[(d->first + k) % HPACK_ENTRIES_MAX].off -= start;
+        }
+    }
+    unsigned i = (d->first + d->count) % HPACK_ENTRIES_MAX;
+    d->entry[i].off = d->end;
+    d->entry[i].name_len = name_len;
+    d->entry[i].value_len = value_len;
+    memcpy(d->data + d->end, name, name_len);
+    memcpy(d->data + d->end + name_len, value, value_len);
+    d->end += name_len + value_len;
+    d->size += size;
+    d->count++;
+}
+
+// Find the name and value of index i in either table
+static int table_get(const struct hpack_decoder *d, uint32_t i,
+                     struct http_str *name, struct http_str *value) {
+    if (i == 0) {
+        return -1;
+    }
+    if (i <= STATIC_ENTRIES) {
+        name->ptr = static_table[i].name;
+        name->len = strlen(name->ptr);
+        value->ptr = static_table[i].value;
+        value->len = strlen(value->ptr);
+        return 0;
+    }
+    i -= STATIC_ENTRIES + 1;
+    if (i >= d->count) {
+        return -1;
+    }
+    unsigned k = (d->first + d->count - 1 - i) % HPACK_ENTRIES_MAX;
+    name->ptr = d->data + d->entry[k].off;
+    name->len = d->entry[k].name_len;
+    value->ptr = name->ptr + name->len;
+    value->len = d->entry[k].value_len;
+    return 0;
+}
+
+// Decode the string literal at *pp, storing at most room bytes at out.
+// Returns its length, which may exceed room, or -1 if it is invalid.
+static ssize_t get_string(const uint8_t **pp, const uint8_t *end, char *out,
+                          size_t room) {
+    if (*pp == end) {
+        return -1;
+    }
+    int huffman = **pp & 0x80;
+    uint32_t len;
+    if (get_int(pp, end, 7, &len) != 0 || len > (size_t)(end - *pp)) {
+        return -1;
+    }
+    const uint8_t *s = *pp;
+    *pp += len;
+    if (huffman) {
+        return huffman_decode(s, len, out, room);
+    }
+    memcpy(out, s, len < room ? len : room);
+    return len;
+}
+
+int hpack_decode(struct hpack_decoder *d, const uint8_t *in, size_t len,
+                 struct http_header *fields, unsigned max, char *out,
+                 size_t cap, int *truncated) {
+    const uint8_t *p = in, *end = in + len;
+    size_t used = 0;
+    unsigned n = 0;
+    int seen_field = 0;
+    *truncated = 0;
+    while (p < end) {
+        uint8_t b = *p;
+        uint32_t index;
+        if (b & 0x80) {
+            // Indexed field
+            struct http_str name, value;
+            if (get_int(&p, end, 7, &index) != 0 ||
+                table_get(d, index, &name, &value) != 0) {
+                return -1;
+            }
+            seen_field = 1;
+            if (n < max && used + name.len + value.len <= cap) {
+                memcpy(out + used, name.ptr, name.len);
+                memcpy(out + used + name.len, value.ptr, value.len);
+                fields[n].name = (struct http_str){out + used, name.len};
+                fields[n].value =
+                    (struct http_str){out + used + name.len, value.len};
+                used += name.len + value.len;
+                n++;
+            } else {
+                *truncated = 1;
+            }
+            continue;
+        }
+        if ((b & 0xe0) == 0x20) {
+            // Dynamic table size update, only before the first field
+            uint32_t size;
+            if (seen_field || get_int(&p, end, 5, &size) != 0 ||
+                size > HPACK_TABLE_SIZE) {
+                return -1;
+            }
+            d->max_size = size;
+            while (d->count > 0 && d->size > d->max_size) {
+                evict_oldest(d);
+            }
+            continue;
+        }
+
+        // A literal, with incremental indexing or without
+        int indexing = (b & 0xc0) == 0x40;
+        seen_field = 1;
+        if (get_int(&p, end, indexing ? 6 : 4, &index) != 0) {
+            return -1;
+        }
+        const uint8_t *name_at = p;
+        size_t room = cap - used;
+        ssize_t name_len, value_len;
+        if (index != 0) {
+            struct http_str name, value;
+            if (table_get(d, index, &name, &value) != 0) {
+                return -1;
+            }
+            name_len = name.len;
+            memcpy(out + used, name.ptr, name.len < room ? name.len : room);
+        } else if ((name_len = get_string(&p, end, out + used, room)) < 0) {
+            return -1;
+        }
+        const uint8_t *value_at = p;
+        room = (size_t)name_len < room ? room - name_len : 0;
+        value_len = get_string(&p, end, out + used + name_len, room);
+        if (value_len < 0) {
+            return -1;
+        }
+        int fits = n < max && (size_t)(name_len + value_len) <= cap - used;
+        if (!fits) {
+            *truncated = 1;
+        }
+        if (indexing) {
+            if (fits) {
+                table_insert(d, out + used, name_len, out + used + name_len,
+                             value_len);
+            } else if (name_len + value_len + 32 > d->max_size) {
+                // Empties the table without taking a place in it
+                table_insert(d, NULL, name_len, NULL, value_len);
+            } else {
+                // Decode once more, into room of our own
+                char field[HPACK_TABLE_SIZE];
+                const uint8_t *q = name_at;
+                if (index != 0) {
+                    struct http_str name, value;
+                    table_get(d, index, &name, &value);
+                    memcpy(field, name.ptr, name_len);
+                } else {
+                    get_string(&q, end, field, name_len);
+                }
+                q = value_at;
+                get_string(&q, end, field + name_len, value_len);
+                table_insert(d, field, name_len, field + name_len,
+                             value_len);
+            }
+        }
+        if (fits) {
+            fields[n].name = (struct http_str){out + used, name_len};
+            fields[n].value =
+                (struct http_str){out + used + name_len, value_len};
+            used += name_len + value_len;
+            n++;
+        }
+    }
+    return (int)n;
+}
+
+void hpack_encoder_init(struct hpack_encoder *e) {
+    e->max_size = HPACK_TABLE_SIZE;
+    e->size = 0;
+    e->inserted = 0;
+    for (int k = 0; k < HPACK_FIXED_MAX; k++) {
+        e->seq[k] = -1;
+    }
+    e->resize = 0;
+}
+
+void hpack_encoder_resize(struct hpack_encoder *e, uint32_t max_size) {
+    if (max_size >= e->max_size) {
+        // We may go on using the smaller table the peer knows about
+        return;
+    }
+    // Simplest to start over: the update to 0 empties the table
+    hpack_encoder_init(e);
+    e->max_size = max_size;
+    e->resize = 1;
+}
+
+uint8_t *hpack_encode_status(struct hpack_encoder *e, uint8_t *p,
+                             int status) {
+    if (e->resize) {
+        p = put_int(p, 0x20, 5, 0);
+        p = put_int(p, 0x20, 5, e->max_size);
+        e->resize = 0;
+    }
+    for (unsigned i = 8; i <= 14; i++) {
+        const char *s = static_table[i].value;
+        if ((s[0] - '0') * 100 + (s[1] - '0') * 10 + (s[2] - '0') ==
+            status) {
+            return put_int(p, 0x80, 7, i);
+        }
+    }
+    p = put_int(p, 0x00, 4, 8);
+    *p++ = 3;
+    *p++ = '0' + status / 100 % 10;
+    *p++ = '0' + status / 10 % 10;
+    *p++ = '0' + status % 10;
+    return p;
+}
+
+uint8_t *hpack_encode_field(struct hpack_encoder *e, uint8_t *p,
+                            const char *name, size_t name_len,
+                            const char *value, size_t value_len) {
+    unsigned index = static_name_index(name, name_len);
+    for (size_t k = 0; index != 0 && k < NFIXED; k++) {
+        if (fixed_fields[k].name_index != index ||
+            strlen(fixed_fields[k].value) != value_len ||
+            memcmp(fixed_fields[k].value, value, value_len) != 0) {
+            continue;
+        }
+        if (e->seq[k] >= 0) {
+            // The newest entry has the lowest index
+            return put_int(p, 0x80, 7,
+                           STATIC_ENTRIES + e->inserted - e->seq[k]);
+        }
+        if (e->size + fixed_size[k] <= e->max_size) {
+            memcpy(p, fixed_insert[k], fixed_insert_len[k]);
+            e->seq[k] = e->inserted++;
+            e->size += fixed_size[k];
+            return p + fixed_insert_len[k];
+        }
+        break;
+    }
+
+    // Literal without indexing
+    p = put_int(p, 0x00, 4, index);
+    if (index == 0) {
+        p = put_int(p, 0x00, 7, name_len);
+        for (size_t i = 0; i < name_len; i++) {
+            char ch = name[i];
+            *p++ = ch >= 'A' && ch <= 'Z' ? ch - 'A' + 'a' : ch;
+        }
+    }
+    p = put_int(p, 0x00, 7, value_len);
+    memcpy(p, value, value_len);
+    return p + value_len;
+}
@@ -0,0 +1,84 @@
+#ifndef WEBSERVER_HPACK_H
+#define WEBSERVER_HPACK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "http_parser.h"
+
+// HPACK (RFC 7541), the header compression of HTTP/2. Each direction of a
+// connection has its own dynamic table of recently sent fields, which the
+// encoder and the decoder keep in step.
+//
+// Decoding is complete: the static and dynamic tables and Huffman coded
+// strings. The encoder is built for the few header fields every response
+// of ours repeats: Server, the common Content-types, Vary and
+// Content-Encoding are pre-encoded once at startup, inserted into the
+// peer's table the first time a connection sends them and from then on
+// cost a single byte. Everything else is sent as a plain literal that is
+// not indexed.
+
+#define HPACK_TABLE_SIZE 4096       // the dynamic table we let peers use
+#define HPACK_ENTRIES_MAX (HPACK_TABLE_SIZE / 32)
+#define HPACK_FIXED_MAX 32          // pre-encoded fields
+
+// The peer's dynamic table. Entries are appended to data in insertion
+// order, so the live ones are always one contiguous run, moved to the
+// front when the end is reached.
+struct hpack_decoder {
+    uint32_t max_size;          // as last set by the peer
+    uint32_t size;              // of the entries, 32 bytes extra each
+    unsigned first;             // oldest entry in entry[], a ring
+    unsigned count;
+    uint32_t end;               // bytes of data in use
+    struct {
+        uint32_t off;
+        uint32_t name_len;
+        uint32_t value_len;
+    } entry[HPACK_ENTRIES_MAX];
+    char data[2 * HPACK_TABLE_SIZE];
+};
+
+// Our view of the peer's table: which pre-encoded fields it holds
+struct hpack_encoder {
+    uint32_t max_size;          // the peer's SETTINGS_HEADER_TABLE_SIZE
+    uint32_t size;              // of the fields we inserted
+    unsigned inserted;
+    int16_t seq[HPACK_FIXED_MAX];   // insertion number, -1 if not inserted
+    unsigned resize : 1;        // the next block starts with a size update
+};
+
+// Worst case bytes hpack_encode_field() writes
+#define HPACK_FIELD_MAX(name_len, value_len) ((name_len) + (value_len) + 12)
+
+// Build the pre-encoded fields and the Huffman decoding tables; call once
+// before the workers start
+void hpack_init(void);
+
+void hpack_decoder_init(struct hpack_decoder *d);
+
+// Decode the complete header block of len bytes at in into at most max
+// fields, with names and values copied to the cap bytes at out. Fields
+// beyond either limit are dropped, but the block is still decoded to its
+// end so the table stays in step; *truncated is set then. Returns the
+// number of fields, or -1 if the block is malformed, which is an error of
+// the whole connection.
+int hpack_decode(struct hpack_decoder *d, const uint8_t *in, size_t len,
+                 struct http_header *fields, unsigned max, char *out,
+                 size_t cap, int *truncated);
+
+void hpack_encoder_init(struct hpack_encoder *e);
+
+// The peer changed SETTINGS_HEADER_TABLE_SIZE
+void hpack_encoder_resize(struct hpack_encoder *e, uint32_t max_size);
+
+// Start a response header block at p with the status; returns the end
+uint8_t *hpack_encode_status(struct hpack_encoder *e, uint8_t *p,
+                             int status);
+
+// Append a field, its name in any case, to the block at p; returns the end
+uint8_t *hpack_encode_field(struct hpack_encoder *e, uint8_t *p,
+                            const char *name, size_t name_len,
+                            const char *value, size_t value_len);
+
+#endif
@@ -0,0 +1,1108 @@
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "accesslog.h"
+#include "compress.h"
+#include "conn.h"
+#include "h2.h"
+#include "http.h"
+#include "limit.h"
+#include "metrics.h"
+#include "offload.h"
+#include "pack.h"
+#include "qsbr.h"
+#include "resp_cache.h"
+#include "router.h"
+#include "static_files.h"
+#include "stream.h"
+#include "trace.h"
+#include "upstream.h"
+#include "ws.h"
+
+static const char body[] = "<html>hello, world</html>\r\n";
+static const char bad_request_body[] = "<html>bad request</html>\r\n";
+static const char server_error_body[] = "<html>server error</html>\r\n";
+static const char too_large_body[] = "<html>request too large</html>\r\n";
+static const char not_implemented_body[] =
+    "<html>not implemented</html>\r\n";
+static const char not_allowed_body[] = "<html>method not allowed</html>\r\n";
+static const char too_many_body[] = "<html>too many requests</html>\r\n";
+
+// Filler for the bodies of /stream/:bytes
+#define STREAM_DEMO_CHUNK (16 * 1024)
+static char stream_demo_data[STREAM_DEMO_CHUNK];
+
+static struct cached_response *resp_bad_request;
+static struct cached_response *resp_server_error;
+static struct cached_response *resp_body_too_large;
+static struct cached_response *resp_head_too_large;
+static struct cached_response *resp_not_implemented;
+static struct cached_response *resp_not_allowed;
+static struct cached_response *resp_too_many;
+
+// Router data is a pointer to one of these, since the router only stores
+// object pointers
+struct http_route {
+    http_handler fn;
+    int blocking;               // run on the offload pool
+    struct cached_response *text;   // what serve_text() answers, or NULL
+};
+
+// A route added with http_route(), for every pipeline
+struct http_route_def {
+    unsigned methods;
+    const char *pattern;
+    http_handler fn;
+    int blocking;
+};
+
+// The stages a request goes through until one of them answers it
+enum stage {
+    STAGE_END,
+    STAGE_LIMIT,                // a client over a rate limit gets a 429
+    STAGE_ROUTE,                // the routing table
+    STAGE_PACK,                 // the pack
+    STAGE_STATIC,               // the document root
+    STAGE_CACHE,                // the response cache, for any path
+    STAGE_PACK_IDENTITY,        // the same three with --compression=off
+    STAGE_STATIC_IDENTITY,
+    STAGE_CACHE_IDENTITY,
+    STAGES,
+};
+
+// How an answered request is logged
+enum log_stage {
+    LOG_STAGE_NONE,
+    LOG_STAGE_PLAIN,
+    LOG_STAGE_TIMED,            // with --log-timing
+};
+
+// What the functions every request runs through do besides answering it,
+// as bits. Each combination is a variant of its own, compiled from one
+// body, and the pipeline names the one to run.
+enum hot_variant {
+    HOT_PLAIN = 0,
+    HOT_OBSERVED = 1,           // record the latency histograms
+    HOT_TIMED = 2,              // take the timings of --log-timing
+    HOT_VARIANTS = 4,
+};
+
+// The request pipeline, specialized for the configuration when it is
+// built: a feature that is switched off has no stage in it, rather than a
+// test on every request. Stages, loggers and the variants of the request
+// loop are indexes into tables of functions, so the pipeline proper is a
+// few bytes; the routing table hangs off it. Built at startup and on every
+// reload, and read-only in between.
+struct pipeline {
+    uint8_t stages[STAGES];     // in order, up to STAGE_END
+    uint8_t log;                // enum log_stage of HTTP/1.x requests
+    uint8_t log_untimed;        // and of the others
+    uint8_t hot;                // enum hot_variant
+    struct router *router;
+    unsigned nroutes;
+    struct http_route routes[]; // the router's data
+};
+
+// Where http_process() was with a request it handed to the offload pool
+struct http_resume {
+    size_t consumed;            // buffered bytes up to the end of its head
+    uint64_t body_len;
+    uint64_t parsed;            // when its head was parsed
+    int was_empty;              // the write queue was empty before it
+};
+
+// A request answered on the offload pool
+struct http_job {
+    struct offload_job job;
+    struct conn *c;
+    struct http_route route;    // a reload may free the pipeline's copy
+    struct http_request req;
+    struct route_match match;
+    enum resp_variant v;
+    int status;
+    size_t bytes;
+    struct http_resume at;
+};
+
+static _Atomic(struct pipeline *) pipeline;
+
+static struct http_route_def *defs;
+static unsigned ndefs;
+
+static int serve_metrics(struct conn *c, const struct http_request *req,
+                         const struct route_match *m, enum resp_variant v,
+                         size_t *bytes);
+static int serve_metrics_identity(struct conn *c,
+                                  const struct http_request *req,
+                                  const struct route_match *m,
+                                  enum resp_variant v, size_t *bytes);
+static int serve_stream(struct conn *c, const struct http_request *req,
+                        const struct route_match *m, enum resp_variant v,
+                        size_t *bytes);
+
+static int serve_text(struct conn *c, const struct http_request *req,
+                      const struct route_match *m, enum resp_variant v,
+                      size_t *bytes);
+
+static int add_route(unsigned methods, const char *pattern, http_handler fn,
+                     int blocking) {
+    struct http_route_def *d = realloc(defs, (ndefs + 1) * sizeof(*d));
+    if (d == NULL) {
+        perror("webserver (realloc)");
+        return -1;
+    }
+    defs = d;
+    defs[ndefs++] = (struct http_route_def){methods, pattern, fn, blocking};
+    return 0;
+}
+
+int http_route(unsigned methods, const char *pattern, http_handler fn) {
+    return add_route(methods, pattern, fn, 0);
+}
+
+int http_route_blocking(unsigned methods, const char *pattern,
+                        http_handler fn) {
+    return add_route(methods, pattern, fn, 1);
+}
+
+static void pipeline_free(struct pipeline *p) {
+    router_free(p->router);
+    for (unsigned i = 0; i < p->nroutes; i++) {
+        if (p->routes[i].text != NULL) {
+            rcbuf_put(&p->routes[i].text->rc);
+        }
+    }
+    free(p);
+}
+
+// Route methods on pattern, which need not be terminated, to fn in p
+static int pipeline_route(struct pipeline *p, unsigned methods,
+                          const char *pattern, size_t len, http_handler fn,
+                          int blocking, struct cached_response *text) {
+    char copy[len + 1];
+    memcpy(copy, pattern, len);
+    copy[len] = '\0';
+    struct http_route *route = &p->routes[p->nroutes++];
+    *route = (struct http_route){fn, blocking, text};
+    return router_add(p->router, methods, copy, route);
+}
+
+// Add the --route routes of cfg to p
+static int pipeline_routes(struct pipeline *p,
+                           const struct server_config *cfg) {
+    static const http_handler actions[] = {
+        [ACTION_TEXT] = serve_text,
+        [ACTION_METRICS] = serve_metrics,
+        [ACTION_STREAM] = serve_stream,
+        [ACTION_PROXY] = upstream_serve,
+    };
+    http_handler metrics = cfg->compression ? serve_metrics
+                                            : serve_metrics_identity;
+    for (int i = 0; i < cfg->nroutes; i++) {
+        const struct route_spec *r = &cfg->routes[i];
+        http_handler fn = r->action == ACTION_METRICS ? metrics
+                                                      : actions[r->action];
+        struct cached_response *text = NULL;
+        if (r->action == ACTION_TEXT) {
+            size_t len = strlen(r->arg);
+            char body[len + 1];
+            memcpy(body, r->arg, len);
+            body[len] = '\n';
+            if ((text = resp_build(200, "text/plain", body, len + 1)) ==
+                NULL) {
+                return -1;
+            }
+        }
+        if (pipeline_route(p, r->methods, r->pattern, r->pattern_len, fn,
+                           r->action == ACTION_METRICS, text) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Build the pipeline for the routes, --metrics and --compression of cfg.
+// The rest comes from the configuration the server started with, which
+// only a restart changes.
+static struct pipeline *pipeline_new(const struct server_config *cfg) {
+    unsigned n = ndefs + (unsigned)cfg->nroutes + 2;
+    struct pipeline *p = calloc(1, sizeof(*p) + n * sizeof(p->routes[0]));
+    if (p == NULL) {
+        perror("webserver (calloc)");
+        return NULL;
+    }
+    // The last stage answers every request that gets to it
+    unsigned k = 0;
+    if (config.max_rate > 0 || config.max_rate_per_ip > 0) {
+        p->stages[k++] = STAGE_LIMIT;
+    }
+    p->stages[k++] = STAGE_ROUTE;
+    int zip = cfg->compression;
+    if (config.pack != NULL) {
+        p->stages[k++] = zip ? STAGE_PACK : STAGE_PACK_IDENTITY;
+    }
+    if (config.root != NULL) {
+        p->stages[k++] = zip ? STAGE_STATIC : STAGE_STATIC_IDENTITY;
+    } else {
+        p->stages[k++] = zip ? STAGE_CACHE : STAGE_CACHE_IDENTITY;
+    }
+    p->stages[k] = STAGE_END;
+    p->log_untimed = config.log_level >= LOG_INFO ? LOG_STAGE_PLAIN
+                                                  : LOG_STAGE_NONE;
+    p->log = p->log_untimed != LOG_STAGE_NONE && config.log_timing
+                 ? LOG_STAGE_TIMED
+                 : p->log_untimed;
+    p->hot = (cfg->metrics ? HOT_OBSERVED : HOT_PLAIN) |
+             (p->log == LOG_STAGE_TIMED ? HOT_TIMED : HOT_PLAIN);
+
+    if ((p->router = router_new()) == NULL ||
+        pipeline_routes(p, cfg) != 0) {
+        goto fail;
+    }
+    for (unsigned i = 0; i < ndefs; i++) {
+        const struct http_route_def *d = &defs[i];
+        if (pipeline_route(p, d->methods, d->pattern, strlen(d->pattern),
+                           d->fn, d->blocking, NULL) != 0) {
+            goto fail;
+        }
+    }
+    // Rendering compresses the whole page, which is better done off the
+    // event loops
+    if (cfg->metrics &&
+        pipeline_route(p, ROUTE_ANY, "/metrics", 8,
+                       zip ? serve_metrics : serve_metrics_identity, 1,
+                       NULL) != 0) {
+        goto fail;
+    }
+    // Paths without a route get a file from the document root, or their
+    // entry in the response cache
+    if (config.nupstream > 0) {
+        if (pipeline_route(p, ROUTE_ANY, config.proxy_path,
+                           strlen(config.proxy_path), upstream_serve, 0,
+                           NULL) != 0) {
+            goto fail;
+        }
+    } else if (config.root == NULL) {
+        // The built-in site can also stream a body of any size
+        if (pipeline_route(p, ROUTE_GET | ROUTE_HEAD, "/stream/:bytes", 14,
+                           serve_stream, 0, NULL) != 0) {
+            goto fail;
+        }
+    }
+    if (router_build(p->router) != 0) {
+        goto fail;
+    }
+    return p;
+fail:
+    pipeline_free(p);
+    return NULL;
+}
+
+int http_init(void) {
+    // Every path gets the same page unless a route says otherwise. It is
+    // compressed once, as well as it gets.
+    struct compressor *z = compressor_new(COMPRESS_BEST);
+    if (z == NULL) {
+        return -1;
+    }
+    struct cached_response *hello =
+        resp_build_encoded(200, "text/html", body, sizeof(body) - 1, z,
+                           encoding_supported());
+    compressor_free(z);
+    if (hello == NULL || resp_cache_set(NULL, hello) != 0) {
+        return -1;
+    }
+
+    resp_bad_request = resp_build(400, "text/html", bad_request_body,
+                                  sizeof(bad_request_body) - 1);
+    if (resp_bad_request == NULL) {
+        return -1;
+    }
+
+    resp_server_error = resp_build(500, "text/html", server_error_body,
+                                   sizeof(server_error_body) - 1);
+    if (resp_server_error == NULL) {
+        return -1;
+    }
+
+    resp_body_too_large = resp_build(413, "text/html", too_large_body,
+                                     sizeof(too_large_body) - 1);
+    resp_head_too_large = resp_build(431, "text/html", too_large_body,
+                                     sizeof(too_large_body) - 1);
+    resp_not_implemented = resp_build(501, "text/html", not_implemented_body,
+                                      sizeof(not_implemented_body) - 1);
+    resp_not_allowed = resp_build(405, "text/html", not_allowed_body,
+                                  sizeof(not_allowed_body) - 1);
+    // Buckets hold a second's worth, so that is when to come back
+    resp_too_many = resp_build_extra(429, "text/html", "Retry-After: 1\r\n",
+                                     too_many_body,
+                                     sizeof(too_many_body) - 1);
+    if (resp_body_too_large == NULL || resp_head_too_large == NULL ||
+        resp_not_implemented == NULL || resp_not_allowed == NULL ||
+        resp_too_many == NULL) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < sizeof(stream_demo_data); i++) {
+        stream_demo_data[i] = "0123456789abcdef"[i % 16];
+    }
+    stream_demo_data[sizeof(stream_demo_data) - 1] = '\n';
+    struct pipeline *p = pipeline_new(&config);
+    if (p == NULL) {
+        return -1;
+    }
+    atomic_store_explicit(&pipeline, p, memory_order_release);
+    return 0;
+}
+
+int http_reload(const struct server_config *cfg) {
+    struct pipeline *p = pipeline_new(cfg);
+    if (p == NULL) {
+        return -1;
+    }
+    struct pipeline *old =
+        atomic_exchange_explicit(&pipeline, p, memory_order_acq_rel);
+    // Workers that loaded the old pipeline before the swap may still be
+    // routing with it; after a grace period only writes that pinned its
+    // responses remain
+    qsbr_synchronize();
+    pipeline_free(old);
+    return 0;
+}
+
+static int is_head(const struct http_request *req) {
+    return req != NULL && req->method.len == 4 &&
+           memcmp(req->method.ptr, "HEAD", 4) == 0;
+}
+
+// Queue one variant of a cached response to req as a single segment, only
+// its head if req is a HEAD request. Returns the bytes queued.
+static size_t queue_response(struct conn *c, const struct http_request *req,
+                             const struct cached_response *r,
+                             enum resp_variant v) {
+    size_t len = is_head(req) ? r->head_len[v] : r->len[v];
+    conn_queue(c, r->data[v], len, (struct rcbuf *)&r->rc);
+    return len;
+}
+
+// Decide how the connection continues after answering req, looking at the
+// protocol version and the Connection header
+static enum resp_variant response_variant(const struct http_request *req) {
+    int keep_alive = req->minor_version == 1;
+    const struct http_str *connection = http_header_get(req, "Connection");
+    if (connection != NULL) {
+        if (http_has_token(connection, "close")) {
+            keep_alive = 0;
+        } else if (http_has_token(connection, "keep-alive")) {
+            keep_alive = 1;
+        }
+    }
+    if (!keep_alive) {
+        return RESP_CLOSE;
+    }
+    return req->minor_version == 1 ? RESP_KEEP_ALIVE : RESP_KEEP_ALIVE_10;
+}
+
+// Answer req, NULL if it could not be parsed, with an error and close;
+// whatever else the client sent is not looked at
+static void reject(struct conn *c, const struct http_request *req,
+                   const struct cached_response *r, int was_empty,
+                   uint64_t now) {
+    queue_response(c, req, r, RESP_CLOSE);
+    c->close_after_write = 1;
+    if (was_empty) {
+        c->write_start = now;
+    }
+}
+
+// Find the length of the request body. Only a single Content-Length made
+// of digits is accepted, since a lenient reading is what lets a request
+// be framed differently by us and by a proxy in front of us. Returns -1
+// for an invalid or repeated length.
+static int body_length(const struct http_request *req, uint64_t *len) {
+    int seen = 0;
+    *len = 0;
+    for (unsigned i = 0; i < req->nheaders; i++) {
+        const struct http_str *name = &req->headers[i].name;
+        if (name->len != 14 ||
+            strncasecmp(name->ptr, "Content-Length", 14) != 0) {
+            continue;
+        }
+        const struct http_str *value = &req->headers[i].value;
+        if (seen++ || value->len == 0 || value->len > 19) {
+            return -1;
+        }
+        for (size_t j = 0; j < value->len; j++) {
+            if (value->ptr[j] < '0' || value->ptr[j] > '9') {
+                return -1;
+            }
+            *len = *len * 10 + (uint64_t)(value->ptr[j] - '0');
+        }
+    }
+    return 0;
+}
+
+// Answer with a snapshot of all workers' counters, compressed with z if it
+// is not NULL. The response is built for this request alone, so the queue
+// holds the only reference.
+static int serve_metrics_with(struct conn *c,
+                              const struct http_request *req,
+                              struct compressor *z, enum resp_variant v,
+                              size_t *bytes) {
+    struct cached_response *r = metrics_render(z, encoding_accepted(req));
+    if (r == NULL) {
+        *bytes = queue_response(c, req, resp_server_error, v);
+        return resp_server_error->status;
+    }
+    // The sibling, if any, lives on in the pinned queue after r is gone
+    const struct cached_response *sent = resp_negotiate(r, ~0u);
+    *bytes = queue_response(c, req, sent, v);
+    conn_pin(c);
+    rcbuf_put(&r->rc);
+    return sent->status;
+}
+
+// Answer with the metrics page
+static int serve_metrics(struct conn *c, const struct http_request *req,
+                         const struct route_match *m, enum resp_variant v,
+                         size_t *bytes) {
+    // On the pool, the worker's compressor is the worker's; without one of
+    // our own the page goes out uncompressed
+    struct compressor *z = offload_thread() ? offload_zip() : c->w->zip;
+    return serve_metrics_with(c, req, z, v, bytes);
+}
+
+// Answer with the metrics page, uncompressed, for --compression=off
+static int serve_metrics_identity(struct conn *c,
+                                  const struct http_request *req,
+                                  const struct route_match *m,
+                                  enum resp_variant v, size_t *bytes) {
+    return serve_metrics_with(c, req, NULL, v, bytes);
+}
+
+// Answer with the body of a text route
+static int serve_text(struct conn *c, const struct http_request *req,
+                      const struct route_match *m, enum resp_variant v,
+                      size_t *bytes) {
+    const struct http_route *route = m->data;
+    *bytes = queue_response(c, req, route->text, v);
+    return route->text->status;
+}
+
+// Queue as many chunks of the body as fit, or its end
+static int produce_demo(struct stream *s, void *arg) {
+    uint64_t *left = arg;
+    while (*left > 0) {
+        size_t n = *left < STREAM_DEMO_CHUNK ? (size_t)*left
+                                             : STREAM_DEMO_CHUNK;
+        if (stream_write(s, stream_demo_data, n, NULL) != 0) {
+            return 0;
+        }
+        *left -= n;
+    }
+    stream_end(s);
+    return 0;
+}
+
+// Stream a generated body of the requested size in chunks, never holding
+// more than one round of them
+static int serve_stream(struct conn *c, const struct http_request *req,
+                        const struct route_match *m, enum resp_variant v,
+                        size_t *bytes) {
+    const struct http_str *size = &m->params[0];
+    uint64_t n = 0;
+    for (size_t i = 0; i < size->len; i++) {
+        if (size->ptr[i] < '0' || size->ptr[i] > '9' || i >= 19) {
+            *bytes = queue_response(c, req, resp_bad_request, v);
+            return resp_bad_request->status;
+        }
+        n = n * 10 + (uint64_t)(size->ptr[i] - '0');
+    }
+
+    uint64_t *left = malloc(sizeof(*left));
+    if (left == NULL ||
+        stream_start(c, req, 200, "text/plain", produce_demo, free, left) ==
+            NULL) {
+        free(left);
+        *bytes = queue_response(c, req, resp_server_error, v);
+        return resp_server_error->status;
+    }
+    *left = n;
+    // The body is counted by /metrics as it goes out
+    *bytes = 0;
+    return 200;
+}
+
+// Answer a request on a pool thread. The worker leaves c alone meanwhile.
+static void job_run(struct offload_job *oj) {
+    struct http_job *j = (struct http_job *)oj;
+    j->status = j->route.fn(j->c, &j->req, &j->match, j->v, &j->bytes);
+    // This thread is not part of the worker's grace periods, so whatever
+    // the queue points into is only safe with a reference
+    conn_pin(j->c);
+}
+
+typedef struct conn *(*offload_done_fn)(struct offload_job *oj);
+static offload_done_fn const finishers[HOT_VARIANTS];
+
+// What a stage returns to hand the request on to the next one
+#define STAGE_NEXT (-2)
+
+// One stage of the pipeline, see respond()
+typedef int (*http_stage)(struct conn *c, const struct http_request *req,
+                          enum resp_variant v, size_t *bytes,
+                          const struct http_resume *at,
+                          const struct pipeline *p);
+
+static int stage_limit(struct conn *c, const struct http_request *req,
+                       enum resp_variant v, size_t *bytes,
+                       const struct http_resume *at,
+                       const struct pipeline *p) {
+    if (limit_request(c) != 0) {
+        // The connection stays open; the client may well slow down
+        metric_add(&c->w->metrics.limit_throttled, 1);
+        *bytes = queue_response(c, req, resp_too_many, v);
+        return resp_too_many->status;
+    }
+    return STAGE_NEXT;
+}
+
+static int stage_route(struct conn *c, const struct http_request *req,
+                       enum resp_variant v, size_t *bytes,
+                       const struct http_resume *at,
+                       const struct pipeline *p) {
+    size_t path_len = req->uri.len;
+    const char *query = memchr(req->uri.ptr, '?', req->uri.len);
+    if (query != NULL) {
+        path_len = query - req->uri.ptr;
+    }
+    struct route_match match;
+    enum route_result found = router_match(p->router, &req->method,
+                                           req->uri.ptr, path_len, &match);
+    if (found == ROUTE_FOUND) {
+        const struct http_route *route = match.data;
+        struct http_job *j;
+        if (route->blocking && at != NULL && c->w->offload != NULL &&
+            (j = malloc(sizeof(*j))) != NULL) {
+            j->at = *at;
+            j->job.run = job_run;
+            j->job.done = finishers[p->hot];
+            j->c = c;
+            j->route = *route;
+            j->req = *req;
+            j->match = match;
+            j->match.data = &j->route;
+            j->v = v;
+            c->offload = &j->job;
+            if (offload_submit(c->w, &j->job) == 0) {
+                return -1;
+            }
+            c->offload = NULL;
+            free(j);
+        }
+        return route->fn(c, req, &match, v, bytes);
+    }
+    if (found == ROUTE_METHOD_NOT_ALLOWED) {
+        *bytes = queue_response(c, req, resp_not_allowed, v);
+        return resp_not_allowed->status;
+    }
+    return STAGE_NEXT;
+}
+
+static int stage_pack(struct conn *c, const struct http_request *req,
+                      enum resp_variant v, size_t *bytes,
+                      const struct http_resume *at,
+                      const struct pipeline *p) {
+    int status = pack_serve(c, req, v, ENCODING_ALL, bytes);
+    return status != 0 ? status : STAGE_NEXT;
+}
+
+static int stage_pack_identity(struct conn *c, const struct http_request *req,
+                               enum resp_variant v, size_t *bytes,
+                               const struct http_resume *at,
+                               const struct pipeline *p) {
+    int status = pack_serve(c, req, v, ENCODING_BIT(ENCODING_IDENTITY), bytes);
+    return status != 0 ? status : STAGE_NEXT;
+}
+
+static int stage_static(struct conn *c, const struct http_request *req,
+                        enum resp_variant v, size_t *bytes,
+                        const struct http_resume *at,
+                        const struct pipeline *p) {
+    return static_serve(c->w->files, c, req, v, ENCODING_ALL, bytes);
+}
+
+static int stage_static_identity(struct conn *c,
+                                 const struct http_request *req,
+                                 enum resp_variant v, size_t *bytes,
+                                 const struct http_resume *at,
+                                 const struct pipeline *p) {
+    return static_serve(c->w->files, c, req, v,
+                        ENCODING_BIT(ENCODING_IDENTITY), bytes);
+}
+
+static int stage_cache(struct conn *c, const struct http_request *req,
+                       enum resp_variant v, size_t *bytes,
+                       const struct http_resume *at,
+                       const struct pipeline *p) {
+    const struct cached_response *r =
+        resp_cache_lookup(req->uri.ptr, req->uri.len);
+    if (r->encodings != 0) {
+        r = resp_negotiate(r, encoding_accepted(req));
+    }
+    *bytes = queue_response(c, req, r, v);
+    return r->status;
+}
+
+// The entry itself is the identity response
+static int stage_cache_identity(struct conn *c,
+                                const struct http_request *req,
+                                enum resp_variant v, size_t *bytes,
+                                const struct http_resume *at,
+                                const struct pipeline *p) {
+    const struct cached_response *r =
+        resp_cache_lookup(req->uri.ptr, req->uri.len);
+    *bytes = queue_response(c, req, r, v);
+    return r->status;
+}
+
+static const http_stage stages[STAGES] = {
+    [STAGE_LIMIT] = stage_limit,
+    [STAGE_ROUTE] = stage_route,
+    [STAGE_PACK] = stage_pack,
+    [STAGE_STATIC] = stage_static,
+    [STAGE_CACHE] = stage_cache,
+    [STAGE_PACK_IDENTITY] = stage_pack_identity,
+    [STAGE_STATIC_IDENTITY] = stage_static_identity,
+    [STAGE_CACHE_IDENTITY] = stage_cache_identity,
+};
+
+// Hand req down the stages of p: the rate limits, its route, the pack, the
+// static files or the response cache, as configured. A blocking route
+// goes to the offload pool if at, where to finish the request from, is
+// given; -1 is returned then. Otherwise returns the status code, 0 if the
+// response is still to come, and stores the bytes queued in *bytes.
+static int respond(struct conn *c, const struct http_request *req,
+                   enum resp_variant v, size_t *bytes,
+                   const struct http_resume *at, const struct pipeline *p) {
+    // The last stage always answers
+    for (const uint8_t *s = p->stages;; s++) {
+        int status = stages[*s](c, req, v, bytes, at, p);
+        if (status != STAGE_NEXT) {
+            return status;
+        }
+    }
+}
+
+// Log an answered request, see enum log_stage. parsed is the trace_clock()
+// tick its head was parsed at, for --log-timing.
+typedef void (*http_logger)(struct conn *c, const struct http_request *req,
+                            int status, size_t bytes, uint64_t parsed);
+
+static void log_none(struct conn *c, const struct http_request *req,
+                     int status, size_t bytes, uint64_t parsed) {
+}
+
+static void log_plain(struct conn *c, const struct http_request *req,
+                      int status, size_t bytes, uint64_t parsed) {
+    if (accesslog_sampled(c->w)) {
+        accesslog_request(c->w, conn_peer(c), req, status, bytes);
+    }
+}
+
+static void log_timed(struct conn *c, const struct http_request *req,
+                      int status, size_t bytes, uint64_t parsed) {
+    if (accesslog_sampled(c->w)) {
+        accesslog_request_timed(c, req, status, bytes, parsed,
+                                trace_clock());
+    }
+}
+
+static const http_logger loggers[] = {
+    [LOG_STAGE_NONE] = log_none,
+    [LOG_STAGE_PLAIN] = log_plain,
+    [LOG_STAGE_TIMED] = log_timed,
+};
+
+// Back on the worker: finish a request the pool answered the way
+// http_process() finishes the others. Specialized like process().
+static inline __attribute__((always_inline)) struct conn *
+finish_job(struct offload_job *oj, const unsigned hot) {
+    struct http_job *j = (struct http_job *)oj;
+    struct conn *c = j->c;
+    struct worker_metrics *m = &c->w->metrics;
+    const struct pipeline *p =
+        atomic_load_explicit(&pipeline, memory_order_acquire);
+    c->offload = NULL;
+    if (c->stream != NULL && stream_pump(c) < 0) {
+        stream_free(c);
+        c->close_after_write = 1;
+    }
+    if (j->status != 0) {
+        loggers[p->log_untimed](c, &j->req, j->status, j->bytes, 0);
+    }
+    if (hot & HOT_OBSERVED) {
+        uint64_t done = metric_clock();
+        metric_observe(&m->latency[LATENCY_HANDLER], done - j->at.parsed);
+        if (j->at.was_empty) {
+            c->write_start = done;
+        }
+    }
+    metric_add(&m->requests, 1);
+    metric_add(&m->offloaded, 1);
+
+    c->requests++;
+    c->body_left = j->at.body_len;
+    if (j->at.body_len == 0) {
+        c->request_start = 0;
+    }
+    http_parser_init(&c->parser);
+    // The request is done with, and what arrived behind it meanwhile can
+    // move to the front
+    memmove(c->buffer, c->buffer + j->at.consumed, c->len - j->at.consumed);
+    c->len -= j->at.consumed;
+    free(j);
+    return c;
+}
+
+static struct conn *job_done(struct offload_job *oj) {
+    return finish_job(oj, HOT_PLAIN);
+}
+
+static struct conn *job_done_observed(struct offload_job *oj) {
+    return finish_job(oj, HOT_OBSERVED);
+}
+
+static offload_done_fn const finishers[HOT_VARIANTS] = {
+    [HOT_PLAIN] = job_done,
+    [HOT_OBSERVED] = job_done_observed,
+    [HOT_TIMED] = job_done,
+    [HOT_OBSERVED | HOT_TIMED] = job_done_observed,
+};
+
+// http_process_stream(), specialized like process()
+static inline __attribute__((always_inline)) void
+process_stream(struct conn *c, const struct http_request *req, int too_large,
+               int body_follows, const struct pipeline *p, const unsigned hot) {
+    struct worker_metrics *m = &c->w->metrics;
+    uint64_t start = hot & HOT_OBSERVED ? metric_clock() : 0;
+    uint64_t body_len = 0;
+    const struct cached_response *error = NULL;
+    if (too_large) {
+        error = resp_head_too_large;
+    } else if (body_length(req, &body_len) != 0) {
+        error = resp_bad_request;
+    } else if (body_follows && http_header_get(req, "Content-Length") == NULL) {
+        // The body would have to be buffered to find its length
+        error = resp_not_implemented;
+    } else if (body_len > config.max_body_size) {
+        error = resp_body_too_large;
+    }
+
+    // The session frames the response and decides when its connection
+    // closes, so every response is the plain keep-alive variant
+    int status;
+    size_t bytes;
+    if (error != NULL) {
+        bytes = queue_response(c, req, error, RESP_KEEP_ALIVE);
+        status = error->status;
+        body_len = 0;
+    } else {
+        status = respond(c, req, RESP_KEEP_ALIVE, &bytes, NULL, p);
+    }
+    c->body_left = body_follows ? body_len : 0;
+    if (status != 0) {
+        loggers[p->log_untimed](c, req, status, bytes, 0);
+    }
+    if (hot & HOT_OBSERVED) {
+        metric_observe(&m->latency[LATENCY_HANDLER], metric_clock() - start);
+    }
+    metric_add(&m->requests, 1);
+}
+
+typedef void (*stream_process_fn)(struct conn *c,
+                                  const struct http_request *req,
+                                  int too_large, int body_follows,
+                                  const struct pipeline *p);
+
+static void process_stream_plain(struct conn *c,
+                                 const struct http_request *req,
+                                 int too_large, int body_follows,
+                                 const struct pipeline *p) {
+    process_stream(c, req, too_large, body_follows, p, HOT_PLAIN);
+}
+
+static void process_stream_observed(struct conn *c,
+                                    const struct http_request *req,
+                                    int too_large, int body_follows,
+                                    const struct pipeline *p) {
+    process_stream(c, req, too_large, body_follows, p, HOT_OBSERVED);
+}
+
+static const stream_process_fn stream_processors[HOT_VARIANTS] = {
+    [HOT_PLAIN] = process_stream_plain,
+    [HOT_OBSERVED] = process_stream_observed,
+    [HOT_TIMED] = process_stream_plain,
+    [HOT_OBSERVED | HOT_TIMED] = process_stream_observed,
+};
+
+void http_process_stream(struct conn *c, const struct http_request *req,
+                         int too_large, int body_follows) {
+    const struct pipeline *p =
+        atomic_load_explicit(&pipeline, memory_order_acquire);
+    stream_processors[p->hot](c, req, too_large, body_follows, p);
+}
+
+// The body of http_process() for the variant hot of p. hot is a constant
+// in every caller, so a variant has no trace of what it does not do: no
+// clock is read for histograms that are off, no tick taken for timings
+// that are not logged.
+static inline __attribute__((always_inline)) int
+process(struct conn *c, const struct pipeline *p, const unsigned hot) {
+    const int observed = (hot & HOT_OBSERVED) != 0;
+    size_t off = 0;
+    int progress = 0;
+    struct worker_metrics *m = &c->w->metrics;
+    uint64_t start = observed ? metric_clock() : 0;
+
+    // A connection is HTTP/2 from its first bytes on, or after an upgrade
+    if (c->h2 == NULL && c->requests == 0) {
+        int h2 = h2_detect(c);
+        if (h2 < 0) {
+            return 0;
+        }
+        if (h2 > 0 && h2_start(c) != 0) {
+            c->close_after_write = 1;
+            return 0;
+        }
+    }
+    if (c->h2 != NULL) {
+        return h2_process(c);
+    }
+    if (c->ws != NULL) {
+        return ws_process(c);
+    }
+
+    // A proxied request stops everything behind it but its own body until
+    // the response is in
+    while (!c->close_after_write && c->stream == NULL && c->offload == NULL &&
+           (c->proxy == NULL || c->body_left > 0) &&
+           conn_queue_space(c) >= PACK_MAX_SEGMENTS) {
+        if (c->body_left > 0) {
+            // The body of an answered request; nothing looks at it, unless
+            // it goes to a backend
+            size_t skip = c->len - off;
+            if (skip > c->body_left) {
+                skip = (size_t)c->body_left;
+            }
+            if (c->proxy != NULL && skip > 0) {
+                upstream_body(c, c->buffer + off, skip);
+            }
+            off += skip;
+            c->body_left -= skip;
+            progress += skip > 0;
+            if (c->body_left > 0) {
+                break;
+            }
+            c->request_start = 0;
+            if (c->proxy != NULL) {
+                break;
+            }
+        }
+
+        struct http_request req;
+        int n = http_parse(&c->parser, c->buffer + off, c->len - off, &req);
+        int was_empty = c->iovcnt == 0;
+        if (n == HTTP_PARSE_AGAIN) {
+            if (c->len - off >= config.max_header_size) {
+                reject(c, NULL, resp_head_too_large, was_empty,
+                       observed ? metric_clock() : 0);
+            }
+            break;
+        }
+        uint64_t parsed = observed ? metric_clock() : 0;
+        uint64_t parsed_tsc = hot & HOT_TIMED ? trace_clock() : 0;
+        TRACE2(parse, c->fd, n);
+        if (n == HTTP_PARSE_ERROR) {
+            reject(c, NULL, resp_bad_request, was_empty, parsed);
+            break;
+        }
+        if ((size_t)n > config.max_header_size) {
+            reject(c, NULL, resp_head_too_large, was_empty, parsed);
+            break;
+        }
+        if (observed) {
+            metric_observe(&m->latency[LATENCY_PARSE], parsed - start);
+        }
+
+        uint64_t body_len;
+        if (body_length(&req, &body_len) != 0) {
+            reject(c, &req, resp_bad_request, was_empty, parsed);
+            break;
+        }
+        if (http_header_get(&req, "Transfer-Encoding") != NULL) {
+            // No chunked request bodies, so we cannot find the next request
+            reject(c, &req, resp_not_implemented, was_empty, parsed);
+            break;
+        }
+        if (body_len > config.max_body_size) {
+            reject(c, &req, resp_body_too_large, was_empty, parsed);
+            break;
+        }
+        if (body_len == 0 && h2_upgrade(c, &req)) {
+            // Answered as the first stream; the rest of the buffer is the
+            // client's HTTP/2 preface
+            progress++;
+            off += n;
+            c->request_start = 0;
+            http_parser_init(&c->parser);
+            break;
+        }
+        if (body_len == 0 && ws_upgrade(c, &req)) {
+            // Whatever follows the request are frames
+            loggers[p->log_untimed](c, &req, 101, 0, 0);
+            metric_add(&m->requests, 1);
+            c->requests++;
+            progress++;
+            off += n;
+            c->request_start = 0;
+            http_parser_init(&c->parser);
+            break;
+        }
+
+        enum resp_variant v = response_variant(&req);
+        if (c->requests + 1 >= config.max_requests || c->w->draining) {
+            v = RESP_CLOSE;
+        }
+        if (body_len > 0) {
+            const struct http_str *expect = http_header_get(&req, "Expect");
+            if (expect != NULL && http_has_token(expect, "100-continue")) {
+                // We answer without a 100 Continue, so the client may
+                // never send the body we would have to skip
+                v = RESP_CLOSE;
+            }
+        }
+        if (v == RESP_CLOSE) {
+            c->close_after_write = 1;
+        }
+        size_t bytes;
+        struct http_resume at = {off + n, body_len, parsed, was_empty};
+        int status = respond(c, &req, v, &bytes, &at, p);
+        if (status < 0) {
+            // job_done() finishes the request and moves the buffer on
+            return progress;
+        }
+        if (c->stream != NULL && stream_pump(c) < 0) {
+            // Only the head went out; all we can do is cut the body short
+            stream_free(c);
+            c->close_after_write = 1;
+        }
+        TRACE2(handler, c->fd, status);
+        // A proxied response is logged once it is complete
+        if (status != 0) {
+            loggers[p->log](c, &req, status, bytes, parsed_tsc);
+        }
+
+        if (observed) {
+            uint64_t done = metric_clock();
+            metric_observe(&m->latency[LATENCY_HANDLER], done - parsed);
+            if (was_empty) {
+                c->write_start = done;
+            }
+            start = done;
+        }
+        metric_add(&m->requests, 1);
+
+        c->requests++;
+        progress++;
+        off += n;
+        // A pipelined request behind it began no later than the last read
+        c->read_tsc = c->head_tsc;
+        c->body_left = body_len;
+        if (body_len == 0) {
+            c->request_start = 0;
+        }
+        http_parser_init(&c->parser);
+    }
+
+    // Responses never point into the receive buffer, so it is safe to move
+    // whatever is left of the next request to the front. The parser keeps
+    // offsets relative to the start of the request, so a partially parsed
+    // request survives the move.
+    if (off > 0) {
+        memmove(c->buffer, c->buffer + off, c->len - off);
+        c->len -= off;
+    }
+
+    return progress;
+}
+
+typedef int (*process_fn)(struct conn *c, const struct pipeline *p);
+
+static int process_plain(struct conn *c, const struct pipeline *p) {
+    return process(c, p, HOT_PLAIN);
+}
+
+static int process_observed(struct conn *c, const struct pipeline *p) {
+    return process(c, p, HOT_OBSERVED);
+}
+
+static int process_timed(struct conn *c, const struct pipeline *p) {
+    return process(c, p, HOT_TIMED);
+}
+
+static int process_observed_timed(struct conn *c, const struct pipeline *p) {
+    return process(c, p, HOT_OBSERVED | HOT_TIMED);
+}
+
+static const process_fn processors[HOT_VARIANTS] = {
+    [HOT_PLAIN] = process_plain,
+    [HOT_OBSERVED] = process_observed,
+    [HOT_TIMED] = process_timed,
+    [HOT_OBSERVED | HOT_TIMED] = process_observed_timed,
+};
+
+// What conn_written() does once a response is out: time the write for the
+// histogram, hand a --log-timing record to the log, both or nothing
+static void written_plain(struct conn *c) {
+}
+
+static void written_observed(struct conn *c) {
+    metric_observe(&c->w->metrics.latency[LATENCY_WRITE],
+                   metric_clock() - c->write_start);
+}
+
+static void written_timed(struct conn *c) {
+    accesslog_written(c, 1);
+}
+
+static void written_observed_timed(struct conn *c) {
+    accesslog_written(c, 1);
+    written_observed(c);
+}
+
+static void (*const writers[HOT_VARIANTS])(struct conn *c) = {
+    [HOT_PLAIN] = written_plain,
+    [HOT_OBSERVED] = written_observed,
+    [HOT_TIMED] = written_timed,
+    [HOT_OBSERVED | HOT_TIMED] = written_observed_timed,
+};
+
+void http_worker_init(struct worker *w) {
+    const struct pipeline *p =
+        atomic_load_explicit(&pipeline, memory_order_acquire);
+    w->written = writers[p->hot];
+}
+
+int http_process(struct conn *c) {
+    const struct pipeline *p =
+        atomic_load_explicit(&pipeline, memory_order_acquire);
+    // Cheaper than asking for p on every write. Right after a reload that
+    // turns --metrics on, a response queued before it may be timed from a
+    // stale stamp.
+    c->w->written = writers[p->hot];
+    return processors[p->hot](c, p);
+}
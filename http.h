@@ -0,0 +1,57 @@
+#ifndef WEBSERVER_HTTP_H
+#define WEBSERVER_HTTP_H
+
+#include "conn.h"
+#include "http_parser.h"
+#include "resp_cache.h"
+#include "router.h"
+
+// Answer a routed request by queueing the response on c. The caller
+// guarantees STATIC_MAX_SEGMENTS free queue slots. Returns the status code
+// and stores the bytes queued in *bytes.
+typedef int (*http_handler)(struct conn *c, const struct http_request *req,
+                            const struct route_match *m, enum resp_variant v,
+                            size_t *bytes);
+
+// Route methods on pattern (see router.h) to fn; call before http_init().
+// The pattern must stay valid: every pipeline is built from it.
+int http_route(unsigned methods, const char *pattern, http_handler fn);
+
+// Like http_route(), for a handler that blocks or takes long enough to
+// stall the event loop. It runs on the offload pool (see offload.h), if
+// there is one, with c to itself; it must not touch the worker's state
+// and takes its compressor from offload_zip().
+int http_route_blocking(unsigned methods, const char *pattern,
+                        http_handler fn);
+
+// Build the canned responses and the request pipeline, with the routing
+// table; call once before serving
+int http_init(void);
+
+// Rebuild the pipeline with the routes and --metrics of cfg and swap it in
+// for every worker at once. Everything else stays as the server started.
+// Returns -1, keeping the old pipeline, if cfg has a bad route.
+int http_reload(const struct server_config *cfg);
+
+// Point w->written at what the current pipeline does once a response is
+// out, see conn_written(); call on w's thread before it serves. From then
+// on http_process() keeps it current.
+void http_worker_init(struct worker *w);
+
+// Answer every complete request buffered on c, in order, by queueing the
+// responses on the connection. Consumed requests and the request bodies
+// behind them are removed from the buffer; a head or body over the
+// configured limits is answered with an error before the connection is
+// closed. Stops early once the write queue is full or the connection is
+// to be closed. Returns non-zero if anything was consumed.
+int http_process(struct conn *c);
+
+// Answer req, an HTTP/2 stream, by queueing the response on the stream's
+// connection c, which the session frames; the variant never says how a
+// connection goes on. too_large means the header block was over the
+// limits. If body_follows, the request body arrives later and has to be
+// announced by Content-Length; c->body_left counts it down.
+void http_process_stream(struct conn *c, const struct http_request *req,
+                         int too_large, int body_follows);
+
+#endif
@@ -0,0 +1,934 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "http_cache.h"
+#include "server.h"
+
+#define CACHE_SHARDS 64
+#define CACHE_BUCKETS 256           // per shard
+#define CACHE_OBJECT_SHARE 8        // an entry takes at most 1/8 of the cache
+#define CACHE_PASS_TTL 10000        // ms a key is not stored after a refusal
+#define CACHE_VARY_MAX 8            // request headers a Vary may name
+
+struct entry {
+    struct entry *next;             // in the bucket
+    struct entry *clock_next;       // in the shard's ring
+    struct entry *clock_prev;
+    uint32_t hash;
+    unsigned referenced;            // hit since the hand last came by
+    const char *key;                // "HOST\nURI"
+    size_t key_len;
+    // The headers of the request the response varies on, with the values
+    // that request had; a NULL value for a header it did not have
+    unsigned nvary;
+    struct http_str vary_name[CACHE_VARY_MAX];
+    struct http_str vary_value[CACHE_VARY_MAX];
+    struct cached_response *resp;           // NULL for a do-not-store marker
+    struct cached_response *not_modified;   // NULL without an ETag
+    struct http_str etag;           // as the backend sent it
+    struct http_str last_modified;
+    uint64_t expires;               // monotonic milliseconds
+    uint64_t lifetime;              // milliseconds it is fresh for
+    size_t size;                    // bytes it takes, with the responses
+    char strings[];                 // key and the header names and values
+};
+
+struct http_cache_fill {
+    struct http_cache_fill *next;   // in the shard's fetches in progress
+    unsigned shard;
+    uint32_t hash;
+    char *key;
+    size_t key_len;
+    struct http_cache_waiter *waiters;
+    struct entry *stale;            // taken out of the table to revalidate
+    struct entry *entry;            // what the response is stored as
+    uint64_t received;              // when the response head arrived
+    char *head;                     // the response head to store
+    size_t head_len;
+    char *body;
+    size_t body_len, body_cap;
+};
+
+struct shard {
+    _Alignas(64) pthread_mutex_t lock;
+    struct entry *buckets[CACHE_BUCKETS];
+    struct http_cache_fill *fills;
+    struct entry *hand;             // next to be looked at for eviction
+    unsigned nentries;
+};
+
+static struct shard *shards;
+static _Atomic size_t cache_used;          // bytes in all shards
+static atomic_uint clock_shard;             // shard the next eviction tries
+static size_t object_max;
+
+int http_cache_init(void) {
+    if (config.cache_size == 0) {
+        return 0;
+    }
+    shards = aligned_alloc(64, sizeof(struct shard) * CACHE_SHARDS);
+    if (shards == NULL) {
+        perror("webserver (aligned_alloc)");
+        return -1;
+    }
+    memset(shards, 0, sizeof(struct shard) * CACHE_SHARDS);
+    for (int s = 0; s < CACHE_SHARDS; s++) {
+        pthread_mutex_init(&shards[s].lock, NULL);
+    }
+    object_max = config.cache_size / CACHE_OBJECT_SHARE;
+    return 0;
+}
+
+int http_cache_enabled(void) {
+    return shards != NULL;
+}
+
+int http_cache_mailbox_init(struct http_cache_mailbox *mb) {
+    pthread_mutex_init(&mb->lock, NULL);
+    mb->head = NULL;
+    mb->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (mb->fd < 0) {
+        perror("webserver (eventfd)");
+        return -1;
+    }
+    return 0;
+}
+
+void http_cache_mailbox_free(struct http_cache_mailbox *mb) {
+    close(mb->fd);
+    pthread_mutex_destroy(&mb->lock);
+}
+
+struct http_cache_waiter *http_cache_mailbox_take(
+    struct http_cache_mailbox *mb) {
+    pthread_mutex_lock(&mb->lock);
+    struct http_cache_waiter *list = mb->head;
+    mb->head = NULL;
+    for (struct http_cache_waiter *w = list; w != NULL; w = w->next) {
+        w->in_mailbox = 0;
+    }
+    pthread_mutex_unlock(&mb->lock);
+    return list;
+}
+
+// FNV-1a, continued from h
+static uint32_t hash_bytes(uint32_t h, const char *p, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (unsigned char)p[i]) * 16777619u;
+    }
+    return h;
+}
+
+static uint32_t hash_key(const struct http_str *host,
+                         const struct http_str *uri) {
+    uint32_t h = hash_bytes(2166136261u, host->ptr, host->len);
+    h = hash_bytes(h, "\n", 1);
+    return hash_bytes(h, uri->ptr, uri->len);
+}
+
+static int key_equal(const char *key, size_t len, const struct http_str *host,
+                     const struct http_str *uri) {
+    return len == host->len + 1 + uri->len &&
+           memcmp(key, host->ptr, host->len) == 0 && key[host->len] == '\n' &&
+           memcmp(key + host->len + 1, uri->ptr, uri->len) == 0;
+}
+
+static struct entry **bucket(struct shard *s, uint32_t hash) {
+    return &s->buckets[(hash / CACHE_SHARDS) % CACHE_BUCKETS];
+}
+
+// Does the request have the values e was stored for, in the headers the
+// response varies on?
+static int vary_match(const struct entry *e, const struct http_request *req) {
+    for (unsigned i = 0; i < e->nvary; i++) {
+        const struct http_str *v = http_header_get(req, e->vary_name[i].ptr);
+        const struct http_str *want = &e->vary_value[i];
+        if ((v == NULL) != (want->ptr == NULL) ||
+            (v != NULL && (v->len != want->len ||
+                           memcmp(v->ptr, want->ptr, v->len) != 0))) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Do a and b store the same key for the same request header values?
+static int same_variant(const struct entry *a, const struct entry *b) {
+    if (a->hash != b->hash || a->key_len != b->key_len ||
+        memcmp(a->key, b->key, a->key_len) != 0 || a->nvary != b->nvary) {
+        return 0;
+    }
+    for (unsigned i = 0; i < a->nvary; i++) {
+        const struct http_str *x = &a->vary_value[i], *y = &b->vary_value[i];
+        if (a->vary_name[i].len != b->vary_name[i].len ||
+            strcasecmp(a->vary_name[i].ptr, b->vary_name[i].ptr) != 0 ||
+            (x->ptr == NULL) != (y->ptr == NULL) || x->len != y->len ||
+            (x->ptr != NULL && memcmp(x->ptr, y->ptr, x->len) != 0)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void entry_free(struct entry *e) {
+    if (e->resp != NULL) {
+        rcbuf_put(&e->resp->rc);
+    }
+    if (e->not_modified != NULL) {
+        rcbuf_put(&e->not_modified->rc);
+    }
+    free(e);
+}
+
+// Take e out of its shard's table and ring
+static void unlink_entry(struct shard *s, struct entry *e) {
+    struct entry **p = bucket(s, e->hash);
+    while (*p != e) {
+        p = &(*p)->next;
+    }
+    *p = e->next;
+    if (e->clock_next == e) {
+        s->hand = NULL;
+    } else {
+        e->clock_prev->clock_next = e->clock_next;
+        e->clock_next->clock_prev = e->clock_prev;
+        if (s->hand == e) {
+            s->hand = e->clock_next;
+        }
+    }
+    s->nentries--;
+    atomic_fetch_sub_explicit(&cache_used, e->size, memory_order_relaxed);
+}
+
+// Add e to the shard, replacing the entry for the same variant, just
+// behind the hand so it has a full sweep before it is looked at
+static void insert_entry(struct shard *s, struct entry *e) {
+    for (struct entry *old = *bucket(s, e->hash); old != NULL;
+         old = old->next) {
+        if (same_variant(old, e)) {
+            unlink_entry(s, old);
+            entry_free(old);
+            break;
+        }
+    }
+    struct entry **b = bucket(s, e->hash);
+    e->next = *b;
+    *b = e;
+    if (s->hand == NULL) {
+        e->clock_next = e->clock_prev = e;
+        s->hand = e;
+    } else {
+        e->clock_next = s->hand;
+        e->clock_prev = s->hand->clock_prev;
+        e->clock_prev->clock_next = e;
+        s->hand->clock_prev = e;
+    }
+    e->referenced = 0;
+    s->nentries++;
+    atomic_fetch_add_explicit(&cache_used, e->size, memory_order_relaxed);
+}
+
+// Evict the first entry the hand of s finds unmarked. Returns 0 if s is
+// empty.
+static int evict_one(struct shard *s) {
+    for (unsigned steps = 0; s->hand != NULL && steps <= s->nentries;
+         steps++) {
+        struct entry *e = s->hand;
+        if (e->referenced) {
+            e->referenced = 0;
+            s->hand = e->clock_next;
+            continue;
+        }
+        unlink_entry(s, e);
+        entry_free(e);
+        return 1;
+    }
+    if (s->hand != NULL) {
+        // Everything was marked; the sweep cleared the marks
+        struct entry *e = s->hand;
+        unlink_entry(s, e);
+        entry_free(e);
+        return 1;
+    }
+    return 0;
+}
+
+// Evict until the cache fits into --cache-size again. Called without any
+// shard lock held.
+static unsigned evict(void) {
+    unsigned evicted = 0, empty = 0;
+    while (atomic_load_explicit(&cache_used, memory_order_relaxed) >
+               config.cache_size &&
+           empty < CACHE_SHARDS) {
+        struct shard *s =
+            &shards[atomic_fetch_add_explicit(&clock_shard, 1,
+                                              memory_order_relaxed) %
+                    CACHE_SHARDS];
+        pthread_mutex_lock(&s->lock);
+        int done = evict_one(s);
+        pthread_mutex_unlock(&s->lock);
+        if (done) {
+            evicted++;
+            empty = 0;
+        } else {
+            empty++;
+        }
+    }
+    return evicted;
+}
+
+// Is directive, e.g. "max-age", in the Cache-Control value cc? Stores its
+// numeric argument in *arg, or -1 if it has none.
+static int directive(const struct http_str *cc, const char *name,
+                     long *arg) {
+    size_t name_len = strlen(name);
+    const char *p = cc->ptr, *end = cc->ptr + cc->len;
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) {
+            p++;
+        }
+        const char *tok = p;
+        while (p < end && *p != ',' && *p != '=' && *p != ' ') {
+            p++;
+        }
+        int match = (size_t)(p - tok) == name_len &&
+                    strncasecmp(tok, name, name_len) == 0;
+        long n = -1;
+        if (p < end && *p == '=') {
+            p++;
+            if (p < end && *p == '"') {
+                p++;
+            }
+            if (p < end && *p >= '0' && *p <= '9') {
+                n = 0;
+                while (p < end && *p >= '0' && *p <= '9') {
+                    n = n < 100000000 ? n * 10 + (*p - '0') : n;
+                    p++;
+                }
+            }
+        }
+        while (p < end && *p != ',') {
+            p++;
+        }
+        if (match) {
+            if (arg != NULL) {
+                *arg = n;
+            }
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Must req be answered by the backend itself? Stores in *revalidate
+// whether a stored response must be checked with the backend first.
+static int request_bypasses(const struct http_request *req,
+                            int *revalidate) {
+    *revalidate = 0;
+    if (http_header_get(req, "Authorization") != NULL) {
+        return 1;
+    }
+    const struct http_str *cc = http_header_get(req, "Cache-Control");
+    long age;
+    if (cc != NULL) {
+        if (directive(cc, "no-store", NULL)) {
+            return 1;
+        }
+        *revalidate = directive(cc, "no-cache", NULL) ||
+                      (directive(cc, "max-age", &age) && age == 0);
+    }
+    const struct http_str *pragma = http_header_get(req, "Pragma");
+    if (pragma != NULL && http_has_token(pragma, "no-cache")) {
+        *revalidate = 1;
+    }
+    return 0;
+}
+
+// Does the request's If-None-Match name e's ETag? A weak ETag matches,
+// as If-None-Match compares weakly.
+static int etag_matches(const struct entry *e,
+                        const struct http_request *req) {
+    const struct http_str *inm = http_header_get(req, "If-None-Match");
+    if (inm == NULL || e->not_modified == NULL) {
+        return 0;
+    }
+    const char *tag = e->etag.ptr;
+    size_t len = e->etag.len;
+    if (len > 2 && tag[0] == 'W' && tag[1] == '/') {
+        tag += 2;
+        len -= 2;
+    }
+    return (inm->len == 1 && inm->ptr[0] == '*') ||
+           memmem(inm->ptr, inm->len, tag, len) != NULL;
+}
+
+enum http_cache_result http_cache_lookup(const struct http_request *req,
+                                         uint64_t now, int may_fill,
+                                         struct http_cache_waiter *w,
+                                         struct http_cache_mailbox *mb,
+                                         const struct cached_response **resp,
+                                         struct http_cache_fill **fill) {
+    int revalidate;
+    int head = req->method.len == 4 && memcmp(req->method.ptr, "HEAD", 4) == 0;
+    int get = req->method.len == 3 && memcmp(req->method.ptr, "GET", 3) == 0;
+    if ((!get && !head) || request_bypasses(req, &revalidate)) {
+        return HTTP_CACHE_PASS;
+    }
+    static const struct http_str no_host = {"", 0};
+    const struct http_str *host = http_header_get(req, "Host");
+    if (host == NULL) {
+        host = &no_host;
+    }
+    uint32_t hash = hash_key(host, &req->uri);
+    unsigned si = hash % CACHE_SHARDS;
+    struct shard *s = &shards[si];
+
+    pthread_mutex_lock(&s->lock);
+    struct entry *e = *bucket(s, hash);
+    for (; e != NULL; e = e->next) {
+        if (e->hash == hash && key_equal(e->key, e->key_len, host, &req->uri) &&
+            vary_match(e, req)) {
+            break;
+        }
+    }
+    if (e != NULL && e->resp == NULL) {
+        if (now < e->expires) {
+            pthread_mutex_unlock(&s->lock);
+            return HTTP_CACHE_PASS;
+        }
+        unlink_entry(s, e);
+        entry_free(e);
+        e = NULL;
+    }
+    if (e != NULL && now < e->expires && !revalidate) {
+        e->referenced = 1;
+        const struct cached_response *r =
+            etag_matches(e, req) ? e->not_modified : e->resp;
+        rcbuf_get((struct rcbuf *)&r->rc);
+        pthread_mutex_unlock(&s->lock);
+        *resp = r;
+        return HTTP_CACHE_HIT;
+    }
+
+    struct http_cache_fill *f = s->fills;
+    while (f != NULL && (f->hash != hash ||
+                         !key_equal(f->key, f->key_len, host, &req->uri))) {
+        f = f->next;
+    }
+    if (f != NULL && w != NULL) {
+        w->fill = f;
+        w->mailbox = mb;
+        w->shard = si;
+        w->in_mailbox = 0;
+        w->next = f->waiters;
+        f->waiters = w;
+        pthread_mutex_unlock(&s->lock);
+        return HTTP_CACHE_WAIT;
+    }
+    if (f != NULL || !may_fill || !get) {
+        pthread_mutex_unlock(&s->lock);
+        return HTTP_CACHE_PASS;
+    }
+
+    f = calloc(1, sizeof(*f));
+    char *key = malloc(host->len + 1 + req->uri.len);
+    if (f == NULL || key == NULL) {
+        pthread_mutex_unlock(&s->lock);
+        perror("webserver (malloc)");
+        free(f);
+        free(key);
+        return HTTP_CACHE_PASS;
+    }
+    memcpy(key, host->ptr, host->len);
+    key[host->len] = '\n';
+    memcpy(key + host->len + 1, req->uri.ptr, req->uri.len);
+    f->key = key;
+    f->key_len = host->len + 1 + req->uri.len;
+    f->hash = hash;
+    f->shard = si;
+    if (e != NULL) {
+        // Stale: revalidated by the fetch if it can be, else replaced
+        unlink_entry(s, e);
+        if (e->etag.ptr != NULL || e->last_modified.ptr != NULL) {
+            f->stale = e;
+        } else {
+            entry_free(e);
+        }
+    }
+    f->next = s->fills;
+    s->fills = f;
+    pthread_mutex_unlock(&s->lock);
+    *fill = f;
+    return HTTP_CACHE_MISS;
+}
+
+void http_cache_cancel(struct http_cache_waiter *w) {
+    if (w->mailbox == NULL) {
+        return;
+    }
+    struct shard *s = &shards[w->shard];
+    pthread_mutex_lock(&s->lock);
+    if (w->fill != NULL) {
+        struct http_cache_waiter **p = &w->fill->waiters;
+        while (*p != w) {
+            p = &(*p)->next;
+        }
+        *p = w->next;
+        w->fill = NULL;
+    }
+    pthread_mutex_unlock(&s->lock);
+    struct http_cache_mailbox *mb = w->mailbox;
+    pthread_mutex_lock(&mb->lock);
+    if (w->in_mailbox) {
+        struct http_cache_waiter **p = &mb->head;
+        while (*p != w) {
+            p = &(*p)->next;
+        }
+        *p = w->next;
+        w->in_mailbox = 0;
+    }
+    pthread_mutex_unlock(&mb->lock);
+    w->mailbox = NULL;
+}
+
+size_t http_cache_fill_validators(const struct http_cache_fill *f,
+                                  char *out, size_t cap) {
+    const struct entry *e = f->stale;
+    if (e == NULL) {
+        return 0;
+    }
+    int n = 0;
+    if (e->etag.ptr != NULL) {
+        n = snprintf(out, cap, "If-None-Match: %.*s\r\n", (int)e->etag.len,
+                     e->etag.ptr);
+    } else {
+        n = snprintf(out, cap, "If-Modified-Since: %.*s\r\n",
+                     (int)e->last_modified.len, e->last_modified.ptr);
+    }
+    return n > 0 && (size_t)n < cap ? (size_t)n : 0;
+}
+
+// Take f out of its shard and hand its waiters to their mailboxes. Called
+// with the shard lock held.
+static void fill_done(struct shard *s, struct http_cache_fill *f) {
+    struct http_cache_fill **p = &s->fills;
+    while (*p != f) {
+        p = &(*p)->next;
+    }
+    *p = f->next;
+    struct http_cache_waiter *w = f->waiters;
+    while (w != NULL) {
+        struct http_cache_waiter *next = w->next;
+        struct http_cache_mailbox *mb = w->mailbox;
+        w->fill = NULL;
+        pthread_mutex_lock(&mb->lock);
+        w->next = mb->head;
+        mb->head = w;
+        w->in_mailbox = 1;
+        pthread_mutex_unlock(&mb->lock);
+        uint64_t one = 1;
+        if (write(mb->fd, &one, sizeof(one)) < 0) {
+            // Only fails with the counter about to overflow: it is set
+        }
+        w = next;
+    }
+}
+
+static void fill_free(struct http_cache_fill *f) {
+    if (f->stale != NULL) {
+        entry_free(f->stale);
+    }
+    if (f->entry != NULL) {
+        entry_free(f->entry);
+    }
+    free(f->key);
+    free(f->head);
+    free(f->body);
+    free(f);
+}
+
+// End f, storing e for its key if not NULL
+static void fill_end(struct http_cache_fill *f, struct entry *e) {
+    struct shard *s = &shards[f->shard];
+    pthread_mutex_lock(&s->lock);
+    if (e != NULL) {
+        insert_entry(s, e);
+    }
+    fill_done(s, f);
+    pthread_mutex_unlock(&s->lock);
+    fill_free(f);
+}
+
+void http_cache_fill_abort(struct http_cache_fill *f) {
+    // A stale entry stays for the next request to try again
+    struct entry *stale = f->stale;
+    f->stale = NULL;
+    fill_end(f, stale);
+}
+
+// An entry for f's key that is passed to the backend until now + ttl
+static struct entry *pass_marker(const struct http_cache_fill *f,
+                                 uint64_t now) {
+    struct entry *e = calloc(1, sizeof(*e) + f->key_len);
+    if (e == NULL) {
+        perror("webserver (calloc)");
+        return NULL;
+    }
+    memcpy(e->strings, f->key, f->key_len);
+    e->key = e->strings;
+    e->key_len = f->key_len;
+    e->hash = f->hash;
+    e->expires = now + CACHE_PASS_TTL;
+    e->size = sizeof(*e) + f->key_len;
+    return e;
+}
+
+// Parse the header lines of a response head into resp->headers, so
+// http_header_get() finds them. Returns -1 if there are too many.
+static int parse_fields(const char *head, size_t len,
+                        struct http_request *resp) {
+    const char *p = memchr(head, '\n', len);
+    const char *end = head + len;
+    resp->nheaders = 0;
+    if (p == NULL) {
+        return -1;
+    }
+    for (p++; p < end;) {
+        const char *eol = memchr(p, '\n', end - p);
+        if (eol == NULL) {
+            eol = end;
+        }
+        const char *colon = memchr(p, ':', eol - p);
+        if (colon != NULL) {
+            if (resp->nheaders == HTTP_MAX_HEADERS) {
+                return -1;
+            }
+            struct http_header *h = &resp->headers[resp->nheaders++];
+            h->name.ptr = p;
+            h->name.len = colon - p;
+            const char *v = colon + 1, *vend = eol;
+            while (v < vend && (*v == ' ' || *v == '\t')) {
+                v++;
+            }
+            while (vend > v && (vend[-1] == '\r' || vend[-1] == ' ')) {
+                vend--;
+            }
+            h->value.ptr = v;
+            h->value.len = vend - v;
+        }
+        p = eol + 1;
+    }
+    return 0;
+}
+
+// How long a response with these headers may be served, in milliseconds,
+// or 0 if it must not be stored
+static uint64_t freshness(const struct http_request *resp) {
+    const struct http_str *cc = http_header_get(resp, "Cache-Control");
+    long max_age = -1;
+    if (cc == NULL || directive(cc, "no-store", NULL) ||
+        directive(cc, "private", NULL) || directive(cc, "no-cache", NULL) ||
+        (!directive(cc, "s-maxage", &max_age) &&
+         !directive(cc, "max-age", &max_age)) ||
+        max_age <= 0) {
+        return 0;
+    }
+    const struct http_str *age = http_header_get(resp, "Age");
+    long aged = 0;
+    if (age != NULL) {
+        for (size_t i = 0; i < age->len && age->ptr[i] >= '0' &&
+                           age->ptr[i] <= '9' && aged < max_age;
+             i++) {
+            aged = aged * 10 + (age->ptr[i] - '0');
+        }
+    }
+    return aged < max_age ? (uint64_t)(max_age - aged) * 1000 : 0;
+}
+
+static int storable_status(int status) {
+    switch (status) {
+    case 200:
+    case 203:
+    case 204:
+    case 300:
+    case 301:
+    case 308:
+    case 404:
+    case 410:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+// Is this header line one of those a 304 carries?
+static int not_modified_field(const struct http_str *name) {
+    static const char *const names[] = {
+        "Server", "Date", "ETag", "Cache-Control", "Expires", "Vary",
+        "Content-Location",
+    };
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if (name->len == strlen(names[i]) &&
+            strncasecmp(name->ptr, names[i], name->len) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int field_is(const struct http_str *name, const char *want) {
+    return name->len == strlen(want) &&
+           strncasecmp(name->ptr, want, name->len) == 0;
+}
+
+// The entry f stores the response with these headers as, without its
+// responses yet. req is the request that was sent.
+static struct entry *new_entry(const struct http_cache_fill *f,
+                               const struct http_request *resp,
+                               const struct http_request *req,
+                               uint64_t lifetime, uint64_t now) {
+    const struct http_str *vary = http_header_get(resp, "Vary");
+    const struct http_str *etag = http_header_get(resp, "ETag");
+    const struct http_str *lm = http_header_get(resp, "Last-Modified");
+
+    // The names Vary lists
+    struct http_str names[CACHE_VARY_MAX];
+    unsigned nvary = 0;
+    size_t strings = f->key_len;
+    if (vary != NULL) {
+        const char *p = vary->ptr, *end = vary->ptr + vary->len;
+        while (p < end) {
+            while (p < end && (*p == ' ' || *p == ',')) {
+                p++;
+            }
+            const char *tok = p;
+            while (p < end && *p != ',' && *p != ' ') {
+                p++;
+            }
+            if (p == tok) {
+                continue;
+            }
+            if (nvary == CACHE_VARY_MAX || (p - tok == 1 && *tok == '*')) {
+                return NULL;
+            }
+            names[nvary].ptr = tok;
+            names[nvary].len = p - tok;
+            strings += names[nvary].len + 1;
+            nvary++;
+        }
+    }
+    const struct http_str *values[CACHE_VARY_MAX];
+    for (unsigned i = 0; i < nvary; i++) {
+        char name[64];
+        if (names[i].len >= sizeof(name)) {
+            return NULL;
+        }
+        memcpy(name, names[i].ptr, names[i].len);
+        name[names[i].len] = '\0';
+        values[i] = http_header_get(req, name);
+        strings += values[i] != NULL ? values[i]->len : 0;
+    }
+    strings += (etag != NULL ? etag->len : 0) + (lm != NULL ? lm->len : 0);
+
+    struct entry *e = calloc(1, sizeof(*e) + strings);
+    if (e == NULL) {
+        perror("webserver (calloc)");
+        return NULL;
+    }
+    char *p = e->strings;
+    memcpy(p, f->key, f->key_len);
+    e->key = p;
+    e->key_len = f->key_len;
+    p += f->key_len;
+    e->nvary = nvary;
+    for (unsigned i = 0; i < nvary; i++) {
+        // NUL-terminated for http_header_get()
+        memcpy(p, names[i].ptr, names[i].len);
+        p[names[i].len] = '\0';
+        e->vary_name[i].ptr = p;
+        e->vary_name[i].len = names[i].len;
+        p += names[i].len + 1;
+        if (values[i] != NULL) {
+            memcpy(p, values[i]->ptr, values[i]->len);
+            e->vary_value[i].ptr = p;
+            e->vary_value[i].len = values[i]->len;
+            p += values[i]->len;
+        }
+    }
+    if (etag != NULL) {
+        memcpy(p, etag->ptr, etag->len);
+        e->etag.ptr = p;
+        e->etag.len = etag->len;
+        p += etag->len;
+    }
+    if (lm != NULL) {
+        memcpy(p, lm->ptr, lm->len);
+        e->last_modified.ptr = p;
+        e->last_modified.len = lm->len;
+    }
+    e->hash = f->hash;
+    e->lifetime = lifetime;
+    e->expires = now + lifetime;
+    e->size = sizeof(*e) + strings;
+    return e;
+}
+
+enum http_cache_fill_result http_cache_fill_head(
+    struct http_cache_fill *f, int status, const char *head, size_t len,
+    const char *req_head, size_t req_len, uint64_t now,
+    const struct cached_response **resp) {
+    struct http_request fields;
+    int too_many = parse_fields(head, len, &fields) != 0;
+
+    if (status == 304 && f->stale != NULL && !too_many) {
+        // Fresh again, for as long as the 304 or else the entry said
+        struct entry *e = f->stale;
+        uint64_t lifetime = freshness(&fields);
+        if (lifetime == 0) {
+            lifetime = e->lifetime;
+        }
+        e->expires = now + lifetime;
+        f->stale = NULL;
+        rcbuf_get(&e->resp->rc);
+        *resp = e->resp;
+        fill_end(f, e);
+        return HTTP_CACHE_REFRESHED;
+    }
+
+    uint64_t lifetime = 0;
+    struct http_request req;
+    struct http_parser parser;
+    http_parser_init(&parser);
+    if (!too_many && storable_status(status) &&
+        http_header_get(&fields, "Set-Cookie") == NULL &&
+        http_parse(&parser, req_head, req_len, &req) > 0) {
+        lifetime = freshness(&fields);
+    }
+    const struct http_str *length = http_header_get(&fields,
+                                                    "Content-Length");
+    if (lifetime > 0 && length != NULL &&
+        strtoull(length->ptr, NULL, 10) > object_max) {
+        lifetime = 0;
+    }
+    if (lifetime == 0 || (f->entry = new_entry(f, &fields, &req, lifetime,
+                                               now)) == NULL) {
+        if (status >= 500 || status == 304) {
+            // Says nothing about whether the next one may be stored
+            http_cache_fill_abort(f);
+        } else {
+            fill_end(f, pass_marker(f, now));
+        }
+        return HTTP_CACHE_DROPPED;
+    }
+    if (f->stale != NULL) {
+        entry_free(f->stale);
+        f->stale = NULL;
+    }
+    f->received = now;
+
+    // The head to store: the status line and the header lines apart from
+    // those that describe this one transfer
+    f->head = malloc(len + 2);
+    if (f->head == NULL) {
+        perror("webserver (malloc)");
+        http_cache_fill_abort(f);
+        return HTTP_CACHE_DROPPED;
+    }
+    const char *line_end = memchr(head, '\n', len) + 1;
+    memcpy(f->head, head, line_end - head);
+    f->head_len = line_end - head;
+    for (unsigned i = 0; i < fields.nheaders; i++) {
+        const struct http_header *h = &fields.headers[i];
+        if (field_is(&h->name, "Content-Length") ||
+            field_is(&h->name, "Transfer-Encoding") ||
+            field_is(&h->name, "Age")) {
+            continue;
+        }
+        const char *start = h->name.ptr;
+        const char *eol = memchr(h->value.ptr, '\n',
+                                 head + len - h->value.ptr);
+        size_t n = (eol != NULL ? eol + 1 : head + len) - start;
+        memcpy(f->head + f->head_len, start, n);
+        f->head_len += n;
+    }
+    return HTTP_CACHE_STORE;
+}
+
+int http_cache_fill_body(struct http_cache_fill *f, const char *data,
+                         size_t len) {
+    if (f->body_len + len > object_max) {
+        fill_end(f, pass_marker(f, f->received));
+        return -1;
+    }
+    if (f->body_len + len > f->body_cap) {
+        size_t cap = f->body_cap > 0 ? f->body_cap : 16 * 1024;
+        while (cap < f->body_len + len) {
+            cap *= 2;
+        }
+        char *body = realloc(f->body, cap);
+        if (body == NULL) {
+            perror("webserver (realloc)");
+            http_cache_fill_abort(f);
+            return -1;
+        }
+        f->body = body;
+        f->body_cap = cap;
+    }
+    memcpy(f->body + f->body_len, data, len);
+    f->body_len += len;
+    return 0;
+}
+
+// The 304 answering a matching If-None-Match for e, with the headers the
+// stored head has of those a 304 carries
+static struct cached_response *build_not_modified(const char *head,
+                                                  size_t len) {
+    struct http_request fields;
+    parse_fields(head, len, &fields);
+    // Lines may gain the space after the colon
+    char *out = malloc(len + 32 + 2 * HTTP_MAX_HEADERS);
+    if (out == NULL) {
+        perror("webserver (malloc)");
+        return NULL;
+    }
+    size_t n = sprintf(out, "HTTP/1.1 304 %s\r\n", resp_reason_phrase(304));
+    for (unsigned i = 0; i < fields.nheaders; i++) {
+        const struct http_header *h = &fields.headers[i];
+        if (not_modified_field(&h->name)) {
+            n += sprintf(out + n, "%.*s: %.*s\r\n", (int)h->name.len,
+                         h->name.ptr, (int)h->value.len, h->value.ptr);
+        }
+    }
+    struct cached_response *r = resp_build_relayed(304, out, n, NULL, 0);
+    free(out);
+    return r;
+}
+
+unsigned http_cache_fill_finish(struct http_cache_fill *f) {
+    struct entry *e = f->entry;
+    int status = atoi(f->head + 9);
+    e->resp = resp_build_relayed(status, f->head, f->head_len, f->body,
+                                 f->body_len);
+    if (e->resp == NULL) {
+        http_cache_fill_abort(f);
+        return 0;
+    }
+    if (e->etag.ptr != NULL) {
+        e->not_modified = build_not_modified(f->head, f->head_len);
+    }
+    e->size += sizeof(struct cached_response) +
+               f->head_len * RESP_VARIANTS + f->body_len * RESP_VARIANTS;
+    if (e->not_modified != NULL) {
+        e->size += sizeof(struct cached_response) + f->head_len;
+    }
+    f->entry = NULL;
+    fill_end(f, e);
+    return evict();
+}
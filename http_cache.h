@@ -0,0 +1,118 @@
+#ifndef WEBSERVER_HTTP_CACHE_H
+#define WEBSERVER_HTTP_CACHE_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "http_parser.h"
+#include "resp_cache.h"
+
+// A shared cache of proxied responses, enabled by --cache-size. Entries
+// are keyed on Host and URI of a GET and on the request headers the
+// response names in Vary, and are kept for as long as its Cache-Control
+// max-age or s-maxage says. A stale entry with an ETag or Last-Modified is
+// revalidated with a conditional request, and a 304 from the backend makes
+// it fresh again. Responses are stored serialized, once per way the
+// connection continues, so a hit is queued like any cached response.
+//
+// The table is split into shards with a lock each. When the cache is over
+// --cache-size, entries are evicted by CLOCK: a hit marks an entry, and
+// the hand sweeping a shard spares a marked entry once.
+//
+// Only one request per key goes to a backend at a time: requests for a key
+// that is being fetched wait for the fetch to finish, wherever they
+// arrived, and then look again. Responses that must not be stored leave a
+// marker that lets requests for the key go to the backend directly for a
+// while, so they do not queue up behind each other.
+
+// A request waiting for a fetch in progress, embedded in the caller's
+// state. When the fetch is done it is moved to the mailbox given to
+// http_cache_lookup(), whose eventfd is written.
+struct http_cache_waiter {
+    struct http_cache_waiter *next;
+    struct http_cache_fill *fill;   // being waited for, under its shard lock
+    struct http_cache_mailbox *mailbox;
+    unsigned shard;
+    int in_mailbox;                 // under the mailbox lock
+};
+
+// Where the waiters of one worker go once their fetch is done
+struct http_cache_mailbox {
+    pthread_mutex_t lock;
+    struct http_cache_waiter *head;
+    int fd;                         // eventfd
+};
+
+enum http_cache_result {
+    HTTP_CACHE_HIT,         // *resp is the response to queue
+    HTTP_CACHE_MISS,        // fetch and store the response through *fill
+    HTTP_CACHE_WAIT,        // another request is fetching it
+    HTTP_CACHE_PASS,        // not for the cache, fetch it
+};
+
+// What to do with the response of a fetch, see http_cache_fill_head()
+enum http_cache_fill_result {
+    HTTP_CACHE_STORE,       // pass the body to http_cache_fill_body()
+    HTTP_CACHE_REFRESHED,   // a 304 made the stale entry *resp fresh again
+    HTTP_CACHE_DROPPED,     // not stored; the fill is gone
+};
+
+// Set up the shards; does nothing without --cache-size
+int http_cache_init(void);
+
+// Is the cache on?
+int http_cache_enabled(void);
+
+int http_cache_mailbox_init(struct http_cache_mailbox *mb);
+void http_cache_mailbox_free(struct http_cache_mailbox *mb);
+
+// Take the waiters whose fetch finished, after a read of mb->fd
+struct http_cache_waiter *http_cache_mailbox_take(
+    struct http_cache_mailbox *mb);
+
+// Look up req at now (monotonic milliseconds). A hit comes with a
+// reference the caller puts once the response is queued and pinned; it is
+// a 304 when the request's If-None-Match has the entry's ETag. A miss
+// makes the caller the one to fetch, if may_fill is set; otherwise, and
+// for requests that must not be answered from the cache, the result is
+// HTTP_CACHE_PASS. While another request fetches the same key, w is
+// registered with it and HTTP_CACHE_WAIT returned.
+enum http_cache_result http_cache_lookup(const struct http_request *req,
+                                         uint64_t now, int may_fill,
+                                         struct http_cache_waiter *w,
+                                         struct http_cache_mailbox *mb,
+                                         const struct cached_response **resp,
+                                         struct http_cache_fill **fill);
+
+// Stop waiting, because the request went away
+void http_cache_cancel(struct http_cache_waiter *w);
+
+// The conditional headers, each ending in CRLF, that revalidate the stale
+// entry f is a fetch for, written to out, which holds cap bytes. Returns
+// their length, 0 when f fetches a new entry.
+size_t http_cache_fill_validators(const struct http_cache_fill *f,
+                                  char *out, size_t cap);
+
+// The response head of the fetch arrived: status line and header lines,
+// without the blank line. req_head is the request head sent to the backend,
+// for the headers Vary names. For HTTP_CACHE_REFRESHED, *resp is the
+// refreshed entry's response, with a reference, and f is gone.
+enum http_cache_fill_result http_cache_fill_head(
+    struct http_cache_fill *f, int status, const char *head, size_t len,
+    const char *req_head, size_t req_len, uint64_t now,
+    const struct cached_response **resp);
+
+// Store len more bytes of the body. Returns -1 once the body has grown
+// beyond what one entry may take; the fill is gone then.
+int http_cache_fill_body(struct http_cache_fill *f, const char *data,
+                         size_t len);
+
+// The body is complete: store the entry and wake the waiters. Returns how
+// many entries were evicted to make room.
+unsigned http_cache_fill_finish(struct http_cache_fill *f);
+
+// The fetch failed: wake the waiters, so one of them tries again
+void http_cache_fill_abort(struct http_cache_fill *f);
+
+#endif
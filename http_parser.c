@@ -0,0 +1,276 @@
+#include <string.h>
+#include <strings.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "http_parser.h"
+
+enum {
+    S_START,
+    S_METHOD,
+    S_URI,
+    S_VERSION,
+    S_REQUEST_LF,
+    S_HEADER_START,
+    S_NAME,
+    S_VALUE_START,
+    S_VALUE,
+    S_HEADER_LF,
+    S_END_LF,
+};
+
+// RFC 9110 tchar
+static const char token_chars[256] = {
+    ['!'] = 1, ['#'] = 1, ['$'] = 1, ['%'] = 1, ['&'] = 1, ['\''] = 1,
+    ['*'] = 1, ['+'] = 1, ['-'] = 1, ['.'] = 1, ['^'] = 1, ['_'] = 1,
+    ['`'] = 1, ['|'] = 1, ['~'] = 1,
+    ['0' ... '9'] = 1, ['A' ... 'Z'] = 1, ['a' ... 'z'] = 1,
+};
+
+void http_parser_init(struct http_parser *p) {
+    p->state = S_START;
+    p->pos = 0;
+    p->nheaders = 0;
+}
+
+// Return the first byte in [p, end) that is a control character, DEL or
+// delim. URIs are scanned with delim ' ', header names with ':' and header
+// values with DEL, in which case only controls (including '\r') stop the
+// scan.
+static const char *scan(const char *p, const char *end, char delim) {
+#ifdef __SSE2__
+    const __m128i vdelim = _mm_set1_epi8(delim);
+    const __m128i vdel = _mm_set1_epi8(0x7f);
+    const __m128i v1f = _mm_set1_epi8(0x1f);
+    while (end - p >= 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *)p);
+        // x <= 0x1f exactly when max(x, 0x1f) == 0x1f
+        __m128i ctl = _mm_cmpeq_epi8(_mm_max_epu8(x, v1f), v1f);
+        __m128i hit = _mm_or_si128(ctl, _mm_cmpeq_epi8(x, vdel));
+        hit = _mm_or_si128(hit, _mm_cmpeq_epi8(x, vdelim));
+        int mask = _mm_movemask_epi8(hit);
+        if (mask != 0) {
+            return p + __builtin_ctz(mask);
+        }
+        p += 16;
+    }
+#endif
+    for (; p < end; p++) {
+        unsigned char ch = *p;
+        if (ch < 0x20 || ch == 0x7f || ch == (unsigned char)delim) {
+            return p;
+        }
+    }
+    return end;
+}
+
+static struct http_span span(uint32_t off, const char *buf, const char *p) {
+    return (struct http_span){off, (uint32_t)(p - buf) - off};
+}
+
+static struct http_str view(const char *buf, struct http_span s) {
+    return (struct http_str){buf + s.off, s.len};
+}
+
+static void fill_request(const struct http_parser *p, const char *buf,
+                         struct http_request *req) {
+    req->method = view(buf, p->method);
+    req->uri = view(buf, p->uri);
+    req->version = view(buf, p->version);
+    req->minor_version = buf[p->version.off + 7] - '0';
+    req->nheaders = p->nheaders;
+    for (unsigned i = 0; i < p->nheaders; i++) {
+        req->headers[i].name = view(buf, p->headers[i].name);
+        req->headers[i].value = view(buf, p->headers[i].value);
+    }
+}
+
+int http_parse(struct http_parser *p, const char *buf, size_t len,
+               struct http_request *req) {
+    const char *c = buf + p->pos;
+    const char *end = buf + len;
+
+    while (c < end) {
+        switch (p->state) {
+        case S_START:
+            // Tolerate empty lines in front of a request
+            if (*c == '\r' || *c == '\n') {
+                c++;
+                break;
+            }
+            p->mark = c - buf;
+            p->state = S_METHOD;
+            // fallthrough
+        case S_METHOD:
+            while (c < end && token_chars[(unsigned char)*c]) {
+                c++;
+            }
+            if (c == end) {
+                break;
+            }
+            if (*c != ' ' || c - buf == p->mark) {
+                return HTTP_PARSE_ERROR;
+            }
+            p->method = span(p->mark, buf, c);
+            p->mark = ++c - buf;
+            p->state = S_URI;
+            break;
+
+        case S_URI:
+            c = scan(c, end, ' ');
+            if (c == end) {
+                break;
+            }
+            if (*c != ' ' || c - buf == p->mark) {
+                return HTTP_PARSE_ERROR;
+            }
+            p->uri = span(p->mark, buf, c);
+            p->mark = ++c - buf;
+            p->state = S_VERSION;
+            break;
+
+        case S_VERSION:
+            while (c < end && *c != '\r') {
+                if (c - buf - p->mark == 8) {
+                    return HTTP_PARSE_ERROR;
+                }
+                c++;
+            }
+            if (c == end) {
+                break;
+            }
+            p->version = span(p->mark, buf, c);
+            if (p->version.len != 8 ||
+                memcmp(buf + p->mark, "HTTP/1.", 7) != 0 ||
+                (c[-1] != '0' && c[-1] != '1')) {
+                return HTTP_PARSE_ERROR;
+            }
+            c++;
+            p->state = S_REQUEST_LF;
+            break;
+
+        case S_REQUEST_LF:
+        case S_HEADER_LF:
+            if (*c++ != '\n') {
+                return HTTP_PARSE_ERROR;
+            }
+            p->state = S_HEADER_START;
+            break;
+
+        case S_HEADER_START:
+            if (*c == '\r') {
+                c++;
+                p->state = S_END_LF;
+                break;
+            }
+            // Obsolete line folding starts with whitespace; refuse it
+            if (!token_chars[(unsigned char)*c]) {
+                return HTTP_PARSE_ERROR;
+            }
+            p->mark = c - buf;
+            p->state = S_NAME;
+            // fallthrough
+        case S_NAME:
+            c = scan(c, end, ':');
+            if (c == end) {
+                break;
+            }
+            if (*c != ':' || p->nheaders == HTTP_MAX_HEADERS) {
+                return HTTP_PARSE_ERROR;
+            }
+            p->name = span(p->mark, buf, c);
+            // The scan only stops at controls; whitespace or separators in
+            // a name would let a request mean different things to us and
+            // to a proxy in front of us
+            for (const char *n = buf + p->mark; n < c; n++) {
+                if (!token_chars[(unsigned char)*n]) {
+                    return HTTP_PARSE_ERROR;
+                }
+            }
+            c++;
+            p->state = S_VALUE_START;
+            break;
+
+        case S_VALUE_START:
+            if (*c == ' ' || *c == '\t') {
+                c++;
+                break;
+            }
+            p->mark = c - buf;
+            p->state = S_VALUE;
+            // fallthrough
+        case S_VALUE:
+            for (;;) {
+                c = scan(c, end, 0x7f);
+                if (c == end || *c != '\t') {
+                    break;
+                }
+                c++;
+            }
+            if (c == end) {
+                break;
+            }
+            if (*c != '\r') {
+                return HTTP_PARSE_ERROR;
+            }
+            {
+                // Trailing whitespace is not part of the value
+                const char *v = c;
+                while (v > buf + p->mark && (v[-1] == ' ' || v[-1] == '\t')) {
+                    v--;
+                }
+                p->headers[p->nheaders].name = p->name;
+                p->headers[p->nheaders].value = span(p->mark, buf, v);
+                p->nheaders++;
+            }
+            c++;
+            p->state = S_HEADER_LF;
+            break;
+
+        case S_END_LF:
+            if (*c++ != '\n') {
+                return HTTP_PARSE_ERROR;
+            }
+            p->pos = c - buf;
+            fill_request(p, buf, req);
+            return p->pos;
+        }
+    }
+
+    p->pos = c - buf;
+    return HTTP_PARSE_AGAIN;
+}
+
+const struct http_str *http_header_get(const struct http_request *req,
+                                       const char *name) {
+    size_t len = strlen(name);
+    for (unsigned i = 0; i < req->nheaders; i++) {
+        const struct http_str *n = &req->headers[i].name;
+        if (n->len == len && strncasecmp(n->ptr, name, len) == 0) {
+            return &req->headers[i].value;
+        }
+    }
+    return NULL;
+}
+
+int http_has_token(const struct http_str *value, const char *token) {
+    size_t toklen = strlen(token);
+    const char *p = value->ptr;
+    const char *end = value->ptr + value->len;
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) {
+            p++;
+        }
+        const char *tok = p;
+        while (p < end && *p != ',' && *p != ' ' && *p != '\t') {
+            p++;
+        }
+        if ((size_t)(p - tok) == toklen &&
+            strncasecmp(tok, token, toklen) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
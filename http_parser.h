@@ -0,0 +1,78 @@
+#ifndef WEBSERVER_HTTP_PARSER_H
+#define WEBSERVER_HTTP_PARSER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define HTTP_MAX_HEADERS 32
+
+// Return values of http_parse() besides the length of a complete request
+#define HTTP_PARSE_AGAIN 0
+#define HTTP_PARSE_ERROR -1
+
+// A view into the receive buffer; never NUL-terminated
+struct http_str {
+    const char *ptr;
+    size_t len;
+};
+
+struct http_header {
+    struct http_str name;
+    struct http_str value;
+};
+
+// A parsed request line and header block. Every view points into the
+// buffer that was passed to http_parse() and is only valid as long as the
+// request stays there.
+struct http_request {
+    struct http_str method;
+    struct http_str uri;
+    struct http_str version;
+    int minor_version;          // 0 for HTTP/1.0, 1 for HTTP/1.1
+    unsigned nheaders;
+    struct http_header headers[HTTP_MAX_HEADERS];
+};
+
+// Offset and length of a token, relative to the start of the request, so
+// the parser state survives the buffer being moved or grown
+struct http_span {
+    uint32_t off;
+    uint32_t len;
+};
+
+// Resumable parser state for one request
+struct http_parser {
+    uint8_t state;
+    uint32_t pos;               // bytes of the request scanned so far
+    uint32_t mark;              // start of the token being scanned
+    struct http_span method;
+    struct http_span uri;
+    struct http_span version;
+    struct http_span name;      // header name waiting for its value
+    unsigned nheaders;
+    struct {
+        struct http_span name;
+        struct http_span value;
+    } headers[HTTP_MAX_HEADERS];
+};
+
+// Reset the parser to expect the start of a new request
+void http_parser_init(struct http_parser *p);
+
+// Parse the request that starts at buf[0] and of which len bytes have been
+// received so far. Scanning resumes where the previous call on the same
+// request stopped, so bytes are looked at once however the request is
+// split across reads. Returns the length of the request line and headers
+// once they are complete and fills in req, HTTP_PARSE_AGAIN if more input
+// is needed or HTTP_PARSE_ERROR for a malformed request.
+int http_parse(struct http_parser *p, const char *buf, size_t len,
+               struct http_request *req);
+
+// Find a header by case-insensitive name; NULL when absent
+const struct http_str *http_header_get(const struct http_request *req,
+                                       const char *name);
+
+// Does the comma separated header value contain token (case-insensitive)?
+int http_has_token(const struct http_str *value, const char *token);
+
+#endif
@@ -0,0 +1,206 @@
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include "limit.h"
+
+// Clients we keep track of at once; a power of two
+#define LIMIT_SLOTS 65536
+// Entries a client may be found in, starting at its hash
+#define LIMIT_PROBES 16
+
+struct limit_entry {
+    _Atomic uint64_t key;       // the client, 0 while the entry is unused
+    _Atomic uint64_t bucket;    // see take()
+    _Atomic uint32_t conns;     // its open connections
+};
+
+// In .bss, so only the pages clients hash to are ever touched
+static struct limit_entry table[LIMIT_SLOTS];
+
+static _Atomic uint32_t total_conns;
+static _Atomic uint64_t total_bucket;
+
+static int per_client(void) {
+    return config.max_conns_per_ip > 0 || config.max_rate_per_ip > 0;
+}
+
+// The key of a's host: tagged IPv4 addresses, IPv4-mapped ones included,
+// and the upper half of anything else. Never 0.
+static uint64_t client_key(const union sock_addr *a) {
+    const uint8_t *b;
+    uint64_t key = 0;
+    if (a->sa.sa_family == AF_INET) {
+        b = (const uint8_t *)&a->in.sin_addr;
+        key = 0xffff;
+    } else if (a->sa.sa_family == AF_INET6) {
+        b = a->in6.sin6_addr.s6_addr;
+        if (!IN6_IS_ADDR_V4MAPPED(&a->in6.sin6_addr)) {
+            for (int i = 0; i < 8; i++) {
+                key = key << 8 | b[i];
+            }
+            return key != 0 ? key : 1;
+        }
+        b += 12;
+        key = 0xffff;
+    } else {
+        return 1;
+    }
+    for (int i = 0; i < 4; i++) {
+        key = key << 8 | b[i];
+    }
+    return key;
+}
+
+// Milliseconds from stamp to now. Every worker has a clock of its own, so
+// now may be a little behind a stamp another worker set.
+static uint32_t since(uint32_t now, uint32_t stamp) {
+    uint32_t elapsed = now - stamp;
+    return elapsed > UINT32_MAX - 1000 ? 0 : elapsed;
+}
+
+// Has the client of e gone, leaving nothing a newcomer would not start
+// with? A bucket untouched for a second is full again.
+static int unused(struct limit_entry *e, uint32_t now) {
+    uint32_t stamp = (uint32_t)atomic_load_explicit(&e->bucket,
+                                                    memory_order_relaxed);
+    return atomic_load_explicit(&e->conns, memory_order_relaxed) == 0 &&
+           (config.max_rate_per_ip == 0 || since(now, stamp) >= 1000);
+}
+
+// The entry of key, claiming one if it has none. NULL if every entry it
+// may have is taken by a client still around.
+static struct limit_entry *lookup(uint64_t key, uint32_t now) {
+    // Fibonacci hashing spreads the sequential addresses of a subnet
+    size_t h = (size_t)((key * 0x9e3779b97f4a7c15ULL) >> 48);
+    for (int i = 0; i < LIMIT_PROBES; i++) {
+        struct limit_entry *e = &table[(h + i) & (LIMIT_SLOTS - 1)];
+        uint64_t k = atomic_load_explicit(&e->key, memory_order_relaxed);
+        if (k == 0 &&
+            atomic_compare_exchange_strong_explicit(
+                &e->key, &k, key, memory_order_relaxed,
+                memory_order_relaxed)) {
+            return e;
+        }
+        // Possibly claimed for the same client by another worker
+        if (k == key) {
+            return e;
+        }
+    }
+    for (int i = 0; i < LIMIT_PROBES; i++) {
+        struct limit_entry *e = &table[(h + i) & (LIMIT_SLOTS - 1)];
+        uint64_t k = atomic_load_explicit(&e->key, memory_order_relaxed);
+        if (unused(e, now) &&
+            atomic_compare_exchange_strong_explicit(
+                &e->key, &k, key, memory_order_relaxed,
+                memory_order_relaxed)) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+// Take a token from a bucket refilled at rate per second, holding up to a
+// second's worth. The token count is in the upper half of the word and
+// the millisecond it was last refilled up to in the lower, so both change
+// with one compare-and-swap. Returns -1 if it is empty.
+static int take(_Atomic uint64_t *bucket, uint32_t rate, uint32_t now) {
+    uint64_t old = atomic_load_explicit(bucket, memory_order_relaxed);
+    uint64_t new;
+    do {
+        uint32_t tokens = (uint32_t)(old >> 32);
+        uint32_t stamp = (uint32_t)old;
+        uint32_t elapsed = since(now, stamp);
+        if (elapsed >= 1000) {
+            tokens = rate;
+            stamp = now;
+        } else {
+            // Only the time the added tokens stand for is used up, or a
+            // steady stream of requests would lose the fractions
+            uint32_t add = (uint32_t)((uint64_t)elapsed * rate / 1000);
+            if (tokens + add >= rate) {
+                tokens = rate;
+                stamp = now;
+            } else if (add > 0) {
+                tokens += add;
+                stamp += (uint32_t)((uint64_t)add * 1000 / rate);
+            }
+        }
+        if (tokens == 0) {
+            return -1;
+        }
+        new = (uint64_t)(tokens - 1) << 32 | stamp;
+    } while (!atomic_compare_exchange_weak_explicit(
+        bucket, &old, new, memory_order_relaxed, memory_order_relaxed));
+    return 0;
+}
+
+int limit_accept(struct conn *c) {
+    if (config.max_conns > 0) {
+        uint32_t n = atomic_fetch_add_explicit(&total_conns, 1,
+                                               memory_order_relaxed);
+        if (n >= (uint32_t)config.max_conns) {
+            atomic_fetch_sub_explicit(&total_conns, 1, memory_order_relaxed);
+            return -1;
+        }
+        c->limit_counted = 1;
+    }
+    if (!per_client()) {
+        return 0;
+    }
+    uint64_t key = client_key(conn_peer(c));
+    uint32_t now = (uint32_t)c->w->now;
+    struct limit_entry *e;
+    for (;;) {
+        e = lookup(key, now);
+        if (e == NULL) {
+            // Too many clients: this one goes by the global limits alone
+            return 0;
+        }
+        uint32_t n = atomic_fetch_add_explicit(&e->conns, 1,
+                                               memory_order_relaxed);
+        // The entry may have gone to another client between the lookup
+        // and the increment; the connection keeps it from going now
+        if (atomic_load_explicit(&e->key, memory_order_relaxed) != key) {
+            atomic_fetch_sub_explicit(&e->conns, 1, memory_order_relaxed);
+            continue;
+        }
+        if (config.max_conns_per_ip > 0 &&
+            n >= (uint32_t)config.max_conns_per_ip) {
+            atomic_fetch_sub_explicit(&e->conns, 1, memory_order_relaxed);
+            limit_release(c);
+            return -1;
+        }
+        break;
+    }
+    c->limit_slot = (uint32_t)(e - table) + 1;
+    return 0;
+}
+
+void limit_release(struct conn *c) {
+    if (c->limit_counted) {
+        atomic_fetch_sub_explicit(&total_conns, 1, memory_order_relaxed);
+        c->limit_counted = 0;
+    }
+    if (c->limit_slot != 0) {
+        atomic_fetch_sub_explicit(&table[c->limit_slot - 1].conns, 1,
+                                  memory_order_relaxed);
+        c->limit_slot = 0;
+    }
+}
+
+int limit_request(const struct conn *c) {
+    // The streams of an HTTP/2 connection count as its requests
+    const struct conn *owner = c->parent != NULL ? c->parent : c;
+    uint32_t now = (uint32_t)c->w->now;
+    if (config.max_rate_per_ip > 0 && owner->limit_slot != 0 &&
+        take(&table[owner->limit_slot - 1].bucket,
+             (uint32_t)config.max_rate_per_ip, now) != 0) {
+        return -1;
+    }
+    // Every worker shares this one, so it is the costlier check
+    if (config.max_rate > 0 &&
+        take(&total_bucket, (uint32_t)config.max_rate, now) != 0) {
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,29 @@
+#ifndef WEBSERVER_LIMIT_H
+#define WEBSERVER_LIMIT_H
+
+#include "conn.h"
+
+// Admission limits, shared by all workers: a cap on open connections and a
+// token bucket of requests per second, both over all clients and per
+// client. A client is an IPv4 address or an IPv6 /64, since that is what
+// one host usually gets.
+//
+// The clients live in a fixed-size open-addressing table updated with
+// compare-and-swap only, so checking a limit is a hash, a probe or two and
+// an atomic instruction. An entry is handed to another client once its
+// connections are gone and its bucket has refilled, which is when it is no
+// different from a new one. Races between workers can let a client slip a
+// little over its limits now and then, but never leak what it holds.
+
+// Admit c, just accepted. Returns -1 if a connection limit is reached, and
+// the caller closes c right away; c holds nothing then.
+int limit_accept(struct conn *c);
+
+// Give back what c holds; called once as it closes
+void limit_release(struct conn *c);
+
+// Take a token for a request on c, which may be a stream of an HTTP/2
+// connection. Returns -1 if its client or the server is over its rate.
+int limit_request(const struct conn *c);
+
+#endif
@@ -0,0 +1,294 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "metrics.h"
+#include "resp_cache.h"
+#include "server.h"
+
+static struct worker *metrics_workers;
+static int metrics_nworkers;
+
+static const char *const syscall_names[METRIC_SYSCALLS] = {
+    [SYSCALL_ACCEPT] = "accept",
+    [SYSCALL_READ] = "read",
+    [SYSCALL_WRITE] = "write",
+    [SYSCALL_SENDFILE] = "sendfile",
+    [SYSCALL_SPLICE] = "splice",
+};
+
+static const struct {
+    const char *name;
+    const char *help;
+} latency_names[METRIC_LATENCIES] = {
+    [LATENCY_PARSE] = {"webserver_parse_seconds",
+                       "Time to parse a complete request head."},
+    [LATENCY_HANDLER] = {"webserver_handler_seconds",
+                         "Time to choose and queue a response."},
+    [LATENCY_WRITE] = {"webserver_write_seconds",
+                       "Time from queueing responses until they were "
+                       "written to the socket."},
+    [LATENCY_LOOP] = {"webserver_loop_lag_seconds",
+                      "Time an event loop wakeup took to handle its "
+                      "events."},
+};
+
+void metric_observe(struct metric_histogram *h, uint64_t ns) {
+    // Round up to whole microseconds, then to the next power of two
+    uint64_t us = (ns + 999) / 1000;
+    unsigned bucket = us <= 1 ? 0 : 64 - __builtin_clzll(us - 1);
+    if (bucket < METRIC_BUCKETS) {
+        metric_add(&h->buckets[bucket], 1);
+    }
+    metric_add(&h->count, 1);
+    metric_add(&h->sum_ns, ns);
+}
+
+void metrics_init(struct worker *workers, int nworkers) {
+    metrics_workers = workers;
+    metrics_nworkers = nworkers;
+}
+
+static uint64_t load(const _Atomic uint64_t *m) {
+    return atomic_load_explicit(m, memory_order_relaxed);
+}
+
+// Every field of struct worker_metrics is a 64-bit counter, so the workers
+// are summed word by word
+static void metrics_sum(struct worker_metrics *total) {
+    _Atomic uint64_t *to = (_Atomic uint64_t *)total;
+    size_t words = sizeof(*total) / sizeof(uint64_t);
+    memset(total, 0, sizeof(*total));
+    for (int i = 0; i < metrics_nworkers; i++) {
+        const _Atomic uint64_t *from =
+            (const _Atomic uint64_t *)&metrics_workers[i].metrics;
+        for (size_t j = 0; j < words; j++) {
+            metric_add(&to[j], load(&from[j]));
+        }
+    }
+}
+
+// The page as it grows. A failed allocation drops the rest and is
+// remembered, so that no cut-off page is served.
+struct out {
+    char *buf;
+    size_t len;
+    size_t cap;
+    int failed;
+};
+
+static void emit(struct out *o, const char *fmt, ...) {
+    for (;;) {
+        if (o->failed) {
+            return;
+        }
+        va_list ap;
+        va_start(ap, fmt);
+        int n = vsnprintf(o->buf + o->len, o->cap - o->len, fmt, ap);
+        va_end(ap);
+        if (n < 0) {
+            o->failed = 1;
+        } else if ((size_t)n < o->cap - o->len) {
+            o->len += n;
+            return;
+        } else {
+            size_t cap = o->cap * 2 > o->len + n + 1 ? o->cap * 2
+                                                     : o->len + n + 1;
+            char *buf = realloc(o->buf, cap);
+            if (buf == NULL) {
+                perror("webserver (realloc)");
+                o->failed = 1;
+            } else {
+                o->buf = buf;
+                o->cap = cap;
+            }
+        }
+    }
+}
+
+static void emit_counter(struct out *o, const char *name, const char *help,
+                         uint64_t value) {
+    emit(o, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n", name, help, name,
+         name, (unsigned long long)value);
+}
+
+static void emit_gauge(struct out *o, const char *name, const char *help,
+                       uint64_t value) {
+    emit(o, "# HELP %s %s\n# TYPE %s gauge\n%s %llu\n", name, help, name,
+         name, (unsigned long long)value);
+}
+
+// The kernel's count of connections a full listen backlog cost, from the
+// TcpExt lines of /proc/net/netstat: a line of names, then one of values
+static void emit_listen_drops(struct out *o) {
+    FILE *f = fopen("/proc/net/netstat", "re");
+    if (f == NULL) {
+        return;
+    }
+    char names[4096];
+    char values[4096];
+    while (fgets(names, sizeof(names), f) != NULL &&
+           fgets(values, sizeof(values), f) != NULL) {
+        if (strncmp(names, "TcpExt:", 7) != 0) {
+            continue;
+        }
+        char *name_save;
+        char *value_save;
+        char *name = strtok_r(names, " \n", &name_save);
+        char *value = strtok_r(values, " \n", &value_save);
+        while (name != NULL && value != NULL) {
+            if (strcmp(name, "ListenOverflows") == 0) {
+                emit_counter(o, "webserver_listen_overflows_total",
+                             "Connections dropped for a full accept queue "
+                             "(host-wide).",
+                             strtoull(value, NULL, 10));
+            } else if (strcmp(name, "ListenDrops") == 0) {
+                emit_counter(o, "webserver_listen_drops_total",
+                             "Connection attempts dropped by listeners "
+                             "(host-wide).",
+                             strtoull(value, NULL, 10));
+            }
+            name = strtok_r(NULL, " \n", &name_save);
+            value = strtok_r(NULL, " \n", &value_save);
+        }
+        break;
+    }
+    fclose(f);
+}
+
+static void emit_histogram(struct out *o, const struct worker_metrics *m,
+                           enum metric_latency l) {
+    const char *name = latency_names[l].name;
+    emit(o, "# HELP %s %s\n# TYPE %s histogram\n", name,
+         latency_names[l].help, name);
+    uint64_t cumulative = 0;
+    for (int b = 0; b < METRIC_BUCKETS; b++) {
+        cumulative += load(&m->latency[l].buckets[b]);
+        emit(o, "%s_bucket{le=\"%g\"} %llu\n", name, (1u << b) / 1e6,
+             (unsigned long long)cumulative);
+    }
+    uint64_t count = load(&m->latency[l].count);
+    emit(o, "%s_bucket{le=\"+Inf\"} %llu\n", name, (unsigned long long)count);
+    emit(o, "%s_sum %.9f\n", name, load(&m->latency[l].sum_ns) / 1e9);
+    emit(o, "%s_count %llu\n", name, (unsigned long long)count);
+}
+
+struct cached_response *metrics_render(struct compressor *z,
+                                       unsigned accepted) {
+    struct worker_metrics m;
+    metrics_sum(&m);
+
+    struct out o = {malloc(16384), 0, 16384, 0};
+    if (o.buf == NULL) {
+        perror("webserver (malloc)");
+        return NULL;
+    }
+
+    emit_counter(&o, "webserver_accepts_total", "Connections accepted.",
+                 load(&m.accepts));
+    emit_counter(&o, "webserver_requests_total", "Requests answered.",
+                 load(&m.requests));
+    emit_counter(&o, "webserver_received_bytes_total",
+                 "Bytes read from clients.", load(&m.bytes_in));
+    emit_counter(&o, "webserver_sent_bytes_total", "Bytes written to clients.",
+                 load(&m.bytes_out));
+    emit_counter(&o, "webserver_tls_handshakes_total",
+                 "TLS handshakes completed.", load(&m.tls_handshakes));
+    emit_counter(&o, "webserver_tls_resumed_total",
+                 "TLS handshakes that resumed a session.",
+                 load(&m.tls_resumed));
+    emit_counter(&o, "webserver_tls_kernel_total",
+                 "TLS connections whose sends the kernel encrypts.",
+                 load(&m.tls_kernel));
+    emit_counter(&o, "webserver_tls_failures_total", "TLS handshakes failed.",
+                 load(&m.tls_failures));
+    emit_counter(&o, "webserver_upstream_requests_total",
+                 "Requests forwarded to a backend.",
+                 load(&m.upstream_requests));
+    emit_counter(&o, "webserver_upstream_reused_total",
+                 "Requests forwarded on a pooled backend connection.",
+                 load(&m.upstream_reused));
+    emit_counter(&o, "webserver_upstream_failures_total",
+                 "Proxied requests answered with a 502 or 504.",
+                 load(&m.upstream_failures));
+    emit_counter(&o, "webserver_cache_hits_total",
+                 "Proxied requests answered from the cache.",
+                 load(&m.cache_hits));
+    emit_counter(&o, "webserver_cache_misses_total",
+                 "Proxied requests fetched to be stored in the cache.",
+                 load(&m.cache_misses));
+    emit_counter(&o, "webserver_cache_coalesced_total",
+                 "Proxied requests that waited for another one's fetch.",
+                 load(&m.cache_coalesced));
+    emit_counter(&o, "webserver_cache_revalidated_total",
+                 "Stale cache entries a backend 304 made fresh again.",
+                 load(&m.cache_revalidated));
+    emit_counter(&o, "webserver_cache_evictions_total",
+                 "Entries evicted from the cache to make room.",
+                 load(&m.cache_evictions));
+    emit_counter(&o, "webserver_h2_sessions_total", "HTTP/2 connections.",
+                 load(&m.h2_sessions));
+    emit_counter(&o, "webserver_h2_streams_total", "HTTP/2 streams opened.",
+                 load(&m.h2_streams));
+    emit_counter(&o, "webserver_offloaded_total",
+                 "Requests answered on the offload pool.",
+                 load(&m.offloaded));
+    emit_counter(&o, "webserver_limit_refused_total",
+                 "Connections closed on accept for a connection limit.",
+                 load(&m.limit_refused));
+    emit_counter(&o, "webserver_limit_throttled_total",
+                 "Requests answered with a 429 for a rate limit.",
+                 load(&m.limit_throttled));
+    emit_counter(&o, "webserver_pack_hits_total",
+                 "Requests answered from the pack.", load(&m.pack_hits));
+    emit_counter(&o, "webserver_ws_sessions_total",
+                 "Connections upgraded to WebSocket.", load(&m.ws_sessions));
+    emit_counter(&o, "webserver_ws_received_total",
+                 "WebSocket messages published by clients.",
+                 load(&m.ws_received));
+    emit_counter(&o, "webserver_ws_sent_total",
+                 "WebSocket frames queued to subscribers.", load(&m.ws_sent));
+    emit_counter(&o, "webserver_ws_dropped_total",
+                 "WebSocket messages dropped for a slow subscriber.",
+                 load(&m.ws_dropped));
+    emit_counter(&o, "webserver_ws_slow_closed_total",
+                 "WebSocket subscribers disconnected for being slow.",
+                 load(&m.ws_slow_closed));
+    emit_counter(&o, "webserver_accept_deferred_total",
+                 "Accept batches cut off at --accept-batch.",
+                 load(&m.accept_deferred));
+    emit_counter(&o, "webserver_overload_paused_total",
+                 "Times a worker stopped accepting for overload.",
+                 load(&m.overload_paused));
+    emit_counter(&o, "webserver_overload_shed_total",
+                 "Connections turned away on accept for overload.",
+                 load(&m.overload_shed));
+    emit_gauge(&o, "webserver_accept_queue",
+               "Connections waiting in the listen backlogs when last seen.",
+               load(&m.accept_queue));
+    emit_listen_drops(&o);
+    emit(&o, "# HELP webserver_errors_total Failed system calls.\n"
+             "# TYPE webserver_errors_total counter\n");
+    for (int s = 0; s < METRIC_SYSCALLS; s++) {
+        emit(&o, "webserver_errors_total{syscall=\"%s\"} %llu\n",
+             syscall_names[s], (unsigned long long)load(&m.errors[s]));
+    }
+    for (int l = 0; l < METRIC_LATENCIES; l++) {
+        emit_histogram(&o, &m, l);
+    }
+
+    // The exposition is built for one client, so only its coding is worth
+    // the work
+    unsigned encodings = 0;
+    if (z != NULL) {
+        encodings = ENCODING_BIT(encoding_pick(accepted, encoding_supported()));
+    }
+    struct cached_response *r = NULL;
+    if (!o.failed) {
+        r = resp_build_encoded(200, "text/plain; version=0.0.4", o.buf, o.len,
+                               z, encodings);
+    }
+    free(o.buf);
+    return r;
+}
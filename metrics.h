@@ -0,0 +1,102 @@
+#ifndef WEBSERVER_METRICS_H
+#define WEBSERVER_METRICS_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <time.h>
+
+// System calls whose failures are counted
+enum metric_syscall {
+    SYSCALL_ACCEPT,
+    SYSCALL_READ,
+    SYSCALL_WRITE,
+    SYSCALL_SENDFILE,
+    SYSCALL_SPLICE,
+    METRIC_SYSCALLS,
+};
+
+enum metric_latency {
+    LATENCY_PARSE,              // parsing a complete request head
+    LATENCY_HANDLER,            // choosing and queueing the response
+    LATENCY_WRITE,              // from queueing until the socket took it all
+    LATENCY_LOOP,               // handling the events of one wakeup
+    METRIC_LATENCIES,
+};
+
+// Histogram buckets count values up to 1us, 2us, 4us, ... 2^19us (~0.5s)
+#define METRIC_BUCKETS 20
+
+struct metric_histogram {
+    _Atomic uint64_t buckets[METRIC_BUCKETS];   // not cumulative
+    _Atomic uint64_t count;
+    _Atomic uint64_t sum_ns;
+};
+
+// One worker's counters. Only the owning worker writes them, with plain
+// loads and stores: the atomics are relaxed and exist so a scrape on
+// another worker can read them without a data race. The struct fills whole
+// cache lines so workers never share one.
+struct worker_metrics {
+    _Alignas(64) _Atomic uint64_t accepts;
+    _Atomic uint64_t requests;
+    _Atomic uint64_t bytes_in;
+    _Atomic uint64_t bytes_out;
+    _Atomic uint64_t errors[METRIC_SYSCALLS];
+    _Atomic uint64_t tls_handshakes;
+    _Atomic uint64_t tls_resumed;       // handshakes that resumed a session
+    _Atomic uint64_t tls_kernel;        // connections the kernel encrypts
+    _Atomic uint64_t tls_failures;      // handshakes that failed
+    _Atomic uint64_t upstream_requests; // requests sent to a backend
+    _Atomic uint64_t upstream_reused;   // on a pooled connection
+    _Atomic uint64_t upstream_failures; // answered with a 502 or 504
+    _Atomic uint64_t cache_hits;        // proxied requests the cache answered
+    _Atomic uint64_t cache_misses;      // fetched to be stored
+    _Atomic uint64_t cache_coalesced;   // waited for another's fetch
+    _Atomic uint64_t cache_revalidated; // answered after a backend 304
+    _Atomic uint64_t cache_evictions;
+    _Atomic uint64_t h2_sessions;       // connections that speak HTTP/2
+    _Atomic uint64_t h2_streams;        // streams they opened
+    _Atomic uint64_t offloaded;         // requests answered on the pool
+    _Atomic uint64_t limit_refused;     // connections closed on accept
+    _Atomic uint64_t limit_throttled;   // requests answered with a 429
+    _Atomic uint64_t pack_hits;         // requests answered from the pack
+    _Atomic uint64_t ws_sessions;       // connections upgraded to WebSocket
+    _Atomic uint64_t ws_received;       // messages clients published
+    _Atomic uint64_t ws_sent;           // frames queued to subscribers
+    _Atomic uint64_t ws_dropped;        // not queued to a slow subscriber
+    _Atomic uint64_t ws_slow_closed;    // slow subscribers disconnected
+    _Atomic uint64_t accept_deferred;   // accept batches cut off at the cap
+    _Atomic uint64_t overload_paused;   // times accepting paused
+    _Atomic uint64_t overload_shed;     // connections turned away on accept
+    _Atomic uint64_t accept_queue;      // a gauge: connections in the backlog
+    struct metric_histogram latency[METRIC_LATENCIES];
+};
+
+static inline void metric_add(_Atomic uint64_t *m, uint64_t n) {
+    atomic_store_explicit(m, atomic_load_explicit(m, memory_order_relaxed) + n,
+                          memory_order_relaxed);
+}
+
+void metric_observe(struct metric_histogram *h, uint64_t ns);
+
+// Nanoseconds for latency measurements
+static inline uint64_t metric_clock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+struct worker;
+struct cached_response;
+struct compressor;
+
+// Make the workers' counters visible to metrics_render()
+void metrics_init(struct worker *workers, int nworkers);
+
+// Sum the counters of all workers into a Prometheus text exposition,
+// compressed with z in the coding out of accepted the client prefers. The
+// caller owns the returned reference. Returns NULL if memory ran out.
+struct cached_response *metrics_render(struct compressor *z,
+                                       unsigned accepted);
+
+#endif
@@ -0,0 +1,202 @@
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "compress.h"
+#include "offload.h"
+
+// Jobs a worker can have waiting for the pool; beyond that it runs them
+// itself, which is what it would have done without a pool
+#define DEQUE_SIZE 1024
+
+// A Chase-Lev work-stealing deque (Lê et al., "Correct and Efficient
+// Work-Stealing for Weak Memory Models") of fixed size. The owning worker
+// pushes at bottom; pool threads steal from top. The owner never takes its
+// own jobs back, so the pop half of the algorithm is left out.
+struct offload_queue {
+    _Alignas(64) _Atomic size_t top;
+    _Alignas(64) _Atomic size_t bottom;
+    _Atomic(struct offload_job *) jobs[DEQUE_SIZE];
+
+    // Finished jobs, newest first, pushed by the pool threads and taken
+    // all at once by the worker
+    _Alignas(64) _Atomic(struct offload_job *) finished;
+    int fd;                         // eventfd
+};
+
+static struct offload_queue *queues;
+static int nqueues;
+static pthread_t *threads;
+static int nthreads;
+static sem_t pending;               // jobs pushed and not yet taken
+static atomic_int stopping;
+
+static _Thread_local int pool_thread;
+static _Thread_local struct compressor *thread_zip;
+
+// Take the oldest job of q. Returns NULL if q is empty, or if another
+// thread took that job first, in which case there may be more.
+static struct offload_job *steal(struct offload_queue *q, int *lost) {
+    size_t t = atomic_load_explicit(&q->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    size_t b = atomic_load_explicit(&q->bottom, memory_order_acquire);
+    if (t >= b) {
+        return NULL;
+    }
+    struct offload_job *j = atomic_load_explicit(
+        &q->jobs[t % DEQUE_SIZE], memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&q->top, &t, t + 1,
+                                                 memory_order_seq_cst,
+                                                 memory_order_relaxed)) {
+        *lost = 1;
+        return NULL;
+    }
+    return j;
+}
+
+static void finish(struct offload_queue *q, struct offload_job *j) {
+    struct offload_job *head =
+        atomic_load_explicit(&q->finished, memory_order_relaxed);
+    do {
+        j->next = head;
+    } while (!atomic_compare_exchange_weak_explicit(
+        &q->finished, &head, j, memory_order_release, memory_order_relaxed));
+    // The worker only needs waking for the first one it has not taken
+    if (head == NULL) {
+        uint64_t one = 1;
+        if (write(q->fd, &one, sizeof(one)) < 0) {
+            perror("webserver (write eventfd)");
+        }
+    }
+}
+
+static void *offload_main(void *arg) {
+    int home = (int)(intptr_t)arg % nqueues;
+    pool_thread = 1;
+    thread_zip = compressor_new(COMPRESS_FAST);
+    for (;;) {
+        while (sem_wait(&pending) != 0 && errno == EINTR) {
+        }
+        if (atomic_load_explicit(&stopping, memory_order_relaxed)) {
+            break;
+        }
+        // Every post stands for a job that is in some deque until one of
+        // us takes it
+        struct offload_queue *q;
+        struct offload_job *j = NULL;
+        for (int i = 0; j == NULL;) {
+            int lost = 0;
+            q = &queues[(home + i) % nqueues];
+            j = steal(q, &lost);
+            if (j == NULL && !lost) {
+                i = (i + 1) % nqueues;
+            }
+        }
+        // It goes back to the worker whose deque it came from
+        j->run(j);
+        finish(q, j);
+    }
+    compressor_free(thread_zip);
+    return NULL;
+}
+
+int offload_start(struct worker *workers, int nworkers) {
+    // The io_uring loop runs blocking handlers itself
+    if (config.offload_threads == 0 || config.io != IO_EPOLL) {
+        return 0;
+    }
+    queues = calloc(nworkers, sizeof(*queues));
+    threads = calloc(config.offload_threads, sizeof(*threads));
+    if (queues == NULL || threads == NULL) {
+        perror("webserver (calloc)");
+        return -1;
+    }
+    nqueues = nworkers;
+    for (int i = 0; i < nworkers; i++) {
+        queues[i].fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (queues[i].fd < 0) {
+            perror("webserver (eventfd)");
+            return -1;
+        }
+        workers[i].offload = &queues[i];
+    }
+    sem_init(&pending, 0, 0);
+    for (int i = 0; i < config.offload_threads; i++) {
+        int err = pthread_create(&threads[i], NULL, offload_main,
+                                 (void *)(intptr_t)i);
+        if (err != 0) {
+            fprintf(stderr, "webserver (pthread_create): %s\n", strerror(err));
+            return -1;
+        }
+        nthreads++;
+    }
+    return 0;
+}
+
+void offload_stop(void) {
+    if (nthreads == 0) {
+        return;
+    }
+    atomic_store(&stopping, 1);
+    for (int i = 0; i < nthreads; i++) {
+        sem_post(&pending);
+    }
+    for (int i = 0; i < nthreads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    nthreads = 0;
+}
+
+int offload_submit(struct worker *w, struct offload_job *j) {
+    struct offload_queue *q = w->offload;
+    if (q == NULL) {
+        return -1;
+    }
+    size_t b = atomic_load_explicit(&q->bottom, memory_order_relaxed);
+    size_t t = atomic_load_explicit(&q->top, memory_order_acquire);
+    if (b - t >= DEQUE_SIZE) {
+        return -1;
+    }
+    atomic_store_explicit(&q->jobs[b % DEQUE_SIZE], j, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&q->bottom, b + 1, memory_order_relaxed);
+    sem_post(&pending);
+    return 0;
+}
+
+int offload_fd(const struct worker *w) {
+    return w->offload != NULL ? w->offload->fd : -1;
+}
+
+struct offload_job *offload_finished(struct worker *w) {
+    uint64_t n;
+    if (read(w->offload->fd, &n, sizeof(n)) < 0 && errno != EAGAIN) {
+        perror("webserver (read eventfd)");
+    }
+    struct offload_job *j = atomic_exchange_explicit(
+        &w->offload->finished, NULL, memory_order_acquire);
+    // Newest first as pushed; the oldest has waited longest
+    struct offload_job *oldest = NULL;
+    while (j != NULL) {
+        struct offload_job *next = j->next;
+        j->next = oldest;
+        oldest = j;
+        j = next;
+    }
+    return oldest;
+}
+
+int offload_thread(void) {
+    return pool_thread;
+}
+
+struct compressor *offload_zip(void) {
+    return thread_zip;
+}
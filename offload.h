@@ -0,0 +1,55 @@
+#ifndef WEBSERVER_OFFLOAD_H
+#define WEBSERVER_OFFLOAD_H
+
+#include "server.h"
+
+// A pool of threads for work that would stall an event loop: handlers that
+// block on the disk or burn CPU on a single request.
+//
+// Every worker owns a Chase-Lev deque it pushes its jobs onto. A pool
+// thread takes jobs from its home worker's deque first and steals from the
+// others once that is empty, so a burst on one worker spreads over the
+// whole pool without a shared queue. A finished job goes back to the
+// worker that submitted it through a lock-free list and an eventfd the
+// worker's event loop waits on, and only there is its outcome acted on.
+
+struct conn;
+
+struct offload_job {
+    // Runs on a pool thread. It must not touch the state of any worker;
+    // the submitting worker leaves whatever the job was given alone until
+    // it is done.
+    void (*run)(struct offload_job *j);
+    // Runs on the submitting worker once run() returned. Returns the
+    // connection to carry on with, or NULL.
+    struct conn *(*done)(struct offload_job *j);
+    struct offload_job *next;   // among the finished jobs
+};
+
+// Start --offload-threads pool threads and give every worker its deque;
+// call once before the workers start. Does nothing without threads or on
+// the io_uring backend.
+int offload_start(struct worker *workers, int nworkers);
+
+// Stop the pool threads once the workers are gone
+void offload_stop(void);
+
+// Hand j to the pool. Returns -1 if there is no pool or w's deque is full,
+// in which case the caller does the work itself.
+int offload_submit(struct worker *w, struct offload_job *j);
+
+// The eventfd w's event loop is woken with once jobs finished, or -1
+int offload_fd(const struct worker *w);
+
+// Take the jobs of w that finished, oldest first, after its eventfd was
+// readable
+struct offload_job *offload_finished(struct worker *w);
+
+// Whether the calling thread is one of the pool's
+int offload_thread(void);
+
+// The compressor of the calling pool thread, NULL on any other thread or
+// if it could not be allocated
+struct compressor *offload_zip(void);
+
+#endif
@@ -0,0 +1,66 @@
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "overload.h"
+#include "resp_cache.h"
+
+static const char unavailable_body[] = "<html>overloaded</html>\r\n";
+
+static struct cached_response *resp_unavailable;
+
+int overload_init(void) {
+    resp_unavailable = resp_build_extra(503, "text/html", "Retry-After: 1\r\n",
+                                        unavailable_body,
+                                        sizeof(unavailable_body) - 1);
+    return resp_unavailable == NULL ? -1 : 0;
+}
+
+void overload_lag(struct worker *w, uint64_t ns) {
+    // An average over the last eight wakeups or so; one slow one is not
+    // an overload
+    int64_t lag = (int64_t)w->lag_ns;
+    lag += ((int64_t)ns - lag) / 8;
+    w->lag_ns = (uint64_t)lag;
+    if (config.shed_lag == 0) {
+        return;
+    }
+    uint64_t limit = (uint64_t)config.shed_lag * 1000000;
+    if (!w->lag_shedding && w->lag_ns > limit) {
+        w->lag_shedding = 1;
+    } else if (w->lag_shedding && w->lag_ns < limit / 2) {
+        w->lag_shedding = 0;
+    }
+}
+
+void overload_reject(struct worker *w, int fd) {
+    metric_add(&w->metrics.overload_shed, 1);
+    // A TLS client could not read a plain answer; it only sees the close
+    if (config.tls_cert == NULL) {
+        // An empty send buffer takes it whole
+        const char *data = resp_unavailable->data[RESP_CLOSE];
+        size_t len = resp_unavailable->len[RESP_CLOSE];
+        if (send(fd, data, len, MSG_DONTWAIT | MSG_NOSIGNAL) > 0) {
+            metric_add(&w->metrics.bytes_out, len);
+        }
+        // Closing with the request unread would send a RST that can
+        // destroy the answer, so what has arrived so far is dropped first
+        char discard[4096];
+        while (recv(fd, discard, sizeof(discard), MSG_DONTWAIT) ==
+               (ssize_t)sizeof(discard)) {
+        }
+    }
+    close(fd);
+}
+
+unsigned overload_queue(int fd) {
+    // For a listener, the kernel reports its accept queue as unacked
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len) != 0 ||
+        info.tcpi_state != TCP_LISTEN) {
+        return 0;
+    }
+    return info.tcpi_unacked;
+}
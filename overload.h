@@ -0,0 +1,35 @@
+#ifndef WEBSERVER_OVERLOAD_H
+#define WEBSERVER_OVERLOAD_H
+
+#include <stdint.h>
+
+#include "server.h"
+
+// Admission control under overload. Every worker measures its loop lag,
+// how long a wakeup takes to handle the events it brought, which is how
+// long the last of them waited. Once the smoothed lag crosses --shed-lag,
+// or the worker holds --shed-conns connections, new connections are shed:
+// left in the kernel's backlog (--shed=pause) or accepted and answered
+// with a prebuilt 503 (--shed=reject). Lag shedding stops once the lag is
+// back under half the threshold, so it does not flap.
+
+// Build the 503; call once before serving
+int overload_init(void);
+
+// Record that a wakeup of w took ns to handle
+void overload_lag(struct worker *w, uint64_t ns);
+
+// Should w turn new connections away right now?
+static inline int overload_shedding(const struct worker *w) {
+    return w->lag_shedding ||
+           (config.shed_conns > 0 &&
+            w->conns.in_use >= (size_t)config.shed_conns);
+}
+
+// Answer fd, just accepted, with the 503 and close it
+void overload_reject(struct worker *w, int fd);
+
+// Connections waiting in the accept queue of listener fd
+unsigned overload_queue(int fd);
+
+#endif
@@ -0,0 +1,546 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "compress.h"
+#include "pack.h"
+#include "qsbr.h"
+#include "static_files.h"
+
+#define PACK_MAGIC "WSPACK\0\1"
+
+// The pack starts with this header; everything else is found by offsets
+// from the start of the file. Written and read in the native byte order.
+struct pack_header {
+    char magic[8];
+    uint32_t nentries;
+    uint32_t nslots;            // index slots, a power of two
+    uint64_t entries_off;       // struct pack_entry[nentries]
+    uint64_t slots_off;         // uint32_t[nslots]: entry + 1, 0 if empty
+    uint64_t size;              // of the whole pack
+};
+
+// One representation of a file
+struct pack_rep {
+    uint64_t off;               // 200 head, the body right behind it
+    uint32_t head_len;          // up to and including the blank line
+    uint32_t body_len;
+    uint64_t off304;            // 304 head
+    uint32_t len304;
+    uint32_t etag_len;
+    uint64_t etag_off;          // its ETag value, inside the 200 head
+};
+
+struct pack_entry {
+    uint64_t hash;              // of the path
+    uint64_t path_off;          // as static_map_path() turns a URI into
+    uint32_t path_len;
+    uint32_t encodings;         // ENCODING_BITs of the representations
+    uint64_t modified_off;      // Last-Modified value
+    uint32_t modified_len;
+    uint32_t reserved;
+    struct pack_rep rep[ENCODINGS];
+};
+
+_Static_assert(ENCODINGS == 3, "the pack format has room for 3 codings");
+
+// A mapped pack. Queued segments point into the mapping and pin it.
+struct pack {
+    struct rcbuf rc;
+    const char *base;
+    size_t size;
+    const struct pack_entry *entries;
+    const uint32_t *slots;
+    uint32_t nentries;
+    uint32_t nslots;
+};
+
+static _Atomic(struct pack *) current;
+static pthread_mutex_t writer_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// The connection line and blank line that end a head for the variants
+// that need one
+static const char *const head_end[RESP_VARIANTS] = {
+    [RESP_KEEP_ALIVE] = "\r\n",
+    [RESP_KEEP_ALIVE_10] = "Connection: keep-alive\r\n\r\n",
+    [RESP_CLOSE] = "Connection: close\r\n\r\n",
+};
+
+static uint64_t hash_path(const char *path, size_t len) {
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (unsigned char)path[i]) * 1099511628211ULL;
+    }
+    return h;
+}
+
+// Is [off, off + len) inside the pack?
+static int within(const struct pack *p, uint64_t off, uint64_t len) {
+    return off <= p->size && len <= p->size - off;
+}
+
+// Only the header is checked when a pack is opened, so that takes the
+// same time for any number of files; an entry is checked once it is found
+static int entry_valid(const struct pack *p, const struct pack_entry *e) {
+    if (!within(p, e->path_off, e->path_len) ||
+        !within(p, e->modified_off, e->modified_len) ||
+        !(e->encodings & ENCODING_BIT(ENCODING_IDENTITY))) {
+        return 0;
+    }
+    for (int i = 0; i < ENCODINGS; i++) {
+        const struct pack_rep *r = &e->rep[i];
+        if ((e->encodings & ENCODING_BIT(i)) &&
+            (r->head_len < 2 || r->len304 < 2 ||
+             !within(p, r->off, (uint64_t)r->head_len + r->body_len) ||
+             !within(p, r->off304, r->len304) ||
+             !within(p, r->etag_off, r->etag_len))) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static const struct pack_entry *lookup(const struct pack *p,
+                                       const char *path, size_t len) {
+    uint64_t h = hash_path(path, len);
+    uint32_t mask = p->nslots - 1;
+    for (uint32_t i = (uint32_t)h & mask, n = 0; n < p->nslots;
+         i = (i + 1) & mask, n++) {
+        uint32_t slot = p->slots[i];
+        if (slot == 0 || slot > p->nentries) {
+            return NULL;
+        }
+        const struct pack_entry *e = &p->entries[slot - 1];
+        if (e->hash == h && e->path_len == len &&
+            within(p, e->path_off, len) &&
+            memcmp(p->base + e->path_off, path, len) == 0) {
+            return entry_valid(p, e) ? e : NULL;
+        }
+    }
+    return NULL;
+}
+
+static void pack_destroy(struct rcbuf *rc) {
+    struct pack *p = (struct pack *)rc;
+    munmap((void *)p->base, p->size);
+    free(p);
+}
+
+int pack_open(const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        perror("webserver (open pack)");
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        perror("webserver (fstat pack)");
+        close(fd);
+        return -1;
+    }
+    if ((size_t)st.st_size < sizeof(struct pack_header)) {
+        fprintf(stderr, "webserver: %s is not a pack\n", path);
+        close(fd);
+        return -1;
+    }
+    // Shared, so every worker and every process serving the same pack
+    // reads it from the same page cache pages
+    void *base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        perror("webserver (mmap pack)");
+        return -1;
+    }
+
+    struct pack *p = malloc(sizeof(*p));
+    if (p == NULL) {
+        perror("webserver (malloc)");
+        munmap(base, st.st_size);
+        return -1;
+    }
+    const struct pack_header *h = base;
+    rcbuf_init(&p->rc, pack_destroy);
+    p->base = base;
+    p->size = st.st_size;
+    p->nentries = h->nentries;
+    p->nslots = h->nslots;
+    if (memcmp(h->magic, PACK_MAGIC, sizeof(h->magic)) != 0 ||
+        h->size != (uint64_t)st.st_size || h->nslots == 0 ||
+        (h->nslots & (h->nslots - 1)) != 0 || h->nslots < h->nentries ||
+        h->entries_off % 8 != 0 || h->slots_off % 4 != 0 ||
+        !within(p, h->entries_off,
+                (uint64_t)h->nentries * sizeof(struct pack_entry)) ||
+        !within(p, h->slots_off, (uint64_t)h->nslots * sizeof(uint32_t))) {
+        fprintf(stderr, "webserver: %s is not a pack\n", path);
+        pack_destroy(&p->rc);
+        return -1;
+    }
+    p->entries = (const struct pack_entry *)(p->base + h->entries_off);
+    p->slots = (const uint32_t *)(p->base + h->slots_off);
+    // Every lookup starts in the index
+    madvise((void *)((uintptr_t)p->slots & ~(uintptr_t)4095),
+            p->nslots * sizeof(uint32_t) + 4096, MADV_WILLNEED);
+
+    pthread_mutex_lock(&writer_lock);
+    struct pack *old =
+        atomic_exchange_explicit(&current, p, memory_order_acq_rel);
+    // Workers that loaded the old pack before the swap may still be
+    // queueing from it; after a grace period only writes that pinned it
+    // remain
+    if (old != NULL) {
+        qsbr_synchronize();
+        rcbuf_put(&old->rc);
+    }
+    pthread_mutex_unlock(&writer_lock);
+    printf("serving %u files from pack %s\n", p->nentries, path);
+    fflush(stdout);
+    return 0;
+}
+
+// Can the client reuse the copy of representation r it already has?
+static int not_modified(const struct pack *p, const struct pack_entry *e,
+                        const struct pack_rep *r,
+                        const struct http_request *req) {
+    const struct http_str *inm = http_header_get(req, "If-None-Match");
+    if (inm != NULL) {
+        return (inm->len == 1 && inm->ptr[0] == '*') ||
+               memmem(inm->ptr, inm->len, p->base + r->etag_off,
+                      r->etag_len) != NULL;
+    }
+    const struct http_str *ims = http_header_get(req, "If-Modified-Since");
+    return ims != NULL && ims->len == e->modified_len &&
+           memcmp(ims->ptr, p->base + e->modified_off, ims->len) == 0;
+}
+
+int pack_serve(struct conn *c, const struct http_request *req,
+               enum resp_variant v, unsigned encodings, size_t *bytes) {
+    struct pack *p = atomic_load_explicit(&current, memory_order_acquire);
+    if (p == NULL) {
+        return 0;
+    }
+    int head = req->method.len == 4 && memcmp(req->method.ptr, "HEAD", 4) == 0;
+    int get = req->method.len == 3 && memcmp(req->method.ptr, "GET", 3) == 0;
+    char path[PATH_MAX];
+    int len;
+    const struct pack_entry *e;
+    if ((!get && !head) ||
+        (len = static_map_path(&req->uri, path, sizeof(path))) < 0 ||
+        (e = lookup(p, path, len)) == NULL) {
+        return 0;
+    }
+
+    const struct pack_rep *r = &e->rep[ENCODING_IDENTITY];
+    if ((e->encodings & encodings) != ENCODING_BIT(ENCODING_IDENTITY)) {
+        r = &e->rep[encoding_pick(encoding_accepted(req),
+                                  e->encodings & encodings)];
+    }
+    int status304 = not_modified(p, e, r, req);
+    const char *data = p->base + (status304 ? r->off304 : r->off);
+    size_t head_len = status304 ? r->len304 : r->head_len;
+    size_t body_len = head || status304 ? 0 : r->body_len;
+    if (v == RESP_KEEP_ALIVE) {
+        // The head is stored the way this variant wants it
+        conn_queue(c, data, head_len + body_len, &p->rc);
+    } else {
+        conn_queue(c, data, head_len - 2, &p->rc);
+        conn_queue(c, head_end[v], strlen(head_end[v]), NULL);
+        if (body_len > 0) {
+            conn_queue(c, data + head_len, body_len, &p->rc);
+        }
+        head_len += strlen(head_end[v]) - 2;
+    }
+    *bytes = head_len + body_len;
+    metric_add(&c->w->metrics.pack_hits, 1);
+    return status304 ? 304 : 200;
+}
+
+// Building a pack. nftw() takes no argument for its callback, so the walk
+// collects into these.
+static const char *walk_root;
+static size_t walk_root_len;
+static struct stat walk_skip;   // an existing pack at the output path
+static char **walk_paths;
+static size_t walk_count, walk_cap;
+
+static int walk_file(const char *fpath, const struct stat *st, int type,
+                     struct FTW *ftw) {
+    (void)ftw;
+    if (type != FTW_F || !S_ISREG(st->st_mode) ||
+        (st->st_dev == walk_skip.st_dev && st->st_ino == walk_skip.st_ino)) {
+        return 0;
+    }
+    if (walk_count == walk_cap) {
+        walk_cap = walk_cap > 0 ? 2 * walk_cap : 1024;
+        char **paths = realloc(walk_paths, walk_cap * sizeof(*paths));
+        if (paths == NULL) {
+            perror("webserver (realloc)");
+            return -1;
+        }
+        walk_paths = paths;
+    }
+    // Relative to the root, the way requests name them
+    if ((walk_paths[walk_count] = strdup(fpath + walk_root_len + 1)) ==
+        NULL) {
+        perror("webserver (strdup)");
+        return -1;
+    }
+    walk_count++;
+    return 0;
+}
+
+// Read all of a file whose size is known
+static char *read_file(const char *path, size_t size) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        perror("webserver (open)");
+        return NULL;
+    }
+    char *data = malloc(size > 0 ? size : 1);
+    size_t got = 0;
+    while (data != NULL && got < size) {
+        ssize_t n = read(fd, data + got, size - got);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            fprintf(stderr, "webserver: %s changed while packing\n", path);
+            free(data);
+            data = NULL;
+            break;
+        }
+        got += n;
+    }
+    close(fd);
+    return data;
+}
+
+struct pack_writer {
+    FILE *out;
+    uint64_t off;
+};
+
+static void put(struct pack_writer *pw, const void *data, size_t len) {
+    fwrite(data, 1, len, pw->out);
+    pw->off += len;
+}
+
+static void align(struct pack_writer *pw, size_t to) {
+    static const char zeros[8];
+    put(pw, zeros, (to - pw->off % to) % to);
+}
+
+// Write one representation of a file: its 200 head with the body, then
+// its 304 head
+static void put_rep(struct pack_writer *pw, struct pack_entry *e,
+                    enum encoding enc, const char *type, const char *coding,
+                    const char *modified, uint64_t tag, const void *body,
+                    size_t body_len) {
+    char etag[48];
+    snprintf(etag, sizeof(etag), "\"%016llx%s%s\"", (unsigned long long)tag,
+             enc != ENCODING_IDENTITY ? "-" : "",
+             enc != ENCODING_IDENTITY ? encoding_name(enc) : "");
+    char head[512];
+    int n = snprintf(head, sizeof(head),
+                     "HTTP/1.1 200 OK\r\n"
+                     "Server: webserver-c\r\n"
+                     "Content-type: %s\r\n"
+                     "Content-Length: %zu\r\n"
+                     "Last-Modified: %s\r\n"
+                     "ETag: %s\r\n"
+                     "%s"
+                     "\r\n",
+                     type, body_len, modified, etag, coding);
+    struct pack_rep *r = &e->rep[enc];
+    r->off = pw->off;
+    r->head_len = (uint32_t)n;
+    r->body_len = (uint32_t)body_len;
+    const char *at = strstr(head, "ETag: ") + 6;
+    r->etag_off = pw->off + (at - head);
+    r->etag_len = (uint32_t)strlen(etag);
+    if (enc == ENCODING_IDENTITY) {
+        at = strstr(head, "Last-Modified: ") + 15;
+        e->modified_off = pw->off + (at - head);
+        e->modified_len = (uint32_t)strlen(modified);
+    }
+    put(pw, head, n);
+    put(pw, body, body_len);
+
+    n = snprintf(head, sizeof(head),
+                 "HTTP/1.1 304 Not Modified\r\n"
+                 "Server: webserver-c\r\n"
+                 "Last-Modified: %s\r\n"
+                 "ETag: %s\r\n"
+                 "%s"
+                 "\r\n",
+                 modified, etag, coding);
+    r->off304 = pw->off;
+    r->len304 = (uint32_t)n;
+    put(pw, head, n);
+    e->encodings |= ENCODING_BIT(enc);
+}
+
+// Add the file at path (relative to the root) to the pack
+static int put_file(struct pack_writer *pw, struct compressor *z,
+                    const char *path, struct pack_entry *e) {
+    char full[PATH_MAX];
+    struct stat st;
+    snprintf(full, sizeof(full), "%s/%s", walk_root, path);
+    if (stat(full, &st) != 0) {
+        perror("webserver (stat)");
+        return -1;
+    }
+    if ((uint64_t)st.st_size > UINT32_MAX) {
+        fprintf(stderr, "webserver: %s is too large for a pack\n", full);
+        return -1;
+    }
+    char *body = read_file(full, st.st_size);
+    if (body == NULL) {
+        return -1;
+    }
+    size_t len = st.st_size;
+
+    memset(e, 0, sizeof(*e));
+    e->path_len = (uint32_t)strlen(path);
+    e->hash = hash_path(path, e->path_len);
+    char modified[32];
+    struct tm tm;
+    gmtime_r(&st.st_mtim.tv_sec, &tm);
+    strftime(modified, sizeof(modified), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    // The tag follows the content, so a rebuilt pack keeps the tags of
+    // unchanged files
+    uint64_t tag = hash_path(body, len);
+    const char *type = static_content_type(path);
+
+    // Compressed once, as well as it gets, and only kept if it shrinks
+    const void *coded[ENCODINGS] = {0};
+    size_t coded_len[ENCODINGS] = {0};
+    int any = 0;
+    if (len >= ENCODING_MIN_SIZE && encoding_compressible(type)) {
+        for (int enc = ENCODING_IDENTITY + 1; enc < ENCODINGS; enc++) {
+            const void *data = compress_body(z, enc, body, len,
+                                             &coded_len[enc]);
+            if (data != NULL && (coded[enc] = malloc(coded_len[enc]))) {
+                memcpy((void *)coded[enc], data, coded_len[enc]);
+                any = 1;
+            }
+        }
+    }
+    put_rep(pw, e, ENCODING_IDENTITY, type,
+            any ? "Vary: Accept-Encoding\r\n" : "", modified, tag, body, len);
+    for (int enc = ENCODING_IDENTITY + 1; enc < ENCODINGS; enc++) {
+        if (coded[enc] == NULL) {
+            continue;
+        }
+        char coding[64];
+        snprintf(coding, sizeof(coding),
+                 "Content-Encoding: %s\r\nVary: Accept-Encoding\r\n",
+                 encoding_name(enc));
+        put_rep(pw, e, enc, type, coding, modified, tag, coded[enc],
+                coded_len[enc]);
+        free((void *)coded[enc]);
+    }
+    e->path_off = pw->off;
+    put(pw, path, e->path_len);
+    free(body);
+    return 0;
+}
+
+int pack_build(const char *root, const char *path) {
+    walk_root = root;
+    walk_root_len = strlen(root);
+    while (walk_root_len > 1 && root[walk_root_len - 1] == '/') {
+        walk_root_len--;
+    }
+    // A pack kept under the root must not end up in the next one
+    memset(&walk_skip, 0, sizeof(walk_skip));
+    stat(path, &walk_skip);
+    if (nftw(root, walk_file, 64, FTW_PHYS) != 0) {
+        perror("webserver (nftw)");
+        return -1;
+    }
+    if (walk_count > UINT32_MAX / 4) {
+        fprintf(stderr, "webserver: too many files for a pack\n");
+        return -1;
+    }
+
+    char tmp[PATH_MAX];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    struct pack_writer pw = {fopen(tmp, "wb"), 0};
+    struct compressor *z = compressor_new(COMPRESS_BEST);
+    struct pack_entry *entries = calloc(walk_count + 1, sizeof(*entries));
+    if (pw.out == NULL || z == NULL || entries == NULL) {
+        perror("webserver (create pack)");
+        return -1;
+    }
+    struct pack_header h = {.nentries = (uint32_t)walk_count};
+    memcpy(h.magic, PACK_MAGIC, sizeof(h.magic));
+    put(&pw, &h, sizeof(h));
+    for (size_t i = 0; i < walk_count; i++) {
+        if (put_file(&pw, z, walk_paths[i], &entries[i]) != 0) {
+            fclose(pw.out);
+            unlink(tmp);
+            return -1;
+        }
+    }
+
+    // The index is at most half full, so a miss ends after a probe or two
+    h.nslots = 1;
+    while (h.nslots < 2 * walk_count) {
+        h.nslots *= 2;
+    }
+    uint32_t *slots = calloc(h.nslots, sizeof(*slots));
+    if (slots == NULL) {
+        perror("webserver (calloc)");
+        return -1;
+    }
+    for (size_t i = 0; i < walk_count; i++) {
+        uint32_t j = (uint32_t)entries[i].hash & (h.nslots - 1);
+        while (slots[j] != 0) {
+            j = (j + 1) & (h.nslots - 1);
+        }
+        slots[j] = (uint32_t)i + 1;
+    }
+    align(&pw, 8);
+    h.entries_off = pw.off;
+    put(&pw, entries, walk_count * sizeof(*entries));
+    h.slots_off = pw.off;
+    put(&pw, slots, h.nslots * sizeof(*slots));
+    h.size = pw.off;
+
+    if (fseek(pw.out, 0, SEEK_SET) != 0 ||
+        fwrite(&h, sizeof(h), 1, pw.out) != 1 || fflush(pw.out) != 0 ||
+        fsync(fileno(pw.out)) != 0 || ferror(pw.out)) {
+        perror("webserver (write pack)");
+        fclose(pw.out);
+        unlink(tmp);
+        return -1;
+    }
+    fclose(pw.out);
+    if (rename(tmp, path) != 0) {
+        perror("webserver (rename pack)");
+        unlink(tmp);
+        return -1;
+    }
+    printf("packed %zu files into %s, %llu bytes\n", walk_count, path,
+           (unsigned long long)h.size);
+    compressor_free(z);
+    free(slots);
+    free(entries);
+    for (size_t i = 0; i < walk_count; i++) {
+        free(walk_paths[i]);
+    }
+    free(walk_paths);
+    return 0;
+}
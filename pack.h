@@ -0,0 +1,46 @@
+#ifndef WEBSERVER_PACK_H
+#define WEBSERVER_PACK_H
+
+#include <stddef.h>
+
+#include "conn.h"
+#include "http_parser.h"
+#include "resp_cache.h"
+
+// A read-only store of many small files in one file, the pack, built ahead
+// of time by pack_build() and served straight from a shared mapping.
+//
+// Every file is stored as the serialized response for HTTP/1.1 keep-alive,
+// head and body back to back, so the common answer is a single segment
+// pointing into the mapping. Other connection variants splice their line
+// in between. Compressible files also carry their gzip and brotli bodies
+// if those are smaller, and each representation has its 304 head, ETag
+// and Last-Modified. An open-addressing index of path hashes finds an
+// entry with a probe or two.
+//
+// Opening a pack maps it and checks its header, whatever the number of
+// files, and publishing it replaces the previous one for every worker at
+// once. The old mapping goes once no worker can see it and no write still
+// points into it.
+
+// Most segments a pack response queues: head, connection line and body
+#define PACK_MAX_SEGMENTS 3
+
+// Write a pack of every regular file under root to path. The pack is
+// written next to it first and renamed over it, so a running server that
+// opens path gets the old pack or the new one, never half of one.
+int pack_build(const char *root, const char *path);
+
+// Map the pack at path and make it the one requests are answered from.
+// Safe to call while the workers serve requests; they never wait on it.
+int pack_open(const char *path);
+
+// Answer a GET or HEAD for a file in the pack, in one of the codings in
+// encodings (see compress.h) the client accepts. Returns 0, with nothing
+// queued, if there is no pack, the method is another or the pack lacks
+// the file. Otherwise returns the status code and stores the bytes queued
+// in *bytes. The caller guarantees PACK_MAX_SEGMENTS free queue slots.
+int pack_serve(struct conn *c, const struct http_request *req,
+               enum resp_variant v, unsigned encodings, size_t *bytes);
+
+#endif
@@ -0,0 +1,65 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "pool.h"
+#include "server.h"
+
+#define CACHE_LINE 64
+
+const size_t buf_tier_size[BUF_TIERS] = {
+    BUFFER_SIZE,
+    4 * 1024,
+    16 * 1024,
+    BUFFER_MAX_SIZE,
+};
+
+void slab_init(struct slab *s, size_t size, unsigned per_chunk) {
+    s->size = (size + CACHE_LINE - 1) & ~(size_t)(CACHE_LINE - 1);
+    s->per_chunk = per_chunk;
+    s->free = NULL;
+    s->in_use = 0;
+    s->total = 0;
+}
+
+// Carve a new chunk into free objects
+static int slab_grow(struct slab *s) {
+    char *chunk = aligned_alloc(CACHE_LINE, s->size * s->per_chunk);
+    if (chunk == NULL) {
+        perror("webserver (aligned_alloc)");
+        return -1;
+    }
+    for (unsigned i = s->per_chunk; i-- > 0;) {
+        void **obj = (void **)(chunk + i * s->size);
+        *obj = s->free;
+        s->free = obj;
+    }
+    s->total += s->per_chunk;
+    return 0;
+}
+
+void *slab_alloc(struct slab *s) {
+    if (s->free == NULL && slab_grow(s) != 0) {
+        return NULL;
+    }
+    void **obj = s->free;
+    s->free = *obj;
+    s->in_use++;
+    return obj;
+}
+
+void slab_free(struct slab *s, void *p) {
+    void **obj = p;
+    *obj = s->free;
+    s->free = obj;
+    s->in_use--;
+}
+
+void buf_pool_init(struct buf_pool *p) {
+    // Aim for chunks of about 256 KB, but at least a few buffers each
+    for (int i = 0; i < BUF_TIERS; i++) {
+        unsigned per_chunk = 256 * 1024 / buf_tier_size[i];
+        slab_init(&p->tiers[i], buf_tier_size[i],
+                  per_chunk < 4 ? 4 : per_chunk);
+    }
+}
@@ -0,0 +1,42 @@
+#ifndef WEBSERVER_POOL_H
+#define WEBSERVER_POOL_H
+
+#include <stddef.h>
+
+// A per-worker allocator for objects of one size. Objects are carved from
+// chunks that are never given back, and freed objects are reused in LIFO
+// order so they are likely still in cache. Not thread-safe: only the
+// owning worker allocates from and frees to a slab.
+struct slab {
+    size_t size;                // object size, rounded up to a cache line
+    unsigned per_chunk;
+    void *free;                 // free objects, linked through themselves
+    size_t in_use;              // objects handed out
+    size_t total;               // objects carved from chunks so far
+};
+
+void slab_init(struct slab *s, size_t size, unsigned per_chunk);
+void *slab_alloc(struct slab *s);
+void slab_free(struct slab *s, void *p);
+
+// Receive buffers come in tiers; a connection starts small and only moves
+// up a tier when a request's headers do not fit
+#define BUF_TIERS 4
+
+struct buf_pool {
+    struct slab tiers[BUF_TIERS];
+};
+
+extern const size_t buf_tier_size[BUF_TIERS];
+
+void buf_pool_init(struct buf_pool *p);
+
+static inline char *buf_alloc(struct buf_pool *p, int tier) {
+    return slab_alloc(&p->tiers[tier]);
+}
+
+static inline void buf_free(struct buf_pool *p, int tier, char *buf) {
+    slab_free(&p->tiers[tier], buf);
+}
+
+#endif
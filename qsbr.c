@@ -0,0 +1,61 @@
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "qsbr.h"
+
+#define QSBR_OFFLINE 0
+
+// Each worker announces on its own cache line so going on- and offline
+// never bounces a shared line between cores
+struct qsbr_slot {
+    _Alignas(64) _Atomic uint64_t epoch;
+};
+
+static _Atomic uint64_t global_epoch = 1;
+static struct qsbr_slot *slots;
+static int nslots;
+
+int qsbr_init(int nworkers) {
+    slots = aligned_alloc(64, sizeof(*slots) * nworkers);
+    if (slots == NULL) {
+        perror("webserver (aligned_alloc)");
+        return -1;
+    }
+    for (int i = 0; i < nworkers; i++) {
+        atomic_init(&slots[i].epoch, QSBR_OFFLINE);
+    }
+    nslots = nworkers;
+    return 0;
+}
+
+void qsbr_online(int worker) {
+    uint64_t epoch = atomic_load_explicit(&global_epoch, memory_order_acquire);
+    atomic_store_explicit(&slots[worker].epoch, epoch, memory_order_relaxed);
+    // Our announcement has to be visible before we load any shared pointer
+    atomic_thread_fence(memory_order_seq_cst);
+}
+
+void qsbr_offline(int worker) {
+    atomic_store_explicit(&slots[worker].epoch, QSBR_OFFLINE,
+                          memory_order_release);
+}
+
+void qsbr_synchronize(void) {
+    atomic_thread_fence(memory_order_seq_cst);
+    uint64_t target = atomic_fetch_add(&global_epoch, 1) + 1;
+
+    for (int i = 0; i < nslots; i++) {
+        for (;;) {
+            uint64_t epoch =
+                atomic_load_explicit(&slots[i].epoch, memory_order_acquire);
+            if (epoch == QSBR_OFFLINE || epoch >= target) {
+                break;
+            }
+            struct timespec ts = {0, 50000};
+            nanosleep(&ts, NULL);
+        }
+    }
+}
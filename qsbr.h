@@ -0,0 +1,21 @@
+#ifndef WEBSERVER_QSBR_H
+#define WEBSERVER_QSBR_H
+
+// Quiescent-state based reclamation for data the workers only read.
+//
+// A worker is online while it handles events and may hold pointers to
+// shared data; it goes offline while it sleeps in the event loop. A writer
+// that unpublished something calls qsbr_synchronize(), which returns once
+// every worker has been offline or come back online since, so no worker
+// can still see the old data. Workers never wait on writers.
+
+// Allocate one slot per worker; call before the workers start
+int qsbr_init(int nworkers);
+
+void qsbr_online(int worker);
+void qsbr_offline(int worker);
+
+// Wait for a grace period
+void qsbr_synchronize(void);
+
+#endif
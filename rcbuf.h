@@ -0,0 +1,29 @@
+#ifndef WEBSERVER_RCBUF_H
+#define WEBSERVER_RCBUF_H
+
+#include <stdatomic.h>
+
+// Header for immutable, reference counted memory that queued writes can
+// point into. Whoever creates the buffer holds the first reference.
+struct rcbuf {
+    atomic_uint refs;
+    void (*destroy)(struct rcbuf *);
+};
+
+static inline void rcbuf_init(struct rcbuf *b,
+                              void (*destroy)(struct rcbuf *)) {
+    atomic_init(&b->refs, 1);
+    b->destroy = destroy;
+}
+
+static inline void rcbuf_get(struct rcbuf *b) {
+    atomic_fetch_add_explicit(&b->refs, 1, memory_order_relaxed);
+}
+
+static inline void rcbuf_put(struct rcbuf *b) {
+    if (atomic_fetch_sub_explicit(&b->refs, 1, memory_order_acq_rel) == 1) {
+        b->destroy(b);
+    }
+}
+
+#endif
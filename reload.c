@@ -0,0 +1,304 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "reload.h"
+
+// The environment variable that tells a new process which descriptor the
+// listeners arrive on
+#define HANDOFF_ENV "WEBSERVER_HANDOFF_FD"
+
+// Descriptors sent per message, below the kernel's SCM_MAX_FD of 253
+#define HANDOFF_BATCH 200
+
+// Seconds a new process gets to receive the listeners and start serving
+#define HANDOFF_TIMEOUT 10
+
+// systemd passes sockets from descriptor 3 on
+#define LISTEN_FDS_START 3
+
+extern char **environ;
+
+static char exe[PATH_MAX];
+static char **args;
+static int handoff_fd = -1;     // to the process that handed over to us
+
+int reload_init(char *argv[]) {
+    args = argv;
+    // The path, not /proc/self/exe itself: that stays the old binary when
+    // the file is replaced for an upgrade
+    ssize_t n = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+    if (n < 0) {
+        perror("webserver (readlink /proc/self/exe)");
+        return -1;
+    }
+    exe[n] = '\0';
+    return 0;
+}
+
+static int check_listener(int fd) {
+    int listening = 0;
+    socklen_t len = sizeof(listening);
+    if (getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &len) != 0 ||
+        !listening) {
+        fprintf(stderr, "webserver: inherited descriptor %d is not a "
+                "listening socket\n", fd);
+        return -1;
+    }
+    return 0;
+}
+
+static void close_all(int *fds, int n) {
+    for (int i = 0; i < n; i++) {
+        close(fds[i]);
+    }
+    free(fds);
+}
+
+// Receive the listeners a running server hands over on sock, in batches
+// that each carry the total count
+static int receive_listeners(int sock, int **out) {
+    struct timeval tv = {.tv_sec = HANDOFF_TIMEOUT};
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    int *fds = NULL;
+    uint32_t total = 0;
+    int got = 0;
+    do {
+        uint32_t count;
+        struct iovec iov = {.iov_base = &count, .iov_len = sizeof(count)};
+        union {
+            struct cmsghdr align;
+            char buf[CMSG_SPACE(HANDOFF_BATCH * sizeof(int))];
+        } control;
+        struct msghdr msg = {
+            .msg_iov = &iov,
+            .msg_iovlen = 1,
+            .msg_control = control.buf,
+            .msg_controllen = sizeof(control.buf),
+        };
+        ssize_t n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+        if (n < 0) {
+            perror("webserver (recvmsg listeners)");
+            close_all(fds, got);
+            return -1;
+        }
+        if (n != sizeof(count) || count == 0 || count > 65536 ||
+            (total != 0 && count != total) ||
+            (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC))) {
+            fprintf(stderr, "webserver: bad listener handoff message\n");
+            close_all(fds, got);
+            return -1;
+        }
+        if (fds == NULL) {
+            total = count;
+            fds = malloc(total * sizeof(*fds));
+            if (fds == NULL) {
+                perror("webserver (malloc)");
+                return -1;
+            }
+        }
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm != NULL;
+             cm = CMSG_NXTHDR(&msg, cm)) {
+            if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS) {
+                continue;
+            }
+            int k = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            int *in = (int *)CMSG_DATA(cm);
+            for (int i = 0; i < k; i++) {
+                if ((uint32_t)got < total) {
+                    fds[got++] = in[i];
+                } else {
+                    close(in[i]);
+                }
+            }
+        }
+    } while ((uint32_t)got < total);
+    *out = fds;
+    return got;
+}
+
+// Sockets systemd opened for us (sd_listen_fds(3)), meant for this very
+// process and not for anything we start
+static int systemd_listeners(int **out) {
+    const char *pid = getenv("LISTEN_PID");
+    const char *count = getenv("LISTEN_FDS");
+    if (pid == NULL || count == NULL || strtol(pid, NULL, 10) != getpid()) {
+        return 0;
+    }
+    long n = strtol(count, NULL, 10);
+    unsetenv("LISTEN_PID");
+    unsetenv("LISTEN_FDS");
+    unsetenv("LISTEN_FDNAMES");
+    if (n <= 0 || n > 65536) {
+        return 0;
+    }
+    int *fds = malloc(n * sizeof(*fds));
+    if (fds == NULL) {
+        perror("webserver (malloc)");
+        return -1;
+    }
+    for (int i = 0; i < n; i++) {
+        fds[i] = LISTEN_FDS_START + i;
+        fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+    }
+    *out = fds;
+    return (int)n;
+}
+
+int reload_inherit(int **fds) {
+    int n;
+    const char *env = getenv(HANDOFF_ENV);
+    if (env != NULL) {
+        handoff_fd = (int)strtol(env, NULL, 10);
+        unsetenv(HANDOFF_ENV);
+        // Whatever we start later must not hold on to it
+        fcntl(handoff_fd, F_SETFD, FD_CLOEXEC);
+        n = receive_listeners(handoff_fd, fds);
+    } else {
+        n = systemd_listeners(fds);
+    }
+    for (int i = 0; i < n; i++) {
+        if (check_listener((*fds)[i]) != 0) {
+            close_all(*fds, n);
+            return -1;
+        }
+    }
+    return n;
+}
+
+void reload_ready(void) {
+    if (handoff_fd < 0) {
+        return;
+    }
+    if (write(handoff_fd, "1", 1) != 1) {
+        perror("webserver (write to old process)");
+    }
+    close(handoff_fd);
+    handoff_fd = -1;
+}
+
+static int send_listeners(int sock, const int *fds, int n) {
+    for (int sent = 0; sent < n;) {
+        int batch = n - sent < HANDOFF_BATCH ? n - sent : HANDOFF_BATCH;
+        uint32_t count = n;
+        struct iovec iov = {.iov_base = &count, .iov_len = sizeof(count)};
+        union {
+            struct cmsghdr align;
+            char buf[CMSG_SPACE(HANDOFF_BATCH * sizeof(int))];
+        } control;
+        memset(&control, 0, sizeof(control));
+        struct msghdr msg = {
+            .msg_iov = &iov,
+            .msg_iovlen = 1,
+            .msg_control = control.buf,
+            .msg_controllen = CMSG_SPACE(batch * sizeof(int)),
+        };
+        struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+        cm->cmsg_level = SOL_SOCKET;
+        cm->cmsg_type = SCM_RIGHTS;
+        cm->cmsg_len = CMSG_LEN(batch * sizeof(int));
+        memcpy(CMSG_DATA(cm), fds + sent, batch * sizeof(int));
+        if (sendmsg(sock, &msg, MSG_NOSIGNAL) < 0) {
+            perror("webserver (sendmsg listeners)");
+            return -1;
+        }
+        sent += batch;
+    }
+    return 0;
+}
+
+// Our environment for the new process: the handoff descriptor instead of
+// any systemd variables, which were meant for us alone
+static char **child_environ(const char *handoff) {
+    size_t n = 0;
+    while (environ[n] != NULL) {
+        n++;
+    }
+    char **env = malloc((n + 2) * sizeof(*env));
+    if (env == NULL) {
+        perror("webserver (malloc)");
+        return NULL;
+    }
+    size_t k = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (strncmp(environ[i], "LISTEN_", 7) != 0 &&
+            strncmp(environ[i], HANDOFF_ENV "=", sizeof(HANDOFF_ENV)) != 0) {
+            env[k++] = environ[i];
+        }
+    }
+    env[k++] = (char *)handoff;
+    env[k] = NULL;
+    return env;
+}
+
+// Wait for the new process to report that it is serving
+static int wait_ready(int sock) {
+    struct pollfd p = {.fd = sock, .events = POLLIN};
+    int ready;
+    do {
+        ready = poll(&p, 1, HANDOFF_TIMEOUT * 1000);
+    } while (ready < 0 && errno == EINTR);
+    char byte;
+    return ready == 1 && read(sock, &byte, 1) == 1 ? 0 : -1;
+}
+
+int reload_spawn(const int *fds, int n) {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) != 0) {
+        perror("webserver (socketpair)");
+        return -1;
+    }
+    // Everything the child needs is prepared up front: between fork() and
+    // exec() a multi-threaded process may only make async-signal-safe calls
+    char handoff[sizeof(HANDOFF_ENV) + 16];
+    snprintf(handoff, sizeof(handoff), HANDOFF_ENV "=%d", sv[1]);
+    char **env = child_environ(handoff);
+    if (env == NULL) {
+        close(sv[0]);
+        close(sv[1]);
+        return -1;
+    }
+    sigset_t none;
+    sigemptyset(&none);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        // The signals our main thread waits for are blocked; the new
+        // process sets up its own
+        sigprocmask(SIG_SETMASK, &none, NULL);
+        fcntl(sv[1], F_SETFD, 0);
+        execve(exe, args, env);
+        _exit(127);
+    }
+    free(env);
+    close(sv[1]);
+    if (pid < 0) {
+        perror("webserver (fork)");
+        close(sv[0]);
+        return -1;
+    }
+
+    if (send_listeners(sv[0], fds, n) != 0 || wait_ready(sv[0]) != 0) {
+        fprintf(stderr, "webserver: new process %d did not start serving\n",
+                (int)pid);
+        close(sv[0]);
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        return -1;
+    }
+    close(sv[0]);
+    printf("handed %d listeners over to process %d\n", n, (int)pid);
+    fflush(stdout);
+    return 0;
+}
@@ -0,0 +1,29 @@
+#ifndef WEBSERVER_RELOAD_H
+#define WEBSERVER_RELOAD_H
+
+// Zero-downtime restarts. The listening sockets outlive any one process:
+// a running server started with the new binary hands them over on a Unix
+// socket, and systemd may pass them in on startup (socket activation).
+// Either way the new process accepts from the very sockets the old one
+// did, so no connection waiting in a backlog is ever refused.
+
+// Remember how we were started, so a reload can start us again. Call
+// first thing in main().
+int reload_init(char *argv[]);
+
+// Take over the listeners this process was given, from a server handing
+// them over or from systemd. Stores a malloc()ed array of descriptors in
+// *fds and returns how many there are: 0 if we were given none, -1 on
+// error.
+int reload_inherit(int **fds);
+
+// Tell the server that handed us its listeners that we are serving, so it
+// can stop. Does nothing if we were not started that way.
+void reload_ready(void);
+
+// Start a new copy of the server from the current binary and hand it the n
+// listeners in fds. Returns 0 once the new process is serving, -1 if it
+// could not be started or did not come up; then we keep serving.
+int reload_spawn(const int *fds, int n);
+
+#endif
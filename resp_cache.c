@@ -0,0 +1,313 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "qsbr.h"
+#include "resp_cache.h"
+
+#define CACHE_LINE 64
+
+// Open addressing table; entries are only ever added or replaced, never
+// removed, so readers need no locks
+#define RESP_CACHE_SLOTS 1024
+
+struct resp_slot {
+    _Atomic(const char *) path;
+    size_t path_len;
+    _Atomic(struct cached_response *) resp;
+};
+
+static struct resp_slot slots[RESP_CACHE_SLOTS];
+static _Atomic(struct cached_response *) default_resp;
+
+// Writers serialize among themselves; readers never take this
+static pthread_mutex_t writer_lock = PTHREAD_MUTEX_INITIALIZER;
+
+const char *resp_reason_phrase(int status) {
+    switch (status) {
+    case 200:
+        return "OK";
+    case 304:
+        return "Not Modified";
+    case 400:
+        return "Bad Request";
+    case 404:
+        return "Not Found";
+    case 405:
+        return "Method Not Allowed";
+    case 413:
+        return "Content Too Large";
+    case 429:
+        return "Too Many Requests";
+    case 431:
+        return "Request Header Fields Too Large";
+    case 500:
+        return "Internal Server Error";
+    case 501:
+        return "Not Implemented";
+    case 502:
+        return "Bad Gateway";
+    case 503:
+        return "Service Unavailable";
+    case 504:
+        return "Gateway Timeout";
+    default:
+        return "Unknown";
+    }
+}
+
+static void resp_destroy(struct rcbuf *rc) {
+    struct cached_response *r = (struct cached_response *)rc;
+    for (int e = 0; e < ENCODINGS; e++) {
+        if (r->encoded[e] != NULL) {
+            rcbuf_put(&r->encoded[e]->rc);
+        }
+    }
+    free(rc);
+}
+
+static size_t align_up(size_t n) {
+    return (n + CACHE_LINE - 1) & ~(size_t)(CACHE_LINE - 1);
+}
+
+static const char *const connection[RESP_VARIANTS] = {
+    [RESP_KEEP_ALIVE] = "",
+    [RESP_KEEP_ALIVE_10] = "Connection: keep-alive\r\n",
+    [RESP_CLOSE] = "Connection: close\r\n",
+};
+
+// Serialize with extra header lines, each ending in CRLF
+static struct cached_response *build(int status, const char *content_type,
+                                     const char *extra, const char *body,
+                                     size_t body_len) {
+    const char *fmt = "HTTP/1.1 %d %s\r\n"
+                      "Server: webserver-c\r\n"
+                      "Content-type: %s\r\n"
+                      "Content-Length: %zu\r\n"
+                      "%s%s"
+                      "\r\n";
+
+    int head_len[RESP_VARIANTS];
+    size_t size = align_up(sizeof(struct cached_response));
+    for (int v = 0; v < RESP_VARIANTS; v++) {
+        head_len[v] = snprintf(NULL, 0, fmt, status,
+                               resp_reason_phrase(status),
+                               content_type, body_len, extra, connection[v]);
+        // One extra byte for the NUL snprintf() writes
+        size += align_up(head_len[v] + body_len + 1);
+    }
+
+    struct cached_response *r = aligned_alloc(CACHE_LINE, size);
+    if (r == NULL) {
+        perror("webserver (aligned_alloc)");
+        return NULL;
+    }
+    rcbuf_init(&r->rc, resp_destroy);
+    r->status = status;
+    r->body_len = body_len;
+    r->encodings = 0;
+    memset(r->encoded, 0, sizeof(r->encoded));
+
+    char *p = (char *)r + align_up(sizeof(*r));
+    for (int v = 0; v < RESP_VARIANTS; v++) {
+        snprintf(p, head_len[v] + 1, fmt, status, resp_reason_phrase(status),
+                 content_type, body_len, extra, connection[v]);
+        memcpy(p + head_len[v], body, body_len);
+        r->data[v] = p;
+        r->len[v] = head_len[v] + body_len;
+        r->head_len[v] = head_len[v];
+        p += align_up(head_len[v] + body_len + 1);
+    }
+    return r;
+}
+
+struct cached_response *resp_build(int status, const char *content_type,
+                                   const char *body, size_t body_len) {
+    return build(status, content_type, "", body, body_len);
+}
+
+struct cached_response *resp_build_extra(int status, const char *content_type,
+                                         const char *extra, const char *body,
+                                         size_t body_len) {
+    return build(status, content_type, extra, body, body_len);
+}
+
+struct cached_response *resp_build_relayed(int status, const char *head,
+                                           size_t head_len, const char *body,
+                                           size_t body_len) {
+    // A 304 describes the body it does not have; so would its length
+    char length[40] = "";
+    if (status != 304) {
+        snprintf(length, sizeof(length), "Content-Length: %zu\r\n",
+                 body_len);
+    }
+    size_t length_len = strlen(length);
+
+    size_t size = align_up(sizeof(struct cached_response));
+    size_t len[RESP_VARIANTS];
+    for (int v = 0; v < RESP_VARIANTS; v++) {
+        len[v] = head_len + length_len + strlen(connection[v]) + 2 + body_len;
+        size += align_up(len[v]);
+    }
+    struct cached_response *r = aligned_alloc(CACHE_LINE, size);
+    if (r == NULL) {
+        perror("webserver (aligned_alloc)");
+        return NULL;
+    }
+    rcbuf_init(&r->rc, resp_destroy);
+    r->status = status;
+    r->body_len = body_len;
+    r->encodings = 0;
+    memset(r->encoded, 0, sizeof(r->encoded));
+
+    char *p = (char *)r + align_up(sizeof(*r));
+    for (int v = 0; v < RESP_VARIANTS; v++) {
+        char *q = p;
+        memcpy(q, head, head_len);
+        q += head_len;
+        memcpy(q, length, length_len);
+        q += length_len;
+        memcpy(q, connection[v], strlen(connection[v]));
+        q += strlen(connection[v]);
+        memcpy(q, "\r\n", 2);
+        if (body_len > 0) {
+            memcpy(q + 2, body, body_len);
+        }
+        r->data[v] = p;
+        r->len[v] = len[v];
+        r->head_len[v] = len[v] - body_len;
+        p += align_up(len[v]);
+    }
+    return r;
+}
+
+struct cached_response *resp_build_encoded(int status,
+                                           const char *content_type,
+                                           const char *body, size_t body_len,
+                                           struct compressor *z,
+                                           unsigned encodings) {
+    static const char vary[] = "Vary: Accept-Encoding\r\n";
+    if (body_len < ENCODING_MIN_SIZE ||
+        !encoding_compressible(content_type)) {
+        return resp_build(status, content_type, body, body_len);
+    }
+
+    struct cached_response *encoded[ENCODINGS] = {NULL};
+    unsigned built = 0;
+    for (int e = ENCODING_IDENTITY + 1; e < ENCODINGS; e++) {
+        size_t len;
+        const char *data;
+        if (!(encodings & ENCODING_BIT(e)) ||
+            (data = compress_body(z, e, body, body_len, &len)) == NULL) {
+            continue;
+        }
+        char extra[64];
+        snprintf(extra, sizeof(extra), "Content-Encoding: %s\r\n%s",
+                 encoding_name(e), vary);
+        if ((encoded[e] = build(status, content_type, extra, data, len)) ==
+            NULL) {
+            continue;
+        }
+        built |= ENCODING_BIT(e);
+    }
+
+    // Caches in between must know the identity body is not all there is
+    struct cached_response *r = build(status, content_type,
+                                      built != 0 ? vary : "", body, body_len);
+    if (r == NULL) {
+        for (int e = 0; e < ENCODINGS; e++) {
+            if (encoded[e] != NULL) {
+                rcbuf_put(&encoded[e]->rc);
+            }
+        }
+        return NULL;
+    }
+    r->encodings = built;
+    memcpy(r->encoded, encoded, sizeof(encoded));
+    return r;
+}
+
+// FNV-1a
+static uint32_t hash_path(const char *path, size_t len) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (unsigned char)path[i]) * 16777619u;
+    }
+    return h;
+}
+
+static struct resp_slot *find_slot(const char *path, size_t len,
+                                   int insert) {
+    uint32_t h = hash_path(path, len);
+    for (size_t i = 0; i < RESP_CACHE_SLOTS; i++) {
+        struct resp_slot *s = &slots[(h + i) & (RESP_CACHE_SLOTS - 1)];
+        const char *key = atomic_load_explicit(&s->path, memory_order_acquire);
+        if (key == NULL) {
+            if (!insert) {
+                return NULL;
+            }
+            char *copy = malloc(len);
+            if (copy == NULL) {
+                perror("webserver (malloc)");
+                return NULL;
+            }
+            memcpy(copy, path, len);
+            s->path_len = len;
+            // Publishing the key last makes the slot visible fully formed
+            atomic_store_explicit(&s->path, copy, memory_order_release);
+            return s;
+        }
+        if (s->path_len == len && memcmp(key, path, len) == 0) {
+            return s;
+        }
+    }
+    return NULL;
+}
+
+int resp_cache_set(const char *path, struct cached_response *r) {
+    pthread_mutex_lock(&writer_lock);
+
+    _Atomic(struct cached_response *) *target = &default_resp;
+    if (path != NULL) {
+        struct resp_slot *s = find_slot(path, strlen(path), 1);
+        if (s == NULL) {
+            pthread_mutex_unlock(&writer_lock);
+            fprintf(stderr, "webserver: response cache full\n");
+            return -1;
+        }
+        target = &s->resp;
+    }
+    struct cached_response *old =
+        atomic_exchange_explicit(target, r, memory_order_acq_rel);
+
+    // Workers that loaded the old entry before the swap may still be
+    // writing it; after a grace period only writes that pinned it remain
+    if (old != NULL) {
+        qsbr_synchronize();
+        rcbuf_put(&old->rc);
+    }
+
+    pthread_mutex_unlock(&writer_lock);
+    return 0;
+}
+
+const struct cached_response *resp_cache_lookup(const char *uri,
+                                                size_t len) {
+    const char *query = memchr(uri, '?', len);
+    if (query != NULL) {
+        len = query - uri;
+    }
+
+    struct resp_slot *s = find_slot(uri, len, 0);
+    struct cached_response *r = NULL;
+    if (s != NULL) {
+        r = atomic_load_explicit(&s->resp, memory_order_acquire);
+    }
+    if (r == NULL) {
+        r = atomic_load_explicit(&default_resp, memory_order_acquire);
+    }
+    return r;
+}
@@ -0,0 +1,85 @@
+#ifndef WEBSERVER_RESP_CACHE_H
+#define WEBSERVER_RESP_CACHE_H
+
+#include <stddef.h>
+
+#include "compress.h"
+#include "rcbuf.h"
+
+// Every response is serialized once per way the connection can continue,
+// so answering a request never has to assemble headers
+enum resp_variant {
+    RESP_KEEP_ALIVE,            // HTTP/1.1, persistent by default
+    RESP_KEEP_ALIVE_10,         // HTTP/1.0 with Connection: keep-alive
+    RESP_CLOSE,                 // Connection: close
+    RESP_VARIANTS,
+};
+
+// A fully serialized response: status line, headers, Content-Length and
+// body. Immutable once built; every variant starts on its own cache line.
+// A compressible response also owns a sibling per content coding that
+// shrinks it, so each body is compressed only once.
+struct cached_response {
+    struct rcbuf rc;
+    int status;
+    size_t body_len;            // at the end of every variant
+    unsigned encodings;         // ENCODING_BITs of the siblings in encoded[]
+    struct cached_response *encoded[ENCODINGS];
+    const char *data[RESP_VARIANTS];
+    size_t len[RESP_VARIANTS];
+    size_t head_len[RESP_VARIANTS]; // of data[v], all a HEAD gets
+};
+
+// The reason phrase of a status code, e.g. "Not Found"
+const char *resp_reason_phrase(int status);
+
+// Serialize a response. The caller owns the returned reference.
+struct cached_response *resp_build(int status, const char *content_type,
+                                   const char *body, size_t body_len);
+
+// Like resp_build(), with extra header lines, each ending in CRLF
+struct cached_response *resp_build_extra(int status, const char *content_type,
+                                         const char *extra, const char *body,
+                                         size_t body_len);
+
+// Serialize a response relayed from elsewhere. head is its status line and
+// header lines, each ending in CRLF, without Content-Length,
+// Transfer-Encoding and Connection, which are added.
+struct cached_response *resp_build_relayed(int status, const char *head,
+                                           size_t head_len, const char *body,
+                                           size_t body_len);
+
+// Serialize a response with a Vary: Accept-Encoding header and give it a
+// compressed sibling for every coding in encodings that z can produce and
+// that makes the body smaller. Bodies that are small or of a type that
+// does not compress are built as by resp_build().
+struct cached_response *resp_build_encoded(int status,
+                                           const char *content_type,
+                                           const char *body, size_t body_len,
+                                           struct compressor *z,
+                                           unsigned encodings);
+
+// The response or sibling to answer a client accepting the given codings
+// with. It lives as long as r does.
+static inline const struct cached_response *
+resp_negotiate(const struct cached_response *r, unsigned accepted) {
+    if (r->encodings == 0) {
+        return r;
+    }
+    enum encoding e = encoding_pick(accepted, r->encodings);
+    return e == ENCODING_IDENTITY ? r : r->encoded[e];
+}
+
+// Publish r under path, or as the response for paths without an entry if
+// path is NULL, taking over the caller's reference. Any previous entry is
+// retired once no worker can still be reading it. Safe to call while
+// workers serve requests; they never wait on it.
+int resp_cache_set(const char *path, struct cached_response *r);
+
+// Find the entry for the path part of uri. The result stays valid until
+// the calling worker goes offline (see qsbr.h), or for as long as it holds
+// a reference.
+const struct cached_response *resp_cache_lookup(const char *uri,
+                                                size_t len);
+
+#endif
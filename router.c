@@ -0,0 +1,543 @@
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "router.h"
+
+#define METHODS 7
+
+// Most seeds tried for one perfect hash bucket before giving up
+#define PHASH_MAX_SEED (1u << 20)
+
+struct route {
+    char *pattern;              // labels in the trie point into this copy
+    const void *data[METHODS];  // by method index, NULL when not routed
+    unsigned nparams;
+    const char *names[ROUTE_MAX_PARAMS];
+    struct route *next;
+};
+
+// A node of the compressed radix trie. The label is the run of path bytes
+// on the edge into the node; children are told apart by their first byte.
+struct trie_node {
+    const char *label;
+    size_t len;
+    unsigned nchildren;
+    unsigned char *first;
+    struct trie_node **children;
+    struct trie_node *param;    // ":name" child, matches one segment
+    struct route *exact;        // a pattern ends here
+    struct route *prefix;       // a pattern ends here with '*'
+};
+
+struct phash_slot {
+    const char *path;
+    size_t len;
+    const struct route *route;
+};
+
+struct router {
+    struct route *routes;
+    unsigned nexact;
+    int built;
+    struct trie_node root;
+
+    // Exact paths: the bucket picked by the high half of the path's hash
+    // holds the seed that sends each of its paths to a slot of their own
+    struct phash_slot *slots;
+    uint32_t slot_mask;
+    uint32_t *seeds;
+    uint32_t bucket_mask;
+};
+
+static int method_index(const struct http_str *m) {
+    switch (m->len) {
+    case 3:
+        if (memcmp(m->ptr, "GET", 3) == 0) {
+            return 0;
+        }
+        return memcmp(m->ptr, "PUT", 3) == 0 ? 3 : -1;
+    case 4:
+        if (memcmp(m->ptr, "HEAD", 4) == 0) {
+            return 1;
+        }
+        return memcmp(m->ptr, "POST", 4) == 0 ? 2 : -1;
+    case 5:
+        return memcmp(m->ptr, "PATCH", 5) == 0 ? 6 : -1;
+    case 6:
+        return memcmp(m->ptr, "DELETE", 6) == 0 ? 4 : -1;
+    case 7:
+        return memcmp(m->ptr, "OPTIONS", 7) == 0 ? 5 : -1;
+    default:
+        return -1;
+    }
+}
+
+// FNV-1a, finished with the murmur3 finalizer: on its own FNV barely
+// changes the high bits for paths that differ in their last bytes
+static uint64_t hash_path(const char *path, size_t len) {
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (unsigned char)path[i]) * 1099511628211ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+// Reseed the low half of a path's hash into a slot
+static uint32_t phash_slot_of(uint64_t h, uint32_t seed, uint32_t mask) {
+    uint32_t x = (uint32_t)h ^ (seed * 0x9e3779b9u);
+    x ^= x >> 16;
+    x *= 0x85ebca6bu;
+    x ^= x >> 13;
+    x *= 0xc2b2ae35u;
+    x ^= x >> 16;
+    return x & mask;
+}
+
+static uint32_t pow2_at_least(uint32_t n) {
+    uint32_t p = 1;
+    while (p < n) {
+        p <<= 1;
+    }
+    return p;
+}
+
+struct router *router_new(void) {
+    struct router *r = calloc(1, sizeof(*r));
+    if (r == NULL) {
+        perror("webserver (calloc)");
+    }
+    return r;
+}
+
+static int invalid_route(const char *pattern, const char *why) {
+    fprintf(stderr, "webserver: route '%s': %s\n", pattern, why);
+    return -1;
+}
+
+static struct trie_node *node_new(const char *label, size_t len) {
+    struct trie_node *n = calloc(1, sizeof(*n));
+    if (n == NULL) {
+        perror("webserver (calloc)");
+        return NULL;
+    }
+    n->label = label;
+    n->len = len;
+    return n;
+}
+
+static int node_add_child(struct trie_node *n, struct trie_node *child) {
+    unsigned char *first = realloc(n->first, n->nchildren + 1);
+    if (first == NULL) {
+        perror("webserver (realloc)");
+        return -1;
+    }
+    n->first = first;
+    struct trie_node **children =
+        realloc(n->children, (n->nchildren + 1) * sizeof(*children));
+    if (children == NULL) {
+        perror("webserver (realloc)");
+        return -1;
+    }
+    n->children = children;
+    n->first[n->nchildren] = (unsigned char)child->label[0];
+    n->children[n->nchildren++] = child;
+    return 0;
+}
+
+static struct trie_node *node_child(const struct trie_node *n,
+                                    unsigned char c) {
+    for (unsigned i = 0; i < n->nchildren; i++) {
+        if (n->first[i] == c) {
+            return n->children[i];
+        }
+    }
+    return NULL;
+}
+
+// Walk the bytes s[0, len) down from n, splitting an edge where s leaves
+// it, and return the node s ends at
+static struct trie_node *insert_static(struct trie_node *n, const char *s,
+                                       size_t len) {
+    while (len > 0) {
+        unsigned i = 0;
+        while (i < n->nchildren && n->first[i] != (unsigned char)s[0]) {
+            i++;
+        }
+        if (i == n->nchildren) {
+            struct trie_node *child = node_new(s, len);
+            if (child == NULL) {
+                return NULL;
+            }
+            if (node_add_child(n, child) != 0) {
+                free(child);
+                return NULL;
+            }
+            return child;
+        }
+
+        struct trie_node *child = n->children[i];
+        size_t common = 1;
+        while (common < child->len && common < len &&
+               child->label[common] == s[common]) {
+            common++;
+        }
+        if (common < child->len) {
+            struct trie_node *mid = node_new(child->label, common);
+            if (mid == NULL) {
+                return NULL;
+            }
+            child->label += common;
+            child->len -= common;
+            if (node_add_child(mid, child) != 0) {
+                // child stays where it was, whole
+                child->label -= common;
+                child->len += common;
+                free(mid->first);
+                free(mid);
+                return NULL;
+            }
+            n->children[i] = mid;
+            child = mid;
+        }
+        n = child;
+        s += common;
+        len -= common;
+    }
+    return n;
+}
+
+// Add a pattern with parameters or a wildcard to the trie
+static int trie_insert(struct router *r, struct route *rt) {
+    const char *pattern = rt->pattern;
+    struct trie_node *n = &r->root;
+    const char *p = pattern;
+    int wildcard = 0;
+    while (*p != '\0') {
+        if (*p == ':' && p[-1] == '/') {
+            const char *name = p + 1;
+            const char *end = strchrnul(name, '/');
+            if (end == name) {
+                return invalid_route(pattern, "unnamed parameter");
+            }
+            if (rt->nparams == ROUTE_MAX_PARAMS) {
+                return invalid_route(pattern, "too many parameters");
+            }
+            char *copy = strndup(name, end - name);
+            if (copy == NULL) {
+                perror("webserver (strndup)");
+                return -1;
+            }
+            rt->names[rt->nparams++] = copy;
+            if (n->param == NULL && (n->param = node_new("", 0)) == NULL) {
+                return -1;
+            }
+            n = n->param;
+            p = end;
+            continue;
+        }
+        if (*p == '*' && p[1] == '\0') {
+            wildcard = 1;
+            break;
+        }
+        const char *q = p + 1;
+        while (*q != '\0' && !(*q == ':' && q[-1] == '/') &&
+               !(*q == '*' && q[1] == '\0')) {
+            q++;
+        }
+        if ((n = insert_static(n, p, q - p)) == NULL) {
+            return -1;
+        }
+        p = q;
+    }
+
+    struct route **target = wildcard ? &n->prefix : &n->exact;
+    if (*target != NULL && *target != rt) {
+        return invalid_route(pattern, "conflicts with another route");
+    }
+    *target = rt;
+    return 0;
+}
+
+static void route_free(struct route *rt) {
+    for (unsigned i = 0; i < rt->nparams; i++) {
+        free((char *)rt->names[i]);
+    }
+    free(rt->pattern);
+    free(rt);
+}
+
+static int is_exact(const char *pattern) {
+    size_t len = strlen(pattern);
+    return strstr(pattern, "/:") == NULL && pattern[len - 1] != '*';
+}
+
+int router_add(struct router *r, unsigned methods, const char *pattern,
+               const void *data) {
+    if (r->built) {
+        return invalid_route(pattern, "added after the router was built");
+    }
+    if (pattern[0] != '/' || methods == 0 || (methods & ~ROUTE_ANY) != 0 ||
+        data == NULL) {
+        return invalid_route(pattern, "invalid route");
+    }
+
+    struct route *rt = r->routes;
+    while (rt != NULL && strcmp(rt->pattern, pattern) != 0) {
+        rt = rt->next;
+    }
+    if (rt == NULL) {
+        rt = calloc(1, sizeof(*rt));
+        if (rt == NULL || (rt->pattern = strdup(pattern)) == NULL) {
+            perror("webserver (malloc)");
+            free(rt);
+            return -1;
+        }
+        if (is_exact(pattern)) {
+            r->nexact++;
+        } else if (trie_insert(r, rt) != 0) {
+            // Nodes the trie grew on the way stay in it, unused, until
+            // router_free(); no node points at rt yet
+            route_free(rt);
+            return -1;
+        }
+        rt->next = r->routes;
+        r->routes = rt;
+    }
+
+    for (int i = 0; i < METHODS; i++) {
+        if (methods & (1u << i)) {
+            if (rt->data[i] != NULL) {
+                return invalid_route(pattern, "routed twice");
+            }
+            rt->data[i] = data;
+        }
+    }
+    return 0;
+}
+
+struct phash_bucket {
+    uint32_t index;
+    uint32_t count;
+};
+
+static int by_count_desc(const void *a, const void *b) {
+    const struct phash_bucket *x = a, *y = b;
+    return (x->count < y->count) - (x->count > y->count);
+}
+
+// Try seeds for the paths of one bucket until they all land in free slots
+// that differ from each other
+static int phash_place(struct router *r, struct route **keys, uint64_t *h,
+                       uint32_t n, uint32_t bucket) {
+    uint32_t slot[n];
+    for (uint32_t seed = 0; seed < PHASH_MAX_SEED; seed++) {
+        uint32_t placed = 0;
+        for (; placed < n; placed++) {
+            uint32_t s = phash_slot_of(h[placed], seed, r->slot_mask);
+            if (r->slots[s].route != NULL) {
+                break;
+            }
+            slot[placed] = s;
+            r->slots[s].route = keys[placed];
+        }
+        if (placed == n) {
+            for (uint32_t i = 0; i < n; i++) {
+                r->slots[slot[i]].path = keys[i]->pattern;
+                r->slots[slot[i]].len = strlen(keys[i]->pattern);
+            }
+            r->seeds[bucket] = seed;
+            return 0;
+        }
+        while (placed > 0) {
+            r->slots[slot[--placed]].route = NULL;
+        }
+    }
+    return -1;
+}
+
+static int phash_build(struct router *r) {
+    uint32_t n = r->nexact;
+    uint32_t nslots = pow2_at_least(2 * n);
+    uint32_t nbuckets = pow2_at_least(n / 2 + 1);
+    r->slots = calloc(nslots, sizeof(*r->slots));
+    r->seeds = calloc(nbuckets, sizeof(*r->seeds));
+    struct phash_bucket *buckets = calloc(nbuckets, sizeof(*buckets));
+    uint32_t *first = calloc(nbuckets + 1, sizeof(*first));
+    struct route **keys = malloc((n + 1) * sizeof(*keys));
+    uint64_t *hashes = malloc((n + 1) * sizeof(*hashes));
+    int ret = -1;
+    if (r->slots == NULL || r->seeds == NULL || buckets == NULL ||
+        first == NULL || keys == NULL || hashes == NULL) {
+        perror("webserver (malloc)");
+        goto out;
+    }
+    r->slot_mask = nslots - 1;
+    r->bucket_mask = nbuckets - 1;
+
+    // Group the paths by bucket with a counting sort, then place the
+    // fullest buckets first while the table still has room for them
+    for (struct route *rt = r->routes; rt != NULL; rt = rt->next) {
+        if (is_exact(rt->pattern)) {
+            uint64_t h = hash_path(rt->pattern, strlen(rt->pattern));
+            first[((h >> 32) & r->bucket_mask) + 1]++;
+        }
+    }
+    for (uint32_t b = 0; b < nbuckets; b++) {
+        buckets[b].index = b;
+        first[b + 1] += first[b];
+    }
+    for (struct route *rt = r->routes; rt != NULL; rt = rt->next) {
+        if (is_exact(rt->pattern)) {
+            uint64_t h = hash_path(rt->pattern, strlen(rt->pattern));
+            uint32_t b = (h >> 32) & r->bucket_mask;
+            uint32_t i = first[b] + buckets[b].count++;
+            keys[i] = rt;
+            hashes[i] = h;
+        }
+    }
+    qsort(buckets, nbuckets, sizeof(*buckets), by_count_desc);
+
+    for (uint32_t i = 0; i < nbuckets && buckets[i].count > 0; i++) {
+        uint32_t b = buckets[i].index;
+        if (phash_place(r, keys + first[b], hashes + first[b],
+                        buckets[i].count, b) != 0) {
+            fprintf(stderr, "webserver: no perfect hash for the routes\n");
+            goto out;
+        }
+    }
+    ret = 0;
+out:
+    free(buckets);
+    free(first);
+    free(keys);
+    free(hashes);
+    return ret;
+}
+
+int router_build(struct router *r) {
+    if (phash_build(r) != 0) {
+        return -1;
+    }
+    r->built = 1;
+    return 0;
+}
+
+static void node_free(struct trie_node *n) {
+    for (unsigned i = 0; i < n->nchildren; i++) {
+        node_free(n->children[i]);
+        free(n->children[i]);
+    }
+    if (n->param != NULL) {
+        node_free(n->param);
+        free(n->param);
+    }
+    free(n->first);
+    free(n->children);
+}
+
+void router_free(struct router *r) {
+    if (r == NULL) {
+        return;
+    }
+    node_free(&r->root);
+    while (r->routes != NULL) {
+        struct route *rt = r->routes;
+        r->routes = rt->next;
+        route_free(rt);
+    }
+    free(r->slots);
+    free(r->seeds);
+    free(r);
+}
+
+static int accepts(const struct route *rt, int method) {
+    return method >= 0 && rt->data[method] != NULL;
+}
+
+// Match the rest of the path below n, preferring static edges over a
+// parameter over a prefix, and backtracking when a branch fails
+static const struct route *trie_match(const struct trie_node *n,
+                                      const char *p, size_t len, int method,
+                                      struct route_match *m, int *seen) {
+    if (len == 0 && n->exact != NULL) {
+        if (accepts(n->exact, method)) {
+            return n->exact;
+        }
+        *seen = 1;
+    }
+    if (len > 0) {
+        const struct trie_node *child = node_child(n, (unsigned char)p[0]);
+        if (child != NULL && child->len <= len &&
+            memcmp(child->label, p, child->len) == 0) {
+            const struct route *rt = trie_match(
+                child, p + child->len, len - child->len, method, m, seen);
+            if (rt != NULL) {
+                return rt;
+            }
+        }
+        if (n->param != NULL) {
+            const char *slash = memchr(p, '/', len);
+            size_t seg = slash != NULL ? (size_t)(slash - p) : len;
+            if (seg > 0) {
+                unsigned i = m->nparams++;
+                m->params[i].ptr = p;
+                m->params[i].len = seg;
+                const struct route *rt = trie_match(n->param, p + seg,
+                                                    len - seg, method, m, seen);
+                if (rt != NULL) {
+                    return rt;
+                }
+                m->nparams = i;
+            }
+        }
+    }
+    if (n->prefix != NULL) {
+        if (accepts(n->prefix, method)) {
+            return n->prefix;
+        }
+        *seen = 1;
+    }
+    return NULL;
+}
+
+enum route_result router_match(const struct router *r,
+                               const struct http_str *method,
+                               const char *path, size_t len,
+                               struct route_match *m) {
+    int mi = method_index(method);
+    int seen = 0;
+    m->nparams = 0;
+
+    const struct route *rt = NULL;
+    if (r->nexact > 0) {
+        uint64_t h = hash_path(path, len);
+        uint32_t seed = r->seeds[(h >> 32) & r->bucket_mask];
+        const struct phash_slot *s =
+            &r->slots[phash_slot_of(h, seed, r->slot_mask)];
+        if (s->route != NULL && s->len == len &&
+            memcmp(s->path, path, len) == 0) {
+            if (accepts(s->route, mi)) {
+                rt = s->route;
+            } else {
+                seen = 1;
+            }
+        }
+    }
+    if (rt == NULL) {
+        rt = trie_match(&r->root, path, len, mi, m, &seen);
+    }
+    if (rt == NULL) {
+        return seen ? ROUTE_METHOD_NOT_ALLOWED : ROUTE_NOT_FOUND;
+    }
+    m->data = rt->data[mi];
+    m->names = rt->names;
+    return ROUTE_FOUND;
+}
@@ -0,0 +1,60 @@
+#ifndef WEBSERVER_ROUTER_H
+#define WEBSERVER_ROUTER_H
+
+#include "http_parser.h"
+
+// Methods a route answers to, or'ed together
+#define ROUTE_GET (1u << 0)
+#define ROUTE_HEAD (1u << 1)
+#define ROUTE_POST (1u << 2)
+#define ROUTE_PUT (1u << 3)
+#define ROUTE_DELETE (1u << 4)
+#define ROUTE_OPTIONS (1u << 5)
+#define ROUTE_PATCH (1u << 6)
+#define ROUTE_ANY ((1u << 7) - 1)
+
+#define ROUTE_MAX_PARAMS 8
+
+enum route_result {
+    ROUTE_FOUND,
+    ROUTE_NOT_FOUND,
+    ROUTE_METHOD_NOT_ALLOWED,   // the path has routes, none for the method
+};
+
+// A successful match. The parameter values point into the path that was
+// matched; names[i] is the name of params[i] without the ':'.
+struct route_match {
+    const void *data;
+    unsigned nparams;
+    const char *const *names;
+    struct http_str params[ROUTE_MAX_PARAMS];
+};
+
+// A set of routes, built once at startup and read-only afterwards, so any
+// number of workers may match against it without locks
+struct router *router_new(void);
+
+// Route methods on pattern to data. A pattern is a path where a segment
+// ":name" matches any one non-empty segment and a trailing '*' matches any
+// rest of the path, e.g. "/users/:id/posts" or "/static/*". Exact paths
+// take precedence over parameters, which take precedence over the longest
+// matching prefix. Must be called before router_build().
+int router_add(struct router *r, unsigned methods, const char *pattern,
+               const void *data);
+
+// Freeze the routes into their lookup structures: a perfect hash for the
+// exact paths and a compressed radix trie for the rest
+int router_build(struct router *r);
+
+// Free r and its routes; the data they point to is the caller's
+void router_free(struct router *r);
+
+// Match a request method and path (without the query). Costs one hash of
+// the path for exact routes and one walk down the trie otherwise, and
+// never allocates.
+enum route_result router_match(const struct router *r,
+                               const struct http_str *method,
+                               const char *path, size_t len,
+                               struct route_match *m);
+
+#endif
@@ -0,0 +1,214 @@
+#ifndef WEBSERVER_SERVER_H
+#define WEBSERVER_SERVER_H
+
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdint.h>
+
+#include "addr.h"
+#include "metrics.h"
+#include "pool.h"
+
+#define DEFAULT_LISTEN "8080"       // without --listen: any address, port 8080
+#define LISTEN_MAX 16               // addresses we can listen on
+#define UPSTREAM_MAX 16             // backends we can proxy to
+#define ROUTES_MAX 64               // --route entries
+#define BUFFER_SIZE 1024            // initial receive buffer
+#define BUFFER_MAX_SIZE (64 * 1024)  // largest request head we accept
+
+enum server_mode {
+    MODE_BLOCKING,
+    MODE_EPOLL,
+};
+
+// What a worker does with new connections while overloaded, see overload.h
+enum shed_mode {
+    SHED_PAUSE,                 // leave them in the listen backlog
+    SHED_REJECT,                // answer them with a 503
+};
+
+// What happens to a WebSocket subscriber too slow for its messages
+enum ws_slow {
+    WS_SLOW_DROP,               // it misses them
+    WS_SLOW_CLOSE,              // it is disconnected
+};
+
+enum log_level {
+    LOG_OFF,
+    LOG_ERROR,
+    LOG_INFO,       // one line per request
+    LOG_DEBUG,      // and one per accepted connection
+};
+
+enum io_backend {
+    IO_EPOLL,
+    IO_URING,
+};
+
+// How the proxy picks a backend for a request
+enum balance {
+    BALANCE_ROUND_ROBIN,
+    BALANCE_LEAST_CONN,         // the fewest of this worker's requests
+};
+
+// What a --route answers with
+enum route_action {
+    ACTION_TEXT,                // a fixed text/plain body
+    ACTION_METRICS,             // the metrics page
+    ACTION_STREAM,              // a generated body of :bytes bytes
+    ACTION_PROXY,               // whatever the --upstream backends answer
+};
+
+// A --route, see config.h. The strings point into the option.
+struct route_spec {
+    unsigned methods;           // ROUTE_GET and so on, or'ed together
+    const char *pattern;        // not terminated after pattern_len
+    size_t pattern_len;
+    enum route_action action;
+    const char *arg;            // the rest of the option, e.g. the body
+};
+
+struct config_text;
+
+// An address to listen on, see addr_parse()
+struct listen_addr {
+    union sock_addr addr;
+    int dual_stack;             // [::] taking IPv4 connections as well
+};
+
+struct server_config {
+    const char *config_file;    // --config, or NULL
+    struct config_text *text;   // the options read from it
+    enum server_mode mode;
+    enum io_backend io;
+    int workers;
+    struct listen_addr listen[LISTEN_MAX];  // --listen or DEFAULT_LISTEN
+    int nlisten;
+    int keepalive_timeout;      // seconds an idle connection is kept open
+    int read_timeout;           // seconds a request may take to arrive
+    int write_timeout;          // seconds a response may make no progress
+    size_t max_header_size;     // largest request head, 431 beyond
+    uint64_t max_body_size;     // largest request body, 413 beyond
+    unsigned max_requests;      // requests served per connection
+    const char *root;           // document root for static files, or NULL
+    const char *pack;           // pack of files to serve first, or NULL
+    const char *make_pack;      // build this pack from root and exit
+    enum log_level log_level;
+    const char *access_log;     // access log path, "-" for stdout
+    unsigned log_sample;        // log one in this many requests
+    int log_timing;             // log where a request's time went
+    const char *tls_cert;       // certificate chain for HTTPS, or NULL
+    const char *tls_key;        // its private key
+    int drain_timeout;          // seconds open connections get to finish
+    int offload_threads;        // threads for blocking handlers
+    int cpu_steering;           // connections go to the worker by CPU
+    int metrics;                // /metrics and the latency histograms
+    int compression;            // answer with compressed variants
+    struct route_spec routes[ROUTES_MAX];   // --route
+    int nroutes;
+
+    // Admission limits, see limit.h; 0 for none
+    int max_conns;              // open connections
+    int max_conns_per_ip;       // open connections of one client
+    int max_rate;               // requests per second
+    int max_rate_per_ip;        // requests per second of one client
+
+    // Overload admission control, see overload.h
+    int accept_batch;           // connections accepted per listener wakeup
+    int shed_lag;               // loop lag milliseconds to shed at, or 0
+    int shed_conns;             // connections of a worker to shed at, or 0
+    enum shed_mode shed;
+
+    // Reverse proxy, see upstream.h
+    union sock_addr upstream[UPSTREAM_MAX];     // --upstream backends
+    int nupstream;
+    enum balance balance;
+    const char *proxy_path;     // route pattern of the proxied requests
+    const char *health_check;   // path every backend is checked with
+    int health_interval;        // seconds between health checks
+    int upstream_timeout;       // seconds a backend may take to answer
+    size_t cache_size;          // bytes of proxied responses to keep, or 0
+
+    // WebSocket, see ws.h
+    const char *ws_path;        // route pattern of the endpoint
+    int ws_queue;               // frames a subscriber may have unwritten
+    enum ws_slow ws_slow;
+    int ws_timeout;             // seconds a WebSocket may be idle
+
+    // Socket options, see sockopt.h
+    int backlog;                // listen() backlog
+    int nodelay;                // TCP_NODELAY
+    int defer_accept;           // TCP_DEFER_ACCEPT seconds, 0 for off
+    int fastopen;               // TCP Fast Open queue length, 0 for off
+    int busy_poll;              // SO_BUSY_POLL microseconds, 0 for off
+    int sndbuf;                 // SO_SNDBUF bytes, 0 for autotuning
+    int rcvbuf;                 // SO_RCVBUF bytes, 0 for autotuning
+};
+
+extern struct server_config config;
+
+struct conn;
+struct static_cache;
+struct log_ring;
+struct compressor;
+struct upstream_pool;
+struct offload_queue;
+struct ws_worker;
+
+// An event-loop thread with its own listeners
+struct worker {
+    int id;
+    int cpu;        // CPU the worker is pinned to, -1 if unpinned
+    int node;       // NUMA node of that CPU, -1 if unknown
+    int listen_fd[LISTEN_MAX];  // this worker's SO_REUSEPORT listeners,
+    int nlisten;                // one per address, none once draining
+    int wakefd;     // eventfd the main thread asks the worker to drain with
+    int draining;   // not accepting any more, finishing open connections
+    pthread_t thread;
+    uint64_t now;   // CLOCK_MONOTONIC milliseconds, refreshed every wakeup
+    uint64_t lag_ns;    // smoothed time a wakeup takes, see overload.h
+    int lag_shedding;   // shedding new connections for the lag
+    struct static_cache *files;     // open files, NULL without --root
+    struct slab conns;              // connection state
+    struct buf_pool bufs;           // receive buffers
+    struct log_ring *log;           // access log records, NULL when off
+    struct compressor *zip;         // for responses built per request
+    void (*written)(struct conn *c);    // a response is out, see http.c
+    struct upstream_pool *upstream; // backend connections, or NULL
+    struct offload_queue *offload;  // jobs for the pool, or NULL
+    struct ws_worker *ws;           // WebSocket subscribers, or NULL
+    struct worker_metrics metrics;
+};
+
+// The hard-coded response of the blocking baseline
+extern const char resp[];
+
+// Create a listening socket on a with the socket options profile,
+// optionally with SO_REUSEPORT set
+int create_listener(const struct listen_addr *a, int reuseport);
+
+// Print the addresses the n listeners in fds are bound to, separated by
+// commas, with "*:PORT" for a dual-stack wildcard
+void print_listeners(const int *fds, int n);
+
+// Serve connections on the worker's listeners with an edge-triggered epoll
+// event loop
+int run_epoll(struct worker *w);
+
+// Milliseconds on a cheap monotonic clock
+uint64_t monotonic_ms(void);
+
+// Serve connections on the worker's listeners with an io_uring event loop:
+// multishot accept, multishot receive into provided buffers and sends with
+// a linked close
+int run_uring(struct worker *w);
+
+// Number of workers to run when --workers is not given: the online CPUs
+int default_workers(void);
+
+// Start nworkers pinned event-loop workers, on the listeners we were handed
+// if any, and serve until a reload or a graceful shutdown is signalled and
+// the workers drained
+int run_workers(int nworkers);
+
+#endif
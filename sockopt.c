@@ -0,0 +1,98 @@
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <sys/socket.h>
+
+#include "server.h"
+#include "sockopt.h"
+
+#ifndef SO_BUSY_POLL
+#define SO_BUSY_POLL 46
+#endif
+
+static void set_int(int fd, int level, int name, int value,
+                    const char *what) {
+    if (setsockopt(fd, level, name, &value, sizeof(value)) != 0) {
+        char msg[64];
+        snprintf(msg, sizeof(msg), "webserver (setsockopt %s)", what);
+        perror(msg);
+    }
+}
+
+static int get_int(int fd, int level, int name) {
+    int value = -1;
+    socklen_t len = sizeof(value);
+    getsockopt(fd, level, name, &value, &len);
+    return value;
+}
+
+// A number from /proc/sys, -1 if it cannot be read
+static long read_sysctl(const char *path) {
+    FILE *f = fopen(path, "re");
+    long value = -1;
+    if (f != NULL) {
+        if (fscanf(f, "%ld", &value) != 1) {
+            value = -1;
+        }
+        fclose(f);
+    }
+    return value;
+}
+
+void sockopt_apply(int fd) {
+    const struct server_config *c = &config;
+    if (c->sndbuf > 0) {
+        set_int(fd, SOL_SOCKET, SO_SNDBUF, c->sndbuf, "SO_SNDBUF");
+    }
+    if (c->rcvbuf > 0) {
+        set_int(fd, SOL_SOCKET, SO_RCVBUF, c->rcvbuf, "SO_RCVBUF");
+    }
+    // Headers and body are already coalesced with MSG_MORE, so Nagle's
+    // algorithm would only hold back the last segment of a response
+    set_int(fd, IPPROTO_TCP, TCP_NODELAY, c->nodelay, "TCP_NODELAY");
+    // Wake us only once the request is there, rather than for a bare
+    // handshake
+    if (c->defer_accept > 0) {
+        set_int(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, c->defer_accept,
+                "TCP_DEFER_ACCEPT");
+    }
+    if (c->fastopen > 0) {
+        set_int(fd, IPPROTO_TCP, TCP_FASTOPEN, c->fastopen, "TCP_FASTOPEN");
+    }
+    if (c->busy_poll > 0) {
+        set_int(fd, SOL_SOCKET, SO_BUSY_POLL, c->busy_poll, "SO_BUSY_POLL");
+    }
+}
+
+int sockopt_listen(int fd) {
+    if (listen(fd, config.backlog) != 0) {
+        perror("webserver (listen)");
+        return -1;
+    }
+    return 0;
+}
+
+void sockopt_report(int fd) {
+    long somaxconn = read_sysctl("/proc/sys/net/core/somaxconn");
+    int backlog = config.backlog;
+    if (somaxconn >= 0 && backlog > somaxconn) {
+        // The kernel caps the backlog silently
+        backlog = (int)somaxconn;
+    }
+    printf("socket options: backlog %d%s, TCP_NODELAY %s, "
+           "TCP_DEFER_ACCEPT %ds, TCP_FASTOPEN %d, SO_BUSY_POLL %dus, "
+           "SO_SNDBUF %d, SO_RCVBUF %d\n",
+           backlog, backlog < config.backlog ? " (net.core.somaxconn)" : "",
+           get_int(fd, IPPROTO_TCP, TCP_NODELAY) ? "on" : "off",
+           get_int(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT),
+           get_int(fd, IPPROTO_TCP, TCP_FASTOPEN),
+           get_int(fd, SOL_SOCKET, SO_BUSY_POLL),
+           get_int(fd, SOL_SOCKET, SO_SNDBUF),
+           get_int(fd, SOL_SOCKET, SO_RCVBUF));
+    // Bit 2 enables the server side
+    long tfo = read_sysctl("/proc/sys/net/ipv4/tcp_fastopen");
+    if (config.fastopen > 0 && tfo >= 0 && !(tfo & 2)) {
+        fprintf(stderr, "webserver: TCP Fast Open is off for servers, "
+                "net.ipv4.tcp_fastopen is %ld\n", tfo);
+    }
+}
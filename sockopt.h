@@ -0,0 +1,22 @@
+#ifndef WEBSERVER_SOCKOPT_H
+#define WEBSERVER_SOCKOPT_H
+
+// The socket options profile (--backlog, --nodelay, --defer-accept,
+// --fastopen, --busy-poll, --sndbuf, --rcvbuf). Everything is set on the
+// listener: accepted sockets inherit it, so accepting a connection costs
+// no system calls beyond accept4() itself.
+
+// Apply the profile to a listener that is not bound yet, so buffer sizes
+// are in place before the window scale is chosen. Failures are reported
+// but not fatal: a kernel may lack an option.
+void sockopt_apply(int fd);
+
+// Start listening on fd, or resize the backlog of a socket that already
+// listens, e.g. one we were handed
+int sockopt_listen(int fd);
+
+// Print the values the kernel actually uses for fd, which may differ from
+// what was asked for
+void sockopt_report(int fd);
+
+#endif
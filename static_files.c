@@ -0,0 +1,588 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/openat2.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "compress.h"
+#include "static_files.h"
+
+// Open files kept per worker, and how often a cached entry is checked
+// against the file system
+#define STATIC_CACHE_SIZE 1024
+#define STATIC_CACHE_BUCKETS 2048
+#define STATIC_REVALIDATE_MS 1000
+
+// One representation of a file: the file itself, or a precompressed
+// sibling such as index.html.gz, with its pre-built response headers
+struct static_variant {
+    int fd;                     // -1 if there is no such sibling
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+
+    // Headers for 200 and 304 responses, for every resp_variant
+    const char *head[2][RESP_VARIANTS];
+    size_t head_len[2][RESP_VARIANTS];
+    char etag[48];
+};
+
+// An open file with its metadata and its representations. Queued file
+// segments point at their descriptors, so those are only closed once the
+// entry was evicted and no deferred write still pins it.
+struct static_file {
+    struct rcbuf rc;
+    char *path;
+    size_t path_len;
+    uint64_t checked;           // when the file was last stat()ed
+    unsigned encodings;         // ENCODING_BITs of the variants that exist
+    struct static_variant variant[ENCODINGS];
+    char last_modified[32];
+
+    struct static_file *hnext;  // hash chain
+    struct static_file *prev, *next;    // LRU list, most recent first
+};
+
+struct static_cache {
+    struct static_file *buckets[STATIC_CACHE_BUCKETS];
+    struct static_file *head, *tail;
+    unsigned count;
+};
+
+static int root_fd = -1;
+
+static struct cached_response *resp_not_found;
+static struct cached_response *resp_not_allowed;
+static struct cached_response *resp_bad_path;
+
+static const struct {
+    const char *ext;
+    const char *type;
+} mime_types[] = {
+    {"html", "text/html"},
+    {"htm", "text/html"},
+    {"css", "text/css"},
+    {"js", "text/javascript"},
+    {"mjs", "text/javascript"},
+    {"json", "application/json"},
+    {"txt", "text/plain"},
+    {"xml", "application/xml"},
+    {"svg", "image/svg+xml"},
+    {"png", "image/png"},
+    {"jpg", "image/jpeg"},
+    {"jpeg", "image/jpeg"},
+    {"gif", "image/gif"},
+    {"webp", "image/webp"},
+    {"ico", "image/x-icon"},
+    {"woff2", "font/woff2"},
+    {"wasm", "application/wasm"},
+    {"pdf", "application/pdf"},
+    {"mp4", "video/mp4"},
+};
+
+const char *static_content_type(const char *path) {
+    const char *dot = strrchr(path, '.');
+    if (dot != NULL && strchr(dot, '/') == NULL) {
+        for (size_t i = 0; i < sizeof(mime_types) / sizeof(*mime_types);
+             i++) {
+            if (strcasecmp(dot + 1, mime_types[i].ext) == 0) {
+                return mime_types[i].type;
+            }
+        }
+    }
+    return "application/octet-stream";
+}
+
+int static_init(const char *root) {
+    root_fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (root_fd < 0) {
+        perror("webserver (open root)");
+        return -1;
+    }
+
+    static const char not_found[] = "<html>not found</html>\r\n";
+    static const char not_allowed[] = "<html>method not allowed</html>\r\n";
+    static const char bad_path[] = "<html>bad request</html>\r\n";
+    resp_not_found =
+        resp_build(404, "text/html", not_found, sizeof(not_found) - 1);
+    resp_not_allowed =
+        resp_build(405, "text/html", not_allowed, sizeof(not_allowed) - 1);
+    resp_bad_path =
+        resp_build(400, "text/html", bad_path, sizeof(bad_path) - 1);
+    if (resp_not_found == NULL || resp_not_allowed == NULL ||
+        resp_bad_path == NULL) {
+        return -1;
+    }
+    return 0;
+}
+
+struct static_cache *static_cache_new(void) {
+    struct static_cache *sc = calloc(1, sizeof(*sc));
+    if (sc == NULL) {
+        perror("webserver (calloc)");
+    }
+    return sc;
+}
+
+static int hex_value(char ch) {
+    if (ch >= '0' && ch <= '9') {
+        return ch - '0';
+    }
+    if (ch >= 'a' && ch <= 'f') {
+        return ch - 'a' + 10;
+    }
+    if (ch >= 'A' && ch <= 'F') {
+        return ch - 'A' + 10;
+    }
+    return -1;
+}
+
+int static_map_path(const struct http_str *uri, char *out, size_t size) {
+    const char *p = uri->ptr;
+    const char *end = uri->ptr + uri->len;
+    const char *query = memchr(p, '?', uri->len);
+    if (query != NULL) {
+        end = query;
+    }
+    if (p == end || *p != '/') {
+        return -1;
+    }
+    p++;
+
+    size_t len = 0;
+    while (p < end) {
+        char ch = *p++;
+        if (ch == '%') {
+            int hi, lo;
+            if (end - p < 2 || (hi = hex_value(p[0])) < 0 ||
+                (lo = hex_value(p[1])) < 0) {
+                return -1;
+            }
+            ch = (char)(hi << 4 | lo);
+            p += 2;
+        }
+        if (ch == '\0' || len + 1 >= size) {
+            return -1;
+        }
+        out[len++] = ch;
+    }
+    out[len] = '\0';
+
+    // Refuse any ".." segment; openat2() would refuse to leave the root
+    // anyway, but there is no reason to let the request get that far
+    for (const char *seg = out; *seg != '\0';) {
+        const char *slash = strchr(seg, '/');
+        size_t seglen = slash != NULL ? (size_t)(slash - seg) : strlen(seg);
+        if (seglen == 2 && seg[0] == '.' && seg[1] == '.') {
+            return -1;
+        }
+        if (slash == NULL) {
+            break;
+        }
+        seg = slash + 1;
+    }
+
+    if (len == 0 || out[len - 1] == '/') {
+        static const char index[] = "index.html";
+        if (len + sizeof(index) > size) {
+            return -1;
+        }
+        memcpy(out + len, index, sizeof(index));
+        len += sizeof(index) - 1;
+    }
+    return (int)len;
+}
+
+static int open_beneath_root(const char *path) {
+    struct open_how how = {
+        .flags = O_RDONLY | O_CLOEXEC,
+        .resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS,
+    };
+    int fd = syscall(SYS_openat2, root_fd, path, &how, sizeof(how));
+    if (fd < 0 && errno == ENOSYS) {
+        // Kernels before 5.6; map_path() already refused ".."
+        fd = openat(root_fd, path, O_RDONLY | O_CLOEXEC);
+    }
+    return fd;
+}
+
+static uint32_t hash_path(const char *path, size_t len) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (unsigned char)path[i]) * 16777619u;
+    }
+    return h;
+}
+
+// File name suffixes of precompressed siblings
+static const char *const encoding_suffix[ENCODINGS] = {
+    [ENCODING_GZIP] = ".gz",
+    [ENCODING_BR] = ".br",
+};
+
+static void file_destroy(struct rcbuf *rc) {
+    struct static_file *f = (struct static_file *)rc;
+    for (int e = 0; e < ENCODINGS; e++) {
+        if (f->variant[e].fd >= 0) {
+            close(f->variant[e].fd);
+        }
+        free((void *)f->variant[e].head[0][0]);
+    }
+    free(f->path);
+    free(f);
+}
+
+// Build the 200 and 304 headers of one representation for every variant
+// in one allocation
+static int build_headers(const struct static_file *f,
+                         struct static_variant *fv, enum encoding e,
+                         const char *type) {
+    static const char *const connection[RESP_VARIANTS] = {
+        [RESP_KEEP_ALIVE] = "",
+        [RESP_KEEP_ALIVE_10] = "Connection: keep-alive\r\n",
+        [RESP_CLOSE] = "Connection: close\r\n",
+    };
+    static const char ok_fmt[] = "HTTP/1.1 200 OK\r\n"
+                                 "Server: webserver-c\r\n"
+                                 "Content-type: %s\r\n"
+                                 "Content-Length: %lld\r\n"
+                                 "Last-Modified: %s\r\n"
+                                 "ETag: %s\r\n"
+                                 "%s%s"
+                                 "\r\n";
+    static const char not_modified_fmt[] = "HTTP/1.1 304 Not Modified\r\n"
+                                           "Server: webserver-c\r\n"
+                                           "Last-Modified: %s\r\n"
+                                           "ETag: %s\r\n"
+                                           "%s%s"
+                                           "\r\n";
+
+    // Once a sibling exists the answer depends on Accept-Encoding, and
+    // every representation has to say so
+    char coding[64] = "";
+    if (e != ENCODING_IDENTITY) {
+        snprintf(coding, sizeof(coding),
+                 "Content-Encoding: %s\r\nVary: Accept-Encoding\r\n",
+                 encoding_name(e));
+    } else if (f->encodings & ~ENCODING_BIT(ENCODING_IDENTITY)) {
+        strcpy(coding, "Vary: Accept-Encoding\r\n");
+    }
+
+    size_t total = 0;
+    for (int v = 0; v < RESP_VARIANTS; v++) {
+        total += snprintf(NULL, 0, ok_fmt, type, (long long)fv->size,
+                          f->last_modified, fv->etag, coding,
+                          connection[v]) + 1;
+        total += snprintf(NULL, 0, not_modified_fmt, f->last_modified,
+                          fv->etag, coding, connection[v]) + 1;
+    }
+
+    char *p = malloc(total);
+    if (p == NULL) {
+        perror("webserver (malloc)");
+        return -1;
+    }
+    for (int v = 0; v < RESP_VARIANTS; v++) {
+        int n = sprintf(p, ok_fmt, type, (long long)fv->size,
+                        f->last_modified, fv->etag, coding, connection[v]);
+        fv->head[0][v] = p;
+        fv->head_len[0][v] = n;
+        p += n + 1;
+        n = sprintf(p, not_modified_fmt, f->last_modified, fv->etag, coding,
+                    connection[v]);
+        fv->head[1][v] = p;
+        fv->head_len[1][v] = n;
+        p += n + 1;
+    }
+    return 0;
+}
+
+static void variant_set(struct static_variant *fv, int fd,
+                        const struct stat *st) {
+    fv->fd = fd;
+    fv->dev = st->st_dev;
+    fv->ino = st->st_ino;
+    fv->size = st->st_size;
+    fv->mtime = st->st_mtim;
+}
+
+// Name of the sibling of path with coding e, or NULL if it does not fit
+static const char *sibling_path(const char *path, size_t len, enum encoding e,
+                                char *out, size_t size) {
+    size_t suffix_len = strlen(encoding_suffix[e]);
+    if (len + suffix_len >= size) {
+        return NULL;
+    }
+    memcpy(out, path, len);
+    memcpy(out + len, encoding_suffix[e], suffix_len + 1);
+    return out;
+}
+
+// Is a precompressed sibling usable? An older one was left behind by an
+// update of the file and would serve stale content.
+static int sibling_usable(const struct stat *st, const struct stat *orig) {
+    return S_ISREG(st->st_mode) &&
+           (st->st_mtim.tv_sec > orig->st_mtim.tv_sec ||
+            (st->st_mtim.tv_sec == orig->st_mtim.tv_sec &&
+             st->st_mtim.tv_nsec >= orig->st_mtim.tv_nsec));
+}
+
+// Open the precompressed siblings of f worth serving
+static void open_siblings(struct static_file *f, const struct stat *orig) {
+    char name[PATH_MAX];
+    for (int e = ENCODING_IDENTITY + 1; e < ENCODINGS; e++) {
+        if (sibling_path(f->path, f->path_len, e, name, sizeof(name)) ==
+            NULL) {
+            continue;
+        }
+        int fd = open_beneath_root(name);
+        if (fd < 0) {
+            continue;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || !sibling_usable(&st, orig)) {
+            close(fd);
+            continue;
+        }
+        variant_set(&f->variant[e], fd, &st);
+        f->encodings |= ENCODING_BIT(e);
+    }
+}
+
+static struct static_file *file_open(const char *path, size_t len) {
+    int fd = open_beneath_root(path);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return NULL;
+    }
+
+    struct static_file *f = calloc(1, sizeof(*f));
+    if (f == NULL || (f->path = malloc(len + 1)) == NULL) {
+        perror("webserver (malloc)");
+        free(f);
+        close(fd);
+        return NULL;
+    }
+    rcbuf_init(&f->rc, file_destroy);
+    memcpy(f->path, path, len + 1);
+    f->path_len = len;
+    for (int e = 0; e < ENCODINGS; e++) {
+        f->variant[e].fd = -1;
+    }
+    variant_set(&f->variant[ENCODING_IDENTITY], fd, &st);
+    f->encodings = ENCODING_BIT(ENCODING_IDENTITY);
+    const char *type = static_content_type(path);
+    if (encoding_compressible(type)) {
+        open_siblings(f, &st);
+    }
+
+    struct tm tm;
+    gmtime_r(&st.st_mtim.tv_sec, &tm);
+    strftime(f->last_modified, sizeof(f->last_modified),
+             "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    for (int e = 0; e < ENCODINGS; e++) {
+        struct static_variant *fv = &f->variant[e];
+        if (!(f->encodings & ENCODING_BIT(e))) {
+            continue;
+        }
+        // Each representation has its own tag, so a 304 never confirms a
+        // copy with a different coding
+        snprintf(fv->etag, sizeof(fv->etag), "\"%llx-%llx%s%s\"",
+                 (unsigned long long)fv->mtime.tv_sec,
+                 (unsigned long long)fv->size,
+                 e != ENCODING_IDENTITY ? "-" : "",
+                 e != ENCODING_IDENTITY ? encoding_name(e) : "");
+        if (build_headers(f, fv, e, type) != 0) {
+            rcbuf_put(&f->rc);
+            return NULL;
+        }
+    }
+    return f;
+}
+
+static void lru_unlink(struct static_cache *sc, struct static_file *f) {
+    if (f->prev != NULL) {
+        f->prev->next = f->next;
+    } else {
+        sc->head = f->next;
+    }
+    if (f->next != NULL) {
+        f->next->prev = f->prev;
+    } else {
+        sc->tail = f->prev;
+    }
+}
+
+static void lru_push(struct static_cache *sc, struct static_file *f) {
+    f->prev = NULL;
+    f->next = sc->head;
+    if (sc->head != NULL) {
+        sc->head->prev = f;
+    } else {
+        sc->tail = f;
+    }
+    sc->head = f;
+}
+
+static void cache_remove(struct static_cache *sc, struct static_file *f) {
+    struct static_file **pp =
+        &sc->buckets[hash_path(f->path, f->path_len) % STATIC_CACHE_BUCKETS];
+    while (*pp != f) {
+        pp = &(*pp)->hnext;
+    }
+    *pp = f->hnext;
+    lru_unlink(sc, f);
+    sc->count--;
+    rcbuf_put(&f->rc);
+}
+
+static void cache_insert(struct static_cache *sc, struct static_file *f) {
+    if (sc->count == STATIC_CACHE_SIZE) {
+        cache_remove(sc, sc->tail);
+    }
+    struct static_file **bucket =
+        &sc->buckets[hash_path(f->path, f->path_len) % STATIC_CACHE_BUCKETS];
+    f->hnext = *bucket;
+    *bucket = f;
+    lru_push(sc, f);
+    sc->count++;
+}
+
+static int variant_changed(const struct static_variant *fv,
+                           const struct stat *st) {
+    return st->st_ino != fv->ino || st->st_dev != fv->dev ||
+           st->st_size != fv->size ||
+           st->st_mtim.tv_sec != fv->mtime.tv_sec ||
+           st->st_mtim.tv_nsec != fv->mtime.tv_nsec;
+}
+
+// Has the file behind a cached entry, or one of its precompressed
+// siblings, been replaced, modified, added or removed?
+static int file_changed(const struct static_file *f) {
+    struct stat orig;
+    if (fstatat(root_fd, f->path, &orig, 0) != 0 ||
+        variant_changed(&f->variant[ENCODING_IDENTITY], &orig)) {
+        return 1;
+    }
+    if (!(f->encodings & ~ENCODING_BIT(ENCODING_IDENTITY)) &&
+        !encoding_compressible(static_content_type(f->path))) {
+        return 0;
+    }
+    char name[PATH_MAX];
+    for (int e = ENCODING_IDENTITY + 1; e < ENCODINGS; e++) {
+        struct stat st;
+        int usable =
+            sibling_path(f->path, f->path_len, e, name, sizeof(name)) !=
+                NULL &&
+            fstatat(root_fd, name, &st, 0) == 0 && sibling_usable(&st, &orig);
+        if (usable != !!(f->encodings & ENCODING_BIT(e)) ||
+            (usable && variant_changed(&f->variant[e], &st))) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static struct static_file *cache_get(struct static_cache *sc,
+                                     const char *path, size_t len,
+                                     uint64_t now) {
+    struct static_file *f =
+        sc->buckets[hash_path(path, len) % STATIC_CACHE_BUCKETS];
+    while (f != NULL &&
+           (f->path_len != len || memcmp(f->path, path, len) != 0)) {
+        f = f->hnext;
+    }
+
+    if (f != NULL && now - f->checked >= STATIC_REVALIDATE_MS) {
+        if (file_changed(f)) {
+            cache_remove(sc, f);
+            f = NULL;
+        } else {
+            f->checked = now;
+        }
+    }
+
+    if (f == NULL) {
+        f = file_open(path, len);
+        if (f == NULL) {
+            return NULL;
+        }
+        f->checked = now;
+        cache_insert(sc, f);
+    } else if (sc->head != f) {
+        lru_unlink(sc, f);
+        lru_push(sc, f);
+    }
+    return f;
+}
+
+// Can the client reuse the copy of representation fv it already has?
+static int not_modified(const struct static_file *f,
+                        const struct static_variant *fv,
+                        const struct http_request *req) {
+    const struct http_str *inm = http_header_get(req, "If-None-Match");
+    if (inm != NULL) {
+        size_t etag_len = strlen(fv->etag);
+        return (inm->len == 1 && inm->ptr[0] == '*') ||
+               memmem(inm->ptr, inm->len, fv->etag, etag_len) != NULL;
+    }
+    const struct http_str *ims = http_header_get(req, "If-Modified-Since");
+    return ims != NULL && ims->len == strlen(f->last_modified) &&
+           memcmp(ims->ptr, f->last_modified, ims->len) == 0;
+}
+
+// Queue r, without its body if head
+static int queue_cached(struct conn *c, const struct cached_response *r,
+                        enum resp_variant v, int head, size_t *bytes) {
+    *bytes = head ? r->head_len[v] : r->len[v];
+    conn_queue(c, r->data[v], *bytes, (struct rcbuf *)&r->rc);
+    return r->status;
+}
+
+int static_serve(struct static_cache *sc, struct conn *c,
+                 const struct http_request *req, enum resp_variant v,
+                 unsigned encodings, size_t *bytes) {
+    int head = req->method.len == 4 && memcmp(req->method.ptr, "HEAD", 4) == 0;
+    int get = req->method.len == 3 && memcmp(req->method.ptr, "GET", 3) == 0;
+    if (!get && !head) {
+        return queue_cached(c, resp_not_allowed, v, head, bytes);
+    }
+
+    char path[PATH_MAX];
+    int len = static_map_path(&req->uri, path, sizeof(path));
+    if (len < 0) {
+        return queue_cached(c, resp_bad_path, v, head, bytes);
+    }
+
+    struct static_file *f = cache_get(sc, path, len, c->w->now);
+    if (f == NULL) {
+        return queue_cached(c, resp_not_found, v, head, bytes);
+    }
+
+    const struct static_variant *fv = &f->variant[ENCODING_IDENTITY];
+    if ((f->encodings & encodings) != ENCODING_BIT(ENCODING_IDENTITY)) {
+        fv = &f->variant[encoding_pick(encoding_accepted(req),
+                                       f->encodings & encodings)];
+    }
+    int status304 = not_modified(f, fv, req);
+    conn_queue(c, fv->head[status304][v], fv->head_len[status304][v], &f->rc);
+    *bytes = fv->head_len[status304][v];
+    if (!head && !status304 && fv->size > 0) {
+        conn_queue_file(c, fv->fd, 0, fv->size, &f->rc);
+        *bytes += fv->size;
+    }
+    return status304 ? 304 : 200;
+}
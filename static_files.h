@@ -0,0 +1,34 @@
+#ifndef WEBSERVER_STATIC_FILES_H
+#define WEBSERVER_STATIC_FILES_H
+
+#include "conn.h"
+#include "http_parser.h"
+#include "resp_cache.h"
+
+// Most segments a static response queues: headers and file data
+#define STATIC_MAX_SEGMENTS 2
+
+// Open the document root; call once before the workers start
+int static_init(const char *root);
+
+// The Content-Type for a file name, by its extension
+const char *static_content_type(const char *path);
+
+// Turn the path part of the URI into a path relative to the document root:
+// percent-decoded, without the leading slash, and with index.html for
+// directories. Returns the length, or -1 for paths we refuse to serve.
+int static_map_path(const struct http_str *uri, char *out, size_t size);
+
+// Create a worker's cache of open files. It is only ever touched by the
+// worker that owns it, so it takes no locks.
+struct static_cache *static_cache_new(void);
+
+// Answer req with the file it names under the document root, in one of
+// the codings in encodings (see compress.h) the client accepts, or with an
+// error page. The caller guarantees STATIC_MAX_SEGMENTS free queue slots.
+// Returns the status code and stores the bytes queued in *bytes.
+int static_serve(struct static_cache *sc, struct conn *c,
+                 const struct http_request *req, enum resp_variant v,
+                 unsigned encodings, size_t *bytes);
+
+#endif
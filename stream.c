@@ -0,0 +1,164 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "metrics.h"
+#include "resp_cache.h"
+#include "stream.h"
+
+#define STREAM_HEAD_MAX 256
+#define CHUNK_FRAME_MAX 24          // CRLF, 16 hex digits, CRLF
+
+struct stream {
+    struct conn *c;
+    stream_fn produce;
+    void (*release)(void *arg);
+    void *arg;
+    unsigned chunked : 1;
+    unsigned started : 1;       // a chunk was queued, frames start with CRLF
+    unsigned ended : 1;
+    unsigned close : 1;         // close the connection after the body
+    unsigned progress : 1;      // the producer queued something this round
+    unsigned pumped : 1;        // the producer ran at least once
+    char head[STREAM_HEAD_MAX];
+    // Chunk frames, indexed by the queue slot they are queued in: a slot is
+    // only reused once the whole queue has been written
+    char frame[CONN_MAX_IOV][CHUNK_FRAME_MAX];
+};
+
+struct stream *stream_start(struct conn *c, const struct http_request *req,
+                            int status, const char *content_type,
+                            stream_fn produce, void (*release)(void *arg),
+                            void *arg) {
+    struct stream *s = calloc(1, sizeof(*s));
+    if (s == NULL) {
+        perror("webserver (calloc)");
+        return NULL;
+    }
+    s->c = c;
+    s->produce = produce;
+    s->release = release;
+    s->arg = arg;
+    s->chunked = req->minor_version == 1;
+    // Without chunks only the end of the connection ends the body
+    s->close = c->close_after_write || !s->chunked;
+
+    int n = snprintf(s->head, sizeof(s->head),
+                     "HTTP/1.1 %d %s\r\n"
+                     "Server: webserver-c\r\n"
+                     "Content-type: %s\r\n"
+                     "%s%s\r\n",
+                     status, resp_reason_phrase(status), content_type,
+                     s->chunked ? "Transfer-Encoding: chunked\r\n" : "",
+                     s->close ? "Connection: close\r\n" : "");
+    if (n < 0 || (size_t)n >= sizeof(s->head)) {
+        fprintf(stderr, "webserver: streamed response head too long\n");
+        free(s);
+        return NULL;
+    }
+    conn_queue(c, s->head, n, NULL);
+
+    if (req->method.len == 4 && memcmp(req->method.ptr, "HEAD", 4) == 0) {
+        s->ended = 1;
+        c->close_after_write = s->close;
+    } else {
+        // The body may take many rounds; the connection only closes after
+        // the last one
+        c->close_after_write = 0;
+    }
+    c->stream = s;
+    return s;
+}
+
+// Make room for a chunk of len bytes and queue its frame. One slot stays
+// free for the end of the body.
+static int stream_frame(struct stream *s, size_t len) {
+    struct conn *c = s->c;
+    if (s->ended || conn_queue_space(c) < 3) {
+        return -1;
+    }
+    s->progress = 1;
+    if (s->chunked) {
+        char *frame = s->frame[c->iovcnt];
+        int n = snprintf(frame, CHUNK_FRAME_MAX, "%s%zx\r\n",
+                         s->started ? "\r\n" : "", len);
+        conn_queue(c, frame, n, NULL);
+        s->started = 1;
+    }
+    return 0;
+}
+
+int stream_write(struct stream *s, const void *data, size_t len,
+                 struct rcbuf *owner) {
+    if (len == 0) {
+        // An empty chunk would end the body
+        return 0;
+    }
+    if (stream_frame(s, len) != 0) {
+        return -1;
+    }
+    conn_queue(s->c, data, len, owner);
+    return 0;
+}
+
+int stream_write_file(struct stream *s, int fd, off_t off, size_t len,
+                      struct rcbuf *owner) {
+    if (len == 0) {
+        return 0;
+    }
+    if (stream_frame(s, len) != 0) {
+        return -1;
+    }
+    conn_queue_file(s->c, fd, off, len, owner);
+    return 0;
+}
+
+void stream_end(struct stream *s) {
+    static const char last[] = "\r\n0\r\n\r\n";
+    if (s->ended) {
+        return;
+    }
+    s->ended = 1;
+    s->progress = 1;
+    if (s->chunked) {
+        // After data the frame closes the previous chunk first
+        const char *end = s->started ? last : last + 2;
+        conn_queue(s->c, end, strlen(end), NULL);
+    }
+    s->c->close_after_write = s->close;
+}
+
+int stream_pump(struct conn *c) {
+    struct stream *s = c->stream;
+    // Only the first round may join what is queued already: the head, and
+    // whatever pipelined responses went before it
+    if (c->iovcnt > 0 &&
+        (s->pumped || s->ended || conn_queue_space(c) < 3)) {
+        return 0;
+    }
+    if (s->ended) {
+        stream_free(c);
+        return 1;
+    }
+    if (c->iovcnt == 0) {
+        c->write_start = metric_clock();
+    }
+    s->pumped = 1;
+    s->progress = 0;
+    if (s->produce(s, s->arg) != 0 || !s->progress) {
+        return -1;
+    }
+    return 1;
+}
+
+void stream_free(struct conn *c) {
+    struct stream *s = c->stream;
+    if (s == NULL) {
+        return;
+    }
+    if (s->release != NULL) {
+        s->release(s->arg);
+    }
+    free(s);
+    c->stream = NULL;
+}
@@ -0,0 +1,56 @@
+#ifndef WEBSERVER_STREAM_H
+#define WEBSERVER_STREAM_H
+
+#include "conn.h"
+#include "http_parser.h"
+
+// A response whose body is produced while it is sent, for bodies too large
+// or too slow to build up front. HTTP/1.1 clients get it with
+// Transfer-Encoding: chunked, HTTP/1.0 clients until the connection closes.
+//
+// The producer is called whenever everything it queued before has been
+// written to the socket, so a slow client holds back the producer instead
+// of making the server buffer the body. Each call queues one or more
+// chunks with stream_write() or stream_write_file(), or finishes with
+// stream_end(); a call that does neither is an error. Chunk data is not
+// copied and must stay valid until the producer is called again, or be
+// owned by a reference counted buffer like every other queued segment.
+struct stream;
+
+typedef int (*stream_fn)(struct stream *s, void *arg);
+
+// Queue the head of a streaming response to req and have produce fill in
+// the body. release, if not NULL, is called with arg once the stream is
+// done with it, whether it ended or the connection went away. The caller
+// guarantees one free queue slot. Returns NULL if no stream could be had,
+// in which case the caller still owns arg.
+struct stream *stream_start(struct conn *c, const struct http_request *req,
+                            int status, const char *content_type,
+                            stream_fn produce, void (*release)(void *arg),
+                            void *arg);
+
+// Queue a chunk of len bytes at data. Returns -1 when the write queue is
+// full; call again from the next round of the producer.
+int stream_write(struct stream *s, const void *data, size_t len,
+                 struct rcbuf *owner);
+
+// Queue len bytes of the file fd starting at off as a chunk; it is sent
+// with sendfile()
+int stream_write_file(struct stream *s, int fd, off_t off, size_t len,
+                      struct rcbuf *owner);
+
+// Queue the end of the body; the producer is not called again
+void stream_end(struct stream *s);
+
+// Called by the event loop once the write queue of c, which has a stream,
+// is empty: runs the producer, or retires the stream once its end went
+// out. Also called right after the handler started the stream, so the
+// first chunks go out with the head. Returns 1 if the connection has been
+// given more to do, 0 if not and -1 if the producer failed and the
+// connection has to be closed.
+int stream_pump(struct conn *c);
+
+// Drop the stream of c, if any, e.g. because the connection closes
+void stream_free(struct conn *c);
+
+#endif
@@ -0,0 +1,90 @@
+#!/bin/bash
+# Check that HEAD requests get a head and no body on every path that
+# answers them: the response cache, text and metrics routes, prebuilt
+# errors, static files, the pack, streams and the proxy. Each HEAD is
+# pipelined ahead of a GET on the same connection, so a stray body shows up
+# where the second response should start.
+#
+#   $ make check
+
+set -u
+cd "$(dirname "$0")/.."
+
+PORT=${PORT:-18080}
+
+docroot=$(mktemp -d)
+servers=()
+cleanup() {
+    for s in "${servers[@]}"; do
+        kill "$s" 2> /dev/null
+    done
+    rm -rf "$docroot"
+}
+trap cleanup EXIT
+
+echo "<html>small file</html>" > "$docroot/index.html"
+echo "<html>packed file</html>" > "$docroot/packed.html"
+./webserver --make-pack="$docroot/site.pack" --root="$docroot" > /dev/null ||
+    exit 1
+
+# Start a server on port $1 with the rest as options and wait until it
+# accepts connections
+start() {
+    local port=$1
+    shift
+    ./webserver --log-level=off --workers=1 --listen="127.0.0.1:$port" \
+        "$@" > /dev/null 2>&1 &
+    servers+=($!)
+    for _ in $(seq 1 50); do
+        (exec 3<> "/dev/tcp/127.0.0.1/$port") 2> /dev/null && return 0
+        sleep 0.1
+    done
+    echo "head: the server did not start with: $*" >&2
+    exit 1
+}
+
+failed=0
+
+# Send HEAD $3 to port $2, followed by a GET unless $4 is "close", and
+# check what follows the head of the first response: the second response,
+# or nothing at all
+check() {
+    local name=$1 port=$2 path=$3 after=${4:-next}
+    local next="GET / HTTP/1.1\r\nHost: test\r\nConnection: close\r\n\r\n"
+    local close=""
+    if [ "$after" = close ]; then
+        next=""
+        close="Connection: close\r\n"
+    fi
+    local out
+    out=$(exec 3<> "/dev/tcp/127.0.0.1/$port" &&
+        printf "HEAD %s HTTP/1.1\r\nHost: test\r\n$close\r\n$next" \
+            "$path" >&3 &&
+        timeout 5 cat <&3 | tr -d '\r' | sed -n '/^$/{n;p;q}')
+    if { [ "$after" = close ] && [ -z "$out" ]; } ||
+        { [ "$after" != close ] && [[ $out == HTTP/1.1\ * ]]; }; then
+        echo "ok    $name"
+    else
+        echo "FAIL  $name: after the head came '$out'"
+        failed=1
+    fi
+}
+
+start "$PORT" --route="GET /get-only text x" --route="/text text hello"
+start $((PORT + 1)) --root="$docroot"
+start $((PORT + 2)) --pack="$docroot/site.pack"
+start $((PORT + 3)) --upstream="127.0.0.1:$PORT"
+start $((PORT + 4)) --upstream=127.0.0.1:1
+
+check "response cache" "$PORT" /
+check "text route" "$PORT" /text
+check "metrics" "$PORT" /metrics
+check "error response" "$PORT" /get-only
+check "stream" "$PORT" /stream/100000
+check "static file" $((PORT + 1)) /index.html
+check "static error" $((PORT + 1)) /missing.html
+check "pack" $((PORT + 2)) /packed.html
+check "proxy" $((PORT + 3)) /text
+check "proxy error" $((PORT + 4)) / close
+
+exit $failed
@@ -0,0 +1,185 @@
+#include <string.h>
+
+#include "timer.h"
+
+#define SLOT_MASK (TIMER_SLOTS - 1)
+
+// Never place a timer further out than the top level reaches from any
+// starting point; it is re-inserted when it gets there
+#define MAX_DELTA \
+    ((uint64_t)(TIMER_SLOTS - 2) << (TIMER_SLOT_BITS * (TIMER_LEVELS - 1)))
+
+void timer_wheel_init(struct timer_wheel *tw, uint64_t now) {
+    memset(tw, 0, sizeof(*tw));
+    tw->now = now;
+}
+
+static void link_slot(struct timer_wheel *tw, int level, int slot,
+                      struct timer *t) {
+    struct timer **head = &tw->slots[level][slot];
+    t->next = *head;
+    if (*head != NULL) {
+        (*head)->pprev = &t->next;
+    }
+    *head = t;
+    t->pprev = head;
+    t->slot = level * TIMER_SLOTS + slot;
+    tw->occupied[level] |= 1ULL << slot;
+}
+
+static void unlink_timer(struct timer_wheel *tw, struct timer *t) {
+    *t->pprev = t->next;
+    if (t->next != NULL) {
+        t->next->pprev = t->pprev;
+    }
+    if (t->slot >= 0) {
+        int level = t->slot / TIMER_SLOTS;
+        int slot = t->slot % TIMER_SLOTS;
+        if (tw->slots[level][slot] == NULL) {
+            tw->occupied[level] &= ~(1ULL << slot);
+        }
+    }
+    t->next = NULL;
+    t->pprev = NULL;
+}
+
+// Put t into the lowest level whose current revolution still contains its
+// expiry. At level l that means the expiry's slot number (the expiry
+// shifted by 6l) is less than a full turn of 64 slots ahead of ours.
+static void place(struct timer_wheel *tw, struct timer *t) {
+    uint64_t expires = t->expires;
+    if (expires <= tw->now) {
+        expires = tw->now + 1;
+    } else if (expires - tw->now > MAX_DELTA) {
+        expires = tw->now + MAX_DELTA;
+    }
+    for (int level = 0; level < TIMER_LEVELS; level++) {
+        int shift = TIMER_SLOT_BITS * level;
+        if ((expires >> shift) - (tw->now >> shift) < TIMER_SLOTS) {
+            link_slot(tw, level, (expires >> shift) & SLOT_MASK, t);
+            return;
+        }
+    }
+}
+
+void timer_set(struct timer_wheel *tw, struct timer *t, uint64_t expires) {
+    if (timer_pending(t)) {
+        unlink_timer(tw, t);
+    } else {
+        tw->pending++;
+    }
+    t->expires = expires;
+    place(tw, t);
+}
+
+void timer_cancel(struct timer_wheel *tw, struct timer *t) {
+    if (timer_pending(t)) {
+        unlink_timer(tw, t);
+        tw->pending--;
+    }
+}
+
+static void link_fired(struct timer_wheel *tw, struct timer *t) {
+    t->next = tw->fired;
+    if (tw->fired != NULL) {
+        tw->fired->pprev = &t->next;
+    }
+    tw->fired = t;
+    t->pprev = &tw->fired;
+    t->slot = -1;
+}
+
+// Take every timer out of a slot and place it again relative to now, which
+// moves it down a level or onto the fired list
+static void redistribute(struct timer_wheel *tw, int level, int slot) {
+    struct timer *t = tw->slots[level][slot];
+    tw->slots[level][slot] = NULL;
+    tw->occupied[level] &= ~(1ULL << slot);
+    while (t != NULL) {
+        struct timer *next = t->next;
+        if (t->expires <= tw->now) {
+            link_fired(tw, t);
+        } else {
+            place(tw, t);
+        }
+        t = next;
+    }
+}
+
+void timer_expire_all(struct timer_wheel *tw) {
+    for (int level = 0; level < TIMER_LEVELS; level++) {
+        while (tw->occupied[level] != 0) {
+            int slot = __builtin_ctzll(tw->occupied[level]);
+            struct timer *t = tw->slots[level][slot];
+            tw->slots[level][slot] = NULL;
+            tw->occupied[level] &= ~(1ULL << slot);
+            while (t != NULL) {
+                struct timer *next = t->next;
+                link_fired(tw, t);
+                t = next;
+            }
+        }
+    }
+}
+
+// Process one tick: when it starts a new slot of a higher level, cascade
+// that slot first (highest level first, so timers can fall through several
+// levels), then collect the level 0 slot
+static void tick(struct timer_wheel *tw) {
+    tw->now++;
+    for (int level = TIMER_LEVELS - 1; level > 0; level--) {
+        int shift = TIMER_SLOT_BITS * level;
+        if ((tw->now & ((1ULL << shift) - 1)) == 0) {
+            redistribute(tw, level, (tw->now >> shift) & SLOT_MASK);
+        }
+    }
+    redistribute(tw, 0, tw->now & SLOT_MASK);
+}
+
+struct timer *timer_expired(struct timer_wheel *tw, uint64_t now) {
+    while (tw->fired == NULL) {
+        if (tw->now >= now) {
+            return NULL;
+        }
+        if (tw->pending == 0) {
+            tw->now = now;
+            return NULL;
+        }
+        tick(tw);
+    }
+    struct timer *t = tw->fired;
+    unlink_timer(tw, t);
+    tw->pending--;
+    return t;
+}
+
+int timer_timeout(const struct timer_wheel *tw) {
+    if (tw->fired != NULL) {
+        return 0;
+    }
+    if (tw->pending == 0) {
+        return -1;
+    }
+    // The nearest occupied slot on any level; on levels above 0 the timers
+    // are due no earlier than the start of their slot
+    uint64_t best = UINT64_MAX;
+    for (int level = 0; level < TIMER_LEVELS; level++) {
+        uint64_t bits = tw->occupied[level];
+        if (bits == 0) {
+            continue;
+        }
+        int shift = TIMER_SLOT_BITS * level;
+        int cur = (tw->now >> shift) & SLOT_MASK;
+        // Rotate so that the slot after the current one comes first
+        int rot = (cur + 1) & SLOT_MASK;
+        uint64_t rotated =
+            rot == 0 ? bits : (bits >> rot) | (bits << (64 - rot));
+        uint64_t ahead = __builtin_ctzll(rotated) + 1;
+        uint64_t start = ((tw->now >> shift) + ahead) << shift;
+        if (start < best) {
+            best = start;
+        }
+    }
+    uint64_t wait = best - tw->now;
+    return wait > 60000 ? 60000 : (int)wait;
+}
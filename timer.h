@@ -0,0 +1,57 @@
+#ifndef WEBSERVER_TIMER_H
+#define WEBSERVER_TIMER_H
+
+#include <stdint.h>
+
+// A hierarchical timer wheel with millisecond ticks. Setting, moving and
+// cancelling a timer are O(1), and so is the work per tick no matter how
+// many timers are pending: a timer is only touched when its slot comes up,
+// and moves down at most once per level on the way. Four levels of 64
+// slots reach about 4.6 hours; later timers wait in the top level and are
+// re-inserted until they are due. Not thread-safe: every worker has its
+// own.
+#define TIMER_LEVELS 4
+#define TIMER_SLOT_BITS 6
+#define TIMER_SLOTS (1 << TIMER_SLOT_BITS)
+
+struct timer {
+    struct timer *next;
+    struct timer **pprev;       // NULL when not pending
+    uint64_t expires;           // milliseconds
+    int slot;                   // level * TIMER_SLOTS + slot, -1 if fired
+};
+
+struct timer_wheel {
+    uint64_t now;               // every tick up to this one was processed
+    struct timer *slots[TIMER_LEVELS][TIMER_SLOTS];
+    uint64_t occupied[TIMER_LEVELS];    // bitmap of non-empty slots
+    struct timer *fired;        // due timers not yet handed out
+    unsigned pending;
+};
+
+void timer_wheel_init(struct timer_wheel *tw, uint64_t now);
+
+static inline int timer_pending(const struct timer *t) {
+    return t->pprev != NULL;
+}
+
+// (Re)arm t to fire at expires; a time in the past fires on the next tick
+void timer_set(struct timer_wheel *tw, struct timer *t, uint64_t expires);
+
+void timer_cancel(struct timer_wheel *tw, struct timer *t);
+
+// Advance to now and return one timer that is due, or NULL once there are
+// none. A returned timer is no longer pending; handling it may set or
+// cancel any timer, including itself.
+struct timer *timer_expired(struct timer_wheel *tw, uint64_t now);
+
+// Hand out every pending timer from the next timer_expired() on, however
+// far away it is. Their expiry stays as it was, so a timer that fired early
+// can tell and be set again. O(pending timers).
+void timer_expire_all(struct timer_wheel *tw);
+
+// Milliseconds until the next timer may be due, or -1 if none is pending.
+// Never later than the real expiry, but may be earlier.
+int timer_timeout(const struct timer_wheel *tw);
+
+#endif
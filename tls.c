@@ -0,0 +1,276 @@
+#include <errno.h>
+#include <limits.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+#include "metrics.h"
+#include "tls.h"
+
+#ifndef TCP_ULP
+#define TCP_ULP 31
+#endif
+
+// Largest TLS record payload; tls_write() fills one record per call
+#define TLS_RECORD_MAX 16384
+
+// Shared by all workers: OpenSSL contexts are safe to use from many
+// threads once set up, and sharing it shares the session ticket keys
+static SSL_CTX *ctx;
+
+// Protocols we speak, in ALPN wire format, most preferred first. Only the
+// epoll backend speaks HTTP/2.
+static const unsigned char alpn_protos[] = "\x02h2\x08http/1.1";
+
+// Plaintext of the record being written; only used within one call to
+// tls_write() and its retries, which see the same bytes again
+static _Thread_local unsigned char record[TLS_RECORD_MAX];
+
+static void print_errors(const char *what) {
+    unsigned long err = ERR_get_error();
+    char buf[256];
+    ERR_error_string_n(err, buf, sizeof(buf));
+    fprintf(stderr, "webserver (%s): %s\n", what, buf);
+    ERR_clear_error();
+}
+
+static int select_alpn(SSL *ssl, const unsigned char **out,
+                       unsigned char *outlen, const unsigned char *in,
+                       unsigned inlen, void *arg) {
+    (void)ssl;
+    (void)arg;
+    unsigned char *chosen;
+    size_t skip = config.io == IO_EPOLL ? 0 : 3;
+    if (SSL_select_next_proto(&chosen, outlen, alpn_protos + skip,
+                              sizeof(alpn_protos) - 1 - skip, in, inlen) !=
+        OPENSSL_NPN_NEGOTIATED) {
+        // Carry on without ALPN rather than fail clients that only offer
+        // protocols we do not know
+        return SSL_TLSEXT_ERR_NOACK;
+    }
+    *out = chosen;
+    return SSL_TLSEXT_ERR_OK;
+}
+
+// Can the kernel do TLS at all? Only an established TCP socket takes the
+// upper layer protocol, so ask on a loopback connection.
+static int probe_kernel_tls(void) {
+    struct sockaddr_in addr = {.sin_family = AF_INET};
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    int ok = 0;
+    int l = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int s = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (l >= 0 && s >= 0 && bind(l, (struct sockaddr *)&addr, len) == 0 &&
+        listen(l, 1) == 0 &&
+        getsockname(l, (struct sockaddr *)&addr, &len) == 0 &&
+        connect(s, (struct sockaddr *)&addr, len) == 0) {
+        ok = setsockopt(s, IPPROTO_TCP, TCP_ULP, "tls", sizeof("tls")) == 0;
+    }
+    if (s >= 0) {
+        close(s);
+    }
+    if (l >= 0) {
+        close(l);
+    }
+    return ok;
+}
+
+int tls_init(const char *cert, const char *key) {
+    ctx = SSL_CTX_new(TLS_server_method());
+    if (ctx == NULL) {
+        print_errors("SSL_CTX_new");
+        return -1;
+    }
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    // Only AEAD suites the kernel can take over; TLS 1.3 has no others
+    if (SSL_CTX_set_cipher_list(ctx, "ECDHE+AESGCM:ECDHE+CHACHA20") != 1) {
+        print_errors("SSL_CTX_set_cipher_list");
+        return -1;
+    }
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS | SSL_OP_NO_RENEGOTIATION |
+                                 SSL_OP_IGNORE_UNEXPECTED_EOF |
+                                 SSL_OP_CIPHER_SERVER_PREFERENCE);
+    // tls_write() repeats a blocked write from the same buffer, but a
+    // session is not tied to one thread's buffer in principle
+    SSL_CTX_set_mode(ctx, SSL_MODE_RELEASE_BUFFERS |
+                              SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+    // Resumption uses stateless tickets only: a server side session cache
+    // would be a lock all workers contend on
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+    SSL_CTX_set_num_tickets(ctx, 1);
+    SSL_CTX_set_alpn_select_cb(ctx, select_alpn, NULL);
+
+    if (SSL_CTX_use_certificate_chain_file(ctx, cert) != 1) {
+        print_errors("certificate");
+        return -1;
+    }
+    if (SSL_CTX_use_PrivateKey_file(ctx, key, SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(ctx) != 1) {
+        print_errors("private key");
+        return -1;
+    }
+    printf("TLS enabled, kernel TLS %s\n",
+           probe_kernel_tls() ? "available" : "not available (modprobe tls)");
+    return 0;
+}
+
+int tls_accept(struct conn *c) {
+    SSL *ssl = SSL_new(ctx);
+    if (ssl == NULL || SSL_set_fd(ssl, c->fd) != 1) {
+        print_errors("SSL_new");
+        SSL_free(ssl);
+        return -1;
+    }
+    SSL_set_accept_state(ssl);
+    c->tls = ssl;
+    c->tls_handshake = 1;
+    return 0;
+}
+
+// Map the outcome of an SSL call onto errno, as for a system call
+static int tls_error(struct conn *c, int ret) {
+    int err = SSL_get_error(c->tls, ret);
+    switch (err) {
+    case SSL_ERROR_WANT_READ:
+        c->tls_want_write = 0;
+        errno = EAGAIN;
+        return -1;
+    case SSL_ERROR_WANT_WRITE:
+        c->tls_want_write = 1;
+        errno = EAGAIN;
+        return -1;
+    case SSL_ERROR_ZERO_RETURN:
+        return 0;
+    case SSL_ERROR_SYSCALL:
+        if (errno == 0) {
+            errno = ECONNRESET;
+        }
+        ERR_clear_error();
+        return -1;
+    default:
+        ERR_clear_error();
+        errno = EPROTO;
+        return -1;
+    }
+}
+
+int tls_handshake(struct conn *c) {
+    // SSL_ERROR_SYSCALL leaves errno alone when the cause was no system call
+    errno = 0;
+    int ret = SSL_do_handshake(c->tls);
+    if (ret != 1) {
+        if (tls_error(c, ret) < 0 && errno == EAGAIN) {
+            return 0;
+        }
+        metric_add(&c->w->metrics.tls_failures, 1);
+        return -1;
+    }
+    c->tls_handshake = 0;
+    c->tls_want_write = 0;
+    c->tls_kernel_tx = BIO_get_ktls_send(SSL_get_wbio(c->tls)) != 0;
+    c->tls_kernel_rx = BIO_get_ktls_recv(SSL_get_rbio(c->tls)) != 0;
+    metric_add(&c->w->metrics.tls_handshakes, 1);
+    if (SSL_session_reused(c->tls)) {
+        metric_add(&c->w->metrics.tls_resumed, 1);
+    }
+    if (c->tls_kernel_tx) {
+        metric_add(&c->w->metrics.tls_kernel, 1);
+    }
+    return 1;
+}
+
+short tls_wants(const struct conn *c) {
+    return c->tls_want_write ? POLLOUT : POLLIN;
+}
+
+ssize_t tls_read(struct conn *c, void *buf, size_t len) {
+    errno = 0;
+    int ret = SSL_read(c->tls, buf, len > INT_MAX ? INT_MAX : (int)len);
+    if (ret > 0) {
+        return ret;
+    }
+    return tls_error(c, ret);
+}
+
+// Copy up to len bytes from the head of the write queue into out
+static ssize_t gather(const struct conn *c, unsigned char *out, size_t len) {
+    size_t n = 0;
+    for (int i = c->iovpos; i < c->iovcnt && n < len; i++) {
+        size_t chunk = c->iov[i].iov_len;
+        if (chunk > len - n) {
+            chunk = len - n;
+        }
+        if (c->iov[i].iov_base != NULL) {
+            memcpy(out + n, c->iov[i].iov_base, chunk);
+        } else {
+            ssize_t got = pread(c->file[i].fd, out + n, chunk,
+                                c->file[i].off);
+            if (got < 0) {
+                return -1;
+            }
+            if ((size_t)got < chunk) {
+                // The file shrank underneath us
+                errno = EIO;
+                return -1;
+            }
+        }
+        n += chunk;
+    }
+    return n;
+}
+
+ssize_t tls_write(struct conn *c) {
+    // A write that blocked must be repeated with the same bytes, and the
+    // queue has not moved since
+    size_t len = c->tls_retry > 0 ? c->tls_retry : TLS_RECORD_MAX;
+    ssize_t n = gather(c, record, len);
+    if (n <= 0) {
+        return n;
+    }
+    errno = 0;
+    int ret = SSL_write(c->tls, record, (int)n);
+    if (ret > 0) {
+        c->tls_retry = 0;
+        return ret;
+    }
+    int err = tls_error(c, ret);
+    if (err < 0 && errno == EAGAIN) {
+        c->tls_retry = (uint16_t)n;
+    } else if (err == 0) {
+        // The peer closed the session under us
+        errno = EPIPE;
+    }
+    return -1;
+}
+
+int tls_alpn_h2(const struct conn *c) {
+    const unsigned char *proto;
+    unsigned len;
+    SSL_get0_alpn_selected(c->tls, &proto, &len);
+    return len == 2 && memcmp(proto, "h2", 2) == 0;
+}
+
+void tls_close_notify(struct conn *c) {
+    if (c->tls != NULL && !c->tls_handshake) {
+        // Best effort: a close_notify that does not fit into the socket
+        // buffer is not worth waiting for
+        SSL_shutdown(c->tls);
+        ERR_clear_error();
+    }
+}
+
+void tls_free(struct conn *c) {
+    if (c->tls != NULL) {
+        SSL_free(c->tls);
+        c->tls = NULL;
+    }
+}
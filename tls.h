@@ -0,0 +1,57 @@
+#ifndef WEBSERVER_TLS_H
+#define WEBSERVER_TLS_H
+
+#include <sys/types.h>
+
+#include "conn.h"
+
+// HTTPS on the listener. Handshakes run on the non-blocking socket from
+// the event loop, like any other read or write. Once they are done, the
+// kernel takes over the record layer where it can (kernel TLS): a
+// direction it handles behaves like plain TCP, so sendfile() keeps working
+// for static files, and only a direction it does not handle goes through
+// OpenSSL in user space.
+
+// Load the certificate chain and key and set up the server context, with
+// session tickets and ALPN. Call once before the workers start.
+int tls_init(const char *cert, const char *key);
+
+// Start a TLS session on the freshly accepted c. Returns -1 on failure.
+int tls_accept(struct conn *c);
+
+// Continue the handshake of c. Returns 1 once it is done, 0 if it has to
+// wait for the socket (see tls_wants()) and -1 if it failed.
+int tls_handshake(struct conn *c);
+
+// The poll events the last TLS call on c that had to stop waits for
+short tls_wants(const struct conn *c);
+
+// Does c read or write through OpenSSL rather than the socket?
+static inline int tls_user_rx(const struct conn *c) {
+    return c->tls != NULL && !c->tls_kernel_rx;
+}
+
+static inline int tls_user_tx(const struct conn *c) {
+    return c->tls != NULL && !c->tls_kernel_tx;
+}
+
+// Like read(), for connections with tls_user_rx(): returns the bytes
+// decrypted into buf, 0 at the end of the stream, or -1 with errno set,
+// EAGAIN if the socket has nothing more for now
+ssize_t tls_read(struct conn *c, void *buf, size_t len);
+
+// Encrypt and send the head of the write queue of a connection with
+// tls_user_tx(), memory and file segments alike. Returns the plaintext
+// bytes written, to be passed to conn_written(), or -1 with errno set.
+ssize_t tls_write(struct conn *c);
+
+// Did the client of c pick HTTP/2 with ALPN?
+int tls_alpn_h2(const struct conn *c);
+
+// Tell the peer we are done sending, before shutting down our side
+void tls_close_notify(struct conn *c);
+
+// Free the session of c, if any
+void tls_free(struct conn *c);
+
+#endif
@@ -0,0 +1,166 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <linux/filter.h>
+#include <linux/mempolicy.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "topology.h"
+
+// Highest node number topology_place() handles, plus one
+#define MAX_NODES 1024
+
+static int steered;     // listeners have the program attached
+
+// The number in a sysfs entry named "node<N>", or -1
+static int node_entry(const char *name) {
+    if (strncmp(name, "node", 4) != 0 || name[4] < '0' || name[4] > '9') {
+        return -1;
+    }
+    char *end;
+    long n = strtol(name + 4, &end, 10);
+    return *end == '\0' && n < MAX_NODES ? (int)n : -1;
+}
+
+int topology_node(int cpu) {
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+    DIR *d = opendir(path);
+    if (d == NULL) {
+        return -1;
+    }
+    // A CPU's directory links to the one of its node
+    int node = -1;
+    struct dirent *e;
+    while (node < 0 && (e = readdir(d)) != NULL) {
+        node = node_entry(e->d_name);
+    }
+    closedir(d);
+    return node;
+}
+
+static int count_nodes(void) {
+    DIR *d = opendir("/sys/devices/system/node");
+    if (d == NULL) {
+        return 1;
+    }
+    int n = 0;
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL) {
+        n += node_entry(e->d_name) >= 0;
+    }
+    closedir(d);
+    return n;
+}
+
+void topology_place(void *p, size_t len, int node) {
+    static int nodes;
+    if (nodes == 0) {
+        nodes = count_nodes();
+    }
+    if (node < 0 || nodes < 2) {
+        return;
+    }
+    uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+    uintptr_t start = ((uintptr_t)p + page - 1) & ~(page - 1);
+    uintptr_t end = ((uintptr_t)p + len) & ~(page - 1);
+    if (end <= start) {
+        return;
+    }
+    const int bits = 8 * sizeof(unsigned long);
+    unsigned long mask[MAX_NODES / (8 * sizeof(unsigned long))] = {0};
+    mask[node / bits] |= 1UL << (node % bits);
+    // The pages were touched where they were allocated, so they have to
+    // move rather than just be placed by the policy from now on. The
+    // kernel takes one bit less of the mask than it is told.
+    if (syscall(SYS_mbind, start, end - start, MPOL_PREFERRED, mask,
+                MAX_NODES + 1, MPOL_MF_MOVE) != 0) {
+        perror("webserver (mbind)");
+    }
+}
+
+void topology_steer(const struct worker *workers, int nworkers) {
+    // A CPU can only lead to one worker, and the program has to fit
+    if (!config.cpu_steering || nworkers < 2 ||
+        2 * nworkers + 2 > BPF_MAXINSNS) {
+        return;
+    }
+    cpu_set_t seen;
+    CPU_ZERO(&seen);
+    for (int i = 0; i < nworkers; i++) {
+        int cpu = workers[i].cpu;
+        if (cpu < 0 || cpu >= CPU_SETSIZE || CPU_ISSET(cpu, &seen)) {
+            return;
+        }
+        CPU_SET(cpu, &seen);
+    }
+
+    // The value returned picks a listener of the SO_REUSEPORT group by the
+    // order they joined it, which is the workers' order. CPUs without a
+    // worker fall through to an index past the group, which makes the
+    // kernel pick by hash as usual.
+    struct sock_filter code[2 * nworkers + 2];
+    int n = 0;
+    code[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+                                             SKF_AD_OFF + SKF_AD_CPU);
+    for (int i = 0; i < nworkers; i++) {
+        code[n++] = (struct sock_filter)BPF_JUMP(
+            BPF_JMP | BPF_JEQ | BPF_K, (uint32_t)workers[i].cpu, 0, 1);
+        code[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K,
+                                                 (uint32_t)i);
+    }
+    code[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K,
+                                             (uint32_t)nworkers);
+    struct sock_fprog prog = {.len = (unsigned short)n, .filter = code};
+
+    // The program belongs to the group, so one listener of each will do
+    for (int g = 0; g < workers[0].nlisten; g++) {
+        if (setsockopt(workers[0].listen_fd[g], SOL_SOCKET,
+                       SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) != 0) {
+            perror("webserver (setsockopt SO_ATTACH_REUSEPORT_CBPF)");
+            return;
+        }
+    }
+    steered = 1;
+}
+
+void topology_report(const struct worker *workers, int nworkers) {
+    // Nodes in the order their first worker comes up
+    for (int i = 0; i < nworkers; i++) {
+        int node = workers[i].node;
+        int first = 1;
+        for (int j = 0; j < i && first; j++) {
+            first = workers[j].node != node;
+        }
+        if (!first) {
+            continue;
+        }
+        if (node >= 0) {
+            printf("node %d:", node);
+        } else {
+            printf("no node:");
+        }
+        const char *sep = " ";
+        for (int j = i; j < nworkers; j++) {
+            if (workers[j].node != node) {
+                continue;
+            }
+            if (workers[j].cpu >= 0) {
+                printf("%sworker %d on cpu %d", sep, j, workers[j].cpu);
+            } else {
+                printf("%sworker %d unpinned", sep, j);
+            }
+            sep = ", ";
+        }
+        printf("\n");
+    }
+    printf("connections go to %s\n",
+           steered ? "the worker on the cpu their packets arrive on"
+                   : "workers by hash");
+}
@@ -0,0 +1,32 @@
+#ifndef WEBSERVER_TOPOLOGY_H
+#define WEBSERVER_TOPOLOGY_H
+
+#include <stddef.h>
+
+#include "server.h"
+
+// Where the workers run. Every worker is pinned to a CPU of its own and
+// allocates its pools once it is, so they come from that CPU's NUMA node.
+// With --steering=cpu each listener group gets a classic BPF program that
+// hands a new connection to the worker on the CPU its packets arrived on:
+// with the NIC's receive queue interrupts (RSS) spread over the same CPUs,
+// softirq, wakeup and handler then all run on one core, and so does the
+// transmit queue XPS picks for the response.
+
+// The NUMA node of cpu, -1 if unknown
+int topology_node(int cpu);
+
+// Move the whole pages of len bytes at p to the memory of node. Memory the
+// main thread set up for a worker is only used there. Does nothing on a
+// single node or if node is -1.
+void topology_place(void *p, size_t len, int node);
+
+// Steer the connections of their listeners to the workers by CPU, if
+// --steering=cpu and every worker is on a CPU of its own. A failure is
+// reported, and the kernel keeps spreading connections by hash.
+void topology_steer(const struct worker *workers, int nworkers);
+
+// Print the nodes, their CPUs and workers, and how connections are steered
+void topology_report(const struct worker *workers, int nworkers);
+
+#endif
@@ -0,0 +1,47 @@
+#ifndef WEBSERVER_TRACE_H
+#define WEBSERVER_TRACE_H
+
+#include <stdint.h>
+
+#include "metrics.h"
+
+// Static tracepoints (USDT) at the stages of a request, for perf,
+// bpftrace or SystemTap to attach to, e.g. usdt:./webserver:webserver:read
+// (see bench/stages.bt):
+//
+//   accept(fd, worker)     a connection was accepted
+//   read(fd, bytes)        bytes arrived from a client
+//   parse(fd, head_len)    a request head was parsed
+//   handler(fd, status)    its response was queued
+//   write(fd, bytes)       bytes went out to a client
+//   close(fd)              the connection was closed
+//
+// Built with <sys/sdt.h> (systemtap-sdt-dev) when the compiler finds it,
+// or not with USDT=0. A probe is a single nop and a note in the binary
+// until a tracer attaches; without <sys/sdt.h> it is nothing at all.
+#ifdef HAVE_USDT
+#include <sys/sdt.h>
+#define TRACE1(name, a) DTRACE_PROBE1(webserver, name, a)
+#define TRACE2(name, a, b) DTRACE_PROBE2(webserver, name, a, b)
+#else
+#define TRACE1(name, a) ((void)(a))
+#define TRACE2(name, a, b) ((void)(a), (void)(b))
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// Ticks of the cheapest clock there is, for --log-timing: the TSC where
+// there is one, which the kernel only uses as its clock source when it is
+// invariant and synchronized across CPUs. accesslog.c converts ticks to
+// time.
+static inline uint64_t trace_clock(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return metric_clock();
+#endif
+}
+
+#endif
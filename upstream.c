@@ -0,0 +1,1452 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "accesslog.h"
+#include "http_cache.h"
+#include "metrics.h"
+#include "tls.h"
+#include "upstream.h"
+
+// Idle connections a worker keeps open per backend
+#define UPSTREAM_IDLE_MAX 64
+
+// Receive buffer tier for response heads and relayed bodies (16K)
+#define UPSTREAM_BUF_TIER 2
+
+// Most bytes moved through the pipe per splice()
+#define UPSTREAM_SPLICE_MAX (64 * 1024)
+
+// Seconds a health check may take
+#define HEALTH_TIMEOUT 2
+
+enum body_mode {
+    BODY_NONE,                  // HEAD, 204 and 304
+    BODY_LENGTH,                // Content-Length
+    BODY_CHUNKED,               // passed through to HTTP/1.1 clients as is
+    BODY_EOF,                   // until the backend closes
+};
+
+// Where the chunk scanner is in a chunked body. It only looks for the end
+// of the body; the chunks themselves go to the client unchanged.
+enum chunk_state {
+    CHUNK_SIZE,
+    CHUNK_EXT,                  // extension or CR after the size
+    CHUNK_DATA,
+    CHUNK_DATA_END,             // CRLF after the data
+    CHUNK_TRAILER,              // at the start of a trailer line
+    CHUNK_TRAILER_LINE,
+    CHUNK_LAST_LF,
+    CHUNK_DONE,
+};
+
+struct backend {
+    union sock_addr addr;
+    char name[ADDR_STRLEN];
+    _Atomic int up;
+};
+
+static struct backend backends[UPSTREAM_MAX];
+static struct cached_response *resp_bad_gateway;
+static struct cached_response *resp_gateway_timeout;
+
+static pthread_t health_thread;
+static pthread_mutex_t health_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t health_cond = PTHREAD_COND_INITIALIZER;
+static int health_stopping;
+static int health_running;
+
+static const char bad_gateway_body[] = "<html>bad gateway</html>\r\n";
+static const char gateway_timeout_body[] = "<html>gateway timeout</html>\r\n";
+
+struct upstream_conn {
+    struct upstream_pool *pool;
+    struct conn *client;        // whose request this is, NULL while idle
+    struct upstream_conn *next; // in the idle or the dead list
+    struct upstream_conn *prev;
+    struct upstream_conn *ready_next;
+    int fd;
+    int backend;
+    int pipe[2];                // for splicing bodies, -1 until needed
+    size_t piped;               // bytes waiting in the pipe
+
+    unsigned connecting : 1;
+    unsigned connect_failed : 1;
+    unsigned reused : 1;        // came from the pool
+    unsigned readable : 1;      // socket may have unread data
+    unsigned failed : 1;        // the backend went away, see upstream_pump()
+    unsigned answered : 1;      // some of the response arrived
+    unsigned head_sent : 1;     // the response head is queued to the client
+    unsigned in_queued : 1;     // the client's queue points into in
+    unsigned keep_alive : 1;    // the connection can serve another request
+    unsigned eof : 1;           // the backend closed its side
+    unsigned close_client : 1;  // close the client after the response
+    unsigned retried : 1;
+    unsigned in_ready : 1;
+    unsigned idle : 1;
+    unsigned dead : 1;
+    unsigned waiting : 1;       // for a fetch of the same response, no socket
+    unsigned woken : 1;         // that fetch is done
+    unsigned capture : 1;       // the body goes into the cache as well
+    unsigned head_request : 1;  // the client's request is a HEAD
+
+    struct http_cache_fill *fill;   // the cache entry the response becomes
+    struct http_cache_waiter wait;
+
+    // The request, kept whole until the response is done so it can be
+    // sent again on another connection
+    char *out;
+    size_t out_len, out_cap, out_sent;
+    size_t method_len, uri_off, uri_len;
+    uint8_t minor_version;      // the client's
+    enum resp_variant variant;
+
+    // The response
+    char *in;                   // receive buffer, from the worker's pool
+    size_t in_len;
+    char *head;                 // the head as the client gets it
+    enum body_mode mode;
+    uint64_t body_left;         // BODY_LENGTH bytes still to come
+    enum chunk_state chunk;
+    uint64_t chunk_left;
+    unsigned chunk_digits;
+    int status;
+    uint64_t bytes;             // sent to the client
+};
+
+struct upstream_pool {
+    struct worker *w;
+    int epfd;
+    struct slab conns;
+    struct upstream_conn *idle[UPSTREAM_MAX];   // most recently used first
+    unsigned nidle[UPSTREAM_MAX];
+    unsigned active[UPSTREAM_MAX];  // connections serving a request
+    unsigned next;                  // where the round-robin goes on
+    struct upstream_conn *ready;    // with a client to drive
+    struct upstream_conn *dead;     // to be freed after this batch
+    struct http_cache_mailbox mailbox;  // waiters whose fetch is done
+};
+
+static void backend_down(int b, const char *why) {
+    if (atomic_exchange(&backends[b].up, 0)) {
+        fprintf(stderr, "webserver: upstream %s is down (%s)\n",
+                backends[b].name, why);
+    }
+}
+
+// Whether a health check of b passes: a 2xx or 3xx to a GET of
+// --health-check
+static int health_probe(const struct backend *b) {
+    int fd = socket(b->addr.sa.sa_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return 0;
+    }
+    // SO_SNDTIMEO bounds connect() as well
+    struct timeval tv = {.tv_sec = HEALTH_TIMEOUT};
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    char req[512];
+    int n = snprintf(req, sizeof(req),
+                     "GET %s HTTP/1.1\r\n"
+                     "Host: %s\r\n"
+                     "User-Agent: webserver-c health check\r\n"
+                     "Connection: close\r\n\r\n",
+                     config.health_check, b->name);
+    char resp[16];
+    size_t got = 0;
+    int ok = 0;
+    if (connect(fd, &b->addr.sa, addr_len(&b->addr)) == 0 &&
+        send(fd, req, n, MSG_NOSIGNAL) == n) {
+        while (got < sizeof(resp)) {
+            ssize_t k = recv(fd, resp + got, sizeof(resp) - got, 0);
+            if (k <= 0) {
+                break;
+            }
+            got += k;
+        }
+        // "HTTP/1.1 200 "
+        ok = got >= 13 && memcmp(resp, "HTTP/1.", 7) == 0 &&
+             (resp[9] == '2' || resp[9] == '3');
+    }
+    close(fd);
+    return ok;
+}
+
+static void *health_main(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&health_lock);
+    while (!health_stopping) {
+        pthread_mutex_unlock(&health_lock);
+        for (int b = 0; b < config.nupstream; b++) {
+            int ok = health_probe(&backends[b]);
+            if (atomic_exchange(&backends[b].up, ok) != ok) {
+                fprintf(stderr, "webserver: upstream %s is %s\n",
+                        backends[b].name, ok ? "up" : "down");
+            }
+        }
+        pthread_mutex_lock(&health_lock);
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += config.health_interval;
+        while (!health_stopping &&
+               pthread_cond_timedwait(&health_cond, &health_lock,
+                                      &deadline) == 0) {
+        }
+    }
+    pthread_mutex_unlock(&health_lock);
+    return NULL;
+}
+
+int upstream_start(void) {
+    if (config.nupstream == 0) {
+        return 0;
+    }
+    resp_bad_gateway = resp_build(502, "text/html", bad_gateway_body,
+                                  sizeof(bad_gateway_body) - 1);
+    resp_gateway_timeout =
+        resp_build(504, "text/html", gateway_timeout_body,
+                   sizeof(gateway_timeout_body) - 1);
+    if (resp_bad_gateway == NULL || resp_gateway_timeout == NULL ||
+        http_cache_init() != 0) {
+        return -1;
+    }
+    for (int b = 0; b < config.nupstream; b++) {
+        backends[b].addr = config.upstream[b];
+        addr_format(&backends[b].addr, backends[b].name);
+        // Innocent until the first check says otherwise
+        atomic_init(&backends[b].up, 1);
+    }
+    int err = pthread_create(&health_thread, NULL, health_main, NULL);
+    if (err != 0) {
+        fprintf(stderr, "webserver (pthread_create): %s\n", strerror(err));
+        return -1;
+    }
+    health_running = 1;
+    return 0;
+}
+
+void upstream_stop(void) {
+    if (!health_running) {
+        return;
+    }
+    pthread_mutex_lock(&health_lock);
+    health_stopping = 1;
+    pthread_cond_signal(&health_cond);
+    pthread_mutex_unlock(&health_lock);
+    pthread_join(health_thread, NULL);
+    health_running = 0;
+}
+
+struct upstream_pool *upstream_pool_new(struct worker *w, int epfd) {
+    struct upstream_pool *p = calloc(1, sizeof(*p));
+    if (p == NULL) {
+        perror("webserver (calloc)");
+        return NULL;
+    }
+    p->w = w;
+    p->epfd = epfd;
+    slab_init(&p->conns, sizeof(struct upstream_conn), 64);
+    p->mailbox.fd = -1;
+    if (http_cache_enabled()) {
+        // Tagged with the pool itself
+        struct epoll_event ev = {.events = EPOLLIN, .data.ptr = p};
+        if (http_cache_mailbox_init(&p->mailbox) != 0 ||
+            epoll_ctl(epfd, EPOLL_CTL_ADD, p->mailbox.fd, &ev) != 0) {
+            perror("webserver (epoll_ctl)");
+            free(p);
+            return NULL;
+        }
+    }
+    return p;
+}
+
+static void wake(struct upstream_conn *u);
+
+void upstream_notify(struct upstream_pool *p) {
+    uint64_t n;
+    if (read(p->mailbox.fd, &n, sizeof(n)) < 0) {
+        return;
+    }
+    struct http_cache_waiter *w = http_cache_mailbox_take(&p->mailbox);
+    while (w != NULL) {
+        struct http_cache_waiter *next = w->next;
+        struct upstream_conn *u =
+            (struct upstream_conn *)((char *)w -
+                                     offsetof(struct upstream_conn, wait));
+        u->woken = 1;
+        wake(u);
+        w = next;
+    }
+}
+
+static void idle_unlink(struct upstream_conn *u) {
+    struct upstream_pool *p = u->pool;
+    if (u->prev != NULL) {
+        u->prev->next = u->next;
+    } else {
+        p->idle[u->backend] = u->next;
+    }
+    if (u->next != NULL) {
+        u->next->prev = u->prev;
+    }
+    p->nidle[u->backend]--;
+    u->idle = 0;
+    u->next = u->prev = NULL;
+}
+
+// Give back what only a request in progress needs
+static void drop_buffers(struct upstream_conn *u) {
+    free(u->out);
+    u->out = NULL;
+    u->out_len = u->out_cap = u->out_sent = 0;
+    if (u->in != NULL) {
+        buf_free(&u->pool->w->bufs, UPSTREAM_BUF_TIER, u->in);
+        u->in = NULL;
+    }
+    u->in_len = 0;
+    free(u->head);
+    u->head = NULL;
+}
+
+// Close u for good. Its memory is only reused after the current batch of
+// events, which may still hold events for it.
+static void upstream_close(struct upstream_conn *u) {
+    if (u->dead) {
+        return;
+    }
+    if (u->idle) {
+        idle_unlink(u);
+    }
+    if (u->fd >= 0) {
+        close(u->fd);
+    }
+    if (u->pipe[0] >= 0) {
+        close(u->pipe[0]);
+        close(u->pipe[1]);
+    }
+    drop_buffers(u);
+    u->dead = 1;
+    u->next = u->pool->dead;
+    u->pool->dead = u;
+}
+
+void upstream_reap(struct upstream_pool *p) {
+    while (p->dead != NULL) {
+        struct upstream_conn *u = p->dead;
+        p->dead = u->next;
+        slab_free(&p->conns, u);
+    }
+}
+
+void upstream_pool_free(struct upstream_pool *p) {
+    if (p == NULL) {
+        return;
+    }
+    for (int b = 0; b < config.nupstream; b++) {
+        while (p->idle[b] != NULL) {
+            upstream_close(p->idle[b]);
+        }
+    }
+    upstream_reap(p);
+    if (p->mailbox.fd >= 0) {
+        http_cache_mailbox_free(&p->mailbox);
+    }
+}
+
+// The backend the next request goes to, other than avoid if there is a
+// choice: the next one round-robin, or the one with the fewest
+// connections in use. Backends that are down only get requests when all
+// are.
+static int pick_backend(struct upstream_pool *p, int avoid) {
+    int n = config.nupstream;
+    int best = -1;
+    for (int pass = 0; pass < 2 && best < 0; pass++) {
+        for (int k = 0; k < n; k++) {
+            int b = (p->next + k) % n;
+            if ((b == avoid && n > 1) ||
+                (pass == 0 && !atomic_load_explicit(&backends[b].up,
+                                                    memory_order_relaxed))) {
+                continue;
+            }
+            if (config.balance == BALANCE_ROUND_ROBIN) {
+                best = b;
+                break;
+            }
+            if (best < 0 || p->active[b] < p->active[best]) {
+                best = b;
+            }
+        }
+    }
+    if (best < 0) {
+        best = avoid;
+    }
+    p->next = (best + 1) % n;
+    return best;
+}
+
+static struct upstream_conn *connect_backend(struct upstream_pool *p,
+                                             int b) {
+    const struct backend *be = &backends[b];
+    int fd = socket(be->addr.sa.sa_family,
+                    SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("webserver (socket)");
+        return NULL;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    int connecting = 0;
+    if (connect(fd, &be->addr.sa, addr_len(&be->addr)) != 0) {
+        if (errno != EINPROGRESS) {
+            backend_down(b, strerror(errno));
+            close(fd);
+            return NULL;
+        }
+        connecting = 1;
+    }
+    struct upstream_conn *u = slab_alloc(&p->conns);
+    if (u == NULL) {
+        close(fd);
+        return NULL;
+    }
+    memset(u, 0, sizeof(*u));
+    u->pool = p;
+    u->fd = fd;
+    u->backend = b;
+    u->pipe[0] = u->pipe[1] = -1;
+    u->connecting = connecting;
+    // Tagged so the event loop can tell backends from clients
+    struct epoll_event ev = {
+        .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+        .data.ptr = (char *)u + 1,
+    };
+    if (epoll_ctl(p->epfd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+        perror("webserver (epoll_ctl)");
+        close(fd);
+        slab_free(&p->conns, u);
+        return NULL;
+    }
+    return u;
+}
+
+// A connection to a backend for a new request: a pooled one if there is
+// one, else a new one
+static struct upstream_conn *upstream_get(struct upstream_pool *p,
+                                          int avoid) {
+    for (int tries = 0; tries < config.nupstream; tries++) {
+        int b = pick_backend(p, avoid);
+        struct upstream_conn *u = p->idle[b];
+        if (u != NULL) {
+            idle_unlink(u);
+            u->reused = 1;
+            metric_add(&p->w->metrics.upstream_reused, 1);
+        } else {
+            u = connect_backend(p, b);
+        }
+        if (u != NULL) {
+            p->active[b]++;
+            return u;
+        }
+        avoid = b;
+    }
+    return NULL;
+}
+
+static void wake(struct upstream_conn *u) {
+    if (u->client != NULL && !u->in_ready) {
+        u->in_ready = 1;
+        u->ready_next = u->pool->ready;
+        u->pool->ready = u;
+    }
+}
+
+struct conn *upstream_ready(struct upstream_pool *p) {
+    while (p->ready != NULL) {
+        struct upstream_conn *u = p->ready;
+        p->ready = u->ready_next;
+        u->in_ready = 0;
+        if (!u->dead && u->client != NULL) {
+            return u->client;
+        }
+    }
+    return NULL;
+}
+
+static void fail(struct upstream_conn *u) {
+    u->failed = 1;
+    wake(u);
+}
+
+// Send as much of the request as the socket takes
+static void request_flush(struct upstream_conn *u) {
+    if (u->fd < 0 || u->connecting || u->failed) {
+        return;
+    }
+    while (u->out_sent < u->out_len) {
+        ssize_t n = send(u->fd, u->out + u->out_sent,
+                         u->out_len - u->out_sent, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                fail(u);
+            }
+            return;
+        }
+        u->out_sent += n;
+    }
+}
+
+void upstream_event(struct upstream_conn *u, uint32_t events) {
+    if (u->dead) {
+        return;
+    }
+    if (u->client == NULL) {
+        // An idle backend connection only ever hears of its end
+        if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+            upstream_close(u);
+        }
+        return;
+    }
+    if (u->connecting) {
+        if (!(events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+            return;
+        }
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(u->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err != 0 || (events & EPOLLERR)) {
+            backend_down(u->backend, strerror(err != 0 ? err : EIO));
+            u->connect_failed = 1;
+            fail(u);
+            return;
+        }
+        u->connecting = 0;
+    } else if (events & EPOLLERR) {
+        fail(u);
+        return;
+    }
+    if (events & EPOLLOUT) {
+        request_flush(u);
+    }
+    if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP)) {
+        u->readable = 1;
+        wake(u);
+    }
+}
+
+// Headers that only concern one hop and are not forwarded either way
+static int hop_by_hop(const char *name, size_t len) {
+    static const char *const names[] = {
+        "Connection", "Keep-Alive", "Proxy-Connection", "TE", "Upgrade",
+        "Expect",
+    };
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if (strlen(names[i]) == len && strncasecmp(name, names[i], len) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int is_header(const struct http_str *name, const char *want) {
+    return name->len == strlen(want) &&
+           strncasecmp(name->ptr, want, name->len) == 0;
+}
+
+static char *put(char *p, const void *data, size_t len) {
+    memcpy(p, data, len);
+    return p + len;
+}
+
+static char *put_str(char *p, const char *s) {
+    return put(p, s, strlen(s));
+}
+
+// Serialize req as the backend gets it into a new buffer u->out: without
+// hop-by-hop headers, with the client in X-Forwarded-For unless
+// append_peer is 0 and asking to keep the connection open. The extra_len
+// bytes of header lines at extra replace the client's conditional headers.
+static int build_request(struct upstream_conn *u, struct conn *c,
+                         const struct http_request *req, const char *extra,
+                         size_t extra_len, int append_peer) {
+    size_t need = req->method.len + req->uri.len + 2 * ADDR_STRLEN + 192 +
+                  extra_len;
+    for (unsigned i = 0; i < req->nheaders; i++) {
+        need += req->headers[i].name.len + req->headers[i].value.len + 4;
+    }
+    char *out = malloc(need);
+    if (out == NULL) {
+        perror("webserver (malloc)");
+        return -1;
+    }
+    char *p = put(out, req->method.ptr, req->method.len);
+    *p++ = ' ';
+    u->method_len = req->method.len;
+    u->uri_off = p - out;
+    u->uri_len = req->uri.len;
+    p = put(p, req->uri.ptr, req->uri.len);
+    // An HTTP/1.0 client cannot take a chunked body, so its backend
+    // must not send one
+    p = put_str(p, req->minor_version == 1 ? " HTTP/1.1\r\n"
+                                           : " HTTP/1.0\r\n");
+
+    const struct http_str *forwarded = NULL;
+    int host = 0;
+    for (unsigned i = 0; i < req->nheaders; i++) {
+        const struct http_header *h = &req->headers[i];
+        if (hop_by_hop(h->name.ptr, h->name.len) ||
+            is_header(&h->name, "X-Forwarded-Proto")) {
+            continue;
+        }
+        if (is_header(&h->name, "X-Forwarded-For")) {
+            forwarded = &h->value;
+            continue;
+        }
+        if (u->fill != NULL && (is_header(&h->name, "If-None-Match") ||
+                                is_header(&h->name, "If-Modified-Since"))) {
+            // The cache wants the whole response, or to revalidate its own
+            continue;
+        }
+        host |= is_header(&h->name, "Host");
+        p = put(p, h->name.ptr, h->name.len);
+        p = put(p, ": ", 2);
+        p = put(p, h->value.ptr, h->value.len);
+        p = put(p, "\r\n", 2);
+    }
+    if (!host && u->backend >= 0) {
+        p = put_str(p, "Host: ");
+        p = put_str(p, backends[u->backend].name);
+        p = put(p, "\r\n", 2);
+    }
+    if (extra_len > 0) {
+        p = put(p, extra, extra_len);
+    }
+    p = put_str(p, "X-Forwarded-For: ");
+    if (forwarded != NULL) {
+        p = put(p, forwarded->ptr, forwarded->len);
+        if (append_peer) {
+            p = put(p, ", ", 2);
+        }
+    }
+    if (append_peer || forwarded == NULL) {
+        p += addr_format_host(conn_peer(c), p);
+    }
+    // An HTTP/2 stream came over its session's connection
+    const struct conn *via = c->parent != NULL ? c->parent : c;
+    p = put_str(p, via->tls != NULL ? "\r\nX-Forwarded-Proto: https\r\n"
+                                    : "\r\nX-Forwarded-Proto: http\r\n");
+    p = put_str(p, "Connection: keep-alive\r\n\r\n");
+
+    u->out = out;
+    u->out_len = p - out;
+    u->out_cap = need;
+    u->minor_version = req->minor_version;
+    return 0;
+}
+
+static void log_response(struct conn *c, struct upstream_conn *u) {
+    if (!accesslog_sampled(c->w)) {
+        return;
+    }
+    struct http_request req;
+    req.method.ptr = u->out;
+    req.method.len = u->method_len;
+    req.uri.ptr = u->out + u->uri_off;
+    req.uri.len = u->uri_len;
+    req.version.ptr = c->parent != NULL ? "HTTP/2.0" : "";
+    req.version.len = c->parent != NULL ? 8 : 0;
+    req.minor_version = u->minor_version;
+    accesslog_request(c->w, conn_peer(c), &req, u->status, u->bytes);
+}
+
+// The client is done with u: back into the pool if the backend can take
+// another request on it, closed otherwise
+static void release(struct conn *c, struct upstream_conn *u, int reusable) {
+    struct upstream_pool *p = u->pool;
+    if (c->proxy == u) {
+        c->proxy = NULL;
+    }
+    u->client = NULL;
+    if (u->waiting) {
+        http_cache_cancel(&u->wait);
+    }
+    if (u->fill != NULL) {
+        http_cache_fill_abort(u->fill);
+        u->fill = NULL;
+    }
+    if (u->fd < 0) {
+        // Never had a socket
+        upstream_close(u);
+        return;
+    }
+    p->active[u->backend]--;
+    if (!reusable || u->piped > 0 ||
+        p->nidle[u->backend] >= UPSTREAM_IDLE_MAX) {
+        upstream_close(u);
+        return;
+    }
+    drop_buffers(u);
+    // Everything but the socket, the pipe and the place in the ready list
+    struct upstream_conn keep = {
+        .pool = p,
+        .fd = u->fd,
+        .backend = u->backend,
+        .pipe = {u->pipe[0], u->pipe[1]},
+        .ready_next = u->ready_next,
+        .in_ready = u->in_ready,
+    };
+    *u = keep;
+    u->idle = 1;
+    u->next = p->idle[u->backend];
+    if (u->next != NULL) {
+        u->next->prev = u;
+    }
+    p->idle[u->backend] = u;
+    p->nidle[u->backend]++;
+}
+
+// Queue the shared response r, of which the caller holds a reference, as
+// variant v; without its body if head_only. Returns the bytes queued.
+static size_t queue_cached(struct conn *c, const struct cached_response *r,
+                           enum resp_variant v, int head_only) {
+    size_t len = r->len[v] - (head_only ? r->body_len : 0);
+    if (c->iovcnt == 0) {
+        c->write_start = metric_clock();
+    }
+    conn_queue(c, r->data[v], len, (struct rcbuf *)&r->rc);
+    // The reference moves to the queue
+    conn_pin(c);
+    rcbuf_put((struct rcbuf *)&r->rc);
+    return len;
+}
+
+static int is_head(const struct http_request *req) {
+    return req->method.len == 4 && memcmp(req->method.ptr, "HEAD", 4) == 0;
+}
+
+// Send req to a backend as variant v of the response, to be stored
+// through fill if not NULL. The peer has been added to X-Forwarded-For
+// already unless append_peer is set. Returns NULL if there is no backend
+// to send it to; fill is aborted then.
+static struct upstream_conn *start_fetch(struct conn *c,
+                                         const struct http_request *req,
+                                         enum resp_variant v,
+                                         struct http_cache_fill *fill,
+                                         int append_peer) {
+    struct upstream_pool *p = c->w->upstream;
+    char validators[256];
+    size_t nvalidators = 0;
+    if (fill != NULL) {
+        nvalidators = http_cache_fill_validators(fill, validators,
+                                                 sizeof(validators));
+    }
+    struct upstream_conn *u = upstream_get(p, -1);
+    if (u != NULL) {
+        u->fill = fill;
+    }
+    if (u == NULL || build_request(u, c, req, validators, nvalidators,
+                                   append_peer) != 0) {
+        if (u != NULL) {
+            u->fill = NULL;
+            p->active[u->backend]--;
+            upstream_close(u);
+        }
+        if (fill != NULL) {
+            http_cache_fill_abort(fill);
+        }
+        return NULL;
+    }
+    metric_add(&c->w->metrics.upstream_requests, 1);
+    if (fill != NULL) {
+        metric_add(&c->w->metrics.cache_misses, 1);
+    }
+    u->client = c;
+    u->variant = v;
+    u->head_request = is_head(req);
+    u->mode = u->head_request ? BODY_NONE : BODY_LENGTH;
+    c->proxy = u;
+    request_flush(u);
+    return u;
+}
+
+int upstream_serve(struct conn *c, const struct http_request *req,
+                   const struct route_match *m, enum resp_variant v,
+                   size_t *bytes) {
+    (void)m;
+    struct upstream_pool *p = c->w->upstream;
+    struct http_cache_fill *fill = NULL;
+    *bytes = 0;
+    if (http_cache_enabled()) {
+        // Stands in for the backend connection while the request waits
+        // for another one fetching the same response
+        struct upstream_conn *u = slab_alloc(&p->conns);
+        if (u == NULL) {
+            perror("webserver (malloc)");
+        } else {
+            memset(u, 0, sizeof(*u));
+            u->pool = p;
+            u->fd = -1;
+            u->backend = -1;
+            u->pipe[0] = u->pipe[1] = -1;
+        }
+        const struct cached_response *hit;
+        enum http_cache_result r = http_cache_lookup(
+            req, c->w->now, 1, u != NULL ? &u->wait : NULL, &p->mailbox,
+            &hit, &fill);
+        if (r == HTTP_CACHE_WAIT && build_request(u, c, req, NULL, 0, 1) != 0) {
+            u->waiting = 1;
+            release(c, u, 0);
+            r = HTTP_CACHE_PASS;
+        } else if (r == HTTP_CACHE_WAIT) {
+            metric_add(&c->w->metrics.cache_coalesced, 1);
+            u->waiting = 1;
+            u->client = c;
+            u->variant = v;
+            u->close_client = c->close_after_write;
+            c->close_after_write = 0;
+            c->proxy = u;
+            return 0;
+        } else if (u != NULL) {
+            upstream_close(u);
+        }
+        if (r == HTTP_CACHE_HIT) {
+            metric_add(&c->w->metrics.cache_hits, 1);
+            *bytes = queue_cached(c, hit, v, is_head(req));
+            return hit->status;
+        }
+    }
+    struct upstream_conn *u = start_fetch(c, req, v, fill, 1);
+    if (u == NULL) {
+        metric_add(&c->w->metrics.upstream_failures, 1);
+        *bytes = is_head(req) ? resp_bad_gateway->head_len[v]
+                              : resp_bad_gateway->len[v];
+        conn_queue(c, resp_bad_gateway->data[v], *bytes,
+                   (struct rcbuf *)&resp_bad_gateway->rc);
+        return resp_bad_gateway->status;
+    }
+    // Like a stream, the connection only closes once the response is
+    // complete; until then the request body still has to be read
+    u->close_client = c->close_after_write;
+    c->close_after_write = 0;
+    return 0;
+}
+
+void upstream_body(struct conn *c, const char *data, size_t len) {
+    struct upstream_conn *u = c->proxy;
+    if (u->out_len + len > u->out_cap) {
+        size_t cap = u->out_cap * 2;
+        while (cap < u->out_len + len) {
+            cap *= 2;
+        }
+        char *out = realloc(u->out, cap);
+        if (out == NULL) {
+            perror("webserver (realloc)");
+            fail(u);
+            return;
+        }
+        u->out = out;
+        u->out_cap = cap;
+    }
+    memcpy(u->out + u->out_len, data, len);
+    u->out_len += len;
+    request_flush(u);
+}
+
+// Answer c with an error response instead of the backend's, if nothing of
+// the backend's went out yet. Returns what upstream_pump() does.
+static int fail_response(struct conn *c, struct upstream_conn *u,
+                         const struct cached_response *r) {
+    metric_add(&c->w->metrics.upstream_failures, 1);
+    if (u->head_sent) {
+        return -1;
+    }
+    if (c->iovcnt == 0) {
+        c->write_start = metric_clock();
+    }
+    u->bytes = u->head_request ? r->head_len[RESP_CLOSE] : r->len[RESP_CLOSE];
+    conn_queue(c, r->data[RESP_CLOSE], u->bytes, (struct rcbuf *)&r->rc);
+    c->close_after_write = 1;
+    u->status = r->status;
+    log_response(c, u);
+    release(c, u, 0);
+    return 1;
+}
+
+static int idempotent(const struct upstream_conn *u) {
+    static const char *const methods[] = {
+        "GET", "HEAD", "PUT", "DELETE", "OPTIONS", "TRACE",
+    };
+    for (size_t i = 0; i < sizeof(methods) / sizeof(methods[0]); i++) {
+        if (strlen(methods[i]) == u->method_len &&
+            memcmp(u->out, methods[i], u->method_len) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// The backend went away before answering. A request that never reached it,
+// or an idempotent one on a pooled connection the backend may have closed
+// just as we sent it, is sent once more on a fresh connection; anything
+// else gets a 502.
+static int retry(struct conn *c, struct upstream_conn *u) {
+    if (u->answered || u->retried ||
+        !(u->connect_failed || (u->reused && idempotent(u)))) {
+        return fail_response(c, u, resp_bad_gateway);
+    }
+    struct upstream_conn *next =
+        upstream_get(u->pool, u->connect_failed ? u->backend : -1);
+    if (next == NULL) {
+        return fail_response(c, u, resp_bad_gateway);
+    }
+    // The request moves over whole
+    next->client = c;
+    next->retried = 1;
+    next->out = u->out;
+    next->out_len = u->out_len;
+    next->out_cap = u->out_cap;
+    next->method_len = u->method_len;
+    next->uri_off = u->uri_off;
+    next->uri_len = u->uri_len;
+    next->minor_version = u->minor_version;
+    next->variant = u->variant;
+    next->mode = u->mode;
+    next->head_request = u->head_request;
+    next->close_client = u->close_client;
+    next->fill = u->fill;
+    u->fill = NULL;
+    u->out = NULL;
+    release(c, u, 0);
+    c->proxy = next;
+    request_flush(next);
+    return 0;
+}
+
+// Look for the end of a chunked body in len bytes at p. Returns how many
+// of them belong to the body, or -1 if it is malformed.
+static ssize_t chunk_scan(struct upstream_conn *u, const char *p,
+                          size_t len) {
+    size_t i = 0;
+    while (i < len && u->chunk != CHUNK_DONE) {
+        char ch = p[i];
+        switch (u->chunk) {
+        case CHUNK_SIZE: {
+            int digit = ch >= '0' && ch <= '9'   ? ch - '0'
+                        : ch >= 'a' && ch <= 'f' ? ch - 'a' + 10
+                        : ch >= 'A' && ch <= 'F' ? ch - 'A' + 10
+                                                 : -1;
+            if (digit >= 0) {
+                if (++u->chunk_digits > 15) {
+                    return -1;
+                }
+                u->chunk_left = u->chunk_left * 16 + digit;
+                i++;
+                break;
+            }
+            if (u->chunk_digits == 0) {
+                return -1;
+            }
+            u->chunk = CHUNK_EXT;
+            break;
+        }
+        case CHUNK_EXT:
+            i++;
+            if (ch == '\n') {
+                u->chunk = u->chunk_left == 0 ? CHUNK_TRAILER : CHUNK_DATA;
+            }
+            break;
+        case CHUNK_DATA: {
+            size_t n = len - i < u->chunk_left ? len - i
+                                               : (size_t)u->chunk_left;
+            if (u->capture && http_cache_fill_body(u->fill, p + i, n) != 0) {
+                u->fill = NULL;
+                u->capture = 0;
+            }
+            i += n;
+            u->chunk_left -= n;
+            if (u->chunk_left == 0) {
+                u->chunk = CHUNK_DATA_END;
+            }
+            break;
+        }
+        case CHUNK_DATA_END:
+            i++;
+            if (ch == '\n') {
+                u->chunk = CHUNK_SIZE;
+                u->chunk_digits = 0;
+            }
+            break;
+        case CHUNK_TRAILER:
+            i++;
+            u->chunk = ch == '\r'   ? CHUNK_LAST_LF
+                       : ch == '\n' ? CHUNK_DONE
+                                    : CHUNK_TRAILER_LINE;
+            break;
+        case CHUNK_TRAILER_LINE:
+            i++;
+            if (ch == '\n') {
+                u->chunk = CHUNK_TRAILER;
+            }
+            break;
+        case CHUNK_LAST_LF:
+            if (ch != '\n') {
+                return -1;
+            }
+            i++;
+            u->chunk = CHUNK_DONE;
+            break;
+        case CHUNK_DONE:
+            break;
+        }
+    }
+    return (ssize_t)i;
+}
+
+// Queue len bytes of body at data to the client, as far as they belong to
+// the body. Anything after the end means the backend connection cannot be
+// trusted with another request. Returns -1 for a malformed body.
+static int queue_body(struct conn *c, struct upstream_conn *u,
+                      const char *data, size_t len) {
+    size_t n = len;
+    if (u->mode == BODY_NONE) {
+        n = 0;
+    } else if (u->mode == BODY_LENGTH && n > u->body_left) {
+        n = (size_t)u->body_left;
+    } else if (u->mode == BODY_CHUNKED) {
+        ssize_t k = chunk_scan(u, data, len);
+        if (k < 0) {
+            return -1;
+        }
+        n = (size_t)k;
+    }
+    if (n < len) {
+        u->keep_alive = 0;
+    }
+    if (u->mode == BODY_LENGTH) {
+        u->body_left -= n;
+    }
+    if (u->capture && u->mode != BODY_CHUNKED && n > 0 &&
+        http_cache_fill_body(u->fill, data, n) != 0) {
+        u->fill = NULL;
+        u->capture = 0;
+    }
+    if (n > 0) {
+        conn_queue(c, data, n, NULL);
+        u->bytes += n;
+        u->in_queued = 1;
+    }
+    return 0;
+}
+
+// Parse the response head at the start of u->in, if it is complete, and
+// queue it to the client without hop-by-hop headers. Interim 1xx responses
+// are skipped. Returns 1 once the head is queued, 0 if it is incomplete
+// and -1 if it is malformed.
+static int parse_head(struct conn *c, struct upstream_conn *u) {
+    char *end;
+    for (;;) {
+        end = memmem(u->in, u->in_len, "\r\n\r\n", 4);
+        if (end == NULL) {
+            return 0;
+        }
+        if (u->in_len < 12 || memcmp(u->in, "HTTP/1.", 7) != 0 ||
+            (u->in[7] != '0' && u->in[7] != '1') || u->in[8] != ' ') {
+            return -1;
+        }
+        u->status = 0;
+        for (int i = 9; i < 12; i++) {
+            if (u->in[i] < '0' || u->in[i] > '9') {
+                return -1;
+            }
+            u->status = u->status * 10 + (u->in[i] - '0');
+        }
+        if (u->status >= 200 || u->status == 101) {
+            break;
+        }
+        size_t skip = end + 4 - u->in;
+        memmove(u->in, u->in + skip, u->in_len - skip);
+        u->in_len -= skip;
+    }
+    if (u->status < 200) {
+        // We never ask for an upgrade
+        return -1;
+    }
+    size_t head_len = end + 4 - u->in;
+    int minor = u->in[7] - '0';
+
+    u->head = malloc(head_len + 64);
+    if (u->head == NULL) {
+        perror("webserver (malloc)");
+        return -1;
+    }
+    const char *line = memchr(u->in, '\n', head_len) + 1;
+    char *p = put_str(u->head, "HTTP/1.1");
+    p = put(p, u->in + 8, line - (u->in + 8));
+
+    int chunked = 0, has_length = 0, closing = minor == 0, keep = 0;
+    uint64_t length = 0;
+    while (line < end + 2) {
+        const char *eol = memchr(line, '\n', end + 4 - line);
+        const char *colon = memchr(line, ':', eol - line);
+        if (colon == NULL) {
+            return -1;
+        }
+        struct http_str name = {line, colon - line};
+        struct http_str value = {colon + 1, eol - colon - 1};
+        while (value.len > 0 && (*value.ptr == ' ' || *value.ptr == '\t')) {
+            value.ptr++;
+            value.len--;
+        }
+        while (value.len > 0 && (value.ptr[value.len - 1] == '\r' ||
+                                 value.ptr[value.len - 1] == ' ')) {
+            value.len--;
+        }
+        if (is_header(&name, "Content-Length")) {
+            uint64_t n = 0;
+            if (value.len == 0 || value.len > 19) {
+                return -1;
+            }
+            for (size_t i = 0; i < value.len; i++) {
+                if (value.ptr[i] < '0' || value.ptr[i] > '9') {
+                    return -1;
+                }
+                n = n * 10 + (uint64_t)(value.ptr[i] - '0');
+            }
+            if (has_length && n != length) {
+                return -1;
+            }
+            has_length = 1;
+            length = n;
+        } else if (is_header(&name, "Transfer-Encoding")) {
+            if (!http_has_token(&value, "chunked")) {
+                return -1;
+            }
+            chunked = 1;
+        } else if (is_header(&name, "Connection")) {
+            closing |= http_has_token(&value, "close");
+            keep |= http_has_token(&value, "keep-alive");
+        }
+        if (!hop_by_hop(name.ptr, name.len)) {
+            p = put(p, line, eol + 1 - line);
+        }
+        line = eol + 1;
+    }
+
+    if (u->mode != BODY_NONE && u->status != 204 && u->status != 304) {
+        if (chunked) {
+            if (u->minor_version == 0) {
+                return -1;
+            }
+            u->mode = BODY_CHUNKED;
+        } else if (has_length) {
+            u->mode = BODY_LENGTH;
+            u->body_left = length;
+        } else {
+            u->mode = BODY_EOF;
+        }
+    }
+    u->keep_alive = (!closing || keep) && u->mode != BODY_EOF;
+    u->close_client |= u->mode == BODY_EOF;
+
+    if (u->fill != NULL) {
+        const char *req_end = memmem(u->out, u->out_len, "\r\n\r\n", 4);
+        const struct cached_response *fresh;
+        switch (http_cache_fill_head(u->fill, u->status, u->head,
+                                     p - u->head, u->out,
+                                     req_end + 4 - u->out, c->w->now,
+                                     &fresh)) {
+        case HTTP_CACHE_STORE:
+            u->capture = 1;
+            break;
+        case HTTP_CACHE_REFRESHED:
+            // The stored response goes out instead of the backend's 304
+            metric_add(&c->w->metrics.cache_revalidated, 1);
+            u->fill = NULL;
+            u->status = fresh->status;
+            u->bytes = queue_cached(
+                c, fresh, u->close_client ? RESP_CLOSE : u->variant, 0);
+            u->head_sent = 1;
+            u->in_queued = 1;
+            u->mode = BODY_NONE;
+            return queue_body(c, u, u->in + head_len,
+                              u->in_len - head_len) == 0;
+        case HTTP_CACHE_DROPPED:
+            u->fill = NULL;
+            break;
+        }
+    }
+    if (u->close_client) {
+        p = put_str(p, "Connection: close\r\n");
+    } else if (u->variant == RESP_KEEP_ALIVE_10) {
+        p = put_str(p, "Connection: keep-alive\r\n");
+    }
+    p = put(p, "\r\n", 2);
+
+    if (c->iovcnt == 0) {
+        c->write_start = metric_clock();
+    }
+    conn_queue(c, u->head, p - u->head, NULL);
+    u->head_sent = 1;
+    u->bytes = p - u->head;
+    u->in_queued = 1;
+    return queue_body(c, u, u->in + head_len, u->in_len - head_len) == 0;
+}
+
+static int body_done(const struct upstream_conn *u) {
+    switch (u->mode) {
+    case BODY_NONE:
+        return 1;
+    case BODY_LENGTH:
+        return u->body_left == 0 && u->piped == 0;
+    case BODY_CHUNKED:
+        return u->chunk == CHUNK_DONE;
+    case BODY_EOF:
+        return u->eof && u->piped == 0;
+    }
+    return 1;
+}
+
+// The response is complete
+static int finish(struct conn *c, struct upstream_conn *u) {
+    if (u->fill != NULL) {
+        metric_add(&c->w->metrics.cache_evictions,
+                   http_cache_fill_finish(u->fill));
+        u->fill = NULL;
+    }
+    log_response(c, u);
+    c->close_after_write = u->close_client;
+    // A backend that answered before it had the whole request body would
+    // take the rest of it for the next request
+    release(c, u, u->keep_alive && u->out_sent == u->out_len &&
+                      c->body_left == 0);
+    return 1;
+}
+
+// Move the body from the backend socket through the pipe to the client
+// socket, kernel buffer to kernel buffer
+static int splice_body(struct conn *c, struct upstream_conn *u) {
+    if (u->pipe[0] < 0 && pipe2(u->pipe, O_NONBLOCK | O_CLOEXEC) != 0) {
+        perror("webserver (pipe2)");
+        return -1;
+    }
+    for (;;) {
+        if (u->piped > 0) {
+            ssize_t n = splice(u->pipe[0], NULL, c->fd, NULL, u->piped,
+                               SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno == EAGAIN) {
+                    // The client's EPOLLOUT brings us back
+                    return 0;
+                }
+                metric_add(&c->w->metrics.errors[SYSCALL_SPLICE], 1);
+                return -1;
+            }
+            u->piped -= n;
+            u->bytes += n;
+            metric_add(&c->w->metrics.bytes_out, n);
+            continue;
+        }
+        if (body_done(u)) {
+            return finish(c, u);
+        }
+        if (!u->readable) {
+            return 0;
+        }
+        size_t want = UPSTREAM_SPLICE_MAX;
+        if (u->mode == BODY_LENGTH && want > u->body_left) {
+            want = (size_t)u->body_left;
+        }
+        ssize_t n = splice(u->fd, NULL, u->pipe[1], NULL, want,
+                           SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n > 0) {
+            u->piped += n;
+            if (u->mode == BODY_LENGTH) {
+                u->body_left -= n;
+            }
+        } else if (n == 0) {
+            if (u->mode != BODY_EOF) {
+                return -1;
+            }
+            u->eof = 1;
+        } else if (errno == EAGAIN) {
+            // The pipe is empty, so it is the socket that has nothing
+            u->readable = 0;
+            return 0;
+        } else if (errno != EINTR) {
+            metric_add(&c->w->metrics.errors[SYSCALL_SPLICE], 1);
+            return -1;
+        }
+    }
+}
+
+// The fetch u waited for is done: answer from the cache now, wait for
+// the next fetch or fetch it. Returns what upstream_pump() does.
+static int resume(struct conn *c, struct upstream_conn *u) {
+    struct http_request req;
+    struct http_parser parser;
+    http_parser_init(&parser);
+    u->woken = 0;
+    int head_len = http_parse(&parser, u->out, u->out_len, &req);
+    if (head_len <= 0) {
+        return fail_response(c, u, resp_bad_gateway);
+    }
+    const struct cached_response *hit;
+    struct http_cache_fill *fill = NULL;
+    switch (http_cache_lookup(&req, c->w->now, 1, &u->wait,
+                              &u->pool->mailbox, &hit, &fill)) {
+    case HTTP_CACHE_HIT:
+        metric_add(&c->w->metrics.cache_hits, 1);
+        u->status = hit->status;
+        u->bytes = queue_cached(c, hit,
+                                u->close_client ? RESP_CLOSE : u->variant,
+                                is_head(&req));
+        u->waiting = 0;
+        return finish(c, u);
+    case HTTP_CACHE_WAIT:
+        return 0;
+    case HTTP_CACHE_MISS:
+    case HTTP_CACHE_PASS:
+        break;
+    }
+    u->waiting = 0;
+    struct upstream_conn *next = start_fetch(c, &req, u->variant, fill, 0);
+    if (next == NULL) {
+        return fail_response(c, u, resp_bad_gateway);
+    }
+    next->close_client = u->close_client;
+    // Body bytes that came with the request while it waited
+    upstream_body(c, u->out + head_len, u->out_len - head_len);
+    release(c, u, 0);
+    return 0;
+}
+
+int upstream_pump(struct conn *c) {
+    struct upstream_conn *u = c->proxy;
+    struct worker *w = c->w;
+    if (u->waiting) {
+        return u->woken ? resume(c, u) : 0;
+    }
+    if (u->in_queued) {
+        // The client took everything queued out of our buffers
+        u->in_len = 0;
+        u->in_queued = 0;
+        free(u->head);
+        u->head = NULL;
+    }
+    if (u->failed) {
+        return retry(c, u);
+    }
+    if (u->in == NULL) {
+        u->in = buf_alloc(&w->bufs, UPSTREAM_BUF_TIER);
+        if (u->in == NULL) {
+            return fail_response(c, u, resp_bad_gateway);
+        }
+    }
+    size_t cap = buf_tier_size[UPSTREAM_BUF_TIER];
+
+    while (!u->head_sent) {
+        if (u->in_len > 0) {
+            int done = parse_head(c, u);
+            if (done < 0) {
+                return fail_response(c, u, resp_bad_gateway);
+            }
+            if (done > 0) {
+                return 1;
+            }
+            if (u->in_len == cap) {
+                // A head this large is not worth relaying
+                return fail_response(c, u, resp_bad_gateway);
+            }
+        }
+        if (!u->readable) {
+            return 0;
+        }
+        ssize_t n = read(u->fd, u->in + u->in_len, cap - u->in_len);
+        if (n > 0) {
+            u->in_len += n;
+            u->answered = 1;
+        } else if (n == 0 || (errno != EAGAIN && errno != EINTR)) {
+            return u->answered ? fail_response(c, u, resp_bad_gateway)
+                               : retry(c, u);
+        } else if (errno == EAGAIN) {
+            u->readable = 0;
+            return 0;
+        }
+    }
+
+    if (body_done(u)) {
+        return finish(c, u);
+    }
+    // The body of a stream has to be framed, so it cannot bypass us
+    if ((u->mode == BODY_LENGTH || u->mode == BODY_EOF) && !tls_user_tx(c) &&
+        !u->capture && c->parent == NULL) {
+        return splice_body(c, u);
+    }
+    // OpenSSL encrypts what we send, or the chunked framing has to be
+    // followed: relay through the buffer
+    while (u->readable) {
+        size_t want = cap;
+        if (u->mode == BODY_LENGTH && want > u->body_left) {
+            want = (size_t)u->body_left;
+        }
+        ssize_t n = read(u->fd, u->in, want);
+        if (n > 0) {
+            u->in_len = n;
+            if (queue_body(c, u, u->in, n) != 0) {
+                return -1;
+            }
+            return 1;
+        }
+        if (n == 0) {
+            if (u->mode != BODY_EOF) {
+                return -1;
+            }
+            u->eof = 1;
+            return finish(c, u);
+        }
+        if (errno == EAGAIN) {
+            u->readable = 0;
+        } else if (errno != EINTR) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int upstream_timeout(struct conn *c) {
+    struct upstream_conn *u = c->proxy;
+    if (u->head_sent) {
+        return -1;
+    }
+    fail_response(c, u, resp_gateway_timeout);
+    return 0;
+}
+
+void upstream_abort(struct conn *c) {
+    struct upstream_conn *u = c->proxy;
+    if (u == NULL) {
+        return;
+    }
+    if (u->head_sent) {
+        // Cut short, but the client saw the status
+        log_response(c, u);
+    }
+    release(c, u, 0);
+}
@@ -0,0 +1,87 @@
+#ifndef WEBSERVER_UPSTREAM_H
+#define WEBSERVER_UPSTREAM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "conn.h"
+#include "http_parser.h"
+#include "resp_cache.h"
+#include "router.h"
+
+// Reverse proxying to the --upstream servers. Requests on --proxy-path are
+// forwarded to one of them, chosen round-robin or by the fewest
+// connections in use, and the response is relayed back. Each worker keeps
+// its own pool of persistent backend connections, so forwarding a request
+// usually costs no connect(). Response bodies of a known length, or that
+// end with the backend connection, are spliced from socket to socket
+// through a pipe without passing through user space.
+//
+// A health checker thread requests --health-check from every backend each
+// --health-interval seconds; a backend that fails, or that refuses a
+// worker's connection, gets no requests until it passes again. When every
+// backend is down they are all tried anyway.
+//
+// With --cache-size, responses the backends allow to be stored are kept in
+// http_cache.c and served from there.
+//
+// Needs the epoll backend: backend sockets are watched from the worker's
+// epoll set, tagged with their address plus one.
+
+struct upstream_conn;
+struct upstream_pool;
+
+// Start the health checker. Does nothing without upstreams.
+int upstream_start(void);
+
+// Stop the health checker
+void upstream_stop(void);
+
+// Give worker w its backend connection pool, with the backend sockets
+// watched from the epoll set epfd
+struct upstream_pool *upstream_pool_new(struct worker *w, int epfd);
+
+// Close the pooled connections once the worker has no clients left
+void upstream_pool_free(struct upstream_pool *p);
+
+// The handler of --proxy-path: start forwarding req. The response is
+// queued later, by upstream_pump(); until then c->proxy is set and no
+// further request is taken off the connection. Returns 0 in that case, or
+// the status of an error response it queued instead.
+int upstream_serve(struct conn *c, const struct http_request *req,
+                   const struct route_match *m, enum resp_variant v,
+                   size_t *bytes);
+
+// Forward len bytes of the body of the request c is waiting for
+void upstream_body(struct conn *c, const char *data, size_t len);
+
+// Called by the event loop whenever c->proxy is set and c's write queue is
+// empty: relay what the backend sent so far. Returns 1 if c has been given
+// more to write or its response is complete (c->proxy is NULL again), 0 if
+// it waits for either socket and -1 if the connection has to be closed.
+int upstream_pump(struct conn *c);
+
+// c's deadline passed while it waits for its backend. Returns 0 if a 504
+// was queued and the connection closes after writing it, -1 if it has to
+// be closed right away.
+int upstream_timeout(struct conn *c);
+
+// Drop c's backend connection because c goes away
+void upstream_abort(struct conn *c);
+
+// Handle an epoll event of a backend socket. The client it concerns, if
+// any, is driven from upstream_ready() once the whole batch of events is
+// handled, since it may have events of its own in the same batch.
+void upstream_event(struct upstream_conn *u, uint32_t events);
+
+// The cache's mailbox eventfd, tagged with p, is readable: drive the
+// clients whose fetch to wait for is done
+void upstream_notify(struct upstream_pool *p);
+
+// The next client a backend event left something to do for, or NULL
+struct conn *upstream_ready(struct upstream_pool *p);
+
+// Free the backend connections closed during this batch of events
+void upstream_reap(struct upstream_pool *p);
+
+#endif
@@ -0,0 +1,1024 @@
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "accesslog.h"
+#include "conn.h"
+#include "http.h"
+#include "limit.h"
+#include "overload.h"
+#include "qsbr.h"
+#include "server.h"
+#include "static_files.h"
+#include "stream.h"
+#include "tls.h"
+
+#define URING_ENTRIES 1024
+
+// Provided receive buffers, shared by all connections of a worker. Each
+// holds at most what fits into an empty connection buffer.
+#define URING_BUFS 1024
+#define URING_BUF_SIZE BUFFER_SIZE
+#define URING_BUF_GROUP 0
+
+// The low bits of user_data say which operation completed; the rest is the
+// connection pointer. Operations of the loop itself carry no connection
+// but the slot of the listener they concern, if any (see loop_tag()).
+enum {
+    OP_ACCEPT,
+    OP_RECV,
+    OP_SEND,
+    OP_POLL,
+    OP_CLOSE,
+    OP_SHUTDOWN,
+    OP_CANCEL,
+    OP_TLS_POLL,
+};
+#define OP_MASK 7ULL
+
+struct uring {
+    int fd;
+    unsigned sq_entries;
+    _Atomic unsigned *sq_head;
+    _Atomic unsigned *sq_tail;
+    unsigned sq_mask;
+    struct io_uring_sqe *sqes;
+    unsigned sqe_tail;          // includes SQEs not yet handed to the kernel
+    _Atomic unsigned *cq_head;
+    _Atomic unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+};
+
+struct uring_loop {
+    struct worker *w;
+    struct uring ring;
+    struct timer_wheel timers;
+
+    struct io_uring_buf_ring *br;
+    uint16_t br_tail;
+    char *bufs;
+    int buf_next[URING_BUFS];   // stash chains through provided buffers
+    uint32_t buf_len[URING_BUFS];
+};
+
+static int uring_setup(struct uring *r, unsigned entries) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    // Completions are only processed when we ask for them, on our thread
+    p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL |
+              IORING_SETUP_COOP_TASKRUN | IORING_SETUP_SINGLE_ISSUER |
+              IORING_SETUP_DEFER_TASKRUN;
+    p.cq_entries = entries * 4;
+    r->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (r->fd < 0 && errno == EINVAL) {
+        // Older kernels
+        p.flags = IORING_SETUP_CQSIZE;
+        r->fd = syscall(__NR_io_uring_setup, entries, &p);
+    }
+    if (r->fd < 0) {
+        perror("webserver (io_uring_setup)");
+        return -1;
+    }
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) ||
+        !(p.features & IORING_FEAT_NODROP)) {
+        fprintf(stderr, "webserver: io_uring on this kernel is too old\n");
+        close(r->fd);
+        return -1;
+    }
+
+    size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    size_t size = sq_size > cq_size ? sq_size : cq_size;
+    char *rings = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (rings == MAP_FAILED) {
+        perror("webserver (mmap)");
+        close(r->fd);
+        return -1;
+    }
+    r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                   PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd,
+                   IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        perror("webserver (mmap)");
+        close(r->fd);
+        return -1;
+    }
+
+    r->sq_entries = p.sq_entries;
+    r->sq_head = (_Atomic unsigned *)(rings + p.sq_off.head);
+    r->sq_tail = (_Atomic unsigned *)(rings + p.sq_off.tail);
+    r->sq_mask = *(unsigned *)(rings + p.sq_off.ring_mask);
+    r->sqe_tail = 0;
+    // SQ slot i always refers to SQE i
+    unsigned *array = (unsigned *)(rings + p.sq_off.array);
+    for (unsigned i = 0; i < p.sq_entries; i++) {
+        array[i] = i;
+    }
+    r->cq_head = (_Atomic unsigned *)(rings + p.cq_off.head);
+    r->cq_tail = (_Atomic unsigned *)(rings + p.cq_off.tail);
+    r->cq_mask = *(unsigned *)(rings + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(rings + p.cq_off.cqes);
+    return 0;
+}
+
+// Hand queued SQEs to the kernel and optionally wait for a completion, for
+// at most timeout milliseconds unless timeout is negative
+static int uring_enter(struct uring *r, int wait, int timeout) {
+    atomic_store_explicit(r->sq_tail, r->sqe_tail, memory_order_release);
+    unsigned to_submit =
+        r->sqe_tail - atomic_load_explicit(r->sq_head, memory_order_acquire);
+
+    unsigned flags = 0;
+    void *arg = NULL;
+    size_t argsz = _NSIG / 8;
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg ext;
+    if (wait) {
+        flags |= IORING_ENTER_GETEVENTS;
+        if (timeout >= 0) {
+            ts.tv_sec = timeout / 1000;
+            ts.tv_nsec = (timeout % 1000) * 1000000LL;
+            memset(&ext, 0, sizeof(ext));
+            ext.sigmask_sz = _NSIG / 8;
+            ext.ts = (uint64_t)(uintptr_t)&ts;
+            flags |= IORING_ENTER_EXT_ARG;
+            arg = &ext;
+            argsz = sizeof(ext);
+        }
+    }
+    int ret = syscall(__NR_io_uring_enter, r->fd, to_submit, wait ? 1 : 0,
+                      flags, arg, argsz);
+    if (ret < 0 && errno != EINTR && errno != ETIME && errno != EBUSY) {
+        perror("webserver (io_uring_enter)");
+        return -1;
+    }
+    return 0;
+}
+
+static struct io_uring_sqe *uring_sqe(struct uring *r) {
+    unsigned head = atomic_load_explicit(r->sq_head, memory_order_acquire);
+    if (r->sqe_tail - head >= r->sq_entries) {
+        uring_enter(r, 0, -1);
+        head = atomic_load_explicit(r->sq_head, memory_order_acquire);
+        if (r->sqe_tail - head >= r->sq_entries) {
+            return NULL;
+        }
+    }
+    struct io_uring_sqe *sqe = &r->sqes[r->sqe_tail & r->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    r->sqe_tail++;
+    return sqe;
+}
+
+static uint64_t tag(struct conn *c, int op) {
+    return (uint64_t)(uintptr_t)c | op;
+}
+
+// No connection lives at the first few addresses, so those tag operations
+// on listener slots
+static uint64_t loop_tag(int slot, int op) {
+    return (uint64_t)slot << 3 | op;
+}
+
+// Get an SQE for an operation on c, counting it as in flight
+static struct io_uring_sqe *conn_sqe(struct uring_loop *l, struct conn *c,
+                                     int op) {
+    struct io_uring_sqe *sqe = uring_sqe(&l->ring);
+    if (sqe == NULL) {
+        fprintf(stderr, "webserver: io_uring submission queue full\n");
+        return NULL;
+    }
+    sqe->user_data = tag(c, op);
+    c->inflight++;
+    return sqe;
+}
+
+static int setup_buffers(struct uring_loop *l) {
+    size_t ring_size = URING_BUFS * sizeof(struct io_uring_buf);
+    l->br = mmap(NULL, ring_size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (l->br == MAP_FAILED) {
+        perror("webserver (mmap)");
+        return -1;
+    }
+    l->bufs = malloc((size_t)URING_BUFS * URING_BUF_SIZE);
+    if (l->bufs == NULL) {
+        perror("webserver (malloc)");
+        return -1;
+    }
+
+    struct io_uring_buf_reg reg = {
+        .ring_addr = (uint64_t)(uintptr_t)l->br,
+        .ring_entries = URING_BUFS,
+        .bgid = URING_BUF_GROUP,
+    };
+    if (syscall(__NR_io_uring_register, l->ring.fd, IORING_REGISTER_PBUF_RING,
+                &reg, 1) != 0) {
+        perror("webserver (io_uring_register)");
+        return -1;
+    }
+
+    for (int i = 0; i < URING_BUFS; i++) {
+        struct io_uring_buf *b = &l->br->bufs[i];
+        b->addr = (uint64_t)(uintptr_t)(l->bufs + (size_t)i * URING_BUF_SIZE);
+        b->len = URING_BUF_SIZE;
+        b->bid = i;
+    }
+    l->br_tail = URING_BUFS;
+    atomic_store_explicit((_Atomic uint16_t *)&l->br->tail, l->br_tail,
+                          memory_order_release);
+    return 0;
+}
+
+// Give a provided buffer back to the kernel
+static void buf_recycle(struct uring_loop *l, int bid) {
+    struct io_uring_buf *b = &l->br->bufs[l->br_tail & (URING_BUFS - 1)];
+    b->addr = (uint64_t)(uintptr_t)(l->bufs + (size_t)bid * URING_BUF_SIZE);
+    b->len = URING_BUF_SIZE;
+    b->bid = bid;
+    l->br_tail++;
+    atomic_store_explicit((_Atomic uint16_t *)&l->br->tail, l->br_tail,
+                          memory_order_release);
+}
+
+static void stash_push(struct uring_loop *l, struct conn *c, int bid,
+                       uint32_t len) {
+    l->buf_next[bid] = -1;
+    l->buf_len[bid] = len;
+    if (c->stash_tail >= 0) {
+        l->buf_next[c->stash_tail] = bid;
+    } else {
+        c->stash_head = bid;
+        c->stash_off = 0;
+    }
+    c->stash_tail = bid;
+}
+
+static void stash_pop(struct uring_loop *l, struct conn *c) {
+    int bid = c->stash_head;
+    c->stash_head = l->buf_next[bid];
+    if (c->stash_head < 0) {
+        c->stash_tail = -1;
+    }
+    c->stash_off = 0;
+    buf_recycle(l, bid);
+}
+
+// Move as much stashed input into the connection buffer as fits
+static int stash_drain(struct uring_loop *l, struct conn *c) {
+    if (c->stash_head >= 0 && conn_buffer_get(c) != 0) {
+        return -1;
+    }
+    while (c->stash_head >= 0 && c->len < c->cap) {
+        int bid = c->stash_head;
+        size_t avail = l->buf_len[bid] - c->stash_off;
+        size_t room = c->cap - c->len;
+        size_t n = avail < room ? avail : room;
+        memcpy(c->buffer + c->len,
+               l->bufs + (size_t)bid * URING_BUF_SIZE + c->stash_off, n);
+        c->len += n;
+        c->stash_off += n;
+        if (c->stash_off == l->buf_len[bid]) {
+            stash_pop(l, c);
+        }
+    }
+    return 0;
+}
+
+static void stash_clear(struct uring_loop *l, struct conn *c) {
+    while (c->stash_head >= 0) {
+        stash_pop(l, c);
+    }
+}
+
+static void arm_recv(struct uring_loop *l, struct conn *c) {
+    if (c->close_armed) {
+        // The linked close may already have run and the descriptor number
+        // been reused for a new connection
+        return;
+    }
+    struct io_uring_sqe *sqe = conn_sqe(l, c, OP_RECV);
+    if (sqe == NULL) {
+        return;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = c->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUF_GROUP;
+    c->recv_armed = 1;
+}
+
+// Wait for the socket on behalf of OpenSSL, which reads and writes it
+// itself: during the handshake, and for input when the kernel does not
+// decrypt it
+static void arm_tls_poll(struct uring_loop *l, struct conn *c) {
+    if (c->close_armed || c->tls_poll_armed) {
+        return;
+    }
+    struct io_uring_sqe *sqe = conn_sqe(l, c, OP_TLS_POLL);
+    if (sqe == NULL) {
+        return;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = c->fd;
+    sqe->poll32_events = tls_wants(c);
+    c->tls_poll_armed = 1;
+}
+
+// Decrypt as much input as fits into the connection buffer, for
+// connections whose input the kernel does not decrypt
+static int tls_fill(struct uring_loop *l, struct conn *c) {
+    if (conn_buffer_get(c) != 0) {
+        return -1;
+    }
+    while (c->len < c->cap && !c->eof) {
+        ssize_t n = tls_read(c, c->buffer + c->len, c->cap - c->len);
+        if (n > 0) {
+            c->len += n;
+            metric_add(&l->w->metrics.bytes_in, n);
+            continue;
+        }
+        if (n == 0 || errno == EIO || errno == EPROTO) {
+            // The end of the session, an alert or garbage
+            c->eof = 1;
+            break;
+        }
+        if (errno == EAGAIN || errno == EINTR) {
+            break;
+        }
+        metric_add(&l->w->metrics.errors[SYSCALL_READ], 1);
+        perror("webserver (read)");
+        return -1;
+    }
+    return 0;
+}
+
+static void cancel_op(struct uring_loop *l, struct conn *c, int op) {
+    struct io_uring_sqe *sqe = conn_sqe(l, c, OP_CANCEL);
+    if (sqe == NULL) {
+        return;
+    }
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = tag(c, op);
+}
+
+// Free the connection once the kernel is done with everything we asked
+static void conn_release(struct uring_loop *l, struct conn *c) {
+    if (!c->closing || c->inflight > 0) {
+        return;
+    }
+    stash_clear(l, c);
+    conn_discard(c);
+    slab_free(&l->w->conns, c);
+}
+
+static void conn_close(struct uring_loop *l, struct conn *c) {
+    if (c->closing) {
+        return;
+    }
+    c->closing = 1;
+    TRACE1(close, c->fd);
+    timer_cancel(&l->timers, &c->timer);
+
+    if (c->recv_armed) {
+        cancel_op(l, c, OP_RECV);
+    }
+    if (c->send_armed) {
+        cancel_op(l, c, OP_SEND);
+    }
+    if (c->poll_armed) {
+        cancel_op(l, c, OP_POLL);
+    }
+    if (c->tls_poll_armed) {
+        cancel_op(l, c, OP_TLS_POLL);
+    }
+    // A close linked behind a cancelled send fails with -ECANCELED and
+    // closes the descriptor from its completion. A linked shutdown looks
+    // the descriptor up only when it runs, so closing it now could shut
+    // down whichever connection is accepted next under the same number;
+    // its completion closes the descriptor instead.
+    if (!c->close_armed && !c->shutdown_armed) {
+        close(c->fd);
+    }
+    conn_release(l, c);
+}
+
+// A multishot accept has no per-connection address buffer; conn_peer()
+// asks for the address if it is ever needed
+static void arm_accept(struct uring_loop *l, int slot) {
+    struct io_uring_sqe *sqe = uring_sqe(&l->ring);
+    if (sqe == NULL) {
+        return;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = l->w->listen_fd[slot];
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = loop_tag(slot, OP_ACCEPT);
+}
+
+static void conn_drive(struct uring_loop *l, struct conn *c);
+
+// Wait until the socket takes more, for writes we make ourselves
+static int arm_write_poll(struct uring_loop *l, struct conn *c, short events) {
+    struct io_uring_sqe *sqe = conn_sqe(l, c, OP_POLL);
+    if (sqe == NULL) {
+        conn_close(l, c);
+        return -1;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = c->fd;
+    sqe->poll32_events = events;
+    c->poll_armed = 1;
+    conn_pin(c);
+    return 0;
+}
+
+// Start writing the queue. Memory segments go out as one linked SENDMSG;
+// file segments are sent with sendfile() right away, with a POLL_ADD to
+// wait for the socket when it is full. The last send of a connection that
+// is to be closed carries a linked CLOSE, or a SHUTDOWN when there may be
+// unread input so the close does not turn into a RST. TLS connections the
+// kernel does not encrypt for are written by OpenSSL, like sendfile().
+static void submit_send(struct uring_loop *l, struct conn *c) {
+    while (c->iovpos < c->iovcnt) {
+        int i = c->iovpos;
+        if (tls_user_tx(c)) {
+            ssize_t n = tls_write(c);
+            if (n >= 0) {
+                conn_written(c, n);
+                continue;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN) {
+                arm_write_poll(l, c, tls_wants(c));
+                return;
+            }
+            metric_add(&l->w->metrics.errors[SYSCALL_WRITE], 1);
+            perror("webserver (write)");
+            conn_close(l, c);
+            return;
+        }
+        if (c->iov[i].iov_base == NULL) {
+            off_t off = c->file[i].off;
+            ssize_t n =
+                sendfile(c->fd, c->file[i].fd, &off, c->iov[i].iov_len);
+            if (n > 0) {
+                conn_written(c, n);
+                continue;
+            }
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                arm_write_poll(l, c, POLLOUT);
+                return;
+            }
+            if (n < 0) {
+                metric_add(&l->w->metrics.errors[SYSCALL_SENDFILE], 1);
+                perror("webserver (sendfile)");
+            }
+            conn_close(l, c);
+            return;
+        }
+
+        int end = i;
+        while (end < c->iovcnt && c->iov[end].iov_base != NULL) {
+            end++;
+        }
+        memset(&c->msg, 0, sizeof(c->msg));
+        c->msg.msg_iov = c->iov + i;
+        c->msg.msg_iovlen = end - i;
+
+        struct io_uring_sqe *sqe = conn_sqe(l, c, OP_SEND);
+        if (sqe == NULL) {
+            conn_close(l, c);
+            return;
+        }
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = c->fd;
+        sqe->addr = (uint64_t)(uintptr_t)&c->msg;
+        sqe->len = 1;
+        // MSG_WAITALL makes the kernel retry short sends, so a linked close
+        // only runs once everything went out
+        sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL |
+                         (end < c->iovcnt ? MSG_MORE : 0);
+        c->send_armed = 1;
+        // The kernel reads the queued data after we went offline
+        conn_pin(c);
+
+        if (end == c->iovcnt && c->close_after_write) {
+            int unread = c->len > 0 || c->stash_head >= 0 || !c->eof;
+            sqe->flags |= IOSQE_IO_LINK;
+            struct io_uring_sqe *next =
+                conn_sqe(l, c, unread ? OP_SHUTDOWN : OP_CLOSE);
+            if (next == NULL) {
+                return;
+            }
+            next->fd = c->fd;
+            if (unread) {
+                next->opcode = IORING_OP_SHUTDOWN;
+                next->len = SHUT_WR;
+                c->shutdown_armed = 1;
+            } else {
+                next->opcode = IORING_OP_CLOSE;
+                c->close_armed = 1;
+            }
+        }
+        return;
+    }
+
+    if (c->close_after_write) {
+        // Everything went out with sendfile() or OpenSSL; finish like a
+        // linked close
+        tls_close_notify(c);
+        if (shutdown(c->fd, SHUT_WR) != 0 || c->eof) {
+            conn_close(l, c);
+            return;
+        }
+        c->lingering = 1;
+    }
+}
+
+static void conn_drive(struct uring_loop *l, struct conn *c) {
+    if (c->closing) {
+        return;
+    }
+    if (c->lingering) {
+        // Our side is shut down; discard input until the peer closes
+        stash_clear(l, c);
+        c->len = 0;
+        conn_buffer_release(c);
+        if (tls_user_rx(c) && !c->eof) {
+            // Nobody receives for us; the records need no decrypting
+            char discard[4096];
+            ssize_t n;
+            while ((n = read(c->fd, discard, sizeof(discard))) > 0) {
+            }
+            if (n == 0 || (errno != EAGAIN && errno != EINTR)) {
+                c->eof = 1;
+            } else {
+                c->tls_want_write = 0;
+                arm_tls_poll(l, c);
+            }
+        }
+        if (c->eof) {
+            conn_close(l, c);
+        }
+        return;
+    }
+    if (c->tls_handshake) {
+        int done = tls_handshake(c);
+        if (done < 0) {
+            conn_close(l, c);
+            return;
+        }
+        if (done == 0) {
+            arm_tls_poll(l, c);
+            return;
+        }
+        if (!tls_user_rx(c)) {
+            // The kernel decrypts, so receiving works like for plain TCP
+            arm_recv(l, c);
+        }
+    }
+
+    for (;;) {
+        while (!c->close_after_write) {
+            int err = tls_user_rx(c) ? tls_fill(l, c) : stash_drain(l, c);
+            if (err != 0) {
+                conn_close(l, c);
+                return;
+            }
+            if (http_process(c) == 0) {
+                break;
+            }
+        }
+        if (c->send_armed || c->poll_armed) {
+            break;
+        }
+        if (c->iovpos < c->iovcnt) {
+            // File data may go out right away, making room for more
+            // pipelined requests
+            submit_send(l, c);
+            if (c->closing) {
+                return;
+            }
+            continue;
+        }
+        if (c->stream != NULL) {
+            int more = stream_pump(c);
+            if (more < 0) {
+                conn_close(l, c);
+                return;
+            }
+            if (c->iovcnt == 0 && c->close_after_write) {
+                // A body delimited by the close ended with nothing left to
+                // send; finish like after the last send
+                submit_send(l, c);
+                if (c->closing) {
+                    return;
+                }
+                break;
+            }
+            if (more > 0) {
+                continue;
+            }
+        }
+        if (c->eof) {
+            conn_close(l, c);
+            return;
+        }
+        if (c->len == c->cap && c->cap > 0 && !c->close_after_write) {
+            // The request head does not fit into the buffer
+            if (conn_buffer_grow(c) != 0) {
+                conn_close(l, c);
+                return;
+            }
+            continue;
+        }
+        break;
+    }
+    conn_buffer_release(c);
+
+    if (tls_user_rx(c)) {
+        // A wakeup with nothing to read is harmless; one that never comes
+        // would stall the connection
+        if (!c->eof && !c->tls_poll_armed) {
+            arm_tls_poll(l, c);
+        }
+        return;
+    }
+
+    // Stop the kernel from receiving for us while we cannot keep up; the
+    // socket buffer then pushes back on the client like it does with epoll
+    if (c->stash_head >= 0 && !c->recv_paused) {
+        c->recv_paused = 1;
+        if (c->recv_armed) {
+            cancel_op(l, c, OP_RECV);
+        }
+    } else if (c->stash_head < 0 && c->recv_paused) {
+        c->recv_paused = 0;
+        if (!c->recv_armed && !c->eof) {
+            arm_recv(l, c);
+        }
+    }
+}
+
+static void on_accept(struct uring_loop *l, struct io_uring_cqe *cqe,
+                      int slot) {
+    if (l->w->draining) {
+        if (cqe->res == -ECANCELED) {
+            return;
+        }
+    } else if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        arm_accept(l, slot);
+    }
+    if (cqe->res < 0) {
+        metric_add(&l->w->metrics.errors[SYSCALL_ACCEPT], 1);
+        errno = -cqe->res;
+        perror("webserver (accept)");
+        return;
+    }
+    // A multishot accept cannot be held back without cancelling it, so
+    // overload always sheds with the 503 here
+    if (overload_shedding(l->w)) {
+        overload_reject(l->w, cqe->res);
+        return;
+    }
+    struct conn *c = slab_alloc(&l->w->conns);
+    if (c == NULL) {
+        close(cqe->res);
+        return;
+    }
+    memset(c, 0, sizeof(*c));
+    c->fd = cqe->res;
+    c->w = l->w;
+    c->stash_head = c->stash_tail = -1;
+    TRACE2(accept, c->fd, l->w->id);
+    if (config.log_timing) {
+        c->accept_tsc = trace_clock();
+    }
+    metric_add(&l->w->metrics.accepts, 1);
+    c->last_active = l->w->now;
+    // Per-client limits cost a getpeername() here
+    if (limit_accept(c) != 0) {
+        metric_add(&l->w->metrics.limit_refused, 1);
+        close(c->fd);
+        slab_free(&l->w->conns, c);
+        return;
+    }
+    if (config.log_level >= LOG_DEBUG) {
+        accesslog_accept(l->w, conn_peer(c));
+    }
+    if (config.tls_cert != NULL) {
+        if (tls_accept(c) != 0) {
+            limit_release(c);
+            close(c->fd);
+            slab_free(&l->w->conns, c);
+            return;
+        }
+        // The handshake has the same deadline as a request; it starts
+        // right away, the client hello is usually there already
+        conn_schedule(&l->timers, c, 1);
+        conn_drive(l, c);
+        return;
+    }
+    conn_schedule(&l->timers, c, 0);
+    arm_recv(l, c);
+}
+
+static void on_recv(struct uring_loop *l, struct conn *c,
+                    struct io_uring_cqe *cqe) {
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        c->recv_armed = 0;
+        c->inflight--;
+    }
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        if (cqe->res > 0 && !c->closing) {
+            TRACE2(read, c->fd, cqe->res);
+            if (config.log_timing) {
+                conn_read_stamp(c, c->len == 0 && c->stash_head < 0);
+            }
+            stash_push(l, c, bid, cqe->res);
+        } else {
+            buf_recycle(l, bid);
+        }
+    }
+    if (c->closing) {
+        return;
+    }
+
+    if (cqe->res == 0) {
+        c->eof = 1;
+    } else if (cqe->res < 0 && cqe->res != -ENOBUFS &&
+               cqe->res != -ECANCELED) {
+        metric_add(&l->w->metrics.errors[SYSCALL_READ], 1);
+        conn_close(l, c);
+        return;
+    }
+    if (cqe->res > 0) {
+        metric_add(&l->w->metrics.bytes_in, cqe->res);
+        c->last_active = l->w->now;
+    }
+
+    conn_drive(l, c);
+    if (!c->closing && !c->recv_armed && !c->recv_paused && !c->eof) {
+        arm_recv(l, c);
+    }
+}
+
+static void on_send(struct uring_loop *l, struct conn *c,
+                    struct io_uring_cqe *cqe) {
+    c->send_armed = 0;
+    c->inflight--;
+    if (c->closing) {
+        return;
+    }
+    if (cqe->res < 0) {
+        if (cqe->res != -ECANCELED) {
+            metric_add(&l->w->metrics.errors[SYSCALL_WRITE], 1);
+            errno = -cqe->res;
+            perror("webserver (write)");
+        }
+        conn_close(l, c);
+        return;
+    }
+    TRACE2(write, c->fd, cqe->res);
+    conn_written(c, cqe->res);
+    c->last_active = l->w->now;
+    if (!c->close_armed) {
+        conn_drive(l, c);
+    }
+}
+
+// Wait for the main thread to ask us to drain
+static void arm_wake(struct uring_loop *l) {
+    struct io_uring_sqe *sqe = uring_sqe(&l->ring);
+    if (sqe == NULL) {
+        return;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = l->w->wakefd;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = loop_tag(0, OP_POLL);
+}
+
+// Stop accepting and let the open connections finish, like the epoll
+// backend: every response from now on closes its connection, and idle
+// connections are shut down right away
+static void drain_start(struct uring_loop *l) {
+    uint64_t value;
+    if (read(l->w->wakefd, &value, sizeof(value)) < 0 || l->w->draining) {
+        return;
+    }
+    l->w->draining = 1;
+    // A multishot accept holds on to its listener however we close it
+    for (int i = 0; i < l->w->nlisten; i++) {
+        struct io_uring_sqe *sqe = uring_sqe(&l->ring);
+        if (sqe != NULL) {
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->addr = loop_tag(i, OP_ACCEPT);
+            sqe->user_data = loop_tag(0, OP_CANCEL);
+        }
+        close(l->w->listen_fd[i]);
+    }
+    l->w->nlisten = 0;
+    timer_expire_all(&l->timers);
+}
+
+static void on_cqe(struct uring_loop *l, struct io_uring_cqe *cqe) {
+    int op = cqe->user_data & OP_MASK;
+    uint64_t ptr = cqe->user_data & ~OP_MASK;
+    if (ptr < loop_tag(LISTEN_MAX, 0)) {
+        // Operations of the loop itself rather than of a connection
+        if (op == OP_ACCEPT) {
+            on_accept(l, cqe, (int)(ptr >> 3));
+        } else if (op == OP_POLL) {
+            drain_start(l);
+        }
+        return;
+    }
+    struct conn *c = (struct conn *)(uintptr_t)ptr;
+
+    // Keep the connection alive while its handlers run, however many of
+    // them decide to close it
+    c->inflight++;
+    switch (op) {
+    case OP_RECV:
+        on_recv(l, c, cqe);
+        break;
+    case OP_SEND:
+        on_send(l, c, cqe);
+        break;
+    case OP_POLL:
+        c->poll_armed = 0;
+        c->inflight--;
+        if (!c->closing) {
+            c->last_active = l->w->now;
+            conn_drive(l, c);
+        }
+        break;
+    case OP_CLOSE:
+        c->inflight--;
+        if (cqe->res == -ECANCELED) {
+            close(c->fd);
+        }
+        c->close_armed = 0;
+        if (!c->closing) {
+            c->closing = 1;
+            timer_cancel(&l->timers, &c->timer);
+            if (c->recv_armed) {
+                cancel_op(l, c, OP_RECV);
+            }
+        }
+        break;
+    case OP_SHUTDOWN:
+        c->inflight--;
+        c->shutdown_armed = 0;
+        if (c->closing) {
+            close(c->fd);
+            break;
+        }
+        if (cqe->res < 0) {
+            conn_close(l, c);
+        } else {
+            c->lingering = 1;
+            conn_drive(l, c);
+        }
+        break;
+    case OP_CANCEL:
+        c->inflight--;
+        break;
+    case OP_TLS_POLL:
+        c->tls_poll_armed = 0;
+        c->inflight--;
+        if (!c->closing) {
+            c->last_active = l->w->now;
+            conn_drive(l, c);
+        }
+        break;
+    }
+    if (!c->closing) {
+        conn_schedule(&l->timers, c,
+                      c->len > 0 || c->stash_head >= 0 || c->tls_handshake);
+    }
+    c->inflight--;
+    conn_release(l, c);
+}
+
+// Shut down our side of an idle connection while draining and discard
+// input until the peer closes, as after a response with Connection: close
+static void conn_retire(struct uring_loop *l, struct conn *c) {
+    if (conn_input_pending(c)) {
+        // The receive that picks it up drives the connection
+        conn_schedule(&l->timers, c, 1);
+        return;
+    }
+    tls_close_notify(c);
+    if (shutdown(c->fd, SHUT_WR) != 0 || c->eof) {
+        conn_close(l, c);
+        return;
+    }
+    c->lingering = 1;
+    conn_schedule(&l->timers, c, 0);
+}
+
+// Close the connections whose deadline passed and return how long we may
+// wait for completions. While draining, idle connections are shut down
+// gracefully as soon as their timer comes up.
+static int expire_timers(struct uring_loop *l) {
+    struct timer *t;
+    while ((t = timer_expired(&l->timers, l->w->now)) != NULL) {
+        struct conn *c =
+            (struct conn *)((char *)t - offsetof(struct conn, timer));
+        if (l->w->draining && conn_idle(c) && c->stash_head < 0 &&
+            !c->send_armed && !c->poll_armed && !c->close_armed &&
+            !c->shutdown_armed) {
+            conn_retire(l, c);
+        } else if (t->expires > l->w->now) {
+            // Woken early by drain_start(); it still has time
+            timer_set(&l->timers, t, t->expires);
+        } else {
+            conn_close(l, c);
+        }
+    }
+    return timer_timeout(&l->timers);
+}
+
+int run_uring(struct worker *w) {
+    struct uring_loop *l = calloc(1, sizeof(*l));
+    if (l == NULL) {
+        perror("webserver (calloc)");
+        return 1;
+    }
+    l->w = w;
+    timer_wheel_init(&l->timers, monotonic_ms());
+
+    if (config.root != NULL) {
+        w->files = static_cache_new();
+        if (w->files == NULL) {
+            return 1;
+        }
+    }
+    if (uring_setup(&l->ring, URING_ENTRIES) != 0 || setup_buffers(l) != 0) {
+        return 1;
+    }
+    for (int i = 0; i < w->nlisten; i++) {
+        arm_accept(l, i);
+    }
+    arm_wake(l);
+
+    for (;;) {
+        w->now = monotonic_ms();
+        int timeout = expire_timers(l);
+        if (w->draining && w->conns.in_use == 0) {
+            qsbr_offline(w->id);
+            close(l->ring.fd);
+            free(l->bufs);
+            free(l);
+            return 0;
+        }
+
+        // Sleeping counts as a quiescent state: everything the kernel
+        // still reads from was pinned when it was submitted
+        qsbr_offline(w->id);
+        int err = uring_enter(&l->ring, 1, timeout);
+        qsbr_online(w->id);
+        if (err != 0) {
+            return 1;
+        }
+
+        w->now = monotonic_ms();
+        uint64_t start = metric_clock();
+        unsigned head = atomic_load_explicit(l->ring.cq_head,
+                                             memory_order_relaxed);
+        unsigned tail = atomic_load_explicit(l->ring.cq_tail,
+                                             memory_order_acquire);
+        for (; head != tail; head++) {
+            on_cqe(l, &l->ring.cqes[head & l->ring.cq_mask]);
+        }
+        atomic_store_explicit(l->ring.cq_head, head, memory_order_release);
+
+        uint64_t lag = metric_clock() - start;
+        metric_observe(&w->metrics.latency[LATENCY_LOOP], lag);
+        overload_lag(w, lag);
+    }
+}
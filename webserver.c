@@ -1,87 +1,137 @@
+#define _GNU_SOURCE
 #include <arpa/inet.h>
 #include <errno.h>
+#include <signal.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/time.h>
 #include <unistd.h>
 
-#define PORT 8080
-#define BUFFER_SIZE 1024
+#include "config.h"
+#include "hpack.h"
+#include "http.h"
+#include "http_parser.h"
+#include "overload.h"
+#include "pack.h"
+#include "reload.h"
+#include "server.h"
+#include "sockopt.h"
+#include "static_files.h"
+#include "tls.h"
 
-int main() {
-    char buffer[BUFFER_SIZE];
-    char resp[] = "HTTP/1.0 200 OK\r\n"
-                  "Server: webserver-c\r\n"
-                  "Content-type: text/html\r\n\r\n"
-                  "<html>hello, world</html>\r\n";
+const char resp[] = "HTTP/1.0 200 OK\r\n"
+                    "Server: webserver-c\r\n"
+                    "Content-type: text/html\r\n\r\n"
+                    "<html>hello, world</html>\r\n";
 
-    // Create a socket
-    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (sockfd == -1) {
-        perror("webserver (socket)");
-        return 1;
-    }
-    printf("socket created successfully\n");
+static const char resp_too_large[] =
+    "HTTP/1.0 431 Request Header Fields Too Large\r\n"
+    "Server: webserver-c\r\n"
+    "Content-type: text/html\r\n\r\n"
+    "<html>request too large</html>\r\n";
 
-    // Create the address to bind the socket to
-    struct sockaddr_in host_addr;
-    int host_addrlen = sizeof(host_addr);
+// The blocking baseline logs synchronously; the workers go through the
+// access log rings instead
+static void log_request(const struct http_request *req,
+                        const union sock_addr *addr) {
+    if (config.log_level < LOG_INFO) {
+        return;
+    }
+    char peer[ADDR_STRLEN];
+    addr_format(addr, peer);
+    printf("[%s] %.*s %.*s %.*s\n", peer, (int)req->method.len,
+           req->method.ptr, (int)req->version.len, req->version.ptr,
+           (int)req->uri.len, req->uri.ptr);
+}
 
-    host_addr.sin_family = AF_INET;
-    host_addr.sin_port = htons(PORT);
-    host_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+// Bound every read and write on s, so a client that stops sending or
+// receiving cannot hold the only connection forever
+static int set_timeouts(int s) {
+    struct timeval rcv = {.tv_sec = config.read_timeout};
+    struct timeval snd = {.tv_sec = config.write_timeout};
+    if (setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &rcv, sizeof(rcv)) != 0 ||
+        setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, &snd, sizeof(snd)) != 0) {
+        perror("webserver (setsockopt SO_RCVTIMEO)");
+        return -1;
+    }
+    return 0;
+}
 
-    // Create client address
-    struct sockaddr_in client_addr;
-    int client_addrlen = sizeof(client_addr);
+#define READ_GONE -2
 
-    // Bind the socket to the address
-    if (bind(sockfd, (struct sockaddr *)&host_addr, host_addrlen) != 0) {
-        perror("webserver (bind)");
-        return 1;
+// Read until the request head is complete. Returns what http_parse() does,
+// with HTTP_PARSE_AGAIN meaning the head does not fit into len bytes, or
+// READ_GONE if the client went away or timed out.
+static int read_request(int s, char *buffer, size_t len,
+                        struct http_parser *parser, struct http_request *req) {
+    size_t got = 0;
+    http_parser_init(parser);
+    while (got < len) {
+        ssize_t n = read(s, buffer + got, len - got);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("webserver (read)");
+            }
+            return READ_GONE;
+        }
+        if (n == 0) {
+            return READ_GONE;
+        }
+        got += (size_t)n;
+        int parsed = http_parse(parser, buffer, got, req);
+        if (parsed != HTTP_PARSE_AGAIN) {
+            return parsed;
+        }
     }
-    printf("socket successfully bound to address\n");
+    return 0;
+}
 
-    // Listen for incoming connections
-    if (listen(sockfd, SOMAXCONN) != 0) {
-        perror("webserver (listen)");
-        return 1;
-    }
-    printf("server listening for connections\n");
+// The original one-connection-at-a-time loop, kept as a baseline
+static int run_blocking(int sockfd) {
+    static char buffer[BUFFER_MAX_SIZE];
 
     for (;;) {
-        // Accept incoming connections
-        int newsockfd = accept(sockfd, (struct sockaddr *)&host_addr,
-                               (socklen_t *)&host_addrlen);
+        // Accept incoming connections, learning the client's address on
+        // the way
+        union sock_addr client_addr;
+        socklen_t client_addrlen = sizeof(client_addr);
+        int newsockfd = accept4(sockfd, &client_addr.sa, &client_addrlen,
+                                SOCK_CLOEXEC);
         if (newsockfd < 0) {
             perror("webserver (accept)");
             continue;
         }
-        printf("connection accepted\n");
-
-        // Get client address
-        int sockn = getsockname(newsockfd, (struct sockaddr *)&client_addr,
-                                (socklen_t *)&client_addrlen);
-        if (sockn < 0) {
-            perror("webserver (getsockname)");
-            continue;
+        if (config.log_level >= LOG_DEBUG) {
+            printf("connection accepted\n");
         }
 
-        // Read from the socket
-        int valread = read(newsockfd, buffer, BUFFER_SIZE);
-        if (valread < 0) {
-            perror("webserver (read)");
+        if (set_timeouts(newsockfd) != 0) {
+            close(newsockfd);
             continue;
         }
 
         // Read the request
-        char method[BUFFER_SIZE], uri[BUFFER_SIZE], version[BUFFER_SIZE];
-        sscanf(buffer, "%s %s %s", method, uri, version);
-        printf("[%s:%u] %s %s %s\n", inet_ntoa(client_addr.sin_addr),
-               ntohs(client_addr.sin_port), method, version, uri);
+        struct http_parser parser;
+        struct http_request req;
+        int parsed = read_request(newsockfd, buffer, config.max_header_size,
+                                  &parser, &req);
+        if (parsed == READ_GONE) {
+            close(newsockfd);
+            continue;
+        }
+        const char *reply = resp;
+        if (parsed > 0) {
+            log_request(&req, &client_addr);
+        } else if (parsed == HTTP_PARSE_AGAIN) {
+            reply = resp_too_large;
+        }
 
         // Write to the socket
-        int valwrite = write(newsockfd, resp, strlen(resp));
+        int valwrite = write(newsockfd, reply, strlen(reply));
         if (valwrite < 0) {
             perror("webserver (write)");
             continue;
@@ -92,3 +142,114 @@ int main() {
 
     return 0;
 }
+
+int create_listener(const struct listen_addr *a, int reuseport) {
+    // Create a socket; a new process started for a reload gets it handed
+    // over explicitly rather than by inheritance
+    union sock_addr addr = a->addr;
+    int sockfd = socket(addr.sa.sa_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sockfd == -1 && errno == EAFNOSUPPORT && a->dual_stack) {
+        // A kernel without IPv6 still serves IPv4 on the wildcard address
+        memset(&addr, 0, sizeof(addr));
+        addr.in.sin_family = AF_INET;
+        addr.in.sin_port = a->addr.in6.sin6_port;
+        addr.in.sin_addr.s_addr = htonl(INADDR_ANY);
+        sockfd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    }
+    if (sockfd == -1) {
+        perror("webserver (socket)");
+        return -1;
+    }
+
+    // Restarting must not wait for connections of the last run to leave
+    // TIME_WAIT
+    int one = 1;
+    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) != 0) {
+        perror("webserver (setsockopt SO_REUSEADDR)");
+        close(sockfd);
+        return -1;
+    }
+    if (reuseport) {
+        if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &one,
+                       sizeof(one)) != 0) {
+            perror("webserver (setsockopt SO_REUSEPORT)");
+            close(sockfd);
+            return -1;
+        }
+    }
+    // Spelled out either way: the default comes from net.ipv6.bindv6only
+    int v6only = !a->dual_stack;
+    if (addr.sa.sa_family == AF_INET6 &&
+        setsockopt(sockfd, IPPROTO_IPV6, IPV6_V6ONLY, &v6only,
+                   sizeof(v6only)) != 0) {
+        perror("webserver (setsockopt IPV6_V6ONLY)");
+        close(sockfd);
+        return -1;
+    }
+    sockopt_apply(sockfd);
+
+    // Bind the socket to the address
+    if (bind(sockfd, &addr.sa, addr_len(&addr)) != 0) {
+        char name[ADDR_STRLEN];
+        addr_format(&addr, name);
+        fprintf(stderr, "webserver (bind %s): %s\n", name, strerror(errno));
+        close(sockfd);
+        return -1;
+    }
+
+    // Listen for incoming connections
+    if (sockopt_listen(sockfd) != 0) {
+        close(sockfd);
+        return -1;
+    }
+
+    return sockfd;
+}
+
+int main(int argc, char *argv[]) {
+    if (reload_init(argv) != 0) {
+        return 1;
+    }
+    if (config_parse(&config, argc, argv) != 0) {
+        return 1;
+    }
+
+    // A client going away mid-response must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+
+    if (config.make_pack != NULL) {
+        if (config.root == NULL) {
+            fprintf(stderr, "webserver: --make-pack needs --root\n");
+            return 1;
+        }
+        return pack_build(config.root, config.make_pack) != 0;
+    }
+
+    if (config.mode == MODE_EPOLL) {
+        hpack_init();
+        if (http_init() != 0 || overload_init() != 0) {
+            return 1;
+        }
+        if (config.root != NULL && static_init(config.root) != 0) {
+            return 1;
+        }
+        if (config.pack != NULL && pack_open(config.pack) != 0) {
+            return 1;
+        }
+        if (config.tls_cert != NULL &&
+            tls_init(config.tls_cert, config.tls_key) != 0) {
+            return 1;
+        }
+        return run_workers(config.workers);
+    }
+
+    int sockfd = create_listener(&config.listen[0], 0);
+    if (sockfd < 0) {
+        return 1;
+    }
+    printf("server listening for connections on ");
+    print_listeners(&sockfd, 1);
+    printf("\n");
+    sockopt_report(sockfd);
+    return run_blocking(sockfd);
+}
@@ -0,0 +1,373 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "accesslog.h"
+#include "compress.h"
+#include "config.h"
+#include "conn.h"
+#include "http.h"
+#include "offload.h"
+#include "pack.h"
+#include "qsbr.h"
+#include "reload.h"
+#include "server.h"
+#include "sockopt.h"
+#include "topology.h"
+#include "upstream.h"
+#include "ws.h"
+
+uint64_t monotonic_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int default_workers(void) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+}
+
+// Return the nth CPU (modulo the set size) we are allowed to run on, or -1
+static int nth_allowed_cpu(const cpu_set_t *set, int n) {
+    int count = CPU_COUNT(set);
+    if (count == 0) {
+        return -1;
+    }
+    n %= count;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, set) && n-- == 0) {
+            return cpu;
+        }
+    }
+    return -1;
+}
+
+static void *worker_main(void *arg) {
+    struct worker *w = arg;
+
+    if (w->cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(w->cpu, &set);
+        int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if (err != 0) {
+            fprintf(stderr, "webserver (pthread_setaffinity_np): %s\n",
+                    strerror(err));
+            w->cpu = -1;
+        }
+    }
+    printf("worker %d running on cpu %d\n", w->id, w->cpu);
+    fflush(stdout);
+
+    // Pinned first, so what the pools allocate and touch from here on is
+    // on the worker's own node
+    slab_init(&w->conns, sizeof(struct conn), 256);
+    buf_pool_init(&w->bufs);
+    // Without a compressor responses simply go out uncompressed
+    w->zip = compressor_new(COMPRESS_FAST);
+    http_worker_init(w);
+
+    if (config.io == IO_URING) {
+        run_uring(w);
+    } else {
+        run_epoll(w);
+    }
+    return NULL;
+}
+
+// Ask every worker to drain and wait until they did, or the drain timeout
+// passed
+static void drain(struct worker *workers, int nworkers) {
+    printf("draining connections for up to %d seconds\n",
+           config.drain_timeout);
+    fflush(stdout);
+    uint64_t one = 1;
+    for (int i = 0; i < nworkers; i++) {
+        if (write(workers[i].wakefd, &one, sizeof(one)) < 0) {
+            perror("webserver (write eventfd)");
+        }
+    }
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += config.drain_timeout;
+    for (int i = 0; i < nworkers; i++) {
+        if (pthread_timedjoin_np(workers[i].thread, NULL, &deadline) != 0) {
+            fprintf(stderr, "webserver: drain timeout, closing the "
+                    "remaining connections\n");
+            return;
+        }
+    }
+}
+
+// Read the config file again and swap in the routes it has now
+static void reload_config(void) {
+    struct server_config next;
+    if (config_reread(&next) != 0 || http_reload(&next) != 0) {
+        fprintf(stderr, "webserver: keeping the previous configuration\n");
+    } else {
+        printf("reloaded %s with %d routes; other changes take a restart "
+               "(SIGUSR2)\n", config.config_file, next.nroutes);
+        fflush(stdout);
+    }
+    config_free(&next);
+}
+
+// The main thread's part once the workers run: wait for the signals that
+// end this process. SIGUSR2, and SIGHUP without --config, start a new
+// server on our listeners and drain once it serves; SIGQUIT just drains.
+// SIGHUP with --config rereads the file and swaps in its routes. SIGUSR1
+// swaps in the pack at the --pack path again, e.g. after pack_build()
+// replaced it.
+static void wait_signals(struct worker *workers, int nworkers,
+                         const sigset_t *signals) {
+    for (;;) {
+        int sig;
+        if (sigwait(signals, &sig) != 0 || sig == SIGQUIT) {
+            break;
+        }
+        if (sig == SIGUSR1) {
+            if (config.pack == NULL) {
+                fprintf(stderr, "webserver: SIGUSR1 without --pack\n");
+            } else if (pack_open(config.pack) != 0) {
+                fprintf(stderr, "webserver: keeping the previous pack\n");
+            }
+            continue;
+        }
+        if (sig == SIGHUP && config.config_file != NULL) {
+            reload_config();
+            continue;
+        }
+        printf("reloading: starting a new server process\n");
+        fflush(stdout);
+        int fds[nworkers * LISTEN_MAX];
+        int n = 0;
+        for (int i = 0; i < nworkers; i++) {
+            for (int j = 0; j < workers[i].nlisten; j++) {
+                fds[n++] = workers[i].listen_fd[j];
+            }
+        }
+        if (reload_spawn(fds, n) == 0) {
+            break;
+        }
+        fprintf(stderr, "webserver: reload failed, still serving\n");
+    }
+    drain(workers, nworkers);
+}
+
+// Sort listeners we were handed by the address they are bound to: group[i]
+// becomes the index of fds[i]'s address, size[] counts the listeners of
+// each. Every worker listens on every address, so a SO_REUSEPORT group
+// per address survives a reload intact. Returns the number of addresses.
+static int group_inherited(const int *fds, int n, int *group, int *size) {
+    union sock_addr addrs[LISTEN_MAX];
+    int naddrs = 0;
+    for (int i = 0; i < n; i++) {
+        union sock_addr a;
+        socklen_t len = sizeof(a);
+        memset(&a, 0, sizeof(a));
+        if (getsockname(fds[i], &a.sa, &len) != 0) {
+            perror("webserver (getsockname)");
+            return -1;
+        }
+        int g = 0;
+        while (g < naddrs && memcmp(&addrs[g], &a, sizeof(a)) != 0) {
+            g++;
+        }
+        if (g == naddrs) {
+            if (naddrs == LISTEN_MAX) {
+                fprintf(stderr, "webserver: listeners on more than %d "
+                        "addresses were handed over\n", LISTEN_MAX);
+                return -1;
+            }
+            addrs[naddrs] = a;
+            size[naddrs++] = 0;
+        }
+        group[i] = g;
+        size[g]++;
+    }
+    return naddrs;
+}
+
+// The kth listener of group g
+static int nth_inherited(const int *fds, int n, const int *group, int g,
+                         int k) {
+    for (int i = 0; i < n; i++) {
+        if (group[i] == g && k-- == 0) {
+            return fds[i];
+        }
+    }
+    return -1;
+}
+
+void print_listeners(const int *fds, int n) {
+    for (int i = 0; i < n; i++) {
+        union sock_addr a;
+        socklen_t len = sizeof(a);
+        int v6only = 1;
+        socklen_t optlen = sizeof(v6only);
+        char name[ADDR_STRLEN];
+        if (getsockname(fds[i], &a.sa, &len) != 0) {
+            continue;
+        }
+        if (a.sa.sa_family == AF_INET6 &&
+            IN6_IS_ADDR_UNSPECIFIED(&a.in6.sin6_addr) &&
+            getsockopt(fds[i], IPPROTO_IPV6, IPV6_V6ONLY, &v6only,
+                       &optlen) == 0 && !v6only) {
+            snprintf(name, sizeof(name), "*:%u", ntohs(a.in6.sin6_port));
+        } else {
+            addr_format(&a, name);
+        }
+        printf("%s%s", i > 0 ? ", " : "", name);
+    }
+}
+
+int run_workers(int nworkers) {
+    // Only the main thread takes the reload and shutdown signals, in
+    // sigwait(). Blocked before any thread is created, so that every one of
+    // them inherits the mask: one that took SIGHUP while the main thread is
+    // busy reloading would die of it, undrained.
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGHUP);
+    sigaddset(&signals, SIGUSR2);
+    sigaddset(&signals, SIGUSR1);
+    sigaddset(&signals, SIGQUIT);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    int *inherited = NULL;
+    int ninherited = reload_inherit(&inherited);
+    if (ninherited < 0) {
+        return 1;
+    }
+    int group[ninherited > 0 ? ninherited : 1];
+    int size[LISTEN_MAX];
+    int naddrs = config.nlisten;
+    if (ninherited > 0) {
+        naddrs = group_inherited(inherited, ninherited, group, size);
+        if (naddrs < 0) {
+            return 1;
+        }
+        for (int g = 0; g < naddrs; g++) {
+            if (size[g] > nworkers) {
+                // A listener of a SO_REUSEPORT group that nobody accepts
+                // from would still get its share of the connections
+                printf("%d listeners on one address were handed over, "
+                       "starting as many workers\n", size[g]);
+                nworkers = size[g];
+            }
+        }
+    }
+
+    // Aligned so that no two workers' counters share a cache line
+    struct worker *workers = aligned_alloc(64, nworkers * sizeof(*workers));
+    if (workers == NULL) {
+        perror("webserver (aligned_alloc)");
+        return 1;
+    }
+    memset(workers, 0, nworkers * sizeof(*workers));
+
+    if (qsbr_init(nworkers) != 0) {
+        return 1;
+    }
+
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        perror("webserver (sched_getaffinity)");
+    }
+
+    // Every worker binds its own SO_REUSEPORT listener on each address so
+    // the kernel spreads new connections across them without a shared
+    // accept queue. Bind them all before starting any thread so
+    // configuration errors show up early. Listeners we were handed are taken
+    // over instead; when an address has fewer of them than there are
+    // workers, workers share them.
+    for (int i = 0; i < nworkers; i++) {
+        struct worker *w = &workers[i];
+        w->id = i;
+        w->cpu = nth_allowed_cpu(&allowed, i);
+        w->node = w->cpu >= 0 ? topology_node(w->cpu) : -1;
+        w->nlisten = naddrs;
+        for (int g = 0; g < naddrs; g++) {
+            if (ninherited == 0) {
+                w->listen_fd[g] = create_listener(&config.listen[g], 1);
+            } else if (i < size[g]) {
+                // Whoever created it chose its options; the profile still
+                // applies to it like to our own
+                int fd = nth_inherited(inherited, ninherited, group, g, i);
+                w->listen_fd[g] = fd;
+                sockopt_apply(fd);
+                if (sockopt_listen(fd) != 0) {
+                    return 1;
+                }
+            } else {
+                // Every worker closes its own descriptors when it drains
+                int fd = nth_inherited(inherited, ninherited, group, g,
+                                       i % size[g]);
+                w->listen_fd[g] = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+                if (w->listen_fd[g] < 0) {
+                    perror("webserver (fcntl F_DUPFD_CLOEXEC)");
+                }
+            }
+            if (w->listen_fd[g] < 0) {
+                return 1;
+            }
+        }
+        w->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (w->wakefd < 0) {
+            perror("webserver (eventfd)");
+            return 1;
+        }
+    }
+    free(inherited);
+    if (ninherited > 0) {
+        printf("server taking over %d listeners on ", ninherited);
+    } else {
+        printf("server listening for connections on ");
+    }
+    print_listeners(workers[0].listen_fd, naddrs);
+    printf(" with %d workers\n", nworkers);
+    sockopt_report(workers[0].listen_fd[0]);
+    topology_steer(workers, nworkers);
+    topology_report(workers, nworkers);
+    struct slab sizing;
+    slab_init(&sizing, sizeof(struct conn), 1);
+    printf("memory per idle connection: %zu bytes, plus a %zu to %zu byte "
+           "receive buffer while a request is being read\n",
+           sizing.size, buf_tier_size[0], buf_tier_size[BUF_TIERS - 1]);
+
+    metrics_init(workers, nworkers);
+    if (accesslog_start(workers, nworkers, config.access_log) != 0 ||
+        upstream_start() != 0 || offload_start(workers, nworkers) != 0 ||
+        ws_start(workers, nworkers) != 0) {
+        return 1;
+    }
+
+    for (int i = 0; i < nworkers; i++) {
+        int err = pthread_create(&workers[i].thread, NULL, worker_main,
+                                 &workers[i]);
+        if (err != 0) {
+            fprintf(stderr, "webserver (pthread_create): %s\n", strerror(err));
+            return 1;
+        }
+    }
+    // Our listeners are all set up; the process that handed them to us can
+    // stop accepting
+    reload_ready();
+
+    wait_signals(workers, nworkers, &signals);
+    offload_stop();
+    upstream_stop();
+    accesslog_stop();
+    return 0;
+}
@@ -0,0 +1,600 @@
+#include <errno.h>
+#include <openssl/evp.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "router.h"
+#include "ws.h"
+
+// Topics there can be at once; a power of two. A topic is never removed.
+#define WS_TOPICS 1024
+#define WS_TOPIC_MAX 64
+
+// Frames a connection may be sent without having written them; a few
+// queue slots are always left for our own control frames
+#define WS_CONTROL_SLOTS 2
+
+enum {
+    WS_CONTINUATION = 0x0,
+    WS_TEXT = 0x1,
+    WS_BINARY = 0x2,
+    WS_CLOSE = 0x8,
+    WS_PING = 0x9,
+    WS_PONG = 0xa,
+};
+
+// Status codes of a close frame
+enum {
+    WS_NORMAL = 1000,
+    WS_GOING_AWAY = 1001,
+    WS_PROTOCOL_ERROR = 1002,
+    WS_UNSUPPORTED = 1003,
+    WS_TOO_BIG = 1009,
+};
+
+// A framed message, shared by the write queues of all its recipients
+struct ws_msg {
+    struct rcbuf rc;
+    unsigned topic;
+    size_t len;
+    char data[];
+};
+
+// A message on its way to one worker
+struct ws_delivery {
+    struct ws_delivery *next;
+    struct ws_msg *msg;
+};
+
+struct ws_session {
+    struct conn *c;
+    unsigned topic;
+    struct ws_session *prev, *next;     // subscribers of the topic
+    struct ws_session *ready_next;      // queued on in this round
+    unsigned ready : 1;
+    unsigned slow : 1;                  // to be disconnected
+};
+
+struct ws_worker {
+    // Messages for this worker, newest first, pushed by the publishers and
+    // taken all at once by the worker
+    _Alignas(64) _Atomic(struct ws_delivery *) inbox;
+    int fd;                             // eventfd
+    // Subscribers per topic. The counts are read by the publishers, to
+    // skip the workers without any.
+    _Alignas(64) _Atomic uint32_t nsubs[WS_TOPICS];
+    struct ws_session *subs[WS_TOPICS];
+    struct ws_session *ready;
+    struct ws_delivery *delivered;      // to be put by ws_reap()
+};
+
+static struct {
+    _Atomic(const char *) name;
+    size_t len;
+} topics[WS_TOPICS];
+
+// Publishers that add a topic serialize among themselves; lookups never
+// take this
+static pthread_mutex_t topics_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct worker *ws_workers;
+static int ws_nworkers;
+static struct router *ws_route;
+
+// The inbox of the worker running on this thread, which needs no waking
+static _Thread_local struct ws_worker *self;
+
+static const char ws_guid[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+
+// The slot of topic, adding it if create is set. Returns -1 if it has
+// none, or the table is full.
+static int topic_find(const char *name, size_t len, int create) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (uint8_t)name[i]) * 16777619u;
+    }
+    for (int locked = 0; locked < 2; locked++) {
+        for (unsigned i = 0; i < WS_TOPICS; i++) {
+            unsigned slot = (h + i) & (WS_TOPICS - 1);
+            const char *n = atomic_load_explicit(&topics[slot].name,
+                                                 memory_order_acquire);
+            if (n == NULL) {
+                if (!locked) {
+                    break;
+                }
+                char *copy = malloc(len);
+                if (copy == NULL) {
+                    pthread_mutex_unlock(&topics_lock);
+                    return -1;
+                }
+                memcpy(copy, name, len);
+                topics[slot].len = len;
+                atomic_store_explicit(&topics[slot].name, copy,
+                                      memory_order_release);
+                pthread_mutex_unlock(&topics_lock);
+                return (int)slot;
+            }
+            if (topics[slot].len == len && memcmp(n, name, len) == 0) {
+                if (locked) {
+                    pthread_mutex_unlock(&topics_lock);
+                }
+                return (int)slot;
+            }
+        }
+        if (!create) {
+            return -1;
+        }
+        if (!locked) {
+            pthread_mutex_lock(&topics_lock);
+        }
+    }
+    pthread_mutex_unlock(&topics_lock);
+    return -1;
+}
+
+static void msg_destroy(struct rcbuf *rc) {
+    free(rc);
+}
+
+// Frame a message the way a server sends it, unmasked
+static struct ws_msg *frame_new(int opcode, const void *payload, size_t len) {
+    struct ws_msg *m = malloc(sizeof(*m) + 10 + len);
+    if (m == NULL) {
+        return NULL;
+    }
+    rcbuf_init(&m->rc, msg_destroy);
+    uint8_t *p = (uint8_t *)m->data;
+    *p++ = 0x80 | opcode;
+    if (len < 126) {
+        *p++ = (uint8_t)len;
+    } else if (len <= 0xffff) {
+        *p++ = 126;
+        *p++ = (uint8_t)(len >> 8);
+        *p++ = (uint8_t)len;
+    } else {
+        *p++ = 127;
+        for (int i = 7; i >= 0; i--) {
+            *p++ = (uint8_t)((uint64_t)len >> (8 * i));
+        }
+    }
+    memcpy(p, payload, len);
+    m->len = (size_t)(p - (uint8_t *)m->data) + len;
+    return m;
+}
+
+// Queue a frame of c's own, e.g. an answer to a ping
+static int send_frame(struct conn *c, struct ws_msg *m) {
+    if (c->iovcnt == 0) {
+        c->write_start = metric_clock();
+    }
+    int err = conn_queue(c, m->data, m->len, &m->rc);
+    if (err == 0) {
+        conn_pin(c);
+    }
+    rcbuf_put(&m->rc);
+    return err;
+}
+
+// Close the connection with a close frame carrying code
+static void send_close(struct conn *c, unsigned code) {
+    uint8_t payload[2] = {(uint8_t)(code >> 8), (uint8_t)code};
+    struct ws_msg *m = frame_new(WS_CLOSE, payload, sizeof(payload));
+    if (m != NULL) {
+        send_frame(c, m);
+    }
+    c->close_after_write = 1;
+}
+
+int ws_start(struct worker *workers, int nworkers) {
+    if (config.io != IO_EPOLL) {
+        return 0;
+    }
+    static const int endpoint;
+    ws_route = router_new();
+    if (ws_route == NULL ||
+        router_add(ws_route, ROUTE_GET, config.ws_path, &endpoint) != 0 ||
+        router_build(ws_route) != 0) {
+        fprintf(stderr, "webserver: invalid --ws-path '%s'\n",
+                config.ws_path);
+        return -1;
+    }
+    for (int i = 0; i < nworkers; i++) {
+        struct ws_worker *ww = aligned_alloc(64, sizeof(*ww));
+        if (ww == NULL) {
+            perror("webserver (aligned_alloc)");
+            return -1;
+        }
+        memset(ww, 0, sizeof(*ww));
+        ww->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (ww->fd < 0) {
+            perror("webserver (eventfd)");
+            free(ww);
+            return -1;
+        }
+        workers[i].ws = ww;
+    }
+    ws_workers = workers;
+    ws_nworkers = nworkers;
+    return 0;
+}
+
+int ws_publish(const char *topic, size_t topic_len, int binary,
+               const void *data, size_t len) {
+    int t = topic_find(topic, topic_len, 0);
+    if (t < 0) {
+        // Nobody ever subscribed to it
+        return 0;
+    }
+    struct ws_msg *m = frame_new(binary ? WS_BINARY : WS_TEXT, data, len);
+    if (m == NULL) {
+        return -1;
+    }
+    m->topic = (unsigned)t;
+    for (int i = 0; i < ws_nworkers; i++) {
+        struct ws_worker *ww = ws_workers[i].ws;
+        if (atomic_load_explicit(&ww->nsubs[t], memory_order_relaxed) == 0) {
+            continue;
+        }
+        struct ws_delivery *d = malloc(sizeof(*d));
+        if (d == NULL) {
+            continue;
+        }
+        rcbuf_get(&m->rc);
+        d->msg = m;
+        struct ws_delivery *head =
+            atomic_load_explicit(&ww->inbox, memory_order_relaxed);
+        do {
+            d->next = head;
+        } while (!atomic_compare_exchange_weak_explicit(
+            &ww->inbox, &head, d, memory_order_release,
+            memory_order_relaxed));
+        // A worker only needs waking for the first message it has not
+        // taken, and never for its own: it takes them at the end of the
+        // round
+        if (head == NULL && ww != self) {
+            uint64_t one = 1;
+            if (write(ww->fd, &one, sizeof(one)) < 0) {
+                perror("webserver (write eventfd)");
+            }
+        }
+    }
+    rcbuf_put(&m->rc);
+    return 0;
+}
+
+// Is req a valid opening handshake (RFC 6455 section 4.2.1)? Stores its
+// key.
+static int handshake_valid(const struct http_request *req,
+                           const struct http_str **key) {
+    const struct http_str *upgrade = http_header_get(req, "Upgrade");
+    const struct http_str *connection = http_header_get(req, "Connection");
+    const struct http_str *version =
+        http_header_get(req, "Sec-WebSocket-Version");
+    *key = http_header_get(req, "Sec-WebSocket-Key");
+    return req->minor_version == 1 && req->method.len == 3 &&
+           memcmp(req->method.ptr, "GET", 3) == 0 && upgrade != NULL &&
+           http_has_token(upgrade, "websocket") && connection != NULL &&
+           http_has_token(connection, "upgrade") && version != NULL &&
+           version->len == 2 && memcmp(version->ptr, "13", 2) == 0 &&
+           *key != NULL && (*key)->len == 24;
+}
+
+int ws_upgrade(struct conn *c, const struct http_request *req) {
+    struct ws_worker *ww = c->w->ws;
+    const struct http_str *key;
+    if (ww == NULL || c->w->draining || !handshake_valid(req, &key)) {
+        return 0;
+    }
+    size_t path_len = req->uri.len;
+    const char *query = memchr(req->uri.ptr, '?', req->uri.len);
+    if (query != NULL) {
+        path_len = query - req->uri.ptr;
+    }
+    struct route_match match;
+    if (router_match(ws_route, &req->method, req->uri.ptr, path_len,
+                     &match) != ROUTE_FOUND) {
+        return 0;
+    }
+    // The topic is the :topic parameter, or the whole path without one
+    struct http_str topic = {req->uri.ptr, path_len};
+    for (unsigned i = 0; i < match.nparams; i++) {
+        if (strcmp(match.names[i], "topic") == 0) {
+            topic = match.params[i];
+        }
+    }
+    int t = topic.len <= WS_TOPIC_MAX ? topic_find(topic.ptr, topic.len, 1)
+                                      : -1;
+    struct ws_session *s = calloc(1, sizeof(*s));
+    if (t < 0 || s == NULL) {
+        free(s);
+        return 0;
+    }
+
+    // The accept value is the base64 SHA-1 of the key and the GUID
+    char concat[24 + sizeof(ws_guid)];
+    memcpy(concat, key->ptr, 24);
+    memcpy(concat + 24, ws_guid, sizeof(ws_guid) - 1);
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned digest_len;
+    char accept[29];
+    if (EVP_Digest(concat, sizeof(concat) - 1, digest, &digest_len,
+                   EVP_sha1(), NULL) != 1) {
+        free(s);
+        return 0;
+    }
+    EVP_EncodeBlock((unsigned char *)accept, digest, (int)digest_len);
+    char head[160];
+    int n = snprintf(head, sizeof(head),
+                     "HTTP/1.1 101 Switching Protocols\r\n"
+                     "Server: webserver-c\r\n"
+                     "Upgrade: websocket\r\n"
+                     "Connection: Upgrade\r\n"
+                     "Sec-WebSocket-Accept: %s\r\n\r\n",
+                     accept);
+    // Not a frame, but it goes out the same way
+    struct ws_msg *m = malloc(sizeof(*m) + n);
+    if (m == NULL) {
+        free(s);
+        return 0;
+    }
+    rcbuf_init(&m->rc, msg_destroy);
+    memcpy(m->data, head, n);
+    m->len = (size_t)n;
+    if (send_frame(c, m) != 0) {
+        free(s);
+        return 0;
+    }
+
+    s->c = c;
+    s->topic = (unsigned)t;
+    s->next = ww->subs[t];
+    if (s->next != NULL) {
+        s->next->prev = s;
+    }
+    ww->subs[t] = s;
+    atomic_store_explicit(&ww->nsubs[t],
+                          atomic_load_explicit(&ww->nsubs[t],
+                                               memory_order_relaxed) + 1,
+                          memory_order_relaxed);
+    c->ws = s;
+    metric_add(&c->w->metrics.ws_sessions, 1);
+    return 1;
+}
+
+int ws_process(struct conn *c) {
+    struct ws_session *s = c->ws;
+    size_t off = 0;
+    int progress = 0;
+    while (!c->close_after_write &&
+           conn_queue_space(c) >= WS_CONTROL_SLOTS) {
+        uint8_t *p = (uint8_t *)c->buffer + off;
+        size_t avail = c->len - off;
+        if (avail < 2) {
+            break;
+        }
+        int fin = p[0] & 0x80;
+        int opcode = p[0] & 0x0f;
+        uint64_t len = p[1] & 0x7f;
+        size_t head = 2;
+        if (len == 126) {
+            head = 4;
+        } else if (len == 127) {
+            head = 10;
+        }
+        if (avail < head) {
+            break;
+        }
+        if (len == 126) {
+            len = (uint64_t)p[2] << 8 | p[3];
+        } else if (len == 127) {
+            len = 0;
+            for (int i = 2; i < 10; i++) {
+                len = len << 8 | p[i];
+            }
+        }
+        // Clients always mask, and we negotiated no extensions
+        if (!(p[1] & 0x80) || (p[0] & 0x70) != 0) {
+            send_close(c, WS_PROTOCOL_ERROR);
+            break;
+        }
+        head += 4;
+        if (len > BUFFER_MAX_SIZE - head) {
+            send_close(c, WS_TOO_BIG);
+            break;
+        }
+        if (avail < head + len) {
+            // The connection's buffer grows until the frame fits
+            break;
+        }
+        uint8_t *payload = p + head;
+        const uint8_t *mask = p + head - 4;
+        for (uint64_t i = 0; i < len; i++) {
+            payload[i] ^= mask[i & 3];
+        }
+        off += head + len;
+        progress++;
+
+        if (opcode >= WS_CLOSE && (!fin || len > 125)) {
+            send_close(c, WS_PROTOCOL_ERROR);
+            break;
+        }
+        if (opcode == WS_TEXT || opcode == WS_BINARY) {
+            if (!fin) {
+                send_close(c, WS_UNSUPPORTED);
+                break;
+            }
+            metric_add(&c->w->metrics.ws_received, 1);
+            ws_publish(topics[s->topic].name, topics[s->topic].len,
+                       opcode == WS_BINARY, payload, len);
+        } else if (opcode == WS_PING) {
+            struct ws_msg *m = frame_new(WS_PONG, payload, len);
+            if (m == NULL || send_frame(c, m) != 0) {
+                c->close_after_write = 1;
+            }
+        } else if (opcode == WS_CLOSE) {
+            // Echo the status code, if there is one, and go
+            unsigned code = len >= 2 ? (unsigned)payload[0] << 8 | payload[1]
+                                     : WS_NORMAL;
+            send_close(c, code);
+        } else if (opcode != WS_PONG) {
+            send_close(c, opcode == WS_CONTINUATION ? WS_UNSUPPORTED
+                                                    : WS_PROTOCOL_ERROR);
+        }
+    }
+    if (off > 0) {
+        memmove(c->buffer, c->buffer + off, c->len - off);
+        c->len -= off;
+    }
+    return progress;
+}
+
+void ws_going_away(struct conn *c) {
+    if (!c->close_after_write) {
+        send_close(c, WS_GOING_AWAY);
+    }
+}
+
+int ws_fd(const struct worker *w) {
+    return w->ws != NULL ? w->ws->fd : -1;
+}
+
+int ws_pending(const struct worker *w) {
+    return w->ws != NULL &&
+           atomic_load_explicit(&w->ws->inbox, memory_order_relaxed) != NULL;
+}
+
+void ws_notify(struct worker *w) {
+    uint64_t n;
+    if (read(w->ws->fd, &n, sizeof(n)) < 0 && errno != EAGAIN) {
+        perror("webserver (read eventfd)");
+    }
+}
+
+static void mark_ready(struct ws_worker *ww, struct ws_session *s) {
+    if (!s->ready) {
+        s->ready = 1;
+        s->ready_next = ww->ready;
+        ww->ready = s;
+    }
+}
+
+void ws_deliver(struct worker *w) {
+    struct ws_worker *ww = w->ws;
+    self = ww;
+    struct ws_delivery *d =
+        atomic_exchange_explicit(&ww->inbox, NULL, memory_order_acquire);
+    if (d == NULL) {
+        return;
+    }
+    // Newest first as pushed; subscribers get them in the order published
+    struct ws_delivery *oldest = NULL;
+    while (d != NULL) {
+        struct ws_delivery *next = d->next;
+        d->next = oldest;
+        oldest = d;
+        d = next;
+    }
+
+    int limit = config.ws_queue;
+    if (limit > CONN_MAX_IOV - WS_CONTROL_SLOTS) {
+        limit = CONN_MAX_IOV - WS_CONTROL_SLOTS;
+    }
+    uint64_t now = metric_clock();
+    uint64_t sent = 0;
+    uint64_t dropped = 0;
+    struct ws_delivery *last = NULL;
+    for (d = oldest; d != NULL; d = d->next) {
+        struct ws_msg *m = d->msg;
+        for (struct ws_session *s = ww->subs[m->topic]; s != NULL;
+             s = s->next) {
+            struct conn *c = s->c;
+            if (s->slow || c->close_after_write) {
+                continue;
+            }
+            if (c->iovcnt - c->iovpos >= limit ||
+                conn_queue_space(c) <= WS_CONTROL_SLOTS) {
+                dropped++;
+                if (config.ws_slow == WS_SLOW_CLOSE) {
+                    s->slow = 1;
+                    mark_ready(ww, s);
+                }
+                continue;
+            }
+            if (c->iovcnt == 0) {
+                c->write_start = now;
+            }
+            // Until ws_reap() our reference keeps it; a write that has to
+            // wait pins it
+            conn_queue(c, m->data, m->len, &m->rc);
+            sent++;
+            mark_ready(ww, s);
+        }
+        last = d;
+    }
+    last->next = ww->delivered;
+    ww->delivered = oldest;
+    metric_add(&w->metrics.ws_sent, sent);
+    metric_add(&w->metrics.ws_dropped, dropped);
+}
+
+struct conn *ws_ready(struct worker *w, int *slow) {
+    struct ws_worker *ww = w->ws;
+    struct ws_session *s = ww->ready;
+    if (s == NULL) {
+        return NULL;
+    }
+    ww->ready = s->ready_next;
+    s->ready = 0;
+    *slow = s->slow;
+    if (s->slow) {
+        metric_add(&w->metrics.ws_slow_closed, 1);
+    }
+    return s->c;
+}
+
+void ws_reap(struct worker *w) {
+    struct ws_worker *ww = w->ws;
+    struct ws_delivery *d = ww->delivered;
+    ww->delivered = NULL;
+    while (d != NULL) {
+        struct ws_delivery *next = d->next;
+        rcbuf_put(&d->msg->rc);
+        free(d);
+        d = next;
+    }
+}
+
+void ws_free(struct conn *c) {
+    struct ws_session *s = c->ws;
+    if (s == NULL) {
+        return;
+    }
+    struct ws_worker *ww = c->w->ws;
+    if (s->prev != NULL) {
+        s->prev->next = s->next;
+    } else {
+        ww->subs[s->topic] = s->next;
+    }
+    if (s->next != NULL) {
+        s->next->prev = s->prev;
+    }
+    atomic_store_explicit(&ww->nsubs[s->topic],
+                          atomic_load_explicit(&ww->nsubs[s->topic],
+                                               memory_order_relaxed) - 1,
+                          memory_order_relaxed);
+    if (s->ready) {
+        struct ws_session **p = &ww->ready;
+        while (*p != s) {
+            p = &(*p)->ready_next;
+        }
+        *p = s->ready_next;
+    }
+    free(s);
+    c->ws = NULL;
+}
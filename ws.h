@@ -0,0 +1,76 @@
+#ifndef WEBSERVER_WS_H
+#define WEBSERVER_WS_H
+
+#include <stddef.h>
+
+#include "conn.h"
+#include "http_parser.h"
+
+// WebSocket (RFC 6455) on the epoll backend, with a publish/subscribe
+// broadcast engine.
+//
+// A GET to --ws-path with Upgrade: websocket switches its connection to
+// WebSocket and subscribes it to the topic the path names. Messages are
+// published to a topic from any thread: each is framed once into a
+// reference counted buffer, and every worker with subscribers to the topic
+// is handed a reference through a lock-free inbox. A worker takes its
+// inbox once per event loop round and queues the frame on the write queue
+// of each subscriber, pointing at the one buffer, so a message costs one
+// copy however many sockets it goes to, and everything a connection got
+// in a round goes out with one write. A subscriber with --ws-queue frames
+// still unwritten is too slow: further messages are dropped for it, or it
+// is disconnected with --ws-slow=close.
+//
+// Messages must fit into the largest receive buffer and are not
+// fragmented; a client message is published to the client's own topic.
+
+struct ws_session;
+struct ws_worker;
+
+// Build the route and give every worker its inbox; call once before the
+// workers start. Does nothing on the io_uring backend.
+int ws_start(struct worker *workers, int nworkers);
+
+// Publish a message of len bytes to topic, as a binary or a text message,
+// to every subscriber on every worker. Returns -1 if it could not be
+// framed.
+int ws_publish(const char *topic, size_t topic_len, int binary,
+               const void *data, size_t len);
+
+// Switch c to WebSocket if req asks for it on --ws-path: queue the 101
+// and subscribe c to the topic. Returns 1 if it did.
+int ws_upgrade(struct conn *c, const struct http_request *req);
+
+// Handle every complete frame buffered on c. Returns non-zero if anything
+// was consumed.
+int ws_process(struct conn *c);
+
+// The worker drains: say goodbye to c with a close frame
+void ws_going_away(struct conn *c);
+
+// The eventfd w's event loop is woken with once its inbox has messages, or
+// -1
+int ws_fd(const struct worker *w);
+
+// Has w messages in its inbox?
+int ws_pending(const struct worker *w);
+
+// w's eventfd is readable; the messages are taken by ws_deliver()
+void ws_notify(struct worker *w);
+
+// Queue the messages in w's inbox on its subscribers, once per round of
+// the event loop
+void ws_deliver(struct worker *w);
+
+// The next connection ws_deliver() queued messages on, or NULL. *slow is
+// set if it has to be disconnected instead for being too slow.
+struct conn *ws_ready(struct worker *w, int *slow);
+
+// Let go of the messages ws_deliver() queued, once the connections they
+// were queued on were driven
+void ws_reap(struct worker *w);
+
+// Drop the session of c, if any
+void ws_free(struct conn *c);
+
+#endif